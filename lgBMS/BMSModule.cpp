@@ -2,24 +2,45 @@
 #include "BMSModule.h"
 #include "BMSUtil.h"
 #include "Logger.h"
+#include "NTCTable.h"
+
+// Generated by the compiler and stored in flash
+static constexpr NTCTable ntcTable;
 
 BMSModule::BMSModule() {
+  cells = 16;
   clearModule();
 }
 
+// Set how many of the 16 cell inputs are populated. Takes effect from the
+// next clearModule().
+void BMSModule::setCells(int n) {
+  cells = constrain(n, 1, 16);
+}
+
+// Return how many cells are populated
+int BMSModule::getCells() {
+  return cells;
+}
+
 void BMSModule::clearModule() {
   dataReceived = 0;
   lastData = 0;
+  balstat = 0;
   for(int n=0; n<16; n++) {
-    cellVolt[n] = 0;
-    lowestCellVolt[n] = 5.0f;
-    highestCellVolt[n] = 0.0f;
+    cellRaw[n] = 0;
+    lowestCellRaw[n] = 0xffff;
+    highestCellRaw[n] = 0;
   }
   for(int n=0; n<2; n++) {
-    temperature[n] = 0;
-    lowestTemperature[n] = 200.0f;
-    highestTemperature[n] = -200.0f;
+    tempRaw[n] = 0;
+    coldestTempRaw[n] = 0;
+    hottestTempRaw[n] = 0xffff;
   }
+  moduleRaw = 0;
+  lowCell = 0;
+  highCell = 0;
+  link.clear();
 }
 
 // Convert a 16-bit ADC value to a float voltage
@@ -27,13 +48,42 @@ float BMSModule::decodeVoltage(uint16_t data) {
   return(data * 5.0f / 65535.0f);
 }
 
+// Convert a 16-bit ADC value to integer millivolts, rounded to nearest
+uint16_t BMSModule::decodeMillivolts(uint16_t data) {
+  return((data * 5000UL + 32767) / 65535);
+}
+
 // Convert a 16-bit ADC value to a float temperature in degrees C
 float BMSModule::decodeTemperature(uint16_t data) {
-  // Calculate NTC resistance
-  float r = 0.0000000347363427499292f * data * data - 0.001025770762903f * data + 2.68235340614337f;
-  // Calculate NTC temperature
-  float t = log(r) * -30.5280964239816f + 95.6841501312447f;
-  return t;
+  return decodeTemperatureTenths(data) * 0.1f;
+}
+
+// Convert a 16-bit ADC value to a temperature in tenths of a degree C
+// by linear interpolation in the NTC table
+int16_t BMSModule::decodeTemperatureTenths(uint16_t data) {
+  const int16_t *t = &ntcTable.tenths[data >> NTC_TABLE_SHIFT];
+  int32_t frac = data & ((1 << NTC_TABLE_SHIFT) - 1);
+  return t[0] + ((t[1] - t[0]) * frac) / (1 << NTC_TABLE_SHIFT);
+}
+
+// Convert a temperature in degrees C to the 16-bit ADC value at which the
+// NTC reads that temperature, so thresholds can be compared in raw counts.
+// Higher temperatures give lower counts.
+uint16_t BMSModule::encodeTemperature(float temperature) {
+  int32_t tenths = (int32_t)(temperature * 10.0f);
+  if(tenths >= ntcTable.tenths[0]) return 0;
+  if(tenths <= ntcTable.tenths[NTC_TABLE_SIZE - 1]) return 0xffff;
+  // Find the segment with tenths[lo] > tenths >= tenths[hi]
+  int lo = 0, hi = NTC_TABLE_SIZE - 1;
+  while(hi - lo > 1) {
+    int mid = (lo + hi) / 2;
+    if(ntcTable.tenths[mid] > tenths) lo = mid;
+    else hi = mid;
+  }
+  int32_t span = ntcTable.tenths[lo] - ntcTable.tenths[hi];
+  uint32_t data = ((uint32_t)lo << NTC_TABLE_SHIFT) + ((ntcTable.tenths[lo] - tenths) << NTC_TABLE_SHIFT) / span;
+  if(data > 0xffff) return 0xffff;
+  return data;
 }
 
 // Decode an incoming CAN message. This function assumes that the
@@ -43,24 +93,36 @@ void BMSModule::decodecan(CAN_message_t &msg) {
   uint16_t data = ((uint16_t)(msg.buf[2]) << 8) | msg.buf[3];
   uint8_t cell = msg.buf[1];
   // Update the received data bitmap to indicate what has been received
-  dataReceived |= (1 << cell);
+  if(cell < 32) dataReceived |= (1UL << cell);
   lastData = millis();
+  // Time the register's arrival, or count it as out of range if the
+  // module doesn't have it
+  if(cell < cells) link.frame(cell, lastData);
+  else if(cell == 17 || cell == 18) link.frame(LINK_REG_TEMP + cell - 17, lastData);
+  else if(cell == 0xff) link.frame(LINK_REG_BALANCE, lastData);
+  else link.outOfRangeFrame();
   // Store the received data and update the high and low points
-  if(cell < 16) {
+  if(cell < cells) {
     // Cell voltages
-    cellVolt[cell] = decodeVoltage(data);
-    if(cellVolt[cell] < lowestCellVolt[cell])  lowestCellVolt[cell]  = cellVolt[cell];
-    if(cellVolt[cell] > highestCellVolt[cell]) highestCellVolt[cell] = cellVolt[cell];
-  } else if(cell == 17) {
-    // External NTC - negative side
-    temperature[0] = decodeTemperature(data);
-    if(temperature[0] > highestTemperature[0]) highestTemperature[0] = temperature[0];
-    if(temperature[0] < lowestTemperature[0])  lowestTemperature[0]  = temperature[0];
-  } else if(cell == 18) {
-    // External NTC - positive side
-    temperature[1] = decodeTemperature(data);
-    if(temperature[1] > highestTemperature[1]) highestTemperature[1] = temperature[1];
-    if(temperature[1] < lowestTemperature[1])  lowestTemperature[1]  = temperature[1];
+    uint16_t oldRaw = cellRaw[cell];
+    cellRaw[cell] = data;
+    moduleRaw += data;
+    moduleRaw -= oldRaw;
+    if(data < lowestCellRaw[cell])  lowestCellRaw[cell]  = data;
+    if(data > highestCellRaw[cell]) highestCellRaw[cell] = data;
+    // Only rescan the module when the current low or high cell moves inwards
+    if((cell == lowCell && data > oldRaw) || (cell == highCell && data < oldRaw)) {
+      findExtremeCells();
+    } else {
+      if(data < cellRaw[lowCell])  lowCell  = cell;
+      if(data > cellRaw[highCell]) highCell = cell;
+    }
+  } else if(cell == 17 || cell == 18) {
+    // External NTC - 17 negative side, 18 positive side
+    int sensor = cell - 17;
+    tempRaw[sensor] = data;
+    if(data > coldestTempRaw[sensor]) coldestTempRaw[sensor] = data;
+    if(data < hottestTempRaw[sensor]) hottestTempRaw[sensor] = data;
   } else if(cell == 0xff) {
     // Balancing status bitmap
     balstat = data;
@@ -69,66 +131,150 @@ void BMSModule::decodecan(CAN_message_t &msg) {
 
 // Return the voltage of a specified cell
 float BMSModule::getCellVoltage(int cell) {
-  return cellVolt[cell];
+  return decodeVoltage(cellRaw[cell]);
+}
+
+// Return the raw ADC reading of a specified cell
+uint16_t BMSModule::getCellRaw(int cell) {
+  return cellRaw[cell];
+}
+
+// Return the voltage of a specified cell in millivolts
+uint16_t BMSModule::getCellMV(int cell) {
+  return decodeMillivolts(cellRaw[cell]);
 }
 
 // Return the temperature of a specified sensor
 float BMSModule::getTemperature(int sensor) {
-  return temperature[sensor];
+  return decodeTemperature(tempRaw[sensor]);
+}
+
+// Return the temperature of a specified sensor in tenths of a degree
+int16_t BMSModule::getTemperatureTenths(int sensor) {
+  return decodeTemperatureTenths(tempRaw[sensor]);
+}
+
+// Return the raw ADC reading of a specified temperature sensor
+uint16_t BMSModule::getTempRaw(int sensor) {
+  return tempRaw[sensor];
+}
+
+// Rescan all cells for the lowest and highest voltage cell in the module
+void BMSModule::findExtremeCells() {
+  lowCell = 0;
+  highCell = 0;
+  for(int n=1; n<cells; n++) {
+    if(cellRaw[n] < cellRaw[lowCell])  lowCell  = n;
+    if(cellRaw[n] > cellRaw[highCell]) highCell = n;
+  }
 }
 
 // Return the voltage of the lowest voltage cell in the module
 float BMSModule::getLowCellV() {
-  float lowCellV = 5.0f;
-  for(int n=0; n<16; n++)
-    if(cellVolt[n] < lowCellV)
-      lowCellV = cellVolt[n];
-  return lowCellV;
+  return decodeVoltage(cellRaw[lowCell]);
 }
 
 // Return the voltage of the highest voltage cell in the module
 float BMSModule::getHighCellV() {
-  float highCellV = 0.0f;
-  for(int n=0; n<16; n++)
-    if(cellVolt[n] > highCellV)
-      highCellV = cellVolt[n];
-  return highCellV;
+  return decodeVoltage(cellRaw[highCell]);
+}
+
+// Return the raw ADC reading of the lowest voltage cell in the module
+uint16_t BMSModule::getLowCellRaw() {
+  return cellRaw[lowCell];
+}
+
+// Return the raw ADC reading of the highest voltage cell in the module
+uint16_t BMSModule::getHighCellRaw() {
+  return cellRaw[highCell];
+}
+
+// Return the lowest cell voltage in the module in millivolts
+uint16_t BMSModule::getLowCellMV() {
+  return decodeMillivolts(cellRaw[lowCell]);
+}
+
+// Return the highest cell voltage in the module in millivolts
+uint16_t BMSModule::getHighCellMV() {
+  return decodeMillivolts(cellRaw[highCell]);
+}
+
+// Return the index of the lowest voltage cell in the module
+int BMSModule::getLowCell() {
+  return lowCell;
+}
+
+// Return the index of the highest voltage cell in the module
+int BMSModule::getHighCell() {
+  return highCell;
+}
+
+// Return the raw ADC reading of the coldest sensor in the module
+uint16_t BMSModule::getLowTempRaw() {
+  if(tempRaw[1] > tempRaw[0]) return tempRaw[1];
+  else return tempRaw[0];
+}
+
+// Return the raw ADC reading of the hottest sensor in the module
+uint16_t BMSModule::getHighTempRaw() {
+  if(tempRaw[1] < tempRaw[0]) return tempRaw[1];
+  else return tempRaw[0];
 }
 
 // Return the lowest temperature in the module
 float BMSModule::getLowTemp() {
-  if(temperature[1] < temperature[0]) return temperature[1];
-  else return temperature[0];
+  return decodeTemperature(getLowTempRaw());
 }
 
 // Return the highest temperature in the module
 float BMSModule::getHighTemp() {
-  if(temperature[1] > temperature[0]) return temperature[1];
-  else return temperature[0];
+  return decodeTemperature(getHighTempRaw());
 }
 
 // Return the highest voltage recorded for a specified cell
 float BMSModule::getHighestCellVolt(int cell)
 {
-  return highestCellVolt[cell];
+  return decodeVoltage(highestCellRaw[cell]);
 }
 
 // Return the lowest voltage recorded for a specified cell
 float BMSModule::getLowestCellVolt(int cell)
 {
-  return lowestCellVolt[cell];
+  return decodeVoltage(lowestCellRaw[cell]);
+}
+
+// Return the raw ADC reading of the lowest any cell has been since the
+// module was cleared
+uint16_t BMSModule::getLowestCellRaw()
+{
+  uint16_t lowest = 0xffff;
+  for(int n=0; n<cells; n++) {
+    if(lowestCellRaw[n] < lowest) lowest = lowestCellRaw[n];
+  }
+  return lowest;
+}
+
+// Return the raw ADC reading of the highest any cell has been since the
+// module was cleared
+uint16_t BMSModule::getHighestCellRaw()
+{
+  uint16_t highest = 0;
+  for(int n=0; n<cells; n++) {
+    if(highestCellRaw[n] > highest) highest = highestCellRaw[n];
+  }
+  return highest;
 }
 
 // Return the highest temperature recorded by a specified sensor
 float BMSModule::getHighestTemp(int sensor)
 {
-  return highestTemperature[sensor];
+  return decodeTemperature(hottestTempRaw[sensor]);
 }
 
 // Return the lowest temperature recorded by a specified sensor
 float BMSModule::getLowestTemp(int sensor)
 {
-  return lowestTemperature[sensor];
+  return decodeTemperature(coldestTempRaw[sensor]);
 }
 
 // Return the balancing status bitmap
@@ -137,17 +283,32 @@ uint16_t BMSModule::getBalStat()
   return balstat;
 }
 
+// Return the daisychain link statistics
+LinkStats &BMSModule::getLink()
+{
+  return link;
+}
+
 // Returns true if module data is valid / complete.
 bool BMSModule::isDataValid() {
   if(millis() - lastData > 5000) return false;
-  if(dataReceived & 0xffffff == 0xffffff) return true;
+  // All populated cell voltages and both temperature sensors
+  uint32_t needed = 0x60000 | ((1UL << cells) - 1);
+  if((dataReceived & needed) == needed) return true;
   return false;
 }
 
 // Return sum of cell voltages
 float BMSModule::getModuleVoltage() {
-  float moduleVoltage = 0.0f;
-  for(int n=0; n<16; n++) 
-    moduleVoltage += cellVolt[n];
-  return moduleVoltage;
+  return moduleRaw * 5.0f / 65535.0f;
+}
+
+// Return sum of raw cell ADC readings
+uint32_t BMSModule::getModuleRaw() {
+  return moduleRaw;
+}
+
+// Return sum of cell voltages in millivolts
+uint32_t BMSModule::getModuleMV() {
+  return (moduleRaw * 5000ULL + 32767) / 65535;
 }
@@ -1,11 +1,14 @@
 #pragma once
 #include <FlexCAN.h>
+#include "LinkStats.h"
 
 class BMSModule
 {
   public:
     BMSModule();
     void clearModule();
+    void setCells(int n);
+    int getCells();
     void decodecan(CAN_message_t &msg);
     bool isDataValid();
     float getCellVoltage(int cell);
@@ -20,17 +23,49 @@ class BMSModule
     float getLowestTemp(int sensor);
     float getModuleVoltage();
     uint16_t getBalStat();
+    LinkStats &getLink();
+    int getLowCell();
+    int getHighCell();
+
+    // Raw ADC counts and integer millivolts, for callers avoiding float
+    uint16_t getCellRaw(int cell);
+    uint16_t getCellMV(int cell);
+    uint16_t getLowCellRaw();
+    uint16_t getHighCellRaw();
+    uint16_t getLowCellMV();
+    uint16_t getHighCellMV();
+    uint32_t getModuleRaw();
+    uint32_t getModuleMV();
+    uint16_t getTempRaw(int sensor);
+    int16_t getTemperatureTenths(int sensor);
+    uint16_t getLowTempRaw();
+    uint16_t getHighTempRaw();
+    uint16_t getLowestCellRaw();
+    uint16_t getHighestCellRaw();
+
+    static float decodeVoltage(uint16_t data);
+    static uint16_t decodeMillivolts(uint16_t data);
+    static float decodeTemperature(uint16_t data);
+    static int16_t decodeTemperatureTenths(uint16_t data);
+    static uint16_t encodeTemperature(float temperature);
 
   private:
+    // All readings are kept as the raw 16-bit ADC counts from the CAN frame.
+    // NTC counts fall as temperature rises, so the coldest reading is the
+    // highest count and the hottest reading is the lowest.
+    uint8_t cells;       // populated cells, the rest are ignored
     uint32_t dataReceived;
     uint16_t balstat;
-    float cellVolt[16];
-    float lowestCellVolt[16];
-    float highestCellVolt[16];
-    float temperature[2];
-    float lowestTemperature[2];
-    float highestTemperature[2];
-    float decodeVoltage(uint16_t data);
-    float decodeTemperature(uint16_t data);
+    uint16_t cellRaw[16];
+    uint16_t lowestCellRaw[16];
+    uint16_t highestCellRaw[16];
+    uint16_t tempRaw[2];
+    uint16_t coldestTempRaw[2];
+    uint16_t hottestTempRaw[2];
+    uint32_t moduleRaw;
+    uint8_t lowCell;
+    uint8_t highCell;
+    void findExtremeCells();
     uint32_t lastData;
+    LinkStats link;
 };
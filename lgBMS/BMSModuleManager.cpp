@@ -7,135 +7,364 @@ extern EEPROMSettings settings;
 
 BMSModuleManager::BMSModuleManager()
 {
+  chains = 4;
+  chainModules = 16;
+  moduleCells = 16;
   clearmodules();
 }
 
+// Set the installed pack: the number of daisychains, modules on each chain
+// and populated cells in each module. Frames from outside it are ignored.
+// Changing it starts the pack again from no modules.
+void BMSModuleManager::setTopology(int chains, int chainModules, int moduleCells)
+{
+  chains = constrain(chains, 1, (MAX_MODULE_ADDR + 1) / 16);
+  chainModules = constrain(chainModules, 1, 16);
+  moduleCells = constrain(moduleCells, 1, 16);
+  if(chains == this->chains && chainModules == this->chainModules && moduleCells == this->moduleCells) return;
+  this->chains = chains;
+  this->chainModules = chainModules;
+  this->moduleCells = moduleCells;
+  for (int y = 0; y <= MAX_MODULE_ADDR; y++) modules[y].setCells(moduleCells);
+  clearmodules();
+}
+
+// Return the number of populated cells in each module
+int BMSModuleManager::getModuleCells()
+{
+  return moduleCells;
+}
+
 // Decode CAN data and dispatch to appropriate module
 void BMSModuleManager::decodecan(CAN_message_t &msg)
 {
-  int chain_id, module_id;
   if(msg.ext) return;
 
-  // Each daisychain of 16 modules has its own CAN connection and address
-  if      (msg.id == 0x4f0) chain_id = 0;
-  else if (msg.id == 0x4f1) chain_id = 1;
-  else if (msg.id == 0x4f2) chain_id = 2;
-  else if (msg.id == 0x4f3) chain_id = 3;
-  else return;
+  // Each daisychain has its own CAN ID from 0x4f0, and modules are
+  // addressed 16 to a chain whatever the number installed
+  int chain_id = (int)msg.id - 0x4f0;
+  if(chain_id < 0) return;
+  if(chain_id >= chains) {
+    strayFrames++;
+    return;
+  }
   // Module ID within daisychain
-  module_id = msg.buf[0];
+  int module_id = msg.buf[0];
 
+  chainFrames[chain_id]++;
   if(module_id == 0xff) {
     // Module manager status
-  } else {
+    decodeAdapter(chain_id, msg);
+  } else if(module_id < chainModules) {
     // Module data
-    modules[chain_id * 16 + module_id].decodecan(msg);
+    int address = chain_id * 16 + module_id;
+    BMSModule &module = modules[address];
+    decoded |= 1ULL << address;
+    if(!inPack[address]) {
+      module.decodecan(msg);
+      if(module.isDataValid()) addModule(address);
+      return;
+    }
+
+    uint8_t reg = msg.buf[1];
+    uint32_t oldRaw = module.getModuleRaw();
+    uint16_t oldLowCell = module.getLowCellRaw();
+    uint16_t oldHighCell = module.getHighCellRaw();
+    uint16_t oldLowTemp = module.getLowTempRaw();
+    uint16_t oldHighTemp = module.getHighTempRaw();
+    int16_t oldTemperature = 0;
+    if(reg == 17 || reg == 18) oldTemperature = module.getTemperatureTenths(reg - 17);
+    module.decodecan(msg);
+    packRaw += module.getModuleRaw();
+    packRaw -= oldRaw;
+    if(reg == 17 || reg == 18) packTenths += module.getTemperatureTenths(reg - 17) - oldTemperature;
+
+    // If the module holding a pack extreme has moved inwards the extremes must be rescanned,
+    // otherwise the module can only take over an extreme from another module.
+    if((address == lowCellModule && module.getLowCellRaw() > oldLowCell) ||
+       (address == highCellModule && module.getHighCellRaw() < oldHighCell) ||
+       (address == lowTempModule && module.getLowTempRaw() < oldLowTemp) ||
+       (address == highTempModule && module.getHighTempRaw() > oldHighTemp)) {
+      findExtremes();
+    } else {
+      updateExtremes(address);
+    }
+  } else {
+    strayFrames++;
+  }
+}
+
+// Decode a status frame from the daisychain adapter. Comparing its count
+// of frames sent with the frames received gives those lost on the CAN bus.
+void BMSModuleManager::decodeAdapter(int chain, CAN_message_t &msg)
+{
+  AdapterStatus &adapter = adapters[chain];
+  uint16_t data = ((uint16_t)(msg.buf[2]) << 8) | msg.buf[3];
+  switch(msg.buf[1]) {
+    case ADAPTER_REG_FRAMES:
+      if(adapter.time != 0) {
+        uint16_t sent = data - adapter.frames;
+        uint16_t received = chainFrames[chain] - adapter.received;
+        if(sent > received) adapter.canLost += sent - received;
+      }
+      adapter.frames = data;
+      adapter.received = chainFrames[chain];
+      break;
+    case ADAPTER_REG_ERRORS:
+      adapter.errors = data;
+      break;
+    case ADAPTER_REG_FAULTS:
+      adapter.faults = data;
+      break;
+    case ADAPTER_REG_PERIOD:
+      adapter.period = data;
+      break;
+  }
+  adapter.time = millis();
+  if(adapter.time == 0) adapter.time = 1;
+}
+
+// Let a module take over any pack extreme it now exceeds. Temperatures are
+// compared as NTC counts, which fall as temperature rises.
+void BMSModuleManager::updateExtremes(int address)
+{
+  BMSModule &module = modules[address];
+  if(module.getLowCellRaw() < modules[lowCellModule].getLowCellRaw())    lowCellModule  = address;
+  if(module.getHighCellRaw() > modules[highCellModule].getHighCellRaw()) highCellModule = address;
+  if(module.getLowTempRaw() > modules[lowTempModule].getLowTempRaw())    lowTempModule  = address;
+  if(module.getHighTempRaw() < modules[highTempModule].getHighTempRaw()) highTempModule = address;
+}
+
+// Add a module that has just become valid to the pack aggregates
+void BMSModuleManager::addModule(int address)
+{
+  BMSModule &module = modules[address];
+  inPack[address] = true;
+  int n = numModules;
+  while(n > 0 && active[n - 1] > address) {
+    active[n] = active[n - 1];
+    n--;
+  }
+  active[n] = address;
+  packRaw += module.getModuleRaw();
+  packTenths += module.getTemperatureTenths(0) + module.getTemperatureTenths(1);
+  if(numModules++ == 0) {
+    lowCellModule = highCellModule = lowTempModule = highTempModule = address;
+    return;
+  }
+  updateExtremes(address);
+}
+
+// Remove a module that has stopped reporting from the pack aggregates
+void BMSModuleManager::removeModule(int address)
+{
+  BMSModule &module = modules[address];
+  inPack[address] = false;
+  int n = 0;
+  while(active[n] != address) n++;
+  for(; n < numModules - 1; n++) active[n] = active[n + 1];
+  if(--numModules == 0) {
+    // Nothing left to find extremes in
+    packRaw = 0;
+    packTenths = 0;
+    return;
+  }
+  packRaw -= module.getModuleRaw();
+  packTenths -= module.getTemperatureTenths(0) + module.getTemperatureTenths(1);
+  if(address == lowCellModule || address == highCellModule || address == lowTempModule || address == highTempModule)
+    findExtremes();
+}
+
+// Rescan the modules in the pack for the modules holding each extreme
+void BMSModuleManager::findExtremes()
+{
+  bool first = true;
+  for (int n = 0; n < numModules; n++) {
+    int y = active[n];
+    if(first) {
+      lowCellModule = highCellModule = lowTempModule = highTempModule = y;
+      first = false;
+      continue;
+    }
+    updateExtremes(y);
   }
 }
 
+// Expire modules which have not sent data recently. This is the only place
+// staleness is checked, so the getters below never need to walk the modules.
+void BMSModuleManager::expireModules()
+{
+  for (int n = numModules - 1; n >= 0; n--)
+    if(!modules[active[n]].isDataValid())
+      removeModule(active[n]);
+}
+
 // Clear module status
 void BMSModuleManager::clearmodules()
 {
   // Clear state of all modules
-  for (int y = 0; y <= MAX_MODULE_ADDR; y++)
+  for (int y = 0; y <= MAX_MODULE_ADDR; y++) {
       modules[y].clearModule();
+      inPack[y] = false;
+  }
+  numModules = 0;
+  decoded = 0;
+  memset(chainLink, 0, sizeof(chainLink));
+  memset(&packLink, 0, sizeof(packLink));
+  weakestModule = -1;
+  strayFrames = 0;
+  memset(chainFrames, 0, sizeof(chainFrames));
+  memset(adapters, 0, sizeof(adapters));
+  packRaw = 0;
+  packTenths = 0;
+  lowCellModule = highCellModule = lowTempModule = highTempModule = 0;
 }
 
 // Return full pack voltage
 float BMSModuleManager::getPackVoltage()
 {
   if(pStrings == 0) return 0;
-  float packVoltage = 0.0f;
-  for (int y = 0; y <= MAX_MODULE_ADDR; y++)
-    if(modules[y].isDataValid())
-      packVoltage += modules[y].getModuleVoltage();
-  return packVoltage / (float)pStrings;
+  return packRaw * 5.0f / 65535.0f / (float)pStrings;
+}
+
+// Return full pack voltage in millivolts
+uint32_t BMSModuleManager::getPackVoltageMV()
+{
+  if(pStrings == 0) return 0;
+  return (packRaw * 5000ULL + 32767) / 65535 / pStrings;
 }
 
 // Return the highest voltage of any cell in the pack
 float BMSModuleManager::getHighCellVolt()
 {
-  float highCellVolt = 0.0;
-  for (int x = 0; x <= MAX_MODULE_ADDR; x++)
-    if (modules[x].isDataValid())
-      if (modules[x].getHighCellV() > highCellVolt) 
-        highCellVolt = modules[x].getHighCellV();
-  return highCellVolt;
+  if(numModules == 0) return 0.0f;
+  return modules[highCellModule].getHighCellV();
+}
+
+// Return the highest cell voltage in the pack in millivolts
+uint16_t BMSModuleManager::getHighCellMV()
+{
+  if(numModules == 0) return 0;
+  return modules[highCellModule].getHighCellMV();
+}
+
+// Return the raw ADC reading of the highest voltage cell in the pack
+uint16_t BMSModuleManager::getHighCellRaw()
+{
+  if(numModules == 0) return 0;
+  return modules[highCellModule].getHighCellRaw();
 }
 
 // Return the lowest voltage of any cell in the pack
 float BMSModuleManager::getLowCellVolt()
 {
-  float lowCellVolt = 5.0;
-  for (int x = 0; x <= MAX_MODULE_ADDR; x++)
-    if (modules[x].isDataValid())
-      if (modules[x].getLowCellV() < lowCellVolt) 
-        lowCellVolt = modules[x].getLowCellV();
-  return lowCellVolt;
+  if(numModules == 0) return 5.0f;
+  return modules[lowCellModule].getLowCellV();
+}
+
+// Return the lowest cell voltage in the pack in millivolts
+uint16_t BMSModuleManager::getLowCellMV()
+{
+  if(numModules == 0) return 5000;
+  return modules[lowCellModule].getLowCellMV();
+}
+
+// Return the raw ADC reading of the lowest voltage cell in the pack
+uint16_t BMSModuleManager::getLowCellRaw()
+{
+  if(numModules == 0) return 0xffff;
+  return modules[lowCellModule].getLowCellRaw();
+}
+
+// Return the module containing the lowest voltage cell
+int BMSModuleManager::getLowCellModule()
+{
+  return lowCellModule;
+}
+
+// Return the index within its module of the lowest voltage cell
+int BMSModuleManager::getLowCellNum()
+{
+  return modules[lowCellModule].getLowCell();
+}
+
+// Return the module containing the highest voltage cell
+int BMSModuleManager::getHighCellModule()
+{
+  return highCellModule;
+}
+
+// Return the index within its module of the highest voltage cell
+int BMSModuleManager::getHighCellNum()
+{
+  return modules[highCellModule].getHighCell();
 }
 
 // Return the highest temperature of any sensor in the pack
 float BMSModuleManager::getHighTemperature()
 {
-  float highTemp = -200;
-  for (int x = 0; x <= MAX_MODULE_ADDR; x++)
-    if (modules[x].isDataValid())
-      if (modules[x].getHighTemp() > highTemp) 
-        highTemp = modules[x].getHighTemp();
-  return highTemp;
+  if(numModules == 0) return -200;
+  return modules[highTempModule].getHighTemp();
 }
 
 // Return the lowest temperature of any sensor in the pack
 float BMSModuleManager::getLowTemperature()
 {
-  float lowTemp = -200;
-  for (int x = 0; x <= MAX_MODULE_ADDR; x++)
-    if (modules[x].isDataValid())
-      if (modules[x].getLowTemp() < lowTemp) 
-        lowTemp = modules[x].getLowTemp();
-  return lowTemp;
+  if(numModules == 0) return -200;
+  return modules[lowTempModule].getLowTemp();
+}
+
+// Return the raw NTC reading of the hottest sensor in the pack
+uint16_t BMSModuleManager::getHighTempRaw()
+{
+  if(numModules == 0) return 0xffff;
+  return modules[highTempModule].getHighTempRaw();
+}
+
+// Return the raw NTC reading of the coldest sensor in the pack
+uint16_t BMSModuleManager::getLowTempRaw()
+{
+  if(numModules == 0) return 0xffff;
+  return modules[lowTempModule].getLowTempRaw();
+}
+
+// Return the module containing the lowest temperature sensor
+int BMSModuleManager::getLowTempModule()
+{
+  return lowTempModule;
+}
+
+// Return the module containing the highest temperature sensor
+int BMSModuleManager::getHighTempModule()
+{
+  return highTempModule;
 }
 
 // Return the average cell voltage in the pack
 float BMSModuleManager::getAvgCellVolt()
 {
-  float avg = 0.0f;
-  int cellCount = 0;
-  for (int x = 0; x <= MAX_MODULE_ADDR; x++) {
-    if (modules[x].isDataValid()) {
-      avg += modules[x].getModuleVoltage();
-      cellCount += 16;
-    }
-  }
-  if(cellCount == 0) return 0;
+  if(numModules == 0) return 0;
+  return packRaw * 5.0f / 65535.0f / (float)(numModules * moduleCells);
+}
 
-  return avg / (float)cellCount;
+// Return the average cell voltage in the pack in millivolts
+uint16_t BMSModuleManager::getAvgCellMV()
+{
+  if(numModules == 0) return 0;
+  return (packRaw * 5000ULL + 32767) / 65535 / (numModules * moduleCells);
 }
 
 // Return average temperature of pack
 float BMSModuleManager::getAvgTemperature()
 {
-  float avg = 0.0f;
-  int sensorCount = 0;
-  for (int x = 0; x <= MAX_MODULE_ADDR; x++) {
-    if (modules[x].isDataValid()) {
-      avg += modules[x].getTemperature(0);
-      avg += modules[x].getTemperature(1);
-      sensorCount += 2;
-    }
-  }
-  if(sensorCount == 0) return 0;
-  return avg / (float)sensorCount;
+  if(numModules == 0) return 0;
+  return packTenths / (numModules * 2 * 10.0f);
 }
 
 // Return the number of detected modules in the pack
 int BMSModuleManager::getNumModules()
 {
-  int moduleCount = 0;
-  for (int x = 0; x <= MAX_MODULE_ADDR; x++)
-    if (modules[x].isDataValid())
-      moduleCount++;
-  return moduleCount;
+  return numModules;
 }
 
 // Set the number of parallel strings to divide total pack voltage
@@ -144,62 +373,87 @@ void BMSModuleManager::setPstrings(int n)
   pStrings = n;
 }
 
+// Copy the pack aggregates into a snapshot taken at now
+void BMSModuleManager::getSnapshot(PackSnapshot &pack, uint32_t now)
+{
+  pack.time = now;
+  pack.numModules = getNumModules();
+  pack.seriesCells = seriescells();
+  pack.packVoltageMV = getPackVoltageMV();
+  pack.avgCellVolt = getAvgCellVolt();
+  pack.lowCellVolt = getLowCellVolt();
+  pack.highCellVolt = getHighCellVolt();
+  pack.avgCellMV = getAvgCellMV();
+  pack.lowCellMV = getLowCellMV();
+  pack.highCellMV = getHighCellMV();
+  pack.lowCellRaw = getLowCellRaw();
+  pack.highCellRaw = getHighCellRaw();
+  pack.lowCellModule = getLowCellModule();
+  pack.lowCellNum = getLowCellNum();
+  pack.highCellModule = getHighCellModule();
+  pack.highCellNum = getHighCellNum();
+  pack.avgTemperature = getAvgTemperature();
+  pack.lowTemperature = getLowTemperature();
+  pack.highTemperature = getHighTemperature();
+  pack.lowTempRaw = getLowTempRaw();
+  pack.highTempRaw = getHighTempRaw();
+  pack.lowTempModule = getLowTempModule();
+  pack.highTempModule = getHighTempModule();
+}
+
 // Return the number of cells in series in the pack
 int BMSModuleManager::seriescells()
 {
   if(pStrings == 0) return 0;
-  return getNumModules() * 16 / pStrings;
+  return getNumModules() * moduleCells / pStrings;
 }
 
-// Print all cell data to serial console in CSV format
-void BMSModuleManager::printAllCSV(unsigned long timestamp, float current, int SOC)
+// Return the address of the first module in the pack at or after address,
+// or -1 if there are no more
+int BMSModuleManager::nextModule(int address)
 {
-  for (int y = 0; y <= MAX_MODULE_ADDR; y++)
+  for (int n = 0; n < numModules; n++)
   {
-    if (modules[y].isDataValid())
-    {
-      SERIALCONSOLE.print(timestamp);
-      SERIALCONSOLE.print(",");
-      SERIALCONSOLE.print(current, 0);
-      SERIALCONSOLE.print(",");
-      SERIALCONSOLE.print(SOC);
-      SERIALCONSOLE.print(",");
-      SERIALCONSOLE.print(y);
-      SERIALCONSOLE.print(",");
-      for (int i = 0; i < 16; i++)
-      {
-        SERIALCONSOLE.print(modules[y].getCellVoltage(i));
-        SERIALCONSOLE.print(",");
-      }
-      SERIALCONSOLE.print(modules[y].getTemperature(0));
-      SERIALCONSOLE.print(",");
-      SERIALCONSOLE.print(modules[y].getTemperature(1));
-      SERIALCONSOLE.println();
-    }
+    if (active[n] >= address) return active[n];
   }
-  for (int y = 0; y <= MAX_MODULE_ADDR; y++)
+  return -1;
+}
+
+// Return the address of the index'th module in the pack, in address order,
+// for index from 0 to getNumModules() - 1
+int BMSModuleManager::getActiveModule(int index)
+{
+  return active[index];
+}
+
+// Return a module by address
+BMSModule &BMSModuleManager::getModule(int address)
+{
+  return modules[address];
+}
+
+// Print one module's cell data as a line of CSV, with the first cells
+// voltages
+void BMSModuleManager::printModuleCSV(Print &out, int address, unsigned long timestamp, float current, int SOC, int cells)
+{
+  BMSModule &module = modules[address];
+  out.print(timestamp);
+  out.print(",");
+  out.print(current, 0);
+  out.print(",");
+  out.print(SOC);
+  out.print(",");
+  out.print(address);
+  out.print(",");
+  for (int i = 0; i < cells && i < moduleCells; i++)
   {
-    if (modules[y].isDataValid())
-    {
-      Serial2.print(timestamp);
-      Serial2.print(",");
-      Serial2.print(current, 0);
-      Serial2.print(",");
-      Serial2.print(SOC);
-      Serial2.print(",");
-      Serial2.print(y);
-      Serial2.print(",");
-      for (int i = 0; i < 8; i++)
-      {
-        Serial2.print(modules[y].getCellVoltage(i));
-        Serial2.print(",");
-      }
-      Serial2.print(modules[y].getTemperature(0));
-      Serial2.print(",");
-      Serial2.print(modules[y].getTemperature(1));
-      Serial2.println();
-    }
+    out.print(module.getCellVoltage(i));
+    out.print(",");
   }
+  out.print(module.getTemperature(0));
+  out.print(",");
+  out.print(module.getTemperature(1));
+  out.println();
 }
 
 // Print general information about the state of the pack
@@ -211,15 +465,13 @@ void BMSModuleManager::printPackSummary()
   Logger::console("Modules: %i  Cells: %i  Voltage: %fV   Avg Cell Voltage: %fV     Avg Temp: %fC ", getNumModules(), seriescells(),
                   getPackVoltage(), getAvgCellVolt(), getAvgTemperature());
   Logger::console("");
-  for (int y = 0; y <= MAX_MODULE_ADDR; y++)
+  for (int n = 0; n < numModules; n++)
   {
-    if (modules[y].isDataValid())
-    {
-      Logger::console("                               Module #%i", y);
+    int y = active[n];
+    Logger::console("                               Module #%i", y);
 
-      Logger::console("  Voltage: %fV   (%fV-%fV)     Temperatures: (%fC-%fC)", modules[y].getModuleVoltage(),
-                      modules[y].getLowCellV(), modules[y].getHighCellV(), modules[y].getLowTemp(), modules[y].getHighTemp());
-    }
+    Logger::console("  Voltage: %fV   (%fV-%fV)     Temperatures: (%fC-%fC)", modules[y].getModuleVoltage(),
+                    modules[y].getLowCellV(), modules[y].getHighCellV(), modules[y].getLowTemp(), modules[y].getHighTemp());
   }
 }
 
@@ -227,60 +479,287 @@ void BMSModuleManager::printPackSummary()
 void BMSModuleManager::printPackDetails(int digits, bool showbal)
 {
   int cellNum = 0;
-  Logger::console("");
-  Logger::console("");
-  Logger::console("");
-  Logger::console("Modules: %i Cells: %i Strings: %i  Voltage: %fV   Avg Cell Voltage: %fV  Low Cell Voltage: %fV   High Cell Voltage: %fV Delta Voltage: %zmV   Avg Temp: %fC ", getNumModules(), seriescells(),
-                  pStrings, getPackVoltage(), getAvgCellVolt(), getLowCellVolt(), getHighCellVolt(), (getLowCellVolt() - getHighCellVolt()) * 1000, getAvgTemperature());
-  Logger::console("");
-  for (int y = 0; y <= MAX_MODULE_ADDR; y++)
+  printDetailsHeader(SERIALCONSOLE);
+  for (int n = 0; n < numModules; n++)
   {
-    if (modules[y].isDataValid())
-    {
-      uint16_t bal = modules[y].getBalStat();
-
-      SERIALCONSOLE.print("Module #");
-      SERIALCONSOLE.print(y);
-      if (y < 10) SERIALCONSOLE.print(" ");
-      SERIALCONSOLE.print("  ");
-      SERIALCONSOLE.print(modules[y].getModuleVoltage(), digits);
-      SERIALCONSOLE.print("V");
-      for (int i = 0; i < 16; i++)
-      {
-        if (cellNum < 10) SERIALCONSOLE.print(" ");
-        SERIALCONSOLE.print("  Cell");
-        SERIALCONSOLE.print(cellNum++);
-        SERIALCONSOLE.print(": ");
-        SERIALCONSOLE.print(modules[y].getCellVoltage(i), digits);
-        SERIALCONSOLE.print("V");
-        if (showbal == 1)
-        {
-          if ((bal & (0x1 << i)) > 0)
-          {
-            SERIALCONSOLE.print(" X");
-          }
-          else
-          {
-            SERIALCONSOLE.print(" -");
-          }
-        }
-      }
-      SERIALCONSOLE.println();
-      SERIALCONSOLE.print(" Temp 1: ");
-      SERIALCONSOLE.print(modules[y].getTemperature(0));
-      SERIALCONSOLE.print("C Temp 2: ");
-      SERIALCONSOLE.print(modules[y].getTemperature(1));
+    printModuleDetails(SERIALCONSOLE, active[n], cellNum, digits, showbal);
+    cellNum += moduleCells;
+  }
+}
+
+// Print the pack totals that head the detailed pack data
+void BMSModuleManager::printDetailsHeader(Print &out)
+{
+  out.println();
+  out.println();
+  out.println();
+  out.print("Modules: ");
+  out.print(getNumModules());
+  out.print(" Cells: ");
+  out.print(seriescells());
+  out.print(" Strings: ");
+  out.print(pStrings);
+  out.print("  Voltage: ");
+  out.print(getPackVoltage(), 3);
+  out.print("V   Avg Cell Voltage: ");
+  out.print(getAvgCellVolt(), 3);
+  out.print("V  Low Cell Voltage: ");
+  out.print(getLowCellVolt(), 3);
+  out.print("V   High Cell Voltage: ");
+  out.print(getHighCellVolt(), 3);
+  out.print("V Delta Voltage: ");
+  out.print((getLowCellVolt() - getHighCellVolt()) * 1000, 0);
+  out.print("mV   Avg Temp: ");
+  out.print(getAvgTemperature(), 3);
+  out.println("C ");
+  if (numModules > 0)
+  {
+    out.print("Low Cell: Module #");
+    out.print(getLowCellModule());
+    out.print(" Cell ");
+    out.print(getLowCellNum());
+    out.print("   High Cell: Module #");
+    out.print(getHighCellModule());
+    out.print(" Cell ");
+    out.println(getHighCellNum());
+  }
+  out.println();
+}
+
+// Print the cells and temperatures of one module, numbering its cells
+// from cellNum
+void BMSModuleManager::printModuleDetails(Print &out, int address, int cellNum, int digits, bool showbal)
+{
+  BMSModule &module = modules[address];
+  uint16_t bal = module.getBalStat();
 
-      if (showbal == 1)
+  out.print("Module #");
+  out.print(address);
+  if (address < 10) out.print(" ");
+  out.print("  ");
+  out.print(module.getModuleVoltage(), digits);
+  out.print("V");
+  for (int i = 0; i < moduleCells; i++)
+  {
+    if (cellNum < 10) out.print(" ");
+    out.print("  Cell");
+    out.print(cellNum++);
+    out.print(": ");
+    out.print(module.getCellVoltage(i), digits);
+    out.print("V");
+    if (showbal == 1)
+    {
+      if ((bal & (0x1 << i)) > 0)
       {
-        SERIALCONSOLE.print("C  Bal Stat: ");
-        SERIALCONSOLE.println( bal, BIN);
+        out.print(" X");
       }
       else
       {
-        SERIALCONSOLE.println("C");
+        out.print(" -");
       }
+    }
+  }
+  out.println();
+  out.print(" Temp 1: ");
+  out.print(module.getTemperature(0));
+  out.print("C Temp 2: ");
+  out.print(module.getTemperature(1));
 
+  if (showbal == 1)
+  {
+    out.print("C  Bal Stat: ");
+    out.println(bal, BIN);
+  }
+  else
+  {
+    out.println("C");
+  }
+}
+
+// Return the modules that have decoded a frame since the last call, a bit
+// per address, and start again
+uint64_t BMSModuleManager::takeDecoded()
+{
+  uint64_t modules = decoded;
+  decoded = 0;
+  return modules;
+}
+
+// Called once a second. Rolls every module in the installed pack that has
+// been heard, then totals them for each chain and the pack. The health of
+// a chain or the pack is that of its weakest module, and is 0 if no
+// module in it has been heard.
+void BMSModuleManager::rollLinks(uint32_t now)
+{
+  memset(&packLink, 0, sizeof(packLink));
+  packLink.outOfRange = strayFrames;
+  weakestModule = -1;
+  for(int chain=0; chain<chains; chain++) {
+    LinkRollup &total = chainLink[chain];
+    memset(&total, 0, sizeof(total));
+    for(int id=0; id<chainModules; id++) {
+      int address = chain * 16 + id;
+      LinkStats &link = modules[address].getLink();
+      if(!link.isHeard()) continue;
+      link.roll(now);
+      if(total.modules++ == 0 || link.getHealth() < total.health) total.health = link.getHealth();
+      total.rate += link.getRate();
+      total.missed += link.getMissed();
+      total.gaps += link.getGaps();
+      total.outOfRange += link.getOutOfRange();
+      if(weakestModule < 0 || link.getHealth() < modules[weakestModule].getLink().getHealth()) weakestModule = address;
+    }
+    if(total.modules == 0) continue;
+    if(packLink.modules == 0 || total.health < packLink.health) packLink.health = total.health;
+    packLink.modules += total.modules;
+    packLink.rate += total.rate;
+    packLink.missed += total.missed;
+    packLink.gaps += total.gaps;
+    packLink.outOfRange += total.outOfRange;
+  }
+}
+
+// Zero the link fault counters of every module
+void BMSModuleManager::resetLinks()
+{
+  for (int y = 0; y <= MAX_MODULE_ADDR; y++) modules[y].getLink().resetCounters();
+  strayFrames = 0;
+}
+
+// Forget the arrival interval averages of every module, so a new scan
+// period is learnt without counting gaps
+void BMSModuleManager::relearnLinks()
+{
+  for (int y = 0; y <= MAX_MODULE_ADDR; y++) modules[y].getLink().relearn();
+}
+
+// Return the latest status of a daisychain from the adapter
+AdapterStatus &BMSModuleManager::getAdapterStatus(int chain)
+{
+  return adapters[chain];
+}
+
+// Return true if the adapter has reported the status of a daisychain in
+// the last 5s
+bool BMSModuleManager::isAdapterHeard(int chain)
+{
+  return adapters[chain].time != 0 && millis() - adapters[chain].time <= 5000;
+}
+
+// Return the number of installed daisychains
+int BMSModuleManager::getChains()
+{
+  return chains;
+}
+
+// Return the link totals of a daisychain as of the last rollLinks()
+LinkRollup &BMSModuleManager::getChainLink(int chain)
+{
+  return chainLink[chain];
+}
+
+// Return the link totals of the pack as of the last rollLinks()
+LinkRollup &BMSModuleManager::getPackLink()
+{
+  return packLink;
+}
+
+// Return the address of the module with the lowest link health, or -1 if
+// none has been heard
+int BMSModuleManager::getWeakestModule()
+{
+  return weakestModule;
+}
+
+// Print the rate, health and fault counts of a link total
+void BMSModuleManager::printLinkRollup(Print &out, LinkRollup &link)
+{
+  out.print("  Modules: ");
+  out.print(link.modules);
+  out.print("  Rate: ");
+  out.print(link.rate);
+  out.print("/s  Health: ");
+  out.print(link.health);
+  out.print("%  Missed: ");
+  out.print(link.missed);
+  out.print("  Gaps: ");
+  out.print(link.gaps);
+  out.print("  Out of Range: ");
+  out.println(link.outOfRange);
+}
+
+// Print the link statistics of the pack, each chain and each module heard.
+// Arrival intervals are the average and longest of each register group.
+void BMSModuleManager::printLinkStats(Print &out)
+{
+  out.println();
+  out.print("Pack");
+  printLinkRollup(out, packLink);
+  out.print("Weakest Module: ");
+  out.print(weakestModule);
+  out.print("  Stray Frames: ");
+  out.println(strayFrames);
+  for(int chain=0; chain<chains; chain++) {
+    out.print("Chain ");
+    out.print(chain);
+    printLinkRollup(out, chainLink[chain]);
+  }
+  for(int chain=0; chain<chains; chain++) {
+    AdapterStatus &adapter = adapters[chain];
+    out.print("Adapter Chain ");
+    out.print(chain);
+    if(!isAdapterHeard(chain)) {
+      out.println("  No Status");
+      continue;
+    }
+    out.print("  Scan Period: ");
+    out.print(adapter.period);
+    out.print("ms  Frames Sent: ");
+    out.print(adapter.frames);
+    out.print("  Read Errors: ");
+    out.print(adapter.errors);
+    out.print("  Faults: 0x");
+    out.print(adapter.faults, HEX);
+    out.print("  Lost on CAN: ");
+    out.println(adapter.canLost);
+  }
+  for(int chain=0; chain<chains; chain++) {
+    for(int id=0; id<chainModules; id++) {
+      int address = chain * 16 + id;
+      LinkStats &link = modules[address].getLink();
+      if(!link.isHeard()) continue;
+      out.print("Module #");
+      out.print(address);
+      out.print("  Rate: ");
+      out.print(link.getRate());
+      out.print("/s  Health: ");
+      out.print(link.getHealth());
+      out.print("%  Missed: ");
+      out.print(link.getMissed());
+      out.print("  Gaps: ");
+      out.print(link.getGaps());
+      out.print("  Out of Range: ");
+      out.print(link.getOutOfRange());
+      uint32_t avg = 0;
+      uint16_t max = 0;
+      for(int n=0; n<moduleCells; n++) {
+        avg += link.getAvgInterval(n);
+        if(link.getMaxInterval(n) > max) max = link.getMaxInterval(n);
+      }
+      out.print("  Cells: ");
+      out.print(avg / moduleCells);
+      out.print("ms/");
+      out.print(max);
+      out.print("ms  Temps: ");
+      out.print((link.getAvgInterval(LINK_REG_TEMP) + link.getAvgInterval(LINK_REG_TEMP + 1)) / 2);
+      out.print("ms/");
+      out.print(link.getMaxInterval(LINK_REG_TEMP) > link.getMaxInterval(LINK_REG_TEMP + 1) ?
+                link.getMaxInterval(LINK_REG_TEMP) : link.getMaxInterval(LINK_REG_TEMP + 1));
+      out.print("ms  Balancing: ");
+      out.print(link.getAvgInterval(LINK_REG_BALANCE));
+      out.print("ms/");
+      out.print(link.getMaxInterval(LINK_REG_BALANCE));
+      out.println("ms");
     }
   }
 }
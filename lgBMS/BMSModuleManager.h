@@ -1,7 +1,61 @@
+#pragma once
 #include  "config.h"
 #include "BMSModule.h"
 #include <FlexCAN.h>
 
+// Pack state copied out once per control tick, so every decision made in
+// the tick sees the same values. Fields match the manager's getters.
+typedef struct {
+  uint32_t time; // ms
+  int numModules;
+  int seriesCells;
+  uint32_t packVoltageMV;
+  float avgCellVolt;
+  float lowCellVolt;
+  float highCellVolt;
+  uint16_t avgCellMV;
+  uint16_t lowCellMV;
+  uint16_t highCellMV;
+  uint16_t lowCellRaw;
+  uint16_t highCellRaw;
+  int lowCellModule;
+  int lowCellNum;
+  int highCellModule;
+  int highCellNum;
+  float avgTemperature;
+  float lowTemperature;
+  float highTemperature;
+  uint16_t lowTempRaw;
+  uint16_t highTempRaw;
+  int lowTempModule;
+  int highTempModule;
+} PackSnapshot;
+
+// Status registers the daisychain adapter reports for each chain, as
+// module 0xff on the chain's CAN ID, with the value in bytes 2 and 3
+#define ADAPTER_REG_FRAMES 0  // frames sent on the chain, wrapping
+#define ADAPTER_REG_ERRORS 1  // daisychain read errors, wrapping
+#define ADAPTER_REG_FAULTS 2  // fault bits
+#define ADAPTER_REG_PERIOD 3  // ms between scans of the chain
+
+// Commands to the adapter on 0x4f8, in byte 0
+#define ADAPTER_CMD_BALANCE 0x00 // balance target, raw cell reading in bytes 1-2
+#define ADAPTER_CMD_RESET 0x01   // reset the modules
+#define ADAPTER_CMD_PERIOD 0x02  // scan period, chain (0xff all) in byte 1, ms in bytes 2-3
+#define ADAPTER_CMD_MODULE_BALANCE 0x03 // balance target for the module addressed in byte 1,
+                                        // raw in bytes 2-3, 0xffff none, held for a minute
+
+// Latest status of a daisychain from the adapter
+typedef struct {
+  uint32_t time;     // ms of the last status frame, 0 if none
+  uint16_t frames;
+  uint16_t errors;
+  uint16_t faults;
+  uint16_t period;   // ms
+  uint32_t canLost;  // frames the adapter sent that weren't received
+  uint32_t received; // frames received from the chain when frames arrived
+} AdapterStatus;
+
 class BMSModuleManager
 {
   public:
@@ -9,6 +63,8 @@ class BMSModuleManager
     int seriescells();
     void decodecan(CAN_message_t &msg);
     void setPstrings(int Pstrings);
+    void setTopology(int chains, int chainModules, int moduleCells);
+    int getModuleCells();
     float getPackVoltage();
     float getAvgTemperature();
     float getHighTemperature();
@@ -16,15 +72,78 @@ class BMSModuleManager
     float getAvgCellVolt();
     float getLowCellVolt();
     float getHighCellVolt();
+    int getLowCellModule();
+    int getLowCellNum();
+    int getHighCellModule();
+    int getHighCellNum();
+    int getLowTempModule();
+    int getHighTempModule();
+    void expireModules();
+    uint32_t getPackVoltageMV();
+    uint16_t getAvgCellMV();
+    uint16_t getLowCellMV();
+    uint16_t getHighCellMV();
+    uint16_t getLowCellRaw();
+    uint16_t getHighCellRaw();
+    uint16_t getLowTempRaw();
+    uint16_t getHighTempRaw();
     float getHighVoltage();
     float getLowVoltage();
-    void printAllCSV(unsigned long timestamp,float current, int SOC);
+    int nextModule(int address);
+    int getActiveModule(int index);
+    BMSModule &getModule(int address);
+    void printModuleCSV(Print &out, int address, unsigned long timestamp, float current, int SOC, int cells);
     void printPackSummary();
     void printPackDetails(int digits,bool showbal);
+    void printDetailsHeader(Print &out);
+    void printModuleDetails(Print &out, int address, int cellNum, int digits, bool showbal);
     int getNumModules();
+    void getSnapshot(PackSnapshot &pack, uint32_t now);
+    uint64_t takeDecoded();
+    void rollLinks(uint32_t now);
+    void resetLinks();
+    int getChains();
+    LinkRollup &getChainLink(int chain);
+    LinkRollup &getPackLink();
+    int getWeakestModule();
+    void printLinkStats(Print &out);
+    void relearnLinks();
+    AdapterStatus &getAdapterStatus(int chain);
+    bool isAdapterHeard(int chain);
 
   private:
     BMSModule modules[MAX_MODULE_ADDR + 1]; // store data for as many modules as we've configured for.
     void clearmodules();
     int pStrings;
+    uint64_t decoded; // modules that have decoded a frame, see takeDecoded()
+
+    // Installed pack, see setTopology()
+    int chains;
+    int chainModules;
+    int moduleCells;
+
+    // Daisychain link quality, see rollLinks()
+    LinkRollup chainLink[(MAX_MODULE_ADDR + 1) / 16];
+    LinkRollup packLink;
+    int weakestModule;
+    uint32_t strayFrames; // for modules outside the installed pack
+    uint32_t chainFrames[(MAX_MODULE_ADDR + 1) / 16];
+    AdapterStatus adapters[(MAX_MODULE_ADDR + 1) / 16];
+    void decodeAdapter(int chain, CAN_message_t &msg);
+    void printLinkRollup(Print &out, LinkRollup &link);
+
+    // Running pack aggregates, kept up to date as frames arrive
+    bool inPack[MAX_MODULE_ADDR + 1];
+    uint8_t active[MAX_MODULE_ADDR + 1]; // addresses in the pack, in order
+    int numModules;
+    uint32_t packRaw;
+    int32_t packTenths;  // sum of every sensor's temperature in tenths of a degree
+    int lowCellModule;
+    int highCellModule;
+    int lowTempModule;
+    int highTempModule;
+    void addModule(int address);
+    void removeModule(int address);
+    void findExtremes();
+    void updateExtremes(int address);
 };
@@ -0,0 +1,228 @@
+#include "BalancePlanner.h"
+#include "OCVTable.h"
+
+BalancePlanner::BalancePlanner(BMSModuleManager &bms) : bms(bms)
+{
+  clear();
+}
+
+// Drop every target and forget the bleed history
+void BalancePlanner::clear()
+{
+  for(int n=0; n<=MAX_MODULE_ADDR; n++) target[n] = BALANCE_OFF;
+  memset(bleedCharge, 0, sizeof(bleedCharge));
+  pending = 0;
+  targeted = 0;
+  lastUpdate = 0;
+  lastRefresh = 0;
+  bleedMs = 0;
+  started = false;
+  capacity = 0;
+  commands = 0;
+}
+
+// Called about once a second. Counts the cells the modules in the pack
+// report bleeding since the last call, then plans each module's target
+// from the floor and hysteresis, in raw cell counts. Balancing is stopped
+// everywhere when it isn't enabled, and on modules that have left the
+// pack.
+void BalancePlanner::update(uint32_t now, bool enabled, uint16_t floorRaw, uint16_t hystRaw, int packAh)
+{
+  capacity = packAh;
+  uint32_t seconds = 0;
+  if(started) {
+    bleedMs += now - lastUpdate;
+    seconds = bleedMs / 1000;
+    bleedMs %= 1000;
+  } else {
+    started = true;
+    lastRefresh = now;
+  }
+  lastUpdate = now;
+
+  uint32_t aim = (uint32_t)floorRaw + hystRaw / BALANCE_MARGIN;
+  if(aim > BALANCE_OFF - 1) aim = BALANCE_OFF - 1;
+  bool refresh = now - lastRefresh >= BALANCE_REFRESH;
+  if(refresh) lastRefresh = now;
+
+  uint64_t seen = 0;
+  for(int n=0; n<bms.getNumModules(); n++) {
+    int y = bms.getActiveModule(n);
+    seen |= 1ULL << y;
+    BMSModule &module = bms.getModule(y);
+    uint16_t want = BALANCE_OFF;
+    if(module.isDataValid()) {
+      uint16_t bal = module.getBalStat();
+      for(int cell=0; bal && seconds && cell<module.getCells(); cell++) {
+        if(!(bal & (1 << cell))) continue;
+        bleedCharge[y][cell] += ((uint32_t)module.getCellMV(cell) * seconds + BALANCE_RESISTOR / 2) / BALANCE_RESISTOR;
+      }
+      uint16_t high = module.getHighCellRaw();
+      if(enabled) {
+        // Carry on to the target once started, but only start when the
+        // module is past the hysteresis
+        if(target[y] != BALANCE_OFF) {
+          if(high > aim + BALANCE_STEP) want = aim;
+        } else if(high > (uint32_t)floorRaw + hystRaw) {
+          want = aim;
+        }
+      }
+    }
+    setTarget(y, want, refresh);
+  }
+  uint64_t lost = targeted & ~seen;
+  for(int y=0; lost; y++) {
+    if(!(lost & (1ULL << y))) continue;
+    setTarget(y, BALANCE_OFF, false);
+    lost &= ~(1ULL << y);
+  }
+}
+
+// Move a module's target, marking it to be sent if it changed by more
+// than BALANCE_STEP, or on a refresh if it is in force
+void BalancePlanner::setTarget(int address, uint16_t want, bool refresh)
+{
+  uint64_t bit = 1ULL << address;
+  if((want == BALANCE_OFF) != (target[address] == BALANCE_OFF) ||
+     (want != BALANCE_OFF && abs((int32_t)want - target[address]) > BALANCE_STEP)) {
+    target[address] = want;
+    pending |= bit;
+    if(want == BALANCE_OFF) targeted &= ~bit;
+    else targeted |= bit;
+  } else if(refresh && target[address] != BALANCE_OFF) {
+    pending |= bit;
+  }
+}
+
+// Fill in the next target command for the adapter, returning false if
+// none is waiting. Called from the CAN schedule, and only builds the
+// frame: the target stays pending until commandSent().
+bool BalancePlanner::nextCommand(CAN_message_t &msg)
+{
+  if(!pending) return false;
+  int y = 0;
+  while(!(pending & (1ULL << y))) y++;
+  msg.id = 0x4f8;
+  msg.len = 4;
+  msg.buf[0] = ADAPTER_CMD_MODULE_BALANCE;
+  msg.buf[1] = y;
+  msg.buf[2] = highByte(target[y]);
+  msg.buf[3] = lowByte(target[y]);
+  return true;
+}
+
+// Mark the target in a command from nextCommand() as sent
+void BalancePlanner::commandSent(CAN_message_t &msg)
+{
+  pending &= ~(1ULL << msg.buf[1]);
+  commands++;
+}
+
+// Return the raw bleed target of a module, BALANCE_OFF if it has none
+uint16_t BalancePlanner::getTarget(int address)
+{
+  return target[address];
+}
+
+// Return an estimate in seconds of how long a module will take to bleed
+// its highest cell down to its target. The charge to bleed is found from
+// the OCV table, so it is only fair for a pack at rest.
+uint32_t BalancePlanner::getEstimate(int address)
+{
+  if(target[address] == BALANCE_OFF) return 0;
+  BMSModule &module = bms.getModule(address);
+  uint16_t highMV = module.getHighCellMV();
+  int32_t soc = ocvSOC(highMV) - ocvSOC(BMSModule::decodeMillivolts(target[address]));
+  if(soc <= 0 || highMV == 0) return 0;
+  // Tenths of a percent of capacity Ah is mAh, and mV over ohms is mA
+  return (uint64_t)soc * capacity * 3600 * BALANCE_RESISTOR / highMV;
+}
+
+// Return the longest estimate of any module
+uint32_t BalancePlanner::getPackEstimate()
+{
+  uint32_t longest = 0;
+  for(int n=0; n<bms.getNumModules(); n++) {
+    uint32_t estimate = getEstimate(bms.getActiveModule(n));
+    if(estimate > longest) longest = estimate;
+  }
+  return longest;
+}
+
+// Return the seconds a cell has been reported bleeding, from the charge
+// bled at its present voltage. Cells sag only a little over a bleed, so
+// this is within a few percent.
+uint32_t BalancePlanner::getBleedTime(int address, int cell)
+{
+  uint16_t mV = bms.getModule(address).getCellMV(cell);
+  if(mV == 0) return 0;
+  return (uint64_t)bleedCharge[address][cell] * BALANCE_RESISTOR / mV;
+}
+
+// Return the charge bled from a cell in mA.s
+uint32_t BalancePlanner::getBleedCharge(int address, int cell)
+{
+  return bleedCharge[address][cell];
+}
+
+// Return the charge bled from all of a module's cells in mA.s
+uint32_t BalancePlanner::getModuleBleedCharge(int address)
+{
+  uint32_t total = 0;
+  for(int n=0; n<16; n++) total += bleedCharge[address][n];
+  return total;
+}
+
+// Return the number of modules with a target
+int BalancePlanner::getBalancing()
+{
+  return __builtin_popcountll(targeted);
+}
+
+// Return the number of commands sent to the adapter
+uint32_t BalancePlanner::getCommands()
+{
+  return commands;
+}
+
+// Print the target, estimate and bleed history of each module in the pack
+// that has a target or has bled
+void BalancePlanner::printStatus(Print &out)
+{
+  out.println();
+  out.print("Balancing Modules: ");
+  out.print(getBalancing());
+  out.print("  Estimate: ");
+  out.print(getPackEstimate() / 60);
+  out.print("min  Commands: ");
+  out.println(commands);
+  for(int i=0; i<bms.getNumModules(); i++) {
+    int y = bms.getActiveModule(i);
+    uint32_t bled = getModuleBleedCharge(y);
+    if(target[y] == BALANCE_OFF && bled == 0) continue;
+    out.print("Module #");
+    out.print(y);
+    out.print("  Target: ");
+    if(target[y] == BALANCE_OFF) {
+      out.print("off");
+    } else {
+      out.print(BMSModule::decodeMillivolts(target[y]));
+      out.print("mV  Estimate: ");
+      out.print(getEstimate(y) / 60);
+      out.print("min");
+    }
+    out.print("  Bled: ");
+    out.print(bled / 3600.0f, 1);
+    out.print("mAh  Cell Seconds:");
+    for(int n=0; n<bms.getModule(y).getCells(); n++) {
+      out.print(" ");
+      out.print(getBleedTime(y, n));
+    }
+    out.print("  Cell mAh:");
+    for(int n=0; n<bms.getModule(y).getCells(); n++) {
+      out.print(" ");
+      out.print(bleedCharge[y][n] / 3600.0f, 1);
+    }
+    out.println();
+  }
+}
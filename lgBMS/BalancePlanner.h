@@ -0,0 +1,54 @@
+#pragma once
+#include <Arduino.h>
+#include <FlexCAN.h>
+#include "config.h"
+#include "BMSModuleManager.h"
+
+#define BALANCE_RESISTOR 75    // ohms, bleed resistor of each cell
+#define BALANCE_MARGIN 2       // modules bleed to the floor plus 1/BALANCE_MARGIN of the hysteresis
+#define BALANCE_STEP 26        // raw counts, about 2mV, smaller target moves are not sent
+#define BALANCE_REFRESH 30000  // ms, targets in force are resent this often
+#define BALANCE_OFF 0xffff     // target that bleeds no cells
+
+// Works out a bleed target for each module instead of one for the pack.
+// A module only gets a target once its highest cell is more than the
+// hysteresis above the floor, the pack's lowest cell or the balance
+// voltage if that is higher, and keeps it until its highest cell is down
+// to the target. Cells that are already close to the floor, and modules
+// with none far from it, are left alone. Targets are sent to the adapter
+// only when they change by more than BALANCE_STEP, and refreshed every
+// BALANCE_REFRESH. The balancing bitmaps the modules report are counted
+// into the charge bled from each cell, and its bleed time is worked back
+// from that and the cell's voltage rather than kept as well.
+class BalancePlanner
+{
+  public:
+    BalancePlanner(BMSModuleManager &bms);
+    void clear();
+    void update(uint32_t now, bool enabled, uint16_t floorRaw, uint16_t hystRaw, int packAh);
+    bool nextCommand(CAN_message_t &msg);
+    void commandSent(CAN_message_t &msg);
+    uint16_t getTarget(int address);
+    uint32_t getEstimate(int address);
+    uint32_t getPackEstimate();
+    uint32_t getBleedTime(int address, int cell);
+    uint32_t getBleedCharge(int address, int cell);
+    uint32_t getModuleBleedCharge(int address);
+    int getBalancing();
+    uint32_t getCommands();
+    void printStatus(Print &out);
+
+  private:
+    void setTarget(int address, uint16_t want, bool refresh);
+    BMSModuleManager &bms;
+    uint16_t target[MAX_MODULE_ADDR + 1];        // raw, BALANCE_OFF if none
+    uint32_t bleedCharge[MAX_MODULE_ADDR + 1][16]; // mA.s
+    uint64_t pending;    // modules whose target is still to be sent
+    uint64_t targeted;   // modules with a target
+    uint32_t lastUpdate; // ms
+    uint32_t lastRefresh;
+    uint32_t bleedMs;    // ms not yet counted into the bleed charges
+    bool started;
+    int capacity;        // Ah
+    uint32_t commands;
+};
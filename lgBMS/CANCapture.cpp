@@ -0,0 +1,145 @@
+#include "config.h"
+#include "CANCapture.h"
+
+CANCapture::CANCapture(CANCaptureRecord *records, int size)
+  : records(records), size(size)
+{
+  head = 0;
+  tail = 0;
+  overflows = 0;
+  active = false;
+  chunkLen = 0;
+  chunkSent = 0;
+  sequence = 0;
+  lastChunk = 0;
+}
+
+// Listen to every received frame from Can0
+void CANCapture::begin()
+{
+  Can0.attachObj(this);
+  attachGeneralHandler();
+}
+
+// Start capturing with an empty ring
+void CANCapture::start()
+{
+  noInterrupts();
+  tail = head;
+  overflows = 0;
+  active = true;
+  interrupts();
+  chunkLen = 0;
+  chunkSent = 0;
+  lastChunk = millis();
+}
+
+// Stop capturing. Whatever has been captured is still sent.
+void CANCapture::stop()
+{
+  active = false;
+}
+
+bool CANCapture::isActive()
+{
+  return active;
+}
+
+// Return true while a chunk is part way out, when nothing else should
+// write to the console
+bool CANCapture::busy()
+{
+  return chunkSent != chunkLen;
+}
+
+// Return true once stopped and everything captured has been sent, when
+// the ring can be used for something else
+bool CANCapture::drained()
+{
+  return !active && waiting() == 0 && !busy();
+}
+
+// Return the number of records in the ring
+int CANCapture::waiting()
+{
+  int count = (int)head - tail;
+  return count < 0 ? count + 2 * size : count;
+}
+
+// Called by FlexCAN from the receive interrupt. The frame is left for the
+// other listeners.
+bool CANCapture::frameHandler(CAN_message_t &frame, int mailbox, uint8_t controller)
+{
+  if(!active) return false;
+  if(waiting() >= size) {
+    overflows++;
+    return false;
+  }
+  uint16_t h = head;
+  CANCaptureRecord &record = records[h < size ? h : h - size];
+  record.time = micros();
+  record.id = frame.id;
+  record.flags = (frame.ext ? CAN_CAPTURE_EXT : 0) | (frame.rtr ? CAN_CAPTURE_RTR : 0);
+  record.len = frame.len;
+  record.reserved[0] = 0;
+  record.reserved[1] = 0;
+  memcpy(record.data, frame.buf, 8);
+  // Make sure the record is stored before the loop can see it
+  __sync_synchronize();
+  head = h + 1 == 2 * size ? 0 : h + 1;
+  return false;
+}
+
+// Move records from the ring into the chunk buffer and seal it
+void CANCapture::fillChunk(int count)
+{
+  CANCaptureHeader header;
+  header.magic = CAN_CAPTURE_MAGIC;
+  header.sequence = sequence++;
+  header.count = count;
+  header.overflows = overflows;
+  memcpy(chunk, &header, sizeof(header));
+  uint8_t *p = chunk + sizeof(header);
+  uint16_t t = tail;
+  for(int n=0; n<count; n++) {
+    memcpy(p, &records[t < size ? t : t - size], sizeof(CANCaptureRecord));
+    p += sizeof(CANCaptureRecord);
+    if(++t == 2 * size) t = 0;
+  }
+  // Finish copying the records out before the slots can be reused
+  __sync_synchronize();
+  tail = t;
+  uint16_t crc = crc16(chunk, p - chunk);
+  *p++ = lowByte(crc);
+  *p++ = highByte(crc);
+  chunkLen = p - chunk;
+  chunkSent = 0;
+}
+
+// Called every loop. Sends as much as the USB buffers have room for,
+// starting a new chunk once the last one has gone and a full one is
+// waiting or the oldest record has waited long enough.
+void CANCapture::stream()
+{
+  for(;;) {
+    if(chunkSent == chunkLen) {
+      int count = waiting();
+      if(count == 0) return;
+      if(count < CAN_CAPTURE_CHUNK && millis() - lastChunk < CAN_CAPTURE_FLUSH) return;
+      fillChunk(count < CAN_CAPTURE_CHUNK ? count : CAN_CAPTURE_CHUNK);
+      lastChunk = millis();
+    }
+    int room = SERIALCONSOLE.availableForWrite();
+    if(room <= 0) return;
+    int n = chunkLen - chunkSent;
+    if(n > room) n = room;
+    SERIALCONSOLE.write(chunk + chunkSent, n);
+    chunkSent += n;
+  }
+}
+
+// Return the number of records dropped because the ring was full
+uint32_t CANCapture::getOverflows()
+{
+  return overflows;
+}
@@ -0,0 +1,72 @@
+#pragma once
+#include <FlexCAN.h>
+#include "CRC16.h"
+
+#define CAN_CAPTURE_CHUNK 32     // records per chunk sent to the host
+#define CAN_CAPTURE_FLUSH 50     // ms before a part filled chunk is sent
+#define CAN_CAPTURE_MAGIC 0x50414343UL // "CCAP" at the start of each chunk
+
+#define CAN_CAPTURE_EXT 0x01 // extended ID
+#define CAN_CAPTURE_RTR 0x02 // remote request
+
+// One received frame. Multi-byte fields are little endian, as they are
+// stored on the Teensy.
+typedef struct __attribute__((packed)) {
+  uint32_t time;  // us arrival time
+  uint32_t id;
+  uint8_t flags;
+  uint8_t len;
+  uint8_t reserved[2];
+  uint8_t data[8];
+} CANCaptureRecord;
+
+// Sent before the records of each chunk, which are followed by a CRC-16
+// (CCITT, initial value 0xffff) over the header and records. The sequence
+// number goes up by one for every chunk so the host can tell if any were
+// lost, and overflows counts records dropped because the ring was full.
+typedef struct __attribute__((packed)) {
+  uint32_t magic;
+  uint16_t sequence;
+  uint16_t count;
+  uint32_t overflows;
+} CANCaptureHeader;
+
+// Records every received frame into a RAM ring from the receive interrupt
+// and streams them over the USB console as binary chunks. Each loop sends
+// only what the USB buffers will take, so capturing never blocks. The ring
+// is given by the caller, and is only used between start() and drained()
+// returning true.
+class CANCapture : public CANListener
+{
+  public:
+    CANCapture(CANCaptureRecord *records, int size);
+    void begin();
+    void start();
+    void stop();
+    bool isActive();
+    bool busy();
+    bool drained();
+    bool frameHandler(CAN_message_t &frame, int mailbox, uint8_t controller);
+    void stream();
+    uint32_t getOverflows();
+
+  private:
+    CANCaptureRecord *records;
+    uint16_t size;          // records
+    // Positions run to twice the size, so a full ring can be told from an
+    // empty one. head is only written by the interrupt and tail only by
+    // the loop.
+    volatile uint16_t head;
+    volatile uint16_t tail;
+    volatile uint32_t overflows;
+    volatile bool active;
+
+    uint8_t chunk[sizeof(CANCaptureHeader) + CAN_CAPTURE_CHUNK * sizeof(CANCaptureRecord) + 2];
+    uint16_t chunkLen;
+    uint16_t chunkSent;
+    uint16_t sequence;
+    uint32_t lastChunk;
+
+    int waiting();
+    void fillChunk(int count);
+};
@@ -0,0 +1,137 @@
+#include "config.h"
+#include "CANDispatch.h"
+
+#define CAN_STD_MASK 0x7ff
+#define CAN_EXT_MASK 0x1fffffff
+#define CAN_EXT_KEY  0x80000000
+
+CANDispatch::CANDispatch()
+{
+  clear();
+}
+
+// Remove all routes
+void CANDispatch::clear()
+{
+  numRoutes = 0;
+  numMasked = 0;
+  for(int n=0; n<CAN_LOOKUP_SIZE; n++) lookupRoute[n] = 0xff;
+}
+
+// Register a handler for every frame whose ID matches id in the bits set
+// in mask. Returns false if the route could not be added.
+bool CANDispatch::add(uint32_t id, uint32_t mask, bool ext, CANHandler handler)
+{
+  if(numRoutes >= CAN_MAX_ROUTES) return false;
+  uint32_t width = ext ? CAN_EXT_MASK : CAN_STD_MASK;
+  mask &= width;
+  uint8_t route = numRoutes;
+  routes[route].id = id & mask;
+  routes[route].mask = mask;
+  routes[route].ext = ext;
+  routes[route].handler = handler;
+  numRoutes++;
+
+  uint32_t free = ~mask & width;
+  if(__builtin_popcount(free) > CAN_EXPAND_BITS) {
+    maskedRoutes[numMasked++] = route;
+    return true;
+  }
+  // Walk every combination of the don't-care bits
+  uint32_t sub = 0;
+  do {
+    uint32_t key = routes[route].id | sub;
+    if(ext) key |= CAN_EXT_KEY;
+    if(!insert(key, route)) {
+      // Table full, fall back to matching this route by mask
+      maskedRoutes[numMasked++] = route;
+      return true;
+    }
+    sub = (sub - free) & free;
+  } while(sub != 0);
+  return true;
+}
+
+// Mix the ID bits down to a lookup table index
+uint8_t CANDispatch::hash(uint32_t key)
+{
+  key ^= key >> 16;
+  key ^= key >> 5;
+  return key & (CAN_LOOKUP_SIZE - 1);
+}
+
+// Add an exact ID to the lookup table with linear probing
+bool CANDispatch::insert(uint32_t key, uint8_t route)
+{
+  uint8_t slot = hash(key);
+  for(int n=0; n<CAN_LOOKUP_SIZE; n++) {
+    if(lookupRoute[slot] == 0xff || lookupKey[slot] == key) {
+      lookupKey[slot] = key;
+      lookupRoute[slot] = route;
+      return true;
+    }
+    slot = (slot + 1) & (CAN_LOOKUP_SIZE - 1);
+  }
+  return false;
+}
+
+// Program the FlexCAN receive mailboxes, one per route. Spare mailboxes
+// repeat the last route so they accept nothing new. If there are more
+// routes than mailboxes, or acceptAll is set for bus debugging, every
+// mailbox is opened instead.
+void CANDispatch::setFilters(bool acceptAll)
+{
+  CAN_filter_t filter;
+  int boxes = Can0.getNumRxBoxes();
+  filter.flags.remote = 0;
+  filter.flags.reserved = 0;
+  if(acceptAll || numRoutes == 0 || numRoutes > boxes) {
+    // Half the mailboxes take standard frames and half extended
+    for(int i=0; i<boxes; i++) {
+      filter.id = 0;
+      filter.flags.extended = (i >= boxes / 2);
+      Can0.setFilter(filter, i);
+      Can0.setMask(0, i);
+    }
+    return;
+  }
+  for(int i=0; i<boxes; i++) {
+    Route &route = routes[i < numRoutes ? i : numRoutes - 1];
+    filter.id = route.id;
+    filter.flags.extended = route.ext;
+    Can0.setFilter(filter, i);
+    // Standard IDs sit in the top 11 bits of the mailbox ID register
+    Can0.setMask(route.ext ? route.mask : route.mask << 18, i);
+  }
+}
+
+// Pass a frame to the handler registered for its ID. Returns false if no
+// route matches.
+bool CANDispatch::dispatch(CAN_message_t &msg)
+{
+  uint32_t key = msg.ext ? (msg.id & CAN_EXT_MASK) | CAN_EXT_KEY : msg.id & CAN_STD_MASK;
+  uint8_t slot = hash(key);
+  for(int n=0; n<CAN_LOOKUP_SIZE; n++) {
+    uint8_t route = lookupRoute[slot];
+    if(route == 0xff) break;
+    if(lookupKey[slot] == key) {
+      routes[route].handler(msg);
+      return true;
+    }
+    slot = (slot + 1) & (CAN_LOOKUP_SIZE - 1);
+  }
+  for(int n=0; n<numMasked; n++) {
+    Route &route = routes[maskedRoutes[n]];
+    if(route.ext == (bool)msg.ext && (msg.id & route.mask) == route.id) {
+      route.handler(msg);
+      return true;
+    }
+  }
+  return false;
+}
+
+// Return the number of registered routes
+int CANDispatch::getNumRoutes()
+{
+  return numRoutes;
+}
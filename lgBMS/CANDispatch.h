@@ -0,0 +1,45 @@
+#pragma once
+#include <FlexCAN.h>
+
+#define CAN_MAX_ROUTES    8   // each route is given its own receive mailbox
+#define CAN_LOOKUP_SIZE   32  // must be a power of two
+#define CAN_EXPAND_BITS   4   // routes with more don't-care bits are matched by mask
+
+typedef void (*CANHandler)(CAN_message_t &msg);
+
+// Routes incoming CAN frames to the subsystems that consume them. Each
+// subsystem registers the ID and mask it is interested in, the FlexCAN
+// mailbox filters are programmed from those registrations, and accepted
+// frames are dispatched through a small hash of exact IDs.
+class CANDispatch
+{
+  public:
+    CANDispatch();
+    void clear();
+    bool add(uint32_t id, uint32_t mask, bool ext, CANHandler handler);
+    void setFilters(bool acceptAll);
+    bool dispatch(CAN_message_t &msg);
+    int getNumRoutes();
+
+  private:
+    struct Route {
+      uint32_t id;
+      uint32_t mask;
+      bool ext;
+      CANHandler handler;
+    };
+    Route routes[CAN_MAX_ROUTES];
+    uint8_t numRoutes;
+
+    // Exact IDs expanded from narrow routes, 0xff marks an empty slot.
+    // Extended IDs have bit 31 set in the key.
+    uint32_t lookupKey[CAN_LOOKUP_SIZE];
+    uint8_t lookupRoute[CAN_LOOKUP_SIZE];
+
+    // Routes too wide to expand, checked only when the lookup misses
+    uint8_t maskedRoutes[CAN_MAX_ROUTES];
+    uint8_t numMasked;
+
+    static uint8_t hash(uint32_t key);
+    bool insert(uint32_t key, uint8_t route);
+};
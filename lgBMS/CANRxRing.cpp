@@ -0,0 +1,75 @@
+#include "config.h"
+#include "CANRxRing.h"
+
+CANRxRing::CANRxRing()
+{
+  head = 0;
+  tail = 0;
+  resetStats();
+}
+
+// Take every received frame from Can0 in interrupt context
+void CANRxRing::begin()
+{
+  Can0.attachObj(this);
+  attachGeneralHandler();
+}
+
+// Called by FlexCAN from the receive interrupt. Returning true tells the
+// driver the frame has been consumed. When the ring is full the new frame
+// is dropped and counted, the loop sees every frame it has not yet read.
+bool CANRxRing::frameHandler(CAN_message_t &frame, int mailbox, uint8_t controller)
+{
+  uint16_t h = head;
+  uint16_t used = (uint16_t)(h - tail);
+  if(used >= CAN_RX_RING_SIZE) {
+    overflows++;
+    return true;
+  }
+  frames[h & (CAN_RX_RING_SIZE - 1)] = frame;
+  arrival[h & (CAN_RX_RING_SIZE - 1)] = micros();
+  // Make sure the frame is stored before the loop can see it
+  __sync_synchronize();
+  head = h + 1;
+  if(used + 1 > highWater) highWater = used + 1;
+  return true;
+}
+
+// Take the oldest frame and its arrival time. Returns false if the ring
+// is empty.
+bool CANRxRing::read(CAN_message_t &msg, uint32_t &timestamp)
+{
+  uint16_t t = tail;
+  if(t == head) return false;
+  msg = frames[t & (CAN_RX_RING_SIZE - 1)];
+  timestamp = arrival[t & (CAN_RX_RING_SIZE - 1)];
+  // Finish copying the frame out before the slot can be reused
+  __sync_synchronize();
+  tail = t + 1;
+  return true;
+}
+
+// Return the number of frames waiting to be read
+int CANRxRing::available()
+{
+  return (uint16_t)(head - tail);
+}
+
+// Return the most frames that have been waiting at once
+uint16_t CANRxRing::getHighWater()
+{
+  return highWater;
+}
+
+// Return the number of frames dropped because the ring was full
+uint32_t CANRxRing::getOverflows()
+{
+  return overflows;
+}
+
+// Clear the high-water mark and overflow count
+void CANRxRing::resetStats()
+{
+  highWater = 0;
+  overflows = 0;
+}
@@ -0,0 +1,29 @@
+#pragma once
+#include <FlexCAN.h>
+
+#define CAN_RX_RING_SIZE 64 // must be a power of two
+
+// Single producer, single consumer receive ring filled from the FlexCAN
+// receive interrupt. Each frame is stamped with its arrival time in
+// microseconds so decoders don't depend on when the loop gets to them.
+class CANRxRing : public CANListener
+{
+  public:
+    CANRxRing();
+    void begin();
+    bool frameHandler(CAN_message_t &frame, int mailbox, uint8_t controller);
+    bool read(CAN_message_t &msg, uint32_t &timestamp);
+    int available();
+    uint16_t getHighWater();
+    uint32_t getOverflows();
+    void resetStats();
+
+  private:
+    CAN_message_t frames[CAN_RX_RING_SIZE];
+    uint32_t arrival[CAN_RX_RING_SIZE];
+    // head is only written by the interrupt and tail only by the loop
+    volatile uint16_t head;
+    volatile uint16_t tail;
+    volatile uint16_t highWater;
+    volatile uint32_t overflows;
+};
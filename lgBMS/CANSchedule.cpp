@@ -0,0 +1,78 @@
+#include "config.h"
+#include "CANSchedule.h"
+
+CANSchedule::CANSchedule(CANScheduleEntry *entries, int count, CANTxQueue &queue)
+  : entries(entries), count(count), queue(queue)
+{
+}
+
+// Work out when each frame is next due. Call again after changing a
+// period or phase.
+void CANSchedule::begin(uint32_t now)
+{
+  for(int n=0; n<count; n++) {
+    CANScheduleEntry &entry = entries[n];
+    if(entry.period == 0) continue;
+    uint16_t phase = entry.phase % entry.period;
+    entry.nextDue = now - (now % entry.period) + phase;
+    if((int32_t)(entry.nextDue - now) < 0) entry.nextDue += entry.period;
+  }
+}
+
+// Send every frame that has come due
+void CANSchedule::run(uint32_t now)
+{
+  for(int n=0; n<count; n++) {
+    CANScheduleEntry &entry = entries[n];
+    if(entry.period == 0) continue;
+    if((int32_t)(now - entry.nextDue) < 0) continue;
+    entry.nextDue += entry.period;
+    // If the loop stalled for a whole period, skip the missed slots rather than bursting
+    if((int32_t)(now - entry.nextDue) >= 0) entry.nextDue += ((now - entry.nextDue) / entry.period + 1) * entry.period;
+    CAN_message_t msg;
+    memset(&msg, 0, sizeof(msg));
+    if(entry.encode(msg) && queue.send(msg, entry.priority) && entry.sent) entry.sent(msg);
+  }
+}
+
+// Worst case length of a data frame on the bus in bits, including bit
+// stuffing and the interframe space
+uint32_t CANSchedule::frameBits(CAN_message_t &msg)
+{
+  uint32_t stuffed = (msg.ext ? 54 : 34) + 8 * msg.len;
+  return stuffed + (stuffed - 1) / 4 + 13;
+}
+
+// Print the frames the active table would send and the bus load they
+// would cause. Entries whose encoder currently declines are not counted.
+// Nothing is sent, so the sent functions aren't called.
+void CANSchedule::printLoad(uint32_t bitrate)
+{
+  float total = 0;
+  SERIALCONSOLE.println();
+  for(int n=0; n<count; n++) {
+    CANScheduleEntry &entry = entries[n];
+    CAN_message_t msg;
+    memset(&msg, 0, sizeof(msg));
+    if(entry.period == 0 || !entry.encode(msg)) continue;
+    float load = frameBits(msg) * 1000.0f / entry.period / bitrate * 100.0f;
+    total += load;
+    SERIALCONSOLE.print(entry.name);
+    SERIALCONSOLE.print(": 0x");
+    SERIALCONSOLE.print(msg.id, HEX);
+    SERIALCONSOLE.print(" len ");
+    SERIALCONSOLE.print(msg.len);
+    SERIALCONSOLE.print(" every ");
+    SERIALCONSOLE.print(entry.period);
+    SERIALCONSOLE.print("mS at +");
+    SERIALCONSOLE.print(entry.phase);
+    SERIALCONSOLE.print("mS  ");
+    SERIALCONSOLE.print(load, 3);
+    SERIALCONSOLE.println("%");
+  }
+  SERIALCONSOLE.print("Projected bus load: ");
+  SERIALCONSOLE.print(total, 3);
+  SERIALCONSOLE.print("% of ");
+  SERIALCONSOLE.print(bitrate / 1000);
+  SERIALCONSOLE.println("kbps");
+}
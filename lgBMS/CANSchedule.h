@@ -0,0 +1,40 @@
+#pragma once
+#include <FlexCAN.h>
+#include "CANTxQueue.h"
+
+typedef bool (*CANEncoder)(CAN_message_t &msg);
+typedef void (*CANSent)(CAN_message_t &msg);
+
+// One periodic frame. The encoder builds the frame and returns false if
+// it should be skipped this time. It may also be called just to see the
+// frame, so it must not change any state; anything that should only
+// happen once the frame is queued goes in the optional sent function.
+// Frames go out at phase + n * period ms, so giving frames of the same
+// period different phases spreads them out instead of sending them back
+// to back.
+typedef struct {
+  const char *name;
+  uint16_t period;  // ms
+  uint16_t phase;   // ms offset within the period
+  uint8_t priority; // CANTxQueue priority
+  CANEncoder encode;
+  CANSent sent;     // NULL if nothing to do
+  uint32_t nextDue;
+} CANScheduleEntry;
+
+// Sends a table of periodic frames through the transmit queue
+class CANSchedule
+{
+  public:
+    CANSchedule(CANScheduleEntry *entries, int count, CANTxQueue &queue);
+    void begin(uint32_t now);
+    void run(uint32_t now);
+    void printLoad(uint32_t bitrate);
+
+  private:
+    CANScheduleEntry *entries;
+    int count;
+    CANTxQueue &queue;
+
+    static uint32_t frameBits(CAN_message_t &msg);
+};
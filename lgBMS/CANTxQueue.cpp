@@ -0,0 +1,137 @@
+#include "config.h"
+#include "CANTxQueue.h"
+
+CANTxQueue::CANTxQueue()
+{
+  for(int p=0; p<CAN_TX_PRIORITIES; p++) {
+    rings[p].head = 0;
+    rings[p].count = 0;
+  }
+  resetStats();
+}
+
+// Hook the transmit complete interrupt for every mailbox
+void CANTxQueue::begin()
+{
+  Can0.attachObj(this);
+  attachGeneralHandler();
+}
+
+// Send a frame, queueing it if the mailboxes are busy or older frames are
+// still waiting. Returns false if the frame had to be dropped.
+bool CANTxQueue::send(CAN_message_t &msg, uint8_t priority)
+{
+  if(priority >= CAN_TX_PRIORITIES) priority = CAN_TX_PRIORITIES - 1;
+  bool ok = true;
+  noInterrupts();
+  if(queued() == 0 && Can0.write(msg) != 0) {
+    sent++;
+    interrupts();
+    return true;
+  }
+  // Latest value wins: overwrite a waiting frame with the same ID
+  if(priority != CAN_TX_COMMAND) {
+    for(int p=CAN_TX_COMMAND + 1; p<CAN_TX_PRIORITIES; p++) {
+      Ring &ring = rings[p];
+      for(int n=0; n<ring.count; n++) {
+        Entry &entry = ring.entries[(ring.head + n) & (CAN_TX_QUEUE_SIZE - 1)];
+        if(entry.msg.id == msg.id && entry.msg.ext == msg.ext) {
+          entry.msg = msg;
+          coalesced++;
+          interrupts();
+          return true;
+        }
+      }
+    }
+  }
+  Ring &ring = rings[priority];
+  if(ring.count < CAN_TX_QUEUE_SIZE) {
+    Entry &entry = ring.entries[(ring.head + ring.count) & (CAN_TX_QUEUE_SIZE - 1)];
+    entry.msg = msg;
+    entry.queuedAt = micros();
+    ring.count++;
+  } else {
+    drops++;
+    ok = false;
+  }
+  interrupts();
+  return ok;
+}
+
+// Move waiting frames into the mailboxes until they are full. Must be
+// called with interrupts disabled or from the CAN interrupt.
+void CANTxQueue::drain()
+{
+  for(int p=0; p<CAN_TX_PRIORITIES; p++) {
+    Ring &ring = rings[p];
+    while(ring.count > 0) {
+      Entry &entry = ring.entries[ring.head];
+      if(Can0.write(entry.msg) == 0) return;
+      uint32_t latency = micros() - entry.queuedAt;
+      if(latency > maxLatency) maxLatency = latency;
+      totalLatency += latency;
+      sent++;
+      ring.head = (ring.head + 1) & (CAN_TX_QUEUE_SIZE - 1);
+      ring.count--;
+    }
+  }
+}
+
+// Called periodically from the loop or a timer in case a transmit
+// complete interrupt was missed
+void CANTxQueue::service()
+{
+  noInterrupts();
+  drain();
+  interrupts();
+}
+
+// Called by FlexCAN when a mailbox has finished transmitting
+void CANTxQueue::txHandler(int mailbox, uint8_t controller)
+{
+  drain();
+}
+
+// Return the number of frames waiting to be sent
+int CANTxQueue::queued()
+{
+  int count = 0;
+  for(int p=0; p<CAN_TX_PRIORITIES; p++) count += rings[p].count;
+  return count;
+}
+
+// Return the number of frames dropped because the queue was full
+uint32_t CANTxQueue::getDrops()
+{
+  return drops;
+}
+
+// Return the number of waiting frames replaced by a newer value
+uint32_t CANTxQueue::getCoalesced()
+{
+  return coalesced;
+}
+
+// Return the longest time a frame has waited in the queue in microseconds
+uint32_t CANTxQueue::getMaxLatency()
+{
+  return maxLatency;
+}
+
+// Return the average time frames have waited in microseconds, counting
+// frames that went straight to a mailbox as no wait
+uint32_t CANTxQueue::getAvgLatency()
+{
+  if(sent == 0) return 0;
+  return totalLatency / sent;
+}
+
+// Clear the counters
+void CANTxQueue::resetStats()
+{
+  drops = 0;
+  coalesced = 0;
+  maxLatency = 0;
+  totalLatency = 0;
+  sent = 0;
+}
@@ -0,0 +1,52 @@
+#pragma once
+#include <FlexCAN.h>
+
+#define CAN_TX_QUEUE_SIZE 16 // per priority, must be a power of two
+
+// Transmit priorities, drained highest first
+#define CAN_TX_COMMAND 0 // daisychain adapter commands, never replaced
+#define CAN_TX_HIGH    1 // charger control
+#define CAN_TX_LOW     2 // periodic status frames
+#define CAN_TX_PRIORITIES 3
+
+// Software transmit queue for frames the FlexCAN mailboxes can't take
+// straight away. A queued frame is replaced by a newer one with the same
+// ID, so only the latest value of each frame is ever waiting. Commands
+// share an ID but differ in their payload, so they are never replaced.
+// The queue is drained from the transmit complete interrupt, as many
+// frames at a time as the mailboxes will accept.
+class CANTxQueue : public CANListener
+{
+  public:
+    CANTxQueue();
+    void begin();
+    bool send(CAN_message_t &msg, uint8_t priority = CAN_TX_LOW);
+    void service();
+    void txHandler(int mailbox, uint8_t controller);
+    int queued();
+    uint32_t getDrops();
+    uint32_t getCoalesced();
+    uint32_t getMaxLatency();
+    uint32_t getAvgLatency();
+    void resetStats();
+
+  private:
+    struct Entry {
+      CAN_message_t msg;
+      uint32_t queuedAt;
+    };
+    struct Ring {
+      Entry entries[CAN_TX_QUEUE_SIZE];
+      uint8_t head;
+      uint8_t count;
+    };
+    Ring rings[CAN_TX_PRIORITIES];
+
+    uint32_t drops;
+    uint32_t coalesced;
+    uint32_t maxLatency;
+    uint32_t totalLatency;
+    uint32_t sent;
+
+    void drain();
+};
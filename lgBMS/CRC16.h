@@ -0,0 +1,13 @@
+#pragma once
+#include <stdint.h>
+
+// CRC-16/CCITT-FALSE over a buffer. Header only so the host tools that
+// decode the binary streams share the same code.
+static inline uint16_t crc16(const uint8_t *data, int len, uint16_t crc = 0xffff)
+{
+  while(len--) {
+    crc ^= (uint16_t)*data++ << 8;
+    for(int i=0; i<8; i++) crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+  }
+  return crc;
+}
@@ -0,0 +1,48 @@
+#include "ConsoleText.h"
+
+ConsoleText::ConsoleText(Print &out, bool (*quiet)()) : out(out), quiet(quiet)
+{
+  heldLen = 0;
+  holding = false;
+  dropped = 0;
+}
+
+// Pass one byte on, hold it back or drop it
+size_t ConsoleText::write(uint8_t b)
+{
+  if(quiet && quiet()) {
+    dropped++;
+    return 0;
+  }
+  if(holding) {
+    if(heldLen >= CONSOLE_HOLD_SIZE) {
+      dropped++;
+      return 0;
+    }
+    held[heldLen++] = b;
+    return 1;
+  }
+  return out.write(b);
+}
+
+// Hold text back from now on, until release()
+void ConsoleText::hold()
+{
+  holding = true;
+}
+
+// Pass on the text held back, and anything written from now on
+void ConsoleText::release()
+{
+  holding = false;
+  if(heldLen == 0) return;
+  if(quiet && quiet()) dropped += heldLen;
+  else out.write(held, heldLen);
+  heldLen = 0;
+}
+
+// Return the number of bytes dropped, while quiet or with the hold full
+uint32_t ConsoleText::getDropped()
+{
+  return dropped;
+}
@@ -0,0 +1,30 @@
+#pragma once
+#include <Arduino.h>
+
+#define CONSOLE_HOLD_SIZE 256 // bytes of text held back while a report is going out
+
+// Debug and trip messages written while the sketch runs. They go to the
+// console's output queue rather than straight to the port, so they can't
+// land in the middle of something the queue is part way through sending.
+// Text written while a report is being formatted is held back and follows
+// it, as it did when the reports were printed in one go. While the quiet
+// function returns true, when a binary stream owns the port, text is
+// dropped and counted instead.
+class ConsoleText : public Print
+{
+  public:
+    ConsoleText(Print &out, bool (*quiet)());
+    size_t write(uint8_t b);
+    using Print::write;
+    void hold();
+    void release();
+    uint32_t getDropped();
+
+  private:
+    Print &out;
+    bool (*quiet)();
+    uint8_t held[CONSOLE_HOLD_SIZE];
+    uint16_t heldLen;
+    bool holding;
+    uint32_t dropped;
+};
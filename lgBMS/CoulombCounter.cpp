@@ -0,0 +1,70 @@
+#include "CoulombCounter.h"
+
+CoulombCounter::CoulombCounter(int32_t restCurrent)
+  : restCurrent(restCurrent)
+{
+  charge = 0;
+  chargeIn = 0;
+  chargeOut = 0;
+  lastCurrent = 0;
+  lastTime = 0;
+  started = false;
+  rest = 0;
+}
+
+// Add a current sample taken at timestamp us. The first sample, and any
+// after a gap longer than COULOMB_MAX_GAP, only start a new interval.
+void CoulombCounter::sample(int32_t milliamps, uint32_t timestamp)
+{
+  uint32_t interval = timestamp - lastTime;
+  if(started && interval <= COULOMB_MAX_GAP) {
+    // The average of the two samples in uA is (last + now) * 1000 / 2
+    int64_t step = (int64_t)(lastCurrent + milliamps) * 500 * interval;
+    charge += step;
+    if(step > 0) chargeIn += step;
+    else chargeOut -= step;
+    if(abs(milliamps) <= restCurrent && abs(lastCurrent) <= restCurrent) rest += interval;
+    else rest = 0;
+  } else {
+    rest = 0;
+  }
+  lastCurrent = milliamps;
+  lastTime = timestamp;
+  started = true;
+}
+
+// Set the charge held, e.g. from a voltage based SOC estimate
+void CoulombCounter::setMilliampHours(int32_t mAh)
+{
+  charge = (int64_t)mAh * COULOMB_PER_MAH;
+}
+
+// Return the charge held in mAh, rounded towards zero
+int32_t CoulombCounter::getMilliampHours()
+{
+  return charge / COULOMB_PER_MAH;
+}
+
+// Return the charge held in uA.us
+int64_t CoulombCounter::getCharge()
+{
+  return charge;
+}
+
+// Return the total charge in since start up, in uA.us
+uint64_t CoulombCounter::getChargeIn()
+{
+  return chargeIn;
+}
+
+// Return the total charge out since start up, in uA.us
+uint64_t CoulombCounter::getChargeOut()
+{
+  return chargeOut;
+}
+
+// Return how long in ms the current has been within the rest threshold
+uint32_t CoulombCounter::getRestTime()
+{
+  return rest / 1000;
+}
@@ -0,0 +1,35 @@
+#pragma once
+#include <Arduino.h>
+
+#define COULOMB_MAX_GAP 1000000 // us, longer gaps between samples are not integrated
+#define COULOMB_PER_MAH 3600000000000LL // uA.us in one mAh
+
+// Integrates current samples into charge, using the time each sample was
+// taken. Charge is held in microamp-microseconds in 64 bits, which keeps
+// small currents that a float total would round away and has room for
+// over 2500Ah. Each interval uses the average of the samples either side
+// of it. Also times how long the current has stayed within the rest
+// threshold, for open circuit voltage corrections, and keeps totals of
+// the charge in and out that SOC corrections don't touch.
+class CoulombCounter
+{
+  public:
+    CoulombCounter(int32_t restCurrent);
+    void sample(int32_t milliamps, uint32_t timestamp);
+    void setMilliampHours(int32_t mAh);
+    int32_t getMilliampHours();
+    int64_t getCharge();
+    uint64_t getChargeIn();
+    uint64_t getChargeOut();
+    uint32_t getRestTime();
+
+  private:
+    int64_t charge;     // uA.us
+    uint64_t chargeIn;  // uA.us
+    uint64_t chargeOut; // uA.us
+    int32_t lastCurrent; // mA
+    uint32_t lastTime;  // us
+    bool started;
+    int32_t restCurrent; // mA
+    uint64_t rest;      // us within restCurrent
+};
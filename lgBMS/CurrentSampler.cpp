@@ -0,0 +1,87 @@
+#include "CurrentSampler.h"
+
+CurrentSampler::CurrentSampler(ADC *adc, uint8_t lowPin, uint8_t highPin)
+  : adc(adc), lowPin(lowPin), highPin(highPin)
+{
+  running = false;
+  full[0] = full[1] = false;
+  filling = 0;
+  index = 0;
+  high = false;
+  overruns = 0;
+}
+
+// Start sampling. isr must call isr() on this object; it is a plain
+// function because that is what the ADC library takes.
+void CurrentSampler::start(void (*isr)())
+{
+  if(running) return;
+  noInterrupts();
+  full[0] = full[1] = false;
+  filling = 0;
+  index = 0;
+  high = false;
+  interrupts();
+  adc->adc0->stopContinuous();
+  adc->adc0->enableInterrupts(isr);
+  // With the timer running this only selects the input for the next trigger
+  adc->adc0->startSingleRead(lowPin);
+  adc->adc0->startTimer(CURRENT_SAMPLE_RATE * 2);
+  running = true;
+}
+
+// Stop sampling, e.g. to take over the ADC for calibration
+void CurrentSampler::stop()
+{
+  if(!running) return;
+  adc->adc0->stopTimer();
+  adc->adc0->disableInterrupts();
+  running = false;
+}
+
+// Conversion complete interrupt. Stores the reading and selects the other
+// input for the next timer trigger.
+void CurrentSampler::isr()
+{
+  uint16_t value = (uint16_t)adc->adc0->readSingle();
+  CurrentBlock &block = blocks[filling];
+  if(!high) {
+    if(index == 0) block.time = micros();
+    block.low[index] = value;
+  } else {
+    block.high[index] = value;
+    if(++index == CURRENT_BLOCK) {
+      full[filling] = true;
+      filling ^= 1;
+      index = 0;
+      // The loop hasn't collected the other block, so it is overwritten
+      if(full[filling]) {
+        full[filling] = false;
+        overruns++;
+      }
+    }
+  }
+  high = !high;
+  adc->adc0->startSingleRead(high ? highPin : lowPin);
+}
+
+// Copy out the block that has finished filling, if there is one
+bool CurrentSampler::read(CurrentBlock &block)
+{
+  bool ready = false;
+  noInterrupts();
+  uint8_t n = filling ^ 1;
+  if(full[n]) {
+    block = blocks[n];
+    full[n] = false;
+    ready = true;
+  }
+  interrupts();
+  return ready;
+}
+
+// Return the number of blocks overwritten before the loop collected them
+uint32_t CurrentSampler::getOverruns()
+{
+  return overruns;
+}
@@ -0,0 +1,41 @@
+#pragma once
+#include <Arduino.h>
+#include <ADC.h>
+
+#define CURRENT_SAMPLE_RATE 1000 // pairs of low and high range readings per second
+#define CURRENT_BLOCK 10         // pairs per block, 10ms at CURRENT_SAMPLE_RATE
+
+// One block of readings. Pair n was taken at time + n * 1000000 /
+// CURRENT_SAMPLE_RATE us.
+typedef struct {
+  uint32_t time; // us
+  uint16_t low[CURRENT_BLOCK];
+  uint16_t high[CURRENT_BLOCK];
+} CurrentBlock;
+
+// Samples the low and high range current sensor inputs at a fixed rate.
+// The PDB timer triggers ADC0 conversions, alternating between the two
+// inputs, and the conversion complete interrupt stores each reading in
+// one of two blocks. The loop collects a block while the other fills.
+class CurrentSampler
+{
+  public:
+    CurrentSampler(ADC *adc, uint8_t lowPin, uint8_t highPin);
+    void start(void (*isr)());
+    void stop();
+    bool read(CurrentBlock &block);
+    void isr();
+    uint32_t getOverruns();
+
+  private:
+    ADC *adc;
+    uint8_t lowPin;
+    uint8_t highPin;
+    volatile bool running;
+    CurrentBlock blocks[2];
+    volatile bool full[2];
+    volatile uint8_t filling; // block the interrupt is writing
+    volatile uint8_t index;   // pair being written
+    volatile bool high;       // reading in progress is the high range
+    volatile uint32_t overruns;
+};
@@ -0,0 +1,343 @@
+#include "FlightRecorder.h"
+#include "CRC16.h"
+
+#define DUMP_IDLE 0
+#define DUMP_BASE 1
+#define DUMP_RING 2
+
+FlightRecorder::FlightRecorder(BMSModuleManager &bms, uint8_t *ring, int size)
+  : bms(bms), ring(ring), size(size)
+{
+  nextDue = 0;
+  frozen = false;
+  suspended = false;
+  tripTime = 0;
+  tripReason = 0;
+  readPos = 0;
+  readHalf = false;
+  dumpStage = DUMP_IDLE;
+  dumpPos = 0;
+  dumpModule = 0;
+  dumpCrc = 0xffff;
+  clear();
+}
+
+// Empty the ring and forget the module values, to start afresh
+void FlightRecorder::clear()
+{
+  head = 0;
+  tail = 0;
+  used = 0;
+  snapshots = 0;
+  memset(base, 0, sizeof(base));
+  memset(last, 0, sizeof(last));
+  baseModules = 0;
+  period = FLIGHT_PERIOD;
+  avgLength = 0;
+  lastTime = 0;
+  nibbles = 0;
+  half = false;
+}
+
+// Return true when the next snapshot should be taken
+bool FlightRecorder::due(uint32_t now)
+{
+  return (int32_t)(now - nextDue) >= 0;
+}
+
+// Append a byte to the ring, dropping the oldest snapshots to make room
+void FlightRecorder::put(uint8_t b)
+{
+  if(used == size) evict();
+  ring[head] = b;
+  head = (head + 1) % size;
+  used++;
+}
+
+// Append a nibble, low nibble first
+void FlightRecorder::putNibble(uint8_t n)
+{
+  if(!half) {
+    nibbles = n;
+    half = true;
+  } else {
+    put(nibbles | (n << 4));
+    half = false;
+  }
+}
+
+// Append a value as the change from previous, see FlightSnapshot
+void FlightRecorder::putValue(uint16_t value, uint16_t previous)
+{
+  int32_t change = (int32_t)value - previous;
+  uint32_t z = ((uint32_t)change << 1) ^ (uint32_t)(change >> 31);
+  if(z < FLIGHT_BYTE) {
+    putNibble(z);
+  } else if(z - FLIGHT_BYTE < 0x100) {
+    putNibble(FLIGHT_BYTE);
+    putNibble((z - FLIGHT_BYTE) & 0x0f);
+    putNibble((z - FLIGHT_BYTE) >> 4);
+  } else {
+    putNibble(FLIGHT_FULL);
+    for(int i=0; i<4; i++) putNibble((value >> (i * 4)) & 0x0f);
+  }
+}
+
+// Return the byte at pos, counting from the start of the ring buffer
+uint8_t FlightRecorder::get(int pos)
+{
+  return ring[pos % size];
+}
+
+// Copy out the snapshot header at pos
+void FlightRecorder::getHeader(int pos, FlightSnapshot &header)
+{
+  uint8_t *p = (uint8_t *)&header;
+  for(int i=0; i<(int)sizeof(header); i++) p[i] = get(pos + i);
+}
+
+// Read the next nibble from readPos
+uint8_t FlightRecorder::getNibble()
+{
+  uint8_t b = get(readPos);
+  if(!readHalf) {
+    readHalf = true;
+    return b & 0x0f;
+  }
+  readHalf = false;
+  readPos++;
+  return b >> 4;
+}
+
+// Read the next value, coded as the change from previous
+uint16_t FlightRecorder::getValue(uint16_t previous)
+{
+  uint32_t z = getNibble();
+  if(z == FLIGHT_FULL) {
+    uint16_t value = 0;
+    for(int i=0; i<4; i++) value |= getNibble() << (i * 4);
+    return value;
+  }
+  if(z == FLIGHT_BYTE) {
+    z = getNibble();
+    z = FLIGHT_BYTE + (z | (getNibble() << 4));
+  }
+  // Undo the zigzag: 0, -1, 1, -2, 2...
+  return previous + (int32_t)((z >> 1) ^ -(z & 1));
+}
+
+// Fold the oldest snapshot into the base values and drop it
+void FlightRecorder::evict()
+{
+  FlightSnapshot header;
+  getHeader(tail, header);
+  readPos = tail + sizeof(header);
+  readHalf = false;
+  for(int address=0; address<FLIGHT_MODULES; address++) {
+    if(!(header.changed & (1ULL << address))) continue;
+    for(int n=0; n<FLIGHT_VALUES; n++) base[address][n] = getValue(base[address][n]);
+  }
+  baseModules |= header.changed;
+  tail = (tail + header.length) % size;
+  used -= header.length;
+  snapshots--;
+}
+
+// Fill values with a module's current readings
+void FlightRecorder::moduleValues(int address, uint16_t *values)
+{
+  BMSModule &module = bms.getModule(address);
+  for(int n=0; n<16; n++) values[n] = module.getCellRaw(n) >> FLIGHT_SHIFT;
+  values[16] = module.getTempRaw(0) >> FLIGHT_SHIFT;
+  values[17] = module.getTempRaw(1) >> FLIGHT_SHIFT;
+  values[18] = module.getBalStat();
+}
+
+// Stretch the period so the ring holds FLIGHT_SPAN of snapshots of about
+// the recent length
+void FlightRecorder::adjustPeriod(int length)
+{
+  if(avgLength == 0) avgLength = length * 8;
+  else avgLength += ((int32_t)length * 8 - (int32_t)avgLength) / 8;
+  uint32_t span = (uint64_t)size * 8 * FLIGHT_PERIOD / avgLength;
+  uint32_t periods = (FLIGHT_SPAN + span - 1) / span;
+  period = periods * FLIGHT_PERIOD;
+}
+
+// Store a snapshot of every module that has reported a change since its
+// last one, with the pack state given. Does nothing while frozen,
+// suspended or dumping.
+void FlightRecorder::record(FlightSnapshot &state)
+{
+  uint64_t decoded = bms.takeDecoded();
+  nextDue = state.time + period;
+  if(frozen || suspended || dumpStage != DUMP_IDLE) return;
+
+  state.modules = decoded;
+  state.changed = 0;
+  for(int address=0; address<FLIGHT_MODULES; address++) {
+    if(!(decoded & (1ULL << address))) continue;
+    uint16_t values[FLIGHT_VALUES];
+    moduleValues(address, values);
+    if(memcmp(values, last[address], sizeof(values)) != 0) state.changed |= 1ULL << address;
+  }
+  // The length is filled in at the end. A whole snapshot is always
+  // smaller than the ring, so making room never drops this one.
+  int start = head;
+  const uint8_t *p = (const uint8_t *)&state;
+  for(int i=0; i<(int)sizeof(state); i++) put(p[i]);
+  for(int address=0; address<FLIGHT_MODULES; address++) {
+    if(!(state.changed & (1ULL << address))) continue;
+    uint16_t values[FLIGHT_VALUES];
+    moduleValues(address, values);
+    for(int n=0; n<FLIGHT_VALUES; n++) {
+      putValue(values[n], last[address][n]);
+      last[address][n] = values[n];
+    }
+  }
+  if(half) {
+    put(nibbles);
+    half = false;
+  }
+  uint16_t length = (head - start + size) % size;
+  ring[start] = length & 0xff;
+  ring[(start + 1) % size] = length >> 8;
+  snapshots++;
+  lastTime = state.time;
+  adjustPeriod(length);
+}
+
+// Stop recording, keeping what led up to a trip
+void FlightRecorder::freeze(uint32_t now, uint16_t reason)
+{
+  if(frozen || suspended) return;
+  frozen = true;
+  tripTime = now;
+  tripReason = reason;
+}
+
+// Start recording again after a freeze
+void FlightRecorder::rearm()
+{
+  frozen = false;
+}
+
+// Return true once frozen
+bool FlightRecorder::isFrozen()
+{
+  return frozen;
+}
+
+// Stop recording and give up the ring, which the caller may then use for
+// something else. Whatever was recorded is lost.
+void FlightRecorder::suspend()
+{
+  suspended = true;
+  clear();
+}
+
+// Take the ring back after suspend() and start recording afresh
+void FlightRecorder::resume()
+{
+  if(!suspended) return;
+  clear();
+  suspended = false;
+}
+
+// Return true while suspended
+bool FlightRecorder::isSuspended()
+{
+  return suspended;
+}
+
+// Start sending the ring in binary, see FlightDumpHeader. Recording pauses
+// until it has all been sent.
+void FlightRecorder::startDump()
+{
+  dumpStage = DUMP_BASE;
+  dumpPos = -1;
+  dumpModule = 0;
+  dumpCrc = 0xffff;
+}
+
+// Return true while a dump is being sent
+bool FlightRecorder::isDumping()
+{
+  return dumpStage != DUMP_IDLE;
+}
+
+// Queue bytes of the dump and add them to the CRC
+void FlightRecorder::send(OutputQueue &out, const void *data, int len)
+{
+  out.write((const uint8_t *)data, len);
+  dumpCrc = crc16((const uint8_t *)data, len, dumpCrc);
+}
+
+// Queue as much of the dump as the output has room for. Called every loop.
+void FlightRecorder::dump(OutputQueue &out)
+{
+  while(dumpStage != DUMP_IDLE && out.room() >= 64) {
+    if(dumpPos < 0) {
+      FlightDumpHeader header;
+      header.magic = FLIGHT_MAGIC;
+      header.version = FLIGHT_VERSION;
+      header.frozen = frozen;
+      header.snapshots = snapshots;
+      header.bytes = used;
+      header.tripTime = tripTime;
+      header.tripReason = tripReason;
+      header.period = period;
+      header.baseModules = baseModules;
+      send(out, &header, sizeof(header));
+      dumpPos = 0;
+    } else if(dumpStage == DUMP_BASE) {
+      while(dumpModule < FLIGHT_MODULES && !(baseModules & (1ULL << dumpModule))) dumpModule++;
+      if(dumpModule == FLIGHT_MODULES) {
+        dumpStage = DUMP_RING;
+        continue;
+      }
+      send(out, base[dumpModule], sizeof(base[dumpModule]));
+      dumpModule++;
+    } else if(dumpPos < used) {
+      // Up to 32 bytes at a time, stopping at the end of the buffer
+      int pos = (tail + dumpPos) % size;
+      int len = used - dumpPos;
+      if(len > 32) len = 32;
+      if(len > size - pos) len = size - pos;
+      send(out, ring + pos, len);
+      dumpPos += len;
+    } else {
+      uint8_t crc[2] = {(uint8_t)(dumpCrc & 0xff), (uint8_t)(dumpCrc >> 8)};
+      out.write(crc, 2);
+      dumpStage = DUMP_IDLE;
+    }
+  }
+}
+
+// Print what the recorder holds
+void FlightRecorder::printStatus(Print &out)
+{
+  out.print("Flight Recorder :");
+  out.print(suspended ? "Suspended" : (frozen ? "Frozen" : "Recording"));
+  out.print(" Snapshots :");
+  out.print(snapshots);
+  out.print(" Bytes :");
+  out.print(used);
+  out.print(" Period :");
+  out.print(period);
+  out.print("ms");
+  if(snapshots > 0) {
+    FlightSnapshot header;
+    getHeader(tail, header);
+    out.print(" Span :");
+    out.print((lastTime - header.time) / 1000);
+    out.print("s");
+  }
+  if(frozen) {
+    out.print(" Tripped at :");
+    out.print(tripTime);
+    out.print("ms Reason :");
+    out.print(tripReason, HEX);
+  }
+  out.println();
+}
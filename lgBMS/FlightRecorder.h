@@ -0,0 +1,130 @@
+#pragma once
+#include <Arduino.h>
+#include "config.h"
+#include "BMSModuleManager.h"
+#include "OutputQueue.h"
+
+#define FLIGHT_RING_SIZE 8192 // bytes of snapshots kept by the sketch
+#define FLIGHT_PERIOD 1000    // ms between snapshots, at the shortest
+#define FLIGHT_SPAN 60000     // ms the ring should hold, see FlightRecorder
+#define FLIGHT_VALUES 19      // per module: 16 cells, 2 temperatures, balancing
+#define FLIGHT_SHIFT 4        // low bits of the cell and NTC readings dropped, 1.2mV
+#define FLIGHT_BYTE 14        // nibble code for a change in the next two nibbles
+#define FLIGHT_FULL 15        // nibble code for a new value in the next four
+#define FLIGHT_MODULES (MAX_MODULE_ADDR + 1)
+#define FLIGHT_MAGIC 0x43455246UL // "FREC" at the start of a dump
+#define FLIGHT_VERSION 2
+
+// Pack state at the start of every snapshot. It is followed by the values
+// of each module set in changed, in address order, FLIGHT_VALUES each: the
+// cell readings and NTC readings, raw shifted down FLIGHT_SHIFT bits, and
+// the balancing bitmap. Modules that reported but are set only in modules
+// read the same as in their last snapshot. Values are coded in nibbles,
+// low nibble first, from the zigzag coded change z from that module's
+// previous value: z itself if less than FLIGHT_BYTE, FLIGHT_BYTE followed
+// by z - FLIGHT_BYTE in two nibbles if that fits, or else FLIGHT_FULL
+// followed by the new value in four, least significant first. The
+// snapshot is padded to a whole byte. All fields are little endian.
+typedef struct __attribute__((packed)) {
+  uint16_t length;      // bytes, including this header
+  uint32_t time;        // ms
+  int32_t current;      // mA
+  uint8_t SOC;          // %
+  uint8_t status;       // bmsstatus
+  uint16_t errorReason;
+  uint8_t outputs;      // output pins, OUT1 in bit 0
+  uint8_t reserved;
+  uint64_t modules;     // modules that reported since the last snapshot
+  uint64_t changed;     // those whose values are stored
+} FlightSnapshot;
+
+// Start of a binary dump. It is followed by the base values, FLIGHT_VALUES
+// uint16 for each module set in baseModules, that the first snapshot's
+// changes apply to, then bytes of snapshots, oldest first, then a CRC-16
+// (CCITT, initial value 0xffff) of everything before it.
+typedef struct __attribute__((packed)) {
+  uint32_t magic;
+  uint8_t version;
+  uint8_t frozen;
+  uint16_t snapshots;
+  uint32_t bytes;
+  uint32_t tripTime;    // ms, when it froze
+  uint16_t tripReason;  // ErrorReason when it froze
+  uint16_t period;      // ms, between the newest snapshots
+  uint64_t baseModules;
+} FlightDumpHeader;
+
+// Keeps the recent history of every module's readings in a RAM ring given
+// by the caller, one snapshot a period. Only modules whose readings have
+// changed since their last snapshot are stored, as nibble coded changes,
+// so a module costs nothing while it is steady and about ten bytes once
+// ADC noise moves its cells by a count or two. To hold FLIGHT_SPAN of
+// history whatever the size of the pack, the period is stretched from
+// FLIGHT_PERIOD in whole seconds to suit the average snapshot length. An
+// 8 KB ring holds a minute of up to 8 modules at 1s, 16 at 2s and 64 at
+// 5s. When the ring is full the oldest snapshot is folded into the base
+// values.
+// Freezing stops recording so the lead up to a trip is kept until it has
+// been dumped. The ring can be lent out while suspended.
+class FlightRecorder
+{
+  public:
+    FlightRecorder(BMSModuleManager &bms, uint8_t *ring, int size);
+    bool due(uint32_t now);
+    void record(FlightSnapshot &state);
+    void freeze(uint32_t now, uint16_t reason);
+    void rearm();
+    bool isFrozen();
+    void suspend();
+    void resume();
+    bool isSuspended();
+    void startDump();
+    bool isDumping();
+    void dump(OutputQueue &out);
+    void printStatus(Print &out);
+
+  private:
+    BMSModuleManager &bms;
+    uint8_t *ring;
+    int size;
+    int head;
+    int tail;
+    int used;
+    uint16_t snapshots;
+    uint16_t base[FLIGHT_MODULES][FLIGHT_VALUES]; // values before the oldest snapshot
+    uint16_t last[FLIGHT_MODULES][FLIGHT_VALUES]; // values in the newest snapshot
+    uint64_t baseModules;
+    uint32_t nextDue;  // ms
+    uint32_t period;   // ms
+    uint32_t avgLength; // bytes * 8 of the recent snapshots, 0 before the first
+    bool frozen;
+    bool suspended;    // the ring is lent out
+    uint32_t tripTime;
+    uint16_t tripReason;
+    uint32_t lastTime;  // ms, newest snapshot
+
+    // Nibble writer and reader
+    uint8_t nibbles;
+    bool half;
+    int readPos;
+    bool readHalf;
+
+    // Dump in progress
+    int dumpStage;
+    int dumpPos;
+    int dumpModule;
+    uint16_t dumpCrc;
+
+    void clear();
+    void put(uint8_t b);
+    void putNibble(uint8_t n);
+    void putValue(uint16_t value, uint16_t previous);
+    uint8_t get(int pos);
+    void getHeader(int pos, FlightSnapshot &header);
+    uint8_t getNibble();
+    uint16_t getValue(uint16_t previous);
+    void adjustPeriod(int length);
+    void evict();
+    void moduleValues(int address, uint16_t *values);
+    void send(OutputQueue &out, const void *data, int len);
+};
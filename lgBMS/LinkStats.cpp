@@ -0,0 +1,176 @@
+#include "LinkStats.h"
+
+LinkStats::LinkStats()
+{
+  clear();
+}
+
+// Forget everything, as for a module that has never been heard
+void LinkStats::clear()
+{
+  for(int n=0; n<LINK_REGISTERS; n++) {
+    last[n] = 0;
+    avg[n] = 0;
+    max[n] = 0;
+  }
+  seen = 0;
+  late = 0;
+  frames = 0;
+  rate = 0;
+  health = 100;
+  resetCounters();
+}
+
+// Zero the fault counts and the longest intervals, keeping the averages
+// and health
+void LinkStats::resetCounters()
+{
+  for(int n=0; n<LINK_REGISTERS; n++) max[n] = 0;
+  missed = 0;
+  gaps = 0;
+  outOfRange = 0;
+  rollFrames = frames;
+  rollMissed = 0;
+  rollOutOfRange = 0;
+}
+
+// Forget the average intervals, for when the scan period is changed
+void LinkStats::relearn()
+{
+  for(int n=0; n<LINK_REGISTERS; n++) avg[n] = 0;
+  late = 0;
+}
+
+// Time the arrival of a frame for register slot at now ms
+void LinkStats::frame(int slot, uint32_t now)
+{
+  uint32_t bit = 1UL << slot;
+  uint16_t t = now;
+  frames++;
+  if(seen & bit) {
+    uint16_t interval = t - last[slot];
+    if(interval > max[slot]) max[slot] = interval;
+    uint32_t sample = (uint32_t)interval * 8;
+    if(avg[slot] == 0) {
+      avg[slot] = sample > 0xffff ? 0xffff : sample;
+    } else {
+      uint32_t periods = (sample + avg[slot] / 2) / avg[slot];
+      if(periods > 1) missed += periods - 1;
+      uint32_t limit = (uint32_t)avg[slot] * LINK_GAP_FACTOR;
+      if(interval > LINK_GAP_MIN && sample > limit) {
+        // Count it unless roll() already has, and only let it pull the
+        // average up as far as the limit, so one dropout doesn't hide the
+        // next but a slower scan rate is soon learnt
+        if(!(late & bit)) gaps++;
+        sample = limit;
+      }
+      int32_t next = avg[slot] + ((int32_t)sample - avg[slot]) / 8;
+      avg[slot] = next > 0xffff ? 0xffff : (next < 1 ? 1 : next);
+    }
+  }
+  late &= ~bit;
+  seen |= bit;
+  last[slot] = t;
+}
+
+// Count a frame for a register the module doesn't have
+void LinkStats::outOfRangeFrame()
+{
+  frames++;
+  outOfRange++;
+}
+
+// Called once a second. Counts registers that are overdue as gaps and
+// updates the frame rate and health from the frames since the last call.
+void LinkStats::roll(uint32_t now)
+{
+  uint16_t t = now;
+  for(int n=0; n<LINK_REGISTERS; n++) {
+    uint32_t bit = 1UL << n;
+    if(!(seen & bit)) continue;
+    uint16_t age = t - last[n];
+    if(age > LINK_MAX_AGE) {
+      // Keep the 16 bit arrival time from wrapping
+      last[n] = t - LINK_MAX_AGE;
+      age = LINK_MAX_AGE;
+    }
+    if(avg[n] == 0 || age <= LINK_GAP_MIN || (uint32_t)age * 8 <= (uint32_t)avg[n] * LINK_GAP_FACTOR) continue;
+    if(age > max[n]) max[n] = age;
+    if(!(late & bit)) {
+      late |= bit;
+      gaps++;
+    }
+  }
+
+  uint32_t newFrames = frames - rollFrames;
+  uint32_t newMissed = missed - rollMissed;
+  uint32_t newOutOfRange = outOfRange - rollOutOfRange;
+  rollFrames = frames;
+  rollMissed = missed;
+  rollOutOfRange = outOfRange;
+  rate = newFrames > 0xffff ? 0xffff : newFrames;
+  // With nothing due and nothing heard there is nothing to judge
+  if(newFrames == 0 && late == 0) return;
+  uint8_t score = 0;
+  if(newFrames > newOutOfRange) score = 100 * (newFrames - newOutOfRange) / (newFrames + newMissed);
+  // Round towards the score so it can be reached
+  if(score > health) health = (health * 3 + score + 3) / 4;
+  else health = (health * 3 + score) / 4;
+}
+
+// Return true once any frame has arrived
+bool LinkStats::isHeard()
+{
+  return frames != 0;
+}
+
+// Return the number of frames since the stats were cleared
+uint32_t LinkStats::getFrames()
+{
+  return frames;
+}
+
+// Return the number of frames in the second before the last roll()
+uint16_t LinkStats::getRate()
+{
+  return rate;
+}
+
+// Return the estimated number of frames missed since the counters were
+// reset
+uint32_t LinkStats::getMissed()
+{
+  return missed;
+}
+
+// Return the number of gaps since the counters were reset
+uint32_t LinkStats::getGaps()
+{
+  return gaps;
+}
+
+// Return the number of out of range frames since the counters were reset
+uint32_t LinkStats::getOutOfRange()
+{
+  return outOfRange;
+}
+
+// Return the smoothed percentage of frames due that arrived in range
+uint8_t LinkStats::getHealth()
+{
+  return health;
+}
+
+// Return the average interval between frames for a register slot in ms,
+// 0 if it hasn't arrived twice
+uint16_t LinkStats::getAvgInterval(int slot)
+{
+  return (avg[slot] + 4) / 8;
+}
+
+// Return the longest interval between frames for a register slot in ms
+// since the counters were reset
+uint16_t LinkStats::getMaxInterval(int slot)
+{
+  return max[slot];
+}
@@ -0,0 +1,64 @@
+#pragma once
+#include <Arduino.h>
+
+#define LINK_REGISTERS 19    // 16 cells, 2 temperatures, balancing
+#define LINK_REG_TEMP 16     // slot of register 17, the first NTC
+#define LINK_REG_BALANCE 18  // slot of register 0xff
+#define LINK_GAP_FACTOR 3    // an interval this many times the average is a gap
+#define LINK_GAP_MIN 200     // ms, shorter intervals are never gaps
+#define LINK_MAX_AGE 60000   // ms, longer intervals are measured as this
+
+// Link quality of one group of modules, see BMSModuleManager::rollLinks()
+typedef struct {
+  uint16_t modules;     // modules heard from since they were cleared
+  uint16_t rate;        // frames in the last second
+  uint32_t missed;
+  uint32_t gaps;
+  uint32_t outOfRange;
+  uint8_t health;       // % of the weakest module
+} LinkRollup;
+
+// Counts the frames of one module's daisychain stream and times the
+// arrivals of each register. An interval of about n times the register's
+// average means n - 1 frames were missed. One more than LINK_GAP_FACTOR
+// times the average is also a gap, as is a register found overdue by
+// roll(). Frames for registers the module doesn't have are out of range.
+// Once a second roll() turns the frames since the last roll into a health
+// figure, the smoothed percentage of the frames due that arrived and were
+// in range.
+class LinkStats
+{
+  public:
+    LinkStats();
+    void clear();
+    void resetCounters();
+    void relearn();
+    void frame(int slot, uint32_t now);
+    void outOfRangeFrame();
+    void roll(uint32_t now);
+    bool isHeard();
+    uint32_t getFrames();
+    uint16_t getRate();
+    uint32_t getMissed();
+    uint32_t getGaps();
+    uint32_t getOutOfRange();
+    uint8_t getHealth();
+    uint16_t getAvgInterval(int slot);
+    uint16_t getMaxInterval(int slot);
+
+  private:
+    uint16_t last[LINK_REGISTERS];   // ms, low 16 bits of the last arrival
+    uint16_t avg[LINK_REGISTERS];    // ms * 8, 0 until the second arrival
+    uint16_t max[LINK_REGISTERS];    // ms
+    uint32_t seen;                   // registers that have arrived
+    uint32_t late;                   // registers roll() counted as a gap
+    uint32_t frames;
+    uint32_t missed;
+    uint32_t gaps;
+    uint32_t outOfRange;
+    uint32_t rollFrames;             // counts at the last roll()
+    uint32_t rollMissed;
+    uint32_t rollOutOfRange;
+    uint16_t rate;
+    uint8_t health;
+};
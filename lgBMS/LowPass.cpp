@@ -0,0 +1,40 @@
+#include "LowPass.h"
+
+// cutoff is the -3dB frequency in Hz
+LowPass::LowPass(float cutoff)
+{
+  tau = 1000000.0f / (2.0f * (float)M_PI * cutoff);
+  state = 0;
+  lastTime = 0;
+  started = false;
+  lastStep = 0;
+  gain = 0;
+}
+
+// Add a sample taken at timestamp us and return the new output. The first
+// sample sets the output directly.
+int32_t LowPass::input(int32_t value, uint32_t timestamp)
+{
+  uint32_t step = timestamp - lastTime;
+  lastTime = timestamp;
+  if(!started) {
+    started = true;
+    state = value * 256;
+    return value;
+  }
+  // Sensors sampled at a fixed rate always give the same step, so the
+  // division is only needed when it changes
+  if(step != lastStep) {
+    lastStep = step;
+    if(step >= tau * 8) gain = 65536;
+    else gain = ((uint64_t)step << 17) / (2 * tau + step);
+  }
+  state += ((int64_t)(value * 256 - state) * gain) >> 16;
+  return output();
+}
+
+// Return the filtered value, rounded to the nearest integer
+int32_t LowPass::output()
+{
+  return (state + 128) >> 8;
+}
@@ -0,0 +1,24 @@
+#pragma once
+#include <Arduino.h>
+
+// Integer one pole low pass filter, the fixed point replacement for
+// FilterOnePole. Samples carry their own timestamps so it works at any or
+// varying sample rates. Each step moves the output towards the input by
+// 2dt / (2tau + dt), which is within 1% of the exact 1 - e^(-dt/tau) for
+// steps up to a third of tau. The output is held with 8 fractional bits,
+// so inputs must stay within +-8 million.
+class LowPass
+{
+  public:
+    LowPass(float cutoff);
+    int32_t input(int32_t value, uint32_t timestamp);
+    int32_t output();
+
+  private:
+    uint32_t tau;       // us
+    int32_t state;      // output << 8
+    uint32_t lastTime;  // us
+    bool started;
+    uint32_t lastStep;  // us, step the cached gain is for
+    uint32_t gain;      // 2dt / (2tau + dt) << 16
+};
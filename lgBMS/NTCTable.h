@@ -0,0 +1,63 @@
+#pragma once
+#include <stdint.h>
+
+// Piecewise-linear lookup table for the module NTC thermistors, generated at
+// compile time from the resistance/temperature fit that decodeTemperature()
+// used to evaluate at run time. Entries are in tenths of a degree C and are
+// indexed by the top NTC_TABLE_BITS of the raw 16-bit ADC count.
+//
+// Below the zero of the resistance fit (around 26600 counts) the quadratic
+// no longer describes the sensor, so those counts read as NTC_TEMP_MAX. This
+// keeps the table monotonic: temperature only ever falls as counts rise.
+
+#define NTC_TABLE_BITS  10
+#define NTC_TABLE_SHIFT (16 - NTC_TABLE_BITS)
+#define NTC_TABLE_SIZE  ((1 << NTC_TABLE_BITS) + 1)
+#define NTC_TEMP_MIN    -550    // tenths of a degree C
+#define NTC_TEMP_MAX    1500    // tenths of a degree C
+
+class NTCTable
+{
+  public:
+    constexpr NTCTable() : tenths() {
+      bool inRange = true;
+      for (int i = NTC_TABLE_SIZE - 1; i >= 0; i--) {
+        // Once the fit has run off the top of the range it stays there
+        if (inRange) tenths[i] = point((uint32_t)i << NTC_TABLE_SHIFT);
+        else tenths[i] = NTC_TEMP_MAX;
+        if (tenths[i] == NTC_TEMP_MAX) inRange = false;
+      }
+    }
+
+    int16_t tenths[NTC_TABLE_SIZE];
+
+  private:
+    // Natural log, usable in a constant expression
+    static constexpr double ln(double x) {
+      double k = 0.0;
+      while (x > 2.0) { x /= 2.0; k += 1.0; }
+      while (x < 1.0) { x *= 2.0; k -= 1.0; }
+      // ln(x) = 2 atanh((x - 1) / (x + 1)), converging quickly for x in [1, 2)
+      double z = (x - 1.0) / (x + 1.0);
+      double z2 = z * z;
+      double term = z;
+      double sum = 0.0;
+      for (int n = 1; n < 40; n += 2) {
+        sum += term / n;
+        term *= z2;
+      }
+      return 2.0 * sum + k * 0.69314718055994530942;
+    }
+
+    // Temperature in tenths of a degree for one raw ADC count
+    static constexpr int16_t point(uint32_t data) {
+      // Calculate NTC resistance
+      double r = 0.0000000347363427499292 * data * data - 0.001025770762903 * data + 2.68235340614337;
+      if (r <= 0.0) return NTC_TEMP_MAX;
+      // Calculate NTC temperature
+      double t = (ln(r) * -30.5280964239816 + 95.6841501312447) * 10.0;
+      if (t >= NTC_TEMP_MAX) return NTC_TEMP_MAX;
+      if (t <= NTC_TEMP_MIN) return NTC_TEMP_MIN;
+      return (int16_t)(t < 0 ? t - 0.5 : t + 0.5);
+    }
+};
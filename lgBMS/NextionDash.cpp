@@ -0,0 +1,77 @@
+#include "NextionDash.h"
+
+NextionDash::NextionDash(DashField *fields, int count, OutputQueue &out)
+  : fields(fields), count(count), out(out)
+{
+  for(int n=0; n<count; n++) fields[n].state.stale = true;
+  lastRefresh = 0;
+  commands = 0;
+  updated = false;
+}
+
+// Set a number field
+void NextionDash::set(int field, int32_t value)
+{
+  if(field < 0 || field >= count) return;
+  fields[field].state.value = value;
+  updated = true;
+}
+
+// Set a text field. The text must stay valid, e.g. a string constant.
+void NextionDash::setText(int field, const char *text)
+{
+  if(field < 0 || field >= count) return;
+  fields[field].state.text = text;
+  updated = true;
+}
+
+// Return true if a field needs sending
+bool NextionDash::changed(DashField &field)
+{
+  DashState &state = field.state;
+  if(state.stale) return true;
+  if(field.deadband < 0) return state.text != state.shownText && (!state.text || !state.shownText || strcmp(state.text, state.shownText) != 0);
+  int32_t delta = state.value - state.shown;
+  return delta > field.deadband || delta < -field.deadband;
+}
+
+// Called every loop. Sends the fields that have changed while the queue
+// has room; any that don't fit are sent on a later call.
+void NextionDash::service(uint32_t now)
+{
+  // Nothing is sent until the values have been set
+  if(!updated) return;
+  if(now - lastRefresh >= DASH_REFRESH) {
+    lastRefresh = now;
+    for(int n=0; n<count; n++) fields[n].state.stale = true;
+  }
+  for(int n=0; n<count; n++) {
+    DashField &field = fields[n];
+    DashState &state = field.state;
+    if(!changed(field)) continue;
+    if(out.room() < DASH_COMMAND_MAX) return;
+    out.print(field.name);
+    if(field.deadband < 0) {
+      out.print(".txt=\"");
+      out.print(state.text ? state.text : "");
+      out.print("\"");
+      state.shownText = state.text;
+    } else {
+      out.print(".val=");
+      out.print((long)state.value);
+      state.shown = state.value;
+    }
+    // Every Nextion command ends with three 0xff bytes
+    out.write(0xff);
+    out.write(0xff);
+    out.write(0xff);
+    state.stale = false;
+    commands++;
+  }
+}
+
+// Return the number of commands sent to the display
+uint32_t NextionDash::getCommands()
+{
+  return commands;
+}
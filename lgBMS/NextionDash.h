@@ -0,0 +1,46 @@
+#pragma once
+#include <Arduino.h>
+#include "OutputQueue.h"
+
+#define DASH_REFRESH 10000 // ms between resending every field
+#define DASH_COMMAND_MAX 40 // longest command, with its terminator
+
+// What a dashboard field holds and what the display was last sent
+typedef struct {
+  int32_t value;
+  int32_t shown;     // last value sent to the display
+  const char *text;
+  const char *shownText;
+  bool stale;        // send even if within the deadband
+} DashState;
+
+// One Nextion object shown on the dashboard. Numbers are resent when they
+// move by more than the deadband; text fields when the text changes.
+typedef struct {
+  const char *name;  // Nextion object, set with name.val= or name.txt=
+  int32_t deadband;  // -1 for a text field
+  DashState state;   // {} in the table
+} DashField;
+
+// Keeps the Nextion display in step with a table of fields, sending only
+// what has changed through a non-blocking output queue. Everything is
+// resent every DASH_REFRESH in case the display was reset or changed page.
+class NextionDash
+{
+  public:
+    NextionDash(DashField *fields, int count, OutputQueue &out);
+    void set(int field, int32_t value);
+    void setText(int field, const char *text);
+    void service(uint32_t now);
+    uint32_t getCommands();
+
+  private:
+    DashField *fields;
+    int count;
+    OutputQueue &out;
+    uint32_t lastRefresh;
+    uint32_t commands;
+    bool updated;
+
+    bool changed(DashField &field);
+};
@@ -0,0 +1,42 @@
+#pragma once
+#include <stdint.h>
+
+// Rested cell voltage against state of charge for the LG NMC cells. Only
+// valid once the cells have relaxed, so it is used for the first SOC
+// estimate and to correct the coulomb count after a long rest.
+typedef struct {
+  uint16_t mV;
+  uint16_t soc; // tenths of a percent
+} OCVPoint;
+
+static const OCVPoint ocvTable[] = {
+  {3300, 0},
+  {3450, 50},
+  {3550, 100},
+  {3620, 200},
+  {3680, 300},
+  {3740, 400},
+  {3800, 500},
+  {3870, 600},
+  {3950, 700},
+  {4030, 800},
+  {4100, 900},
+  {4180, 1000},
+};
+
+#define OCV_POINTS (int)(sizeof(ocvTable) / sizeof(ocvTable[0]))
+
+// Return the SOC in tenths of a percent for a rested cell voltage,
+// interpolating between table points
+static inline int ocvSOC(uint16_t mV)
+{
+  if(mV <= ocvTable[0].mV) return ocvTable[0].soc;
+  for(int n=1; n<OCV_POINTS; n++) {
+    if(mV < ocvTable[n].mV) {
+      const OCVPoint &a = ocvTable[n - 1];
+      const OCVPoint &b = ocvTable[n];
+      return a.soc + (int32_t)(mV - a.mV) * (b.soc - a.soc) / (b.mV - a.mV);
+    }
+  }
+  return ocvTable[OCV_POINTS - 1].soc;
+}
@@ -0,0 +1,57 @@
+#include "OutputQueue.h"
+
+OutputQueue::OutputQueue(Print &port) : port(port)
+{
+  head = 0;
+  tail = 0;
+  truncated = 0;
+}
+
+// Queue one byte, dropping it if the buffer is full
+size_t OutputQueue::write(uint8_t b)
+{
+  if((uint16_t)(head - tail) >= OUTPUT_QUEUE_SIZE) {
+    truncated++;
+    return 0;
+  }
+  buf[head & (OUTPUT_QUEUE_SIZE - 1)] = b;
+  head++;
+  return 1;
+}
+
+// Return the number of bytes that can be queued
+int OutputQueue::room()
+{
+  return OUTPUT_QUEUE_SIZE - (uint16_t)(head - tail);
+}
+
+// Return true once everything queued has been handed to the port
+bool OutputQueue::idle()
+{
+  return head == tail;
+}
+
+// Called every loop. Passes the port as much as it has room for, up to a
+// slice, in at most two contiguous writes.
+void OutputQueue::service()
+{
+  int n = (uint16_t)(head - tail);
+  if(n == 0) return;
+  int space = port.availableForWrite();
+  if(n > space) n = space;
+  if(n > OUTPUT_QUEUE_SLICE) n = OUTPUT_QUEUE_SLICE;
+  while(n > 0) {
+    int start = tail & (OUTPUT_QUEUE_SIZE - 1);
+    int chunk = OUTPUT_QUEUE_SIZE - start;
+    if(chunk > n) chunk = n;
+    port.write(buf + start, chunk);
+    tail += chunk;
+    n -= chunk;
+  }
+}
+
+// Return the number of bytes dropped because the buffer was full
+uint32_t OutputQueue::getTruncated()
+{
+  return truncated;
+}
@@ -0,0 +1,28 @@
+#pragma once
+#include <Arduino.h>
+
+#define OUTPUT_QUEUE_SIZE 2048 // bytes, must be a power of two
+#define OUTPUT_QUEUE_SLICE 256 // most bytes handed to the port per call
+
+// Buffers text for a serial port and hands it over a slice at a time,
+// only as much as the port will take without blocking. Writers should
+// check room() before formatting; text that doesn't fit is cut and
+// counted rather than waited for.
+class OutputQueue : public Print
+{
+  public:
+    OutputQueue(Print &port);
+    size_t write(uint8_t b);
+    using Print::write;
+    int room();
+    bool idle();
+    void service();
+    uint32_t getTruncated();
+
+  private:
+    Print &port;
+    uint8_t buf[OUTPUT_QUEUE_SIZE];
+    uint16_t head;
+    uint16_t tail;
+    uint32_t truncated;
+};
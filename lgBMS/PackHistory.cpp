@@ -0,0 +1,153 @@
+#include "PackHistory.h"
+
+PackHistory::PackHistory(int start, int banks, int bankSize)
+  : store(&image, sizeof(image), HISTORY_VERSION, start, banks, bankSize)
+{
+  clear();
+  saved = image;
+  started = false;
+  lastIn = 0;
+  lastOut = 0;
+  energyIn = 0;
+  energyOut = 0;
+  chargeIn = 0;
+  chargeOut = 0;
+  changed = false;
+  urgent = false;
+  lastSave = 0;
+}
+
+// Read the history from the EEPROM, starting afresh if there is none
+void PackHistory::begin()
+{
+  if(!store.load()) clear();
+  saved = image;
+}
+
+// Forget all history
+void PackHistory::clear()
+{
+  memset(&image, 0, sizeof(image));
+  image.coldestTempRaw = 0;
+  image.hottestTempRaw = 0xffff;
+  for(int n=0; n<=MAX_MODULE_ADDR; n++) {
+    image.lowestCellRaw[n] = 0xffff;
+    image.highestCellRaw[n] = 0;
+  }
+  changed = true;
+  urgent = true;
+}
+
+// Count the charge that has gone in and out since the last call, from the
+// coulomb counter's totals in uA.us, at the pack voltage in mV. capacity
+// is the pack's Ah, used to count cycles.
+void PackHistory::addCharge(uint64_t totalIn, uint64_t totalOut, uint32_t packMV, uint32_t capacity)
+{
+  if(!started) {
+    started = true;
+    lastIn = totalIn;
+    lastOut = totalOut;
+    return;
+  }
+  // Work in mA.ms so the energy fits in 64 bits, leaving the remainder
+  // for next time
+  int64_t in = (totalIn - lastIn) / 1000000;
+  int64_t out = (totalOut - lastOut) / 1000000;
+  lastIn += in * 1000000;
+  lastOut += out * 1000000;
+  energyIn += in * packMV;
+  energyOut += out * packMV;
+  chargeIn += in;
+  chargeOut += out;
+
+  uint32_t wh = energyIn / HISTORY_NJ_PER_WH;
+  energyIn -= wh * HISTORY_NJ_PER_WH;
+  image.energyIn += wh;
+  wh = energyOut / HISTORY_NJ_PER_WH;
+  energyOut -= wh * HISTORY_NJ_PER_WH;
+  image.energyOut += wh;
+
+  uint32_t ah = chargeIn / HISTORY_MAMS_PER_AH;
+  chargeIn -= ah * HISTORY_MAMS_PER_AH;
+  image.chargeIn += ah;
+  ah = chargeOut / HISTORY_MAMS_PER_AH;
+  chargeOut -= ah * HISTORY_MAMS_PER_AH;
+  image.chargeOut += ah;
+  image.cycleCharge += ah;
+  if(capacity > 0 && image.cycleCharge >= capacity) {
+    image.cycles += image.cycleCharge / capacity;
+    image.cycleCharge %= capacity;
+    urgent = true;
+  }
+
+  if(image.energyIn != saved.energyIn || image.energyOut != saved.energyOut) changed = true;
+  if(image.energyIn - saved.energyIn >= HISTORY_SAVE_WH) urgent = true;
+  if(image.energyOut - saved.energyOut >= HISTORY_SAVE_WH) urgent = true;
+}
+
+// Record the lowest and highest raw cell readings a module has seen
+void PackHistory::addModule(int address, uint16_t lowestRaw, uint16_t highestRaw)
+{
+  if(address < 0 || address > MAX_MODULE_ADDR) return;
+  if(lowestRaw < image.lowestCellRaw[address]) {
+    image.lowestCellRaw[address] = lowestRaw;
+    changed = true;
+    if(lowestRaw + HISTORY_SAVE_CELL < saved.lowestCellRaw[address]) urgent = true;
+  }
+  if(highestRaw > image.highestCellRaw[address]) {
+    image.highestCellRaw[address] = highestRaw;
+    changed = true;
+    if(highestRaw > saved.highestCellRaw[address] + HISTORY_SAVE_CELL) urgent = true;
+  }
+}
+
+// Record the coldest and hottest raw NTC readings seen in the pack
+void PackHistory::addTemperature(uint16_t coldestRaw, uint16_t hottestRaw)
+{
+  if(coldestRaw > image.coldestTempRaw) {
+    image.coldestTempRaw = coldestRaw;
+    changed = true;
+    if(coldestRaw > saved.coldestTempRaw + HISTORY_SAVE_TEMP) urgent = true;
+  }
+  if(hottestRaw < image.hottestTempRaw) {
+    image.hottestTempRaw = hottestRaw;
+    changed = true;
+    if(hottestRaw + HISTORY_SAVE_TEMP < saved.hottestTempRaw) urgent = true;
+  }
+}
+
+// Save the history if it has changed enough, or has waited long enough
+void PackHistory::check(uint32_t now)
+{
+  if(!changed) return;
+  uint32_t since = now - lastSave;
+  if(since < HISTORY_MIN_INTERVAL) return;
+  if(!urgent && since < HISTORY_MAX_INTERVAL) return;
+  store.save();
+  saved = image;
+  changed = false;
+  urgent = false;
+  lastSave = now;
+}
+
+// Write a little of any saved change to the EEPROM
+void PackHistory::service()
+{
+  store.service();
+}
+
+// Save everything now and wait for it to be written, e.g. before a restart
+void PackHistory::flush()
+{
+  store.save();
+  saved = image;
+  changed = false;
+  urgent = false;
+  store.flush();
+}
+
+// Return the history as it is now
+HistoryImage &PackHistory::get()
+{
+  return image;
+}
@@ -0,0 +1,64 @@
+#pragma once
+#include "config.h"
+#include "SettingsStore.h"
+
+#define HISTORY_VERSION 1
+#define HISTORY_SAVE_WH 1000       // energy in or out that forces a save
+#define HISTORY_SAVE_CELL 66       // raw counts, about 5mV, a new extreme must pass the saved one by
+#define HISTORY_SAVE_TEMP 100      // raw NTC counts
+#define HISTORY_MIN_INTERVAL 600000 // ms, shortest time between saves
+#define HISTORY_MAX_INTERVAL 3600000 // ms, longest time unsaved changes wait
+
+#define HISTORY_NJ_PER_WH 3600000000000LL // mA.ms.mV in one Wh
+#define HISTORY_MAMS_PER_AH 3600000000LL  // mA.ms in one Ah
+
+// Lifetime pack history, as kept in the EEPROM. Temperatures are raw NTC
+// counts, which fall as temperature rises.
+typedef struct {
+  uint32_t energyIn;    // Wh
+  uint32_t energyOut;   // Wh
+  uint32_t chargeIn;    // Ah
+  uint32_t chargeOut;   // Ah
+  uint32_t cycleCharge; // Ah discharged towards the next cycle
+  uint16_t cycles;      // full equivalent discharge cycles
+  uint16_t coldestTempRaw;
+  uint16_t hottestTempRaw;
+  uint16_t reserved;
+  uint16_t lowestCellRaw[MAX_MODULE_ADDR + 1];  // per module
+  uint16_t highestCellRaw[MAX_MODULE_ADDR + 1];
+} HistoryImage;
+
+// Accumulates energy and charge throughput, discharge cycles and the
+// extreme cell voltages and temperatures the pack has seen. Everything is
+// kept in RAM, and only saved to the EEPROM journal when a counter has
+// moved by a useful amount or an extreme has gone clearly past the saved
+// one, and no more often than HISTORY_MIN_INTERVAL.
+class PackHistory
+{
+  public:
+    PackHistory(int start, int banks, int bankSize);
+    void begin();
+    void clear();
+    void addCharge(uint64_t chargeIn, uint64_t chargeOut, uint32_t packMV, uint32_t capacity);
+    void addModule(int address, uint16_t lowestRaw, uint16_t highestRaw);
+    void addTemperature(uint16_t coldestRaw, uint16_t hottestRaw);
+    void check(uint32_t now);
+    void service();
+    void flush();
+    HistoryImage &get();
+
+  private:
+    HistoryImage image;
+    HistoryImage saved;  // image as of the last save
+    SettingsStore store;
+    bool started;
+    uint64_t lastIn;     // uA.us
+    uint64_t lastOut;
+    int64_t energyIn;    // mA.ms.mV not yet counted
+    int64_t energyOut;
+    int64_t chargeIn;    // mA.ms not yet counted
+    int64_t chargeOut;
+    bool changed;        // image differs from saved
+    bool urgent;         // and by enough to save
+    uint32_t lastSave;   // ms
+};
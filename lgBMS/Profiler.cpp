@@ -0,0 +1,90 @@
+#include "Profiler.h"
+
+#ifdef PROFILE
+ProfileStats Profiler::stats[PROF_REGIONS];
+
+static const char *regionNames[PROF_REGIONS] = {
+  "loop",
+  "canread",
+  "contcon",
+  "state logic",
+  "getcurrent",
+  "500ms tasks",
+  "dashupdate",
+  "CAN transmit",
+  "serial output",
+};
+#endif
+
+// Start the cycle counter, which the core may have left off
+void Profiler::begin()
+{
+#if defined(PROFILE) && defined(ARM_DWT_CYCCNT)
+  ARM_DEMCR |= ARM_DEMCR_TRCENA;
+  ARM_DWT_CTRL |= ARM_DWT_CTRL_CYCCNTENA;
+#endif
+}
+
+// Add one pass through a region
+void Profiler::record(int region, uint32_t ticks)
+{
+#ifdef PROFILE
+  if(region < 0 || region >= PROF_REGIONS) return;
+  ProfileStats &s = stats[region];
+  s.count++;
+  s.total += ticks;
+  if(ticks > s.max) s.max = ticks;
+  int bucket = ticks ? 32 - __builtin_clz(ticks) : 0;
+  if(bucket >= PROFILE_BUCKETS) bucket = PROFILE_BUCKETS - 1;
+  s.histogram[bucket]++;
+#else
+  (void)region;
+  (void)ticks;
+#endif
+}
+
+#ifdef PROFILE
+// Convert ticks to microseconds for printing
+static float ticksToUs(uint64_t ticks)
+{
+  return ticks * 1000000.0f / PROFILE_HZ;
+}
+#endif
+
+// Print the count, average and maximum time of each region, then the
+// non-empty histogram buckets as "<upper limit in us:count"
+void Profiler::print()
+{
+  SERIALCONSOLE.println();
+#ifdef PROFILE
+  for(int n=0; n<PROF_REGIONS; n++) {
+    ProfileStats &s = stats[n];
+    SERIALCONSOLE.print(regionNames[n]);
+    SERIALCONSOLE.print(": ");
+    SERIALCONSOLE.print(s.count);
+    SERIALCONSOLE.print(" runs, avg ");
+    SERIALCONSOLE.print(s.count ? ticksToUs(s.total) / s.count : 0.0f, 2);
+    SERIALCONSOLE.print("us max ");
+    SERIALCONSOLE.print(ticksToUs(s.max), 2);
+    SERIALCONSOLE.print("us ");
+    for(int b=0; b<PROFILE_BUCKETS; b++) {
+      if(!s.histogram[b]) continue;
+      SERIALCONSOLE.print(" <");
+      SERIALCONSOLE.print(ticksToUs(1ULL << b), 2);
+      SERIALCONSOLE.print(":");
+      SERIALCONSOLE.print(s.histogram[b]);
+    }
+    SERIALCONSOLE.println();
+  }
+#else
+  SERIALCONSOLE.println("Profiling is not built in, define PROFILE in config.h");
+#endif
+}
+
+// Clear all the statistics
+void Profiler::reset()
+{
+#ifdef PROFILE
+  memset(stats, 0, sizeof(stats));
+#endif
+}
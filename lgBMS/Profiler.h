@@ -0,0 +1,78 @@
+#pragma once
+#include <Arduino.h>
+#include "config.h"
+
+// Sections of loop() that can be timed. Names are in Profiler.cpp.
+enum ProfileRegion {
+  PROF_LOOP,
+  PROF_CANREAD,
+  PROF_CONTCON,
+  PROF_STATE,
+  PROF_CURRENT,
+  PROF_SLOW,
+  PROF_DASH,
+  PROF_CANTX,
+  PROF_SERIAL,
+  PROF_REGIONS
+};
+
+#define PROFILE_BUCKETS 32 // histogram bucket n counts times of 2^(n-1) to 2^n - 1 ticks
+
+// The Cortex-M4 cycle counter on the target. The host build has no DWT so
+// times come from std::chrono instead, in nanoseconds.
+#ifdef ARM_DWT_CYCCNT
+#define PROFILE_HZ F_CPU
+static inline uint32_t profileTicks() { return ARM_DWT_CYCCNT; }
+#else
+#include <chrono>
+#define PROFILE_HZ 1000000000UL
+static inline uint32_t profileTicks()
+{
+  return (uint32_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+#endif
+
+typedef struct {
+  uint32_t count;
+  uint64_t total;
+  uint32_t max;
+  uint32_t histogram[PROFILE_BUCKETS];
+} ProfileStats;
+
+// Accumulates the time spent in each region. Only built in when PROFILE
+// is defined in config.h; otherwise the probes below compile to nothing.
+class Profiler
+{
+  public:
+    static void begin();
+    static void record(int region, uint32_t ticks);
+    static void print();
+    static void reset();
+
+  private:
+#ifdef PROFILE
+    static ProfileStats stats[PROF_REGIONS];
+#endif
+};
+
+// Times from construction to the end of the enclosing block
+class ProfileScope
+{
+  public:
+    ProfileScope(int region) : region(region), start(profileTicks()) {}
+    ~ProfileScope() { Profiler::record(region, profileTicks() - start); }
+
+  private:
+    int region;
+    uint32_t start;
+};
+
+#ifdef PROFILE
+#define PROFILE_SCOPE(region) ProfileScope profileScope_##region(region)
+#define PROFILE_BEGIN(region) uint32_t profileStart_##region = profileTicks()
+#define PROFILE_END(region) Profiler::record(region, profileTicks() - profileStart_##region)
+#else
+#define PROFILE_SCOPE(region)
+#define PROFILE_BEGIN(region)
+#define PROFILE_END(region)
+#endif
@@ -0,0 +1,234 @@
+#include "SettingsStore.h"
+#include <EEPROM.h>
+
+#define RECORD_DELTA 0   // change to the current bank
+#define RECORD_COMPACT 1 // part of the copy into the next bank
+#define RECORD_HEADER 2  // header of the next bank, ends the copy
+
+SettingsStore::SettingsStore(void *image, uint16_t size, uint8_t version, int start, int banks, int bankSize)
+  : image((uint8_t *)image), size(size), version(version), start(start), banks(banks), bankSize(bankSize)
+{
+  if(this->size > STORE_IMAGE_MAX) this->size = STORE_IMAGE_MAX;
+  memset(stored, 0, sizeof(stored));
+  memset(target, 0, sizeof(target));
+  bank = -1;
+  sequence = 0;
+  end = 0;
+  recordLen = 0;
+  recordPos = 0;
+  recordAddr = 0;
+  recordType = RECORD_DELTA;
+  compacting = false;
+  nextBank = 0;
+  compactOffset = 0;
+  compactAddr = 0;
+  records = 0;
+  compactions = 0;
+}
+
+// Return the EEPROM address of bank n
+int SettingsStore::bankStart(int n)
+{
+  return start + n * bankSize;
+}
+
+// Read the header of bank n, returning false unless it is valid for this
+// image
+bool SettingsStore::readHeader(int n, StoreHeader &header)
+{
+  EEPROM.get(bankStart(n), header);
+  if(header.magic != STORE_MAGIC || header.size != size || header.version != version) return false;
+  return crc16((uint8_t *)&header, sizeof(header) - 2) == header.crc;
+}
+
+// Apply the records in bank n to stored, returning the address after the
+// last good one
+int SettingsStore::replay(int n, uint32_t seq)
+{
+  int addr = bankStart(n) + sizeof(StoreHeader);
+  int limit = bankStart(n) + bankSize;
+  uint8_t buf[STORE_RECORD_MAX + STORE_RECORD_OVERHEAD];
+  while(addr + STORE_RECORD_OVERHEAD < limit) {
+    int len = EEPROM.read(addr);
+    if(len == 0 || len > STORE_RECORD_MAX) break;
+    int total = len + STORE_RECORD_OVERHEAD;
+    if(addr + total > limit) break;
+    for(int i=0; i<total; i++) buf[i] = EEPROM.read(addr + i);
+    uint16_t offset = buf[1] | (buf[2] << 8);
+    if(offset + len > size) break;
+    uint16_t crc = crc16(buf, len + STORE_RECORD_HEAD, crc16((uint8_t *)&seq, sizeof(seq)));
+    if((buf[total - 2] | (buf[total - 1] << 8)) != crc) break;
+    memcpy(stored + offset, buf + STORE_RECORD_HEAD, len);
+    addr += total;
+  }
+  return addr;
+}
+
+// Find the newest valid bank and read the image from it. Returns false,
+// leaving the image alone, if there is none.
+bool SettingsStore::load()
+{
+  StoreHeader header;
+  bank = -1;
+  for(int n=0; n<banks; n++) {
+    if(!readHeader(n, header)) continue;
+    if(bank < 0 || (int32_t)(header.sequence - sequence) > 0) {
+      bank = n;
+      sequence = header.sequence;
+    }
+  }
+  if(bank < 0) return false;
+  memset(stored, 0, sizeof(stored));
+  end = replay(bank, sequence);
+  memcpy(image, stored, size);
+  memcpy(target, stored, size);
+  return true;
+}
+
+// Mark the image as it is now to be stored. Without a valid bank the whole
+// image is copied into a new one.
+void SettingsStore::save()
+{
+  memcpy(target, image, size);
+  if(bank < 0 && !compacting) {
+    memcpy(stored, target, size);
+    compacting = true;
+    nextBank = 1 % banks; // keep clear of bank 0, older firmware kept the settings there
+    compactOffset = 0;
+    compactAddr = bankStart(nextBank) + sizeof(StoreHeader);
+  }
+}
+
+// Return true while there is anything left to write
+bool SettingsStore::busy()
+{
+  return recordPos < recordLen || compacting || memcmp(target, stored, size) != 0;
+}
+
+// Fill record with one run of image bytes to go at addr
+void SettingsStore::buildRecord(int addr, uint16_t offset, const uint8_t *data, int len, uint32_t seq)
+{
+  record[0] = len;
+  record[1] = offset & 0xff;
+  record[2] = offset >> 8;
+  memcpy(record + STORE_RECORD_HEAD, data, len);
+  uint16_t crc = crc16(record, len + STORE_RECORD_HEAD, crc16((uint8_t *)&seq, sizeof(seq)));
+  record[len + STORE_RECORD_HEAD] = crc & 0xff;
+  record[len + STORE_RECORD_HEAD + 1] = crc >> 8;
+  recordLen = len + STORE_RECORD_OVERHEAD;
+  recordPos = 0;
+  recordAddr = addr;
+}
+
+// Set up the next record to write, returning false if there is none
+bool SettingsStore::nextRecord()
+{
+  if(!compacting) {
+    int first = 0;
+    while(first < size && target[first] == stored[first]) first++;
+    if(first == size) return false;
+    int last = first;
+    for(int n=first; n<size && n<first+STORE_RECORD_MAX; n++) {
+      if(target[n] != stored[n]) last = n;
+    }
+    int len = last - first + 1;
+    if(end + len + STORE_RECORD_OVERHEAD <= bankStart(bank) + bankSize) {
+      buildRecord(end, first, target + first, len, sequence);
+      recordType = RECORD_DELTA;
+      return true;
+    }
+    // The bank is full, so copy what it holds into the next one before
+    // going on with the changes
+    compacting = true;
+    nextBank = (bank + 1) % banks;
+    compactOffset = 0;
+    compactAddr = bankStart(nextBank) + sizeof(StoreHeader);
+  }
+  if(compactOffset < size) {
+    int len = size - compactOffset;
+    if(len > STORE_RECORD_MAX) len = STORE_RECORD_MAX;
+    buildRecord(compactAddr, compactOffset, stored + compactOffset, len, sequence + 1);
+    recordType = RECORD_COMPACT;
+    return true;
+  }
+  StoreHeader header;
+  header.sequence = sequence + 1;
+  header.magic = STORE_MAGIC;
+  header.size = size;
+  header.version = version;
+  header.reserved = 0;
+  header.crc = crc16((uint8_t *)&header, sizeof(header) - 2);
+  memcpy(record, &header, sizeof(header));
+  recordLen = sizeof(header);
+  recordPos = 0;
+  recordAddr = bankStart(nextBank);
+  recordType = RECORD_HEADER;
+  return true;
+}
+
+// Account for a record once all of it is in the EEPROM
+void SettingsStore::finishRecord()
+{
+  if(recordType == RECORD_DELTA) {
+    memcpy(stored + (record[1] | (record[2] << 8)), record + STORE_RECORD_HEAD, record[0]);
+    end += recordLen;
+    records++;
+  } else if(recordType == RECORD_COMPACT) {
+    compactOffset += record[0];
+    compactAddr += recordLen;
+  } else {
+    bank = nextBank;
+    sequence++;
+    end = compactAddr;
+    compacting = false;
+    compactions++;
+  }
+}
+
+// Write up to STORE_WRITE_BYTES bytes of pending records
+void SettingsStore::service()
+{
+  for(int n=0; n<STORE_WRITE_BYTES; n++) {
+    if(recordPos == recordLen && !nextRecord()) return;
+    EEPROM.update(recordAddr + recordPos, record[recordPos]);
+    recordPos++;
+    if(recordPos == recordLen) finishRecord();
+  }
+}
+
+// Write everything pending now, e.g. before a restart
+void SettingsStore::flush()
+{
+  while(busy()) service();
+}
+
+// Return the bank in use, -1 if none
+int SettingsStore::getBank()
+{
+  return bank;
+}
+
+// Return the sequence number of the bank in use
+uint32_t SettingsStore::getSequence()
+{
+  return sequence;
+}
+
+// Return the bytes used in the current bank
+int SettingsStore::getUsed()
+{
+  if(bank < 0) return 0;
+  return end - bankStart(bank);
+}
+
+// Return the change records written since start up
+uint32_t SettingsStore::getRecords()
+{
+  return records;
+}
+
+// Return the copies into a new bank made since start up
+uint32_t SettingsStore::getCompactions()
+{
+  return compactions;
+}
@@ -0,0 +1,87 @@
+#pragma once
+#include <Arduino.h>
+#include "CRC16.h"
+
+#define STORE_MAGIC 0x4a53       // "SJ" at the start of each bank header
+#define STORE_IMAGE_MAX 512      // largest image that can be stored
+#define STORE_RECORD_MAX 16      // most image bytes in one record
+#define STORE_WRITE_BYTES 4      // most EEPROM bytes written per service() call
+
+// Written at the start of a bank once it holds a complete copy of the
+// image. The CRC-16 covers the fields before it.
+typedef struct __attribute__((packed)) {
+  uint32_t sequence; // one more than the bank before
+  uint16_t magic;
+  uint16_t size;     // image bytes
+  uint8_t version;
+  uint8_t reserved;
+  uint16_t crc;
+} StoreHeader;
+
+// Each record after the header is a run of image bytes:
+//   length, offset (2 bytes), data, CRC-16 (2 bytes)
+// The CRC is seeded with the bank's sequence number, so records left over
+// from the last time the bank was used never pass. A length of 0xff is
+// blank EEPROM and ends the list.
+#define STORE_RECORD_HEAD 3
+#define STORE_RECORD_OVERHEAD 5
+
+// Journaled copy of a block of RAM, such as the settings, kept in a run
+// of equal sized EEPROM banks. save() only marks the image to be stored;
+// service() then appends records for the bytes that differ from what the
+// bank holds, a few EEPROM bytes per call so the loop never waits on the
+// EEPROM. When the bank is full, the whole image is copied into the next
+// bank and its header written last, so the banks wear evenly and a reset
+// at any point leaves the last complete state readable by load().
+class SettingsStore
+{
+  public:
+    SettingsStore(void *image, uint16_t size, uint8_t version, int start, int banks, int bankSize);
+    bool load();
+    void save();
+    bool busy();
+    void service();
+    void flush();
+    int getBank();
+    uint32_t getSequence();
+    int getUsed();
+    uint32_t getRecords();
+    uint32_t getCompactions();
+
+  private:
+    uint8_t *image;
+    uint16_t size;
+    uint8_t version;
+    int start;
+    int banks;
+    int bankSize;
+
+    uint8_t stored[STORE_IMAGE_MAX]; // image as the current bank holds it
+    uint8_t target[STORE_IMAGE_MAX]; // image as of the last save()
+    int bank;                        // current bank, -1 if none is valid
+    uint32_t sequence;
+    int end;                         // EEPROM address after the last record
+
+    // Record being written
+    uint8_t record[STORE_RECORD_MAX + STORE_RECORD_OVERHEAD];
+    int recordLen;
+    int recordPos;
+    int recordAddr;
+    int recordType;
+
+    // Copy of the image into the next bank
+    bool compacting;
+    int nextBank;
+    int compactOffset;
+    int compactAddr;
+
+    uint32_t records;
+    uint32_t compactions;
+
+    int bankStart(int n);
+    bool readHeader(int n, StoreHeader &header);
+    int replay(int n, uint32_t seq);
+    bool nextRecord();
+    void buildRecord(int addr, uint16_t offset, const uint8_t *data, int len, uint32_t seq);
+    void finishRecord();
+};
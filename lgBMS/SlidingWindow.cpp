@@ -0,0 +1,91 @@
+#include "SlidingWindow.h"
+
+SlidingWindow::SlidingWindow(WindowBucket *ring, int buckets, uint32_t bucketTime)
+  : ring(ring), buckets(buckets), bucketTime(bucketTime)
+{
+  memset(ring, 0, buckets * sizeof(WindowBucket));
+  head = 0;
+  headStart = 0;
+  started = false;
+  sum = 0;
+  count = 0;
+  min = 0;
+  max = 0;
+}
+
+// Move the head on to the bucket covering now, emptying the buckets it
+// passes
+void SlidingWindow::advance(uint32_t now)
+{
+  if(!started) {
+    started = true;
+    headStart = now;
+    return;
+  }
+  if(now - headStart < bucketTime) return;
+  uint32_t steps = (now - headStart) / bucketTime;
+  headStart += steps * bucketTime;
+  if(steps > (uint32_t)buckets) steps = buckets;
+  while(steps--) {
+    head = (head + 1) % buckets;
+    sum -= ring[head].sum;
+    count -= ring[head].count;
+    ring[head].sum = 0;
+    ring[head].count = 0;
+  }
+  rescan();
+}
+
+// Recalculate the minimum and maximum from the buckets
+void SlidingWindow::rescan()
+{
+  bool first = true;
+  for(int n=0; n<buckets; n++) {
+    WindowBucket &bucket = ring[n];
+    if(bucket.count == 0) continue;
+    if(first || bucket.min < min) min = bucket.min;
+    if(first || bucket.max > max) max = bucket.max;
+    first = false;
+  }
+  if(first) min = max = 0;
+}
+
+// Add a sample taken at now ms
+void SlidingWindow::add(int32_t value, uint32_t now)
+{
+  advance(now);
+  WindowBucket &bucket = ring[head];
+  if(bucket.count == 0 || value < bucket.min) bucket.min = value;
+  if(bucket.count == 0 || value > bucket.max) bucket.max = value;
+  bucket.sum += value;
+  bucket.count++;
+  if(count == 0 || value < min) min = value;
+  if(count == 0 || value > max) max = value;
+  sum += value;
+  count++;
+}
+
+// Return the average over the window, 0 if it is empty
+int32_t SlidingWindow::getAverage()
+{
+  if(count == 0) return 0;
+  return sum / (int32_t)count;
+}
+
+// Return the smallest sample in the window
+int32_t SlidingWindow::getMin()
+{
+  return min;
+}
+
+// Return the largest sample in the window
+int32_t SlidingWindow::getMax()
+{
+  return max;
+}
+
+// Return the number of samples in the window
+uint32_t SlidingWindow::getCount()
+{
+  return count;
+}
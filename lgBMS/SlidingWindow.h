@@ -0,0 +1,39 @@
+#pragma once
+#include <Arduino.h>
+
+typedef struct {
+  int64_t sum;
+  uint32_t count;
+  int32_t min;
+  int32_t max;
+} WindowBucket;
+
+// Average, minimum and maximum of the samples in a sliding time window.
+// The window is a ring of buckets, given by the caller and each covering
+// bucketTime ms, and slides a whole bucket at a time. Adding a sample is O(1); the minimum
+// and maximum are rescanned only when the oldest bucket drops out.
+class SlidingWindow
+{
+  public:
+    SlidingWindow(WindowBucket *ring, int buckets, uint32_t bucketTime);
+    void add(int32_t value, uint32_t now);
+    int32_t getAverage();
+    int32_t getMin();
+    int32_t getMax();
+    uint32_t getCount();
+
+  private:
+    WindowBucket *ring;
+    int buckets;
+    uint32_t bucketTime; // ms
+    int head;            // bucket being filled
+    uint32_t headStart;  // ms
+    bool started;
+    int64_t sum;
+    uint32_t count;
+    int32_t min;
+    int32_t max;
+
+    void advance(uint32_t now);
+    void rescan();
+};
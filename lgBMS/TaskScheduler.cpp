@@ -0,0 +1,113 @@
+#include "config.h"
+#include "TaskScheduler.h"
+
+TaskScheduler::TaskScheduler(TaskEntry *tasks, int count)
+  : tasks(tasks), count(count)
+{
+}
+
+// Work out when each task is first due and clear the statistics. Call
+// again after changing a period or phase.
+void TaskScheduler::begin()
+{
+  uint32_t now = millis();
+  uint32_t nowUs = micros();
+  for(int n=0; n<count; n++) {
+    TaskEntry &task = tasks[n];
+    if(task.period == 0) continue;
+    uint32_t wait = (task.phase % task.period + task.period - now % task.period) % task.period;
+    task.state.nextDue = nowUs + wait * 1000;
+  }
+  resetStats();
+}
+
+// Return the highest priority task that is due, or -1
+int TaskScheduler::nextTask(uint32_t now)
+{
+  int best = -1;
+  for(int n=0; n<count; n++) {
+    TaskEntry &task = tasks[n];
+    if(task.period == 0) continue;
+    if((int32_t)(now - task.state.nextDue) < 0) continue;
+    if(best < 0 || task.priority < tasks[best].priority) best = n;
+  }
+  return best;
+}
+
+// Run every task that was due when called, highest priority first, so
+// each task runs at most once per call
+void TaskScheduler::run()
+{
+  uint32_t start = micros();
+  uint32_t now = start;
+  int n;
+  while((n = nextTask(start)) >= 0) {
+    TaskEntry &task = tasks[n];
+    TaskState &state = task.state;
+    uint32_t due = state.nextDue;
+    uint32_t period = task.period * 1000UL;
+    state.nextDue += period;
+    // If the loop stalled for a whole period, skip the missed slots rather than bursting
+    if((int32_t)(start - state.nextDue) >= 0) {
+      uint32_t missed = (start - state.nextDue) / period + 1;
+      state.nextDue += missed * period;
+      state.skipped += missed;
+    }
+
+    uint32_t jitter = now - due;
+    task.run();
+    uint32_t end = micros();
+    uint32_t time = end - now;
+
+    state.runs++;
+    state.totalJitter += jitter;
+    if(jitter > state.maxJitter) state.maxJitter = jitter;
+    if(time > state.maxTime) state.maxTime = time;
+    if(time > task.budget) state.overruns++;
+    if(end - due > task.deadline) state.misses++;
+    now = end;
+  }
+}
+
+// Print each task's rate and timing statistics
+void TaskScheduler::printStats()
+{
+  SERIALCONSOLE.println();
+  for(int n=0; n<count; n++) {
+    TaskEntry &task = tasks[n];
+    TaskState &state = task.state;
+    SERIALCONSOLE.print(task.name);
+    SERIALCONSOLE.print(": every ");
+    SERIALCONSOLE.print(task.period);
+    SERIALCONSOLE.print("mS, ");
+    SERIALCONSOLE.print(state.runs);
+    SERIALCONSOLE.print(" runs, jitter ");
+    SERIALCONSOLE.print(state.runs ? (uint32_t)(state.totalJitter / state.runs) : 0);
+    SERIALCONSOLE.print("us avg ");
+    SERIALCONSOLE.print(state.maxJitter);
+    SERIALCONSOLE.print("us max, time ");
+    SERIALCONSOLE.print(state.maxTime);
+    SERIALCONSOLE.print("us max, ");
+    SERIALCONSOLE.print(state.misses);
+    SERIALCONSOLE.print(" deadlines missed, ");
+    SERIALCONSOLE.print(state.overruns);
+    SERIALCONSOLE.print(" over budget, ");
+    SERIALCONSOLE.print(state.skipped);
+    SERIALCONSOLE.println(" skipped");
+  }
+}
+
+// Clear the statistics
+void TaskScheduler::resetStats()
+{
+  for(int n=0; n<count; n++) {
+    TaskState &state = tasks[n].state;
+    state.runs = 0;
+    state.skipped = 0;
+    state.misses = 0;
+    state.overruns = 0;
+    state.maxJitter = 0;
+    state.totalJitter = 0;
+    state.maxTime = 0;
+  }
+}
@@ -0,0 +1,54 @@
+#pragma once
+#include <Arduino.h>
+
+// Task priorities. When several tasks are due at once the highest runs
+// first, then table order.
+#define TASK_HIGH   0 // protection and current measurement
+#define TASK_NORMAL 1
+#define TASK_LOW    2 // reporting
+
+typedef void (*TaskFunction)();
+
+// Run time state of a task, kept by the scheduler
+typedef struct {
+  uint32_t nextDue;  // us
+  uint32_t runs;
+  uint32_t skipped;  // whole periods lost to a stalled loop
+  uint32_t misses;
+  uint32_t overruns;
+  uint32_t maxJitter; // us late starting
+  uint64_t totalJitter;
+  uint32_t maxTime;  // us
+} TaskState;
+
+// One periodic task. Tasks run at phase + n * period ms. A task that ends
+// more than deadline us after it was due has missed its deadline, and one
+// that runs for longer than budget us has overrun.
+typedef struct {
+  const char *name;
+  uint16_t period;   // ms
+  uint16_t phase;    // ms offset within the period
+  uint8_t priority;
+  uint32_t deadline; // us
+  uint32_t budget;   // us
+  TaskFunction run;
+  TaskState state;   // {} in the table
+} TaskEntry;
+
+// Cooperative scheduler for a table of fixed rate tasks, called from
+// loop(). Each call runs every task that has come due.
+class TaskScheduler
+{
+  public:
+    TaskScheduler(TaskEntry *tasks, int count);
+    void begin();
+    void run();
+    void printStats();
+    void resetStats();
+
+  private:
+    TaskEntry *tasks;
+    int count;
+
+    int nextTask(uint32_t now);
+};
@@ -0,0 +1,164 @@
+#include "Telemetry.h"
+#include "CRC16.h"
+
+Telemetry::Telemetry(BMSModuleManager &bms, OutputQueue &out, TelemetryPackSource source)
+  : bms(bms), out(out), source(source)
+{
+  active = false;
+  sequence = 0;
+  frames = 0;
+  overruns = 0;
+  period[TELEM_PACK] = 200;
+  period[TELEM_CELLS] = 250;
+  period[TELEM_TEMPS] = 1000;
+  period[TELEM_BALANCE] = 1000;
+  for(int type=0; type<TELEM_TYPES; type++) {
+    nextDue[type] = 0;
+    cursor[type] = -1;
+  }
+}
+
+// Start streaming with every record type due straight away
+void Telemetry::start(uint32_t now)
+{
+  for(int type=0; type<TELEM_TYPES; type++) {
+    nextDue[type] = now;
+    cursor[type] = -1;
+  }
+  active = true;
+}
+
+void Telemetry::stop()
+{
+  active = false;
+}
+
+bool Telemetry::isActive()
+{
+  return active;
+}
+
+// Set how often a record type is sent in ms, 0 to stop sending it
+void Telemetry::setPeriod(int type, uint16_t period)
+{
+  if(type < 0 || type >= TELEM_TYPES) return;
+  this->period[type] = period;
+}
+
+uint16_t Telemetry::getPeriod(int type)
+{
+  if(type < 0 || type >= TELEM_TYPES) return 0;
+  return period[type];
+}
+
+// Called every loop. Starts the record types that have come due and sends
+// at most one record of each type while the queue has room.
+void Telemetry::run(uint32_t now)
+{
+  if(!active) return;
+  for(int type=0; type<TELEM_TYPES; type++) {
+    if(period[type] == 0) continue;
+    if(cursor[type] < 0) {
+      if((int32_t)(now - nextDue[type]) < 0) continue;
+      nextDue[type] += period[type];
+      // A sweep that took longer than its period makes the next one late
+      if((int32_t)(now - nextDue[type]) >= 0) {
+        overruns++;
+        nextDue[type] = now + period[type];
+      }
+      cursor[type] = 0;
+    }
+    if(out.room() < (int)TELEMETRY_FRAME_MAX) return;
+    if(type == TELEM_PACK) {
+      TelemetryPack pack;
+      memset(&pack, 0, sizeof(pack));
+      source(pack);
+      sendFrame(TELEM_PACK, &pack, sizeof(pack));
+      cursor[type] = -1;
+      continue;
+    }
+    int address = bms.nextModule(cursor[type]);
+    if(address < 0) {
+      cursor[type] = -1;
+      continue;
+    }
+    sendModule(type, address);
+    cursor[type] = address + 1;
+  }
+}
+
+// Send one per-module record
+void Telemetry::sendModule(int type, int address)
+{
+  BMSModule &module = bms.getModule(address);
+  if(type == TELEM_CELLS) {
+    TelemetryCells record;
+    record.module = address;
+    record.reserved = 0;
+    for(int i=0; i<16; i++) record.cells[i] = module.getCellRaw(i);
+    sendFrame(type, &record, sizeof(record));
+  } else if(type == TELEM_TEMPS) {
+    TelemetryTemps record;
+    record.module = address;
+    record.reserved = 0;
+    for(int i=0; i<2; i++) record.temps[i] = module.getTemperatureTenths(i);
+    sendFrame(type, &record, sizeof(record));
+  } else if(type == TELEM_BALANCE) {
+    TelemetryBalance record;
+    record.module = address;
+    record.reserved = 0;
+    record.balance = module.getBalStat();
+    sendFrame(type, &record, sizeof(record));
+  }
+}
+
+// Add the header and CRC to a record, COBS encode it so the only zero is
+// the one that ends the frame, and queue it
+void Telemetry::sendFrame(uint8_t type, const void *record, int len)
+{
+  uint8_t frame[sizeof(TelemetryHeader) + TELEMETRY_RECORD_MAX + 2];
+  TelemetryHeader header;
+  header.schema = TELEMETRY_SCHEMA;
+  header.type = type;
+  header.sequence = sequence++;
+  header.time = millis();
+  memcpy(frame, &header, sizeof(header));
+  memcpy(frame + sizeof(header), record, len);
+  int n = sizeof(header) + len;
+  uint16_t crc = crc16(frame, n);
+  frame[n++] = lowByte(crc);
+  frame[n++] = highByte(crc);
+
+  uint8_t encoded[TELEMETRY_FRAME_MAX];
+  int code = 0;  // where the current block's length goes
+  int e = 1;
+  for(int i=0; i<n; i++) {
+    if(frame[i] == 0) {
+      encoded[code] = e - code;
+      code = e++;
+    } else {
+      encoded[e++] = frame[i];
+      if(e - code == 0xff) {
+        encoded[code] = 0xff;
+        code = e++;
+      }
+    }
+  }
+  encoded[code] = e - code;
+  encoded[e++] = 0;
+  out.write(encoded, e);
+  frames++;
+}
+
+// Return the number of frames sent since power up
+uint32_t Telemetry::getFrames()
+{
+  return frames;
+}
+
+// Return the number of times a record type started a period late because
+// the last one was still being sent
+uint32_t Telemetry::getOverruns()
+{
+  return overruns;
+}
@@ -0,0 +1,95 @@
+#pragma once
+#include <Arduino.h>
+#include "OutputQueue.h"
+#include "BMSModuleManager.h"
+
+// Version of the record layouts below. Bump it whenever a record changes
+// so old decoders refuse the stream rather than misreading it.
+#define TELEMETRY_SCHEMA 1
+
+// Record types, each sent at its own rate
+#define TELEM_PACK 0    // pack summary, status and limits
+#define TELEM_CELLS 1   // one module's raw cell readings
+#define TELEM_TEMPS 2   // one module's temperatures
+#define TELEM_BALANCE 3 // one module's balancing bitmap
+#define TELEM_TYPES 4
+
+// Every frame is a header, one record and a CRC-16 of both, COBS encoded
+// and ended with a zero byte. All fields are little endian.
+typedef struct __attribute__((packed)) {
+  uint8_t schema;
+  uint8_t type;
+  uint16_t sequence; // counts every frame so the host can spot losses
+  uint32_t time;     // ms
+} TelemetryHeader;
+
+typedef struct __attribute__((packed)) {
+  uint8_t status;          // bmsstatus
+  uint8_t modules;
+  uint16_t errorReason;
+  uint32_t packMV;
+  uint16_t lowCellMV;
+  uint16_t highCellMV;
+  int16_t lowTemp;         // 0.1C
+  int16_t highTemp;        // 0.1C
+  int32_t current;         // mA
+  uint8_t SOC;             // %
+  uint8_t reserved;
+  uint16_t chargeLimit;    // 0.1A
+  uint16_t dischargeLimit; // 0.1A
+} TelemetryPack;
+
+typedef struct __attribute__((packed)) {
+  uint8_t module;
+  uint8_t reserved;
+  uint16_t cells[16]; // raw ADC counts, 5V full scale
+} TelemetryCells;
+
+typedef struct __attribute__((packed)) {
+  uint8_t module;
+  uint8_t reserved;
+  int16_t temps[2]; // 0.1C
+} TelemetryTemps;
+
+typedef struct __attribute__((packed)) {
+  uint8_t module;
+  uint8_t reserved;
+  uint16_t balance; // bit per cell
+} TelemetryBalance;
+
+#define TELEMETRY_RECORD_MAX sizeof(TelemetryCells)
+#define TELEMETRY_FRAME_MAX (sizeof(TelemetryHeader) + TELEMETRY_RECORD_MAX + 2 + 2) // plus COBS overhead and delimiter
+
+typedef void (*TelemetryPackSource)(TelemetryPack &pack);
+
+// Streams binary telemetry records into an output queue. Per-module
+// records are sent one module per call, so a whole pack is spread over
+// several loops, and nothing is formatted unless the queue has room.
+class Telemetry
+{
+  public:
+    Telemetry(BMSModuleManager &bms, OutputQueue &out, TelemetryPackSource source);
+    void start(uint32_t now);
+    void stop();
+    bool isActive();
+    void setPeriod(int type, uint16_t period);
+    uint16_t getPeriod(int type);
+    void run(uint32_t now);
+    uint32_t getFrames();
+    uint32_t getOverruns();
+
+  private:
+    BMSModuleManager &bms;
+    OutputQueue &out;
+    TelemetryPackSource source;
+    bool active;
+    uint16_t sequence;
+    uint16_t period[TELEM_TYPES]; // ms, 0 for off
+    uint32_t nextDue[TELEM_TYPES];
+    int cursor[TELEM_TYPES];      // next module of a sweep, -1 between sweeps
+    uint32_t frames;
+    uint32_t overruns;
+
+    void sendModule(int type, int address);
+    void sendFrame(uint8_t type, const void *record, int len);
+};
@@ -13,6 +13,9 @@
 // victron serial VE direct bus config
 #define canSerial Serial2
 
+//Uncomment to time sections of loop() with the cycle counter, see Profiler.h
+//#define PROFILE
+
 #define REG_DEV_STATUS      1
 #define REG_GPAI            1
 #define REG_VCELL1          3
@@ -36,9 +39,19 @@
 
 #define MAX_MODULE_ADDR     0x3F    // 4 Strings of 16 modules
 
-#define EEPROM_VERSION      0x13    //update any time EEPROM struct below is changed.
+#define EEPROM_VERSION      0x16    //update any time EEPROM struct below is changed.
 #define EEPROM_PAGE         0
 
+// EEPROM journals, see SettingsStore.h. A bank must hold a full copy of
+// its image, about 5/16 more with the record overhead, with room to spare
+// for changes.
+#define SETTINGS_STORE_START 0
+#define SETTINGS_STORE_BANKS 2
+#define SETTINGS_BANK_SIZE   512
+#define HISTORY_STORE_START  1024 // PackHistory
+#define HISTORY_STORE_BANKS  2
+#define HISTORY_BANK_SIZE    512
+
 typedef struct {
   uint8_t version;
   uint8_t checksum;
@@ -99,4 +112,10 @@ typedef struct {
   uint32_t EngOut;
     uint8_t tripcont;
     int16_t chargecurrentcold;
+  uint8_t chains; //daisychains installed, each on its own CAN ID from 0x4f0
+  uint8_t chainModules; //modules on each daisychain
+  uint8_t moduleCells; //populated cells in each module
+  uint16_t scanFast; //ms between daisychain scans outside Ready and storage mode, 0 leaves the adapter's own
+  uint16_t scanSlow; //ms between daisychain scans when Ready or in storage mode
+  uint8_t moduleBalance; //1 sends each module its own balance target, the adapter must support it
 } EEPROMSettings;
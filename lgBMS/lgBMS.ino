@@ -20,6 +20,26 @@
 */
 
 #include "BMSModuleManager.h"
+#include "CANDispatch.h"
+#include "CANRxRing.h"
+#include "CANTxQueue.h"
+#include "CANSchedule.h"
+#include "CANCapture.h"
+#include "OutputQueue.h"
+#include "ConsoleText.h"
+#include "Telemetry.h"
+#include "NextionDash.h"
+#include "Profiler.h"
+#include "TaskScheduler.h"
+#include "CoulombCounter.h"
+#include "OCVTable.h"
+#include "CurrentSampler.h"
+#include "LowPass.h"
+#include "SlidingWindow.h"
+#include "SettingsStore.h"
+#include "PackHistory.h"
+#include "FlightRecorder.h"
+#include "BalancePlanner.h"
 #include <Arduino.h>
 #include "config.h"
 #include "SerialConsole.h"
@@ -28,9 +48,7 @@
 #include <EEPROM.h>
 #include <FlexCAN.h> //https://github.com/collin80/FlexCAN_Library
 #include <SPI.h>
-#include <Filters.h>//https://github.com/JonHub/Filters
 #include "Serial_CAN_Module_TeensyS3.h" //https://github.com/tomdebree/Serial_CAN_Teensy
-#include <movingAvg.h>                  // https://github.com/JChristensen/movingAvg
 
 #define RESTART_ADDR       0xE000ED0C
 #define READ_RESTART()     (*(volatile uint32_t *)RESTART_ADDR)
@@ -39,8 +57,27 @@
 
 Serial_CAN can;
 BMSModuleManager bms;
+PackSnapshot snapshot; // pack state for this control tick, see snapshottask()
 SerialConsole console;
 EEPROMSettings settings;
+SettingsStore settingsStore(&settings, sizeof(settings), EEPROM_VERSION, SETTINGS_STORE_START, SETTINGS_STORE_BANKS, SETTINGS_BANK_SIZE);
+PackHistory history(HISTORY_STORE_START, HISTORY_STORE_BANKS, HISTORY_BANK_SIZE);
+//The flight recorder's ring is lent to the CAN capture while it runs, when
+//the capture holds every module frame anyway
+union {
+  uint8_t flight[FLIGHT_RING_SIZE];
+  CANCaptureRecord capture[FLIGHT_RING_SIZE / sizeof(CANCaptureRecord)];
+} sharedRing;
+FlightRecorder recorder(bms, sharedRing.flight, FLIGHT_RING_SIZE);
+BalancePlanner planner(bms);
+byte recorderStatus = 0; //bmsstatus and ErrorReason at the last check, to spot a trip
+uint16_t recorderReason = 0;
+CANDispatch canDispatch;
+CANRxRing canRx;
+CANTxQueue canTx;
+CANCapture canCapture(sharedRing.capture, FLIGHT_RING_SIZE / sizeof(CANCaptureRecord));
+OutputQueue consoleOut(SERIALCONSOLE);
+OutputQueue serial2Out(Serial2);
 
 // Create an IntervalTimer object
 IntervalTimer myTimer;
@@ -49,8 +86,8 @@ IntervalTimer myTimer;
 int firmver = 211001;
 
 //Curent filter//
-float filterFrequency = 5.0 ;
-FilterOnePole lowpassFilter( LOWPASS, filterFrequency );
+#define CURRENT_CUTOFF 5.0 //Hz
+LowPass lowpassFilter(CURRENT_CUTOFF);
 
 //Simple BMS V2 wiring//
 const int ACUR2 = A0; // current 1
@@ -131,13 +168,14 @@ int16_t discurrent;
 uint16_t SOH = 100; // SOH place holder
 
 unsigned char alarm[4], warning[4] = {0, 0, 0, 0};
+//temperature alarm thresholds as raw NTC counts, lower counts are hotter
+uint16_t OverTRaw, OverTWarnRaw, UnderTRaw, UnderTWarnRaw;
 unsigned char mes[8] = {0, 0, 0, 0, 0, 0, 0, 0};
 unsigned char bmsname[8] = {'S', 'I', 'M', 'P', ' ', 'B', 'M', 'S'};
 unsigned char bmsmanu[8] = {'S', 'I', 'M', 'P', ' ', 'E', 'C', 'O'};
 long unsigned int rxId;
 unsigned char len = 0;
 byte rxBuf[8];
-char msgString[128];                        // Array to store serial string
 uint32_t inbox;
 signed long CANmilliamps;
 signed long voltage1, voltage2, voltage3 = 0; //mV only with ISAscale sensor
@@ -146,25 +184,17 @@ signed long voltage1, voltage2, voltage3 = 0; //mV only with ISAscale sensor
 
 
 //variables for current calulation
-int value;
-float currentact, RawCur, AverageCurrent, AverageCurrentMin, AverageCurrentSec ;
-float ampsecond;
-unsigned long lasttime;
-unsigned long looptime, UnderTime, OverTime, looptime1, cleartime = 0; //ms
+float currentact, RawCur;
+#define OCV_REST_CURRENT 1000 //mA, below this the pack is resting
+#define OCV_REST_TIME 1800000 //ms at rest before the SOC is corrected from the cell voltage
+CoulombCounter coulombs(OCV_REST_CURRENT);
+int ocvCorrected = 0;
+unsigned long currenttime; //us timestamp of the sample being processed
+unsigned long UnderTime, OverTime, cleartime = 0; //ms
 int currentsense = 14;
 int sensor = 1;
 unsigned long curloop1 = 0;
 
-//running average
-int SecCount = 0;
-/*
-  const int RunningAverageCount = 100;
-  float RunningAverageBuffer[RunningAverageCount];
-  int NextRunningAverage = 0;
-  float  AverageCurrent;
-  float  AverageCurrentTotal;
-*/
-
 //Variables for SOC calc
 int SOC = 100; //State of Charge
 int SOCset = 0;
@@ -191,6 +221,7 @@ unsigned char dta[8];
 int outputstate = 0;
 int incomingByte = 0;
 int storagemode = 0;
+uint16_t scanPeriod = 0; //ms, last daisychain scan period sent to the adapter
 int x = 0;
 int balancecells;
 int cellspresent = 0;
@@ -199,7 +230,7 @@ int cellspresent = 0;
 int debug = 1; //scrolling debug
 int inputcheck = 0; //read digital inputs
 int outputcheck = 0; //check outputs
-int candebug = 0; //view can frames
+int candebug = 0; //capture can frames to the console in binary, see CANCapture.h
 int gaugedebug = 0;
 int debugCur = 0;
 int debugAvgCur = 0;
@@ -209,11 +240,35 @@ int debugdigits = 2; //amount of digits behind decimal for voltage reading
 bool showbal = 0; //turn on showing balancing status
 int Charged = 0;
 
+////Console reports////
+//The 500ms status, pack detail and CSV reports are formatted a module per
+//loop into the output queues, which send a slice per loop, so a big pack
+//can't hold up the loop. A report that is due while the last one is still
+//going is skipped and counted.
+#define REPORT_IDLE 0
+#define REPORT_STATUS 1
+#define REPORT_HEADER 2
+#define REPORT_DETAILS 3
+#define REPORT_CSV 4
+#define REPORT_PIECE 512 //queue room needed for the largest piece, a module with balancing shown
+int reportStage = REPORT_IDLE;
+int reportModule = 0;
+int reportCell = 0;
+uint32_t reportTime;
+float reportCurrent;
+int reportSOC;
+uint32_t reportsSkipped = 0;
+
 ADC *adc = new ADC(); // adc object
+CurrentSampler currentSampler(adc, ACUR1, ACUR2);
 
-movingAvg myRASec(60);
-movingAvg myRAMin(60);
-movingAvg myRA(100);
+//filtered current over the last second, minute and hour, mA
+WindowBucket currentSecBuckets[10];
+WindowBucket currentMinBuckets[60];
+WindowBucket currentHourBuckets[60];
+SlidingWindow currentSec(currentSecBuckets, 10, 100);
+SlidingWindow currentMin(currentMinBuckets, 60, 1000);
+SlidingWindow currentHour(currentHourBuckets, 60, 60000);
 
 void loadSettings()
 {
@@ -276,19 +331,108 @@ void loadSettings()
   settings.SerialCan = 0; //Serial canbus or display: 0-display 1- canbus expansion
   settings.tripcont = 1; //in ESSmode 1 - Main contactor function, 0 - Trip function
   settings.chargecurrentcold = 1; // Max allowed charging current below under temperature
+  settings.chains = 4; //Daisychains installed
+  settings.chainModules = 16; //Modules on each daisychain
+  settings.moduleCells = 16; //Populated cells in each module
+  settings.scanFast = 200; //ms between daisychain scans in Drive and Charge
+  settings.scanSlow = 1000; //ms between daisychain scans when Ready or in storage mode
+  settings.moduleBalance = 0; //1 - per module balance targets, 0 - one target for the pack
 }
 
 
 
-////Variables for canbus transmit soft buffer////
-int sendCnt = 0;
-int sendbufsize = 10;
-///
-
 CAN_message_t msg;
-CAN_message_t msgbuf[10];
 CAN_message_t inMsg;
-CAN_filter_t filter;
+uint32_t inMsgTime; //us arrival time of inMsg
+
+////Periodic CAN transmit table////
+//Frames with the same period are given different phases so they are spread
+//across the period. The name and manufacturer frames never change so are
+//only repeated every 5s. The charger entries take their period from
+//settings.chargerspd in setupCanSchedule().
+#define CANTABLE_CHARGER1 0
+#define CANTABLE_CHARGER2 1
+CANScheduleEntry canTable[] = {
+  //name, period ms, phase ms, priority, encoder, sent
+  {"Charger 1", 100, 0, CAN_TX_HIGH, chargerframe1, NULL, 0},
+  {"Charger 2", 100, 50, CAN_TX_HIGH, chargerframe2, NULL, 0},
+  {"VE Limits", 500, 0, CAN_TX_LOW, VEcan351, NULL, 0},
+  {"VE SOC", 500, 60, CAN_TX_LOW, VEcan355, NULL, 0},
+  {"VE Pack", 500, 120, CAN_TX_LOW, VEcan356, NULL, 0},
+  {"VE Alarms", 500, 180, CAN_TX_LOW, VEcan35A, NULL, 0},
+  {"VE Cells", 500, 240, CAN_TX_LOW, VEcan373, NULL, 0},
+  {"Balance", 500, 300, CAN_TX_COMMAND, balancecan, NULL, 0},
+  {"Module Balance", 20, 10, CAN_TX_COMMAND, modulebalancecan, modulebalancesent, 0},
+  {"Scan Period", 1000, 460, CAN_TX_COMMAND, scancan, scansent, 0},
+  {"VE Modules", 1000, 360, CAN_TX_LOW, VEcan372, NULL, 0},
+  {"VE Capacity", 5000, 420, CAN_TX_LOW, VEcan379, NULL, 0},
+  {"VE Energy", 5000, 3420, CAN_TX_LOW, VEcan378, NULL, 0},
+  {"VE Name", 5000, 1420, CAN_TX_LOW, VEcan35E, NULL, 0},
+  {"VE Manu", 5000, 2420, CAN_TX_LOW, VEcan370, NULL, 0},
+  {"Link Health", 1000, 860, CAN_TX_LOW, linkcan, NULL, 0},
+};
+CANSchedule canSchedule(canTable, sizeof(canTable) / sizeof(canTable[0]), canTx);
+
+////Binary telemetry////
+//Replaces the text reports on the console while it is running. The frame
+//layout is in Telemetry.h and sim/teldecode converts a capture to CSV.
+Telemetry telemetry(bms, consoleOut, telemetryPack);
+
+////Debug and trip messages////
+//Queued behind the reports, and dropped while a binary stream owns the
+//console, see consolequiet()
+ConsoleText consoleText(consoleOut, consolequiet);
+
+////Nextion dashboard////
+//Values are only resent when they move by more than the deadband, and
+//everything is resent every DASH_REFRESH. Deadbands are in display units.
+#define DASH_STAT 0
+#define DASH_SOC 1
+#define DASH_SOC1 2
+#define DASH_CURRENT 3
+#define DASH_TEMP 4
+#define DASH_TEMPLOW 5
+#define DASH_TEMPHIGH 6
+#define DASH_VOLT 7
+#define DASH_LOWCELL 8
+#define DASH_HIGHCELL 9
+#define DASH_FIRM 10
+#define DASH_CELLDELTA 11
+DashField dashFields[] = {
+  //object, deadband, state
+  {"stat", -1, {}},
+  {"soc", 0, {}},
+  {"soc1", 0, {}},
+  {"current", 2, {}}, //0.1A
+  {"temp", 0, {}},
+  {"templow", 0, {}},
+  {"temphigh", 0, {}},
+  {"volt", 1, {}}, //0.1V
+  {"lowcell", 2, {}}, //mV
+  {"highcell", 2, {}},
+  {"firm", 0, {}},
+  {"celldelta", 2, {}},
+};
+NextionDash dash(dashFields, sizeof(dashFields) / sizeof(dashFields[0]), serial2Out);
+
+////Task table////
+//Protection and current measurement run at 100Hz, reporting at 2Hz.
+//Deadline and budget are in us and only feed the statistics on the
+//debug menu.
+TaskEntry taskTable[] = {
+  //name, period ms, phase ms, priority, deadline us, budget us, function, state
+  {"Snapshot", 10, 0, TASK_HIGH, 5000, 200, snapshottask, {}},
+  {"Protection", 10, 0, TASK_HIGH, 5000, 500, protection, {}},
+  {"Current", 10, 0, TASK_HIGH, 5000, 500, currenttask, {}},
+  {"CAN Transmit", 1, 0, TASK_NORMAL, 2000, 200, cantask, {}},
+  {"500ms", 500, 250, TASK_LOW, 50000, 5000, slowtask, {}},
+  {"Settings", 10, 5, TASK_LOW, 50000, 1000, storetask, {}},
+  {"History", 1000, 750, TASK_LOW, 50000, 2000, historytask, {}},
+  {"Recorder", 100, 0, TASK_LOW, 50000, 2000, recordertask, {}},
+  {"Link", 1000, 800, TASK_LOW, 50000, 2000, linktask, {}},
+  {"Balance", 1000, 300, TASK_LOW, 50000, 2000, balancetask, {}},
+};
+TaskScheduler tasks(taskTable, sizeof(taskTable) / sizeof(taskTable[0]));
 
 
 uint32_t lastUpdate;
@@ -319,21 +463,6 @@ void setup()
 
   Can0.begin(500000);
 
-  //set filters for standard
-  for (int i = 0; i < 8; i++)
-  {
-    Can0.getFilter(filter, i);
-    filter.flags.extended = 0;
-    Can0.setFilter(filter, i);
-  }
-  //set filters for extended
-  for (int i = 9; i < 13; i++)
-  {
-    Can0.getFilter(filter, i);
-    filter.flags.extended = 1;
-    Can0.setFilter(filter, i);
-  }
-
   //if using enable pins on a transceiver they need to be set on
 
 
@@ -341,7 +470,7 @@ void setup()
   adc->adc0->setResolution(16); // set bits of resolution
   adc->adc0->setConversionSpeed(ADC_CONVERSION_SPEED::MED_SPEED);
   adc->adc0->setSamplingSpeed(ADC_SAMPLING_SPEED::MED_SPEED);
-  adc->adc0->startContinuous(ACUR1);
+  currentSampler.start(currentsampleisr);
 
 
   SERIALCONSOLE.begin(115200);
@@ -393,11 +522,15 @@ void setup()
   SERIALCONSOLE.println("Started serial interface to BMS.");
 
 
-  EEPROM.get(0, settings);
-  if (settings.version != EEPROM_VERSION)
+  if (!settingsStore.load())
   {
-    loadSettings();
+    EEPROM.get(0, settings); //older firmware saved the whole struct here
+    if (settings.version != EEPROM_VERSION)
+    {
+      loadSettings();
+    }
   }
+  history.begin();
 
   Logger::setLoglevel(Logger::Off); //Debug = 0, Info = 1, Warn = 2, Error = 3, Off = 4
 
@@ -408,31 +541,66 @@ void setup()
   myTimer.begin(Can0callback, 10000); //cally every x ms
 
   bms.setPstrings(settings.Pstrings);
+  bms.setTopology(settings.chains, settings.chainModules, settings.moduleCells);
+  updateTempThresholds();
+  setupCanRoutes();
+  canRx.begin();
+  canCapture.begin();
+  canTx.begin();
+  setupCanSchedule();
+  tasks.begin();
+  Profiler::begin();
 
   ///precharge timer kickers
   Pretimer = millis();
   Pretimer1  = millis();
   bmsstatus = Boot;
-  myRA.begin(); // explicitly start clean
-  myRASec.begin(); // explicitly start clean
-  myRAMin.begin(); // explicitly start clean
 }
 
 void loop()
 {
-  while (Can0.available())
+  PROFILE_SCOPE(PROF_LOOP);
+  canread();
+  PROFILE_BEGIN(PROF_SERIAL);
+  canCapture.stream();
+  recorder.dump(consoleOut);
+  reportStep();
+  if (!recorder.isDumping())
+  {
+    telemetry.run(millis());
+  }
+  if (CSVdebug != 1)
   {
-    canread();
+    dash.service(millis());
   }
 
-  if (SERIALCONSOLE.available() > 0)
+  //The menu prints straight to the port, so wait for a capture chunk that
+  //is part way out
+  if (SERIALCONSOLE.available() > 0 && !canCapture.busy())
   {
     menu();
   }
+  PROFILE_END(PROF_SERIAL);
 
+  tasks.run();
+}
+
+// Drop modules that have stopped reporting and copy the pack state that
+// the control tasks and CAN frames will use until the next tick
+void snapshottask()
+{
+  bms.expireModules();
+  bms.getSnapshot(snapshot, millis());
+}
+
+// Contactor drive and the ESS/vehicle state machine
+void protection()
+{
+  const PackSnapshot &pack = snapshot;
   if (outputcheck != 1)
   {
     contcon();
+    PROFILE_BEGIN(PROF_STATE);
     if (settings.ESSmode == 1)
     {
       if (bmsstatus != Error && bmsstatus != Boot)
@@ -441,24 +609,24 @@ void loop()
 
         if (settings.tripcont != 0)
         {
-          if (bms.getLowCellVolt() > settings.UnderVSetpoint && bms.getHighCellVolt() < settings.OverVSetpoint)
+          if (pack.lowCellVolt > settings.UnderVSetpoint && pack.highCellVolt < settings.OverVSetpoint)
           {
             if (digitalRead(OUT2) == LOW && digitalRead(OUT4) == LOW)
             {
               mainconttimer = millis();
               digitalWrite(OUT4, HIGH);//Precharge start
-              Serial.println();
-              Serial.println("Precharge!!!");
-              Serial.println(mainconttimer);
-              Serial.println();
+              consoleText.println();
+              consoleText.println("Precharge!!!");
+              consoleText.println(mainconttimer);
+              consoleText.println();
             }
             if (mainconttimer + settings.Pretime < millis() && digitalRead(OUT2) == LOW && abs(currentact) < settings.Precurrent)
             {
               digitalWrite(OUT2, HIGH);//turn on contactor
               contctrl = contctrl | 2; //turn on contactor
-              Serial.println();
-              Serial.println("Main On!!!");
-              Serial.println();
+              consoleText.println();
+              consoleText.println("Main On!!!");
+              consoleText.println();
               mainconttimer = millis() + settings.Pretime;
             }
             if (mainconttimer + settings.Pretime + 1000 < millis() )
@@ -486,7 +654,7 @@ void loop()
             storagemode = 1;
           }
         }
-        if (bms.getHighCellVolt() > settings.balanceVoltage && bms.getHighCellVolt() > bms.getLowCellVolt() + settings.balanceHyst)
+        if (pack.highCellVolt > settings.balanceVoltage && pack.highCellVolt > pack.lowCellVolt + settings.balanceHyst)
         {
           balancecells = 1;
         }
@@ -499,7 +667,7 @@ void loop()
 
         if (storagemode == 1)
         {
-          if (bms.getHighCellVolt() > settings.StoreVsetpoint)
+          if (pack.highCellVolt > settings.StoreVsetpoint)
           {
             digitalWrite(OUT3, LOW);//turn off charger
             // contctrl = contctrl & 253;
@@ -511,7 +679,7 @@ void loop()
           {
             if (Charged == 1)
             {
-              if (bms.getHighCellVolt() < (settings.StoreVsetpoint - settings.ChargeHys))
+              if (pack.highCellVolt < (settings.StoreVsetpoint - settings.ChargeHys))
               {
                 Charged = 0;
                 digitalWrite(OUT3, HIGH);//turn on charger
@@ -539,14 +707,14 @@ void loop()
         }
         else
         {
-          if (bms.getHighCellVolt() > settings.OverVSetpoint || bms.getHighCellVolt() > settings.ChargeVsetpoint)
+          if (pack.highCellVolt > settings.OverVSetpoint || pack.highCellVolt > settings.ChargeVsetpoint)
           {
             if ((millis() - overtriptimer) > settings.triptime)
             {
               if (digitalRead(OUT3) == 1)
               {
-                Serial.println();
-                Serial.println("Over Voltage Trip");
+                consoleText.println();
+                consoleText.println("Over Voltage Trip");
                 digitalWrite(OUT3, LOW);//turn off charger
                 // contctrl = contctrl & 253;
                 //Pretimer = millis();
@@ -562,20 +730,20 @@ void loop()
             if (Charged == 1)
             {
 
-              if (bms.getHighCellVolt() < (settings.ChargeVsetpoint - settings.ChargeHys))
+              if (pack.highCellVolt < (settings.ChargeVsetpoint - settings.ChargeHys))
               {
                 if (digitalRead(OUT3) == 0)
                 {
-                  Serial.println();
-                  Serial.println("Reset Over Voltage Trip Not Charged");
+                  consoleText.println();
+                  consoleText.println("Reset Over Voltage Trip Not Charged");
                   Charged = 0;
                   digitalWrite(OUT3, HIGH);//turn on charger
                 }
                 /*
                   if (Pretimer + settings.Pretime < millis())
                   {
-                  // Serial.println();
-                  //Serial.print(Pretimer);
+                  // consoleText.println();
+                  //consoleText.print(Pretimer);
                   contctrl = contctrl | 2;
                   }*/
               }
@@ -585,30 +753,30 @@ void loop()
             {
               if (digitalRead(OUT3) == 0)
               {
-                Serial.println();
-                Serial.println("Reset Over Voltage Trip Not Charged");
+                consoleText.println();
+                consoleText.println("Reset Over Voltage Trip Not Charged");
                 digitalWrite(OUT3, HIGH);//turn on charger
               }
               /*
                 if (Pretimer + settings.Pretime < millis())
                 {
-                // Serial.println();
-                //Serial.print(Pretimer);
+                // consoleText.println();
+                //consoleText.print(Pretimer);
                 contctrl = contctrl | 2;
                 }*/
             }
           }
         }
 
-        if (bms.getLowCellVolt() < settings.UnderVSetpoint || bms.getLowCellVolt() < settings.DischVsetpoint)
+        if (pack.lowCellVolt < settings.UnderVSetpoint || pack.lowCellVolt < settings.DischVsetpoint)
         {
           if (digitalRead(OUT1) == 1)
           {
 
             if ((millis() - undertriptimer) > settings.triptime)
             {
-              Serial.println();
-              Serial.println("Under Voltage Trip");
+              consoleText.println();
+              consoleText.println("Under Voltage Trip");
               digitalWrite(OUT1, LOW);//turn off discharge
               // contctrl = contctrl & 254;
               // Pretimer1 = millis();
@@ -619,12 +787,12 @@ void loop()
         {
           undertriptimer = millis();
 
-          if (bms.getLowCellVolt() > settings.DischVsetpoint + settings.DischHys)
+          if (pack.lowCellVolt > settings.DischVsetpoint + settings.DischHys)
           {
             if (digitalRead(OUT1) == 0)
             {
-              Serial.println();
-              Serial.println("Reset Under Voltage Trip");
+              consoleText.println();
+              consoleText.println("Reset Under Voltage Trip");
               digitalWrite(OUT1, HIGH);//turn on discharge
             }
             /*
@@ -639,7 +807,7 @@ void loop()
         {
           if (settings.tripcont == 0)
           {
-            if (bms.getLowCellVolt() < settings.UnderVSetpoint || bms.getHighCellVolt() > settings.OverVSetpoint || bms.getHighTemperature() > settings.OverTSetpoint)
+            if (pack.lowCellVolt < settings.UnderVSetpoint || pack.highCellVolt > settings.OverVSetpoint || pack.highTemperature > settings.OverTSetpoint)
             {
               digitalWrite(OUT2, HIGH);//trip breaker
               bmsstatus = Error;
@@ -651,7 +819,7 @@ void loop()
           }
           else
           {
-            if (bms.getLowCellVolt() < settings.UnderVSetpoint || bms.getHighCellVolt() > settings.OverVSetpoint || bms.getHighTemperature() > settings.OverTSetpoint)
+            if (pack.lowCellVolt < settings.UnderVSetpoint || pack.highCellVolt > settings.OverVSetpoint || pack.highTemperature > settings.OverTSetpoint)
             {
               digitalWrite(OUT2, LOW);//turn off contactor
               contctrl = contctrl & 253; //turn off contactor
@@ -684,7 +852,7 @@ void loop()
             digitalWrite(OUT4, LOW);//ensure precharge is low
           }
 
-          if (bms.getLowCellVolt() > settings.UnderVSetpoint && bms.getHighCellVolt() < settings.OverVSetpoint && bms.getHighTemperature() < settings.OverTSetpoint && cellspresent == bms.seriescells() && cellspresent == (settings.Scells * settings.Pstrings))
+          if (pack.lowCellVolt > settings.UnderVSetpoint && pack.highCellVolt < settings.OverVSetpoint && pack.highTemperature < settings.OverTSetpoint && cellspresent == pack.seriesCells && cellspresent == (settings.Scells * settings.Pstrings))
           {
             if (ErrorReason == 0)
             {
@@ -716,7 +884,7 @@ void loop()
           digitalWrite(OUT2, LOW);
           digitalWrite(OUT1, LOW);//turn off discharge
           contctrl = 0; //turn off out 5 and 6
-          if (bms.getHighCellVolt() > settings.balanceVoltage && bms.getHighCellVolt() > bms.getLowCellVolt() + settings.balanceHyst)
+          if (pack.highCellVolt > settings.balanceVoltage && pack.highCellVolt > pack.lowCellVolt + settings.balanceHyst)
           {
             //bms.balanceCells();
             balancecells = 1;
@@ -725,7 +893,7 @@ void loop()
           {
             balancecells = 0;
           }
-          if (digitalRead(IN3) == HIGH && (bms.getHighCellVolt() < (settings.ChargeVsetpoint - settings.ChargeHys))) //detect AC present for charging and check not balancing
+          if (digitalRead(IN3) == HIGH && (pack.highCellVolt < (settings.ChargeVsetpoint - settings.ChargeHys))) //detect AC present for charging and check not balancing
           {
             if (settings.ChargerDirect == 1)
             {
@@ -757,7 +925,7 @@ void loop()
           {
             bmsstatus = Ready;
           }
-          if (digitalRead(IN3) == HIGH && (bms.getHighCellVolt() < (settings.ChargeVsetpoint - settings.ChargeHys))) //detect AC present for charging and check not balancing
+          if (digitalRead(IN3) == HIGH && (pack.highCellVolt < (settings.ChargeVsetpoint - settings.ChargeHys))) //detect AC present for charging and check not balancing
           {
             bmsstatus = Charge;
           }
@@ -767,7 +935,7 @@ void loop()
         case (Charge):
           Discharge = 0;
           digitalWrite(OUT3, HIGH);//enable charger
-          if (bms.getHighCellVolt() > settings.balanceVoltage)
+          if (pack.highCellVolt > settings.balanceVoltage)
           {
             //bms.balanceCells();
             balancecells = 1;
@@ -776,9 +944,9 @@ void loop()
           {
             balancecells = 0;
           }
-          if (bms.getHighCellVolt() > settings.ChargeVsetpoint)
+          if (pack.highCellVolt > settings.ChargeVsetpoint)
           {
-            if (bms.getAvgCellVolt() > (settings.ChargeVsetpoint - settings.ChargeHys))
+            if (pack.avgCellVolt > (settings.ChargeVsetpoint - settings.ChargeHys))
             {
               SOCcharged(2);
             }
@@ -812,7 +980,7 @@ void loop()
           {
             //if (cellspresent == bms.seriescells()) //detect a fault in cells detected
             //{
-            if (bms.getLowCellVolt() >= settings.UnderVSetpoint && bms.getHighCellVolt() <= settings.OverVSetpoint)
+            if (pack.lowCellVolt >= settings.UnderVSetpoint && pack.highCellVolt <= settings.OverVSetpoint)
             {
               bmsstatus = Ready;
             }
@@ -822,216 +990,295 @@ void loop()
           break;
       }
     }
+    PROFILE_END(PROF_STATE);
+  }
+}
+
+// Current measurement and integration
+void currenttask()
+{
+  if (outputcheck != 1)
+  {
     if ( settings.cursens == Analoguedual || settings.cursens == Analoguesing)
     {
-      getcurrent();
+      analogcurrent();
     }
     if (settings.cursens == 0)
     {
       currentact = 0;
     }
   }
+}
 
-  if (millis() - looptime > 500)
+// Module expiry, voltage checks, SOC, limits and reporting
+void slowtask()
+{
+  PROFILE_SCOPE(PROF_SLOW);
+  const PackSnapshot &pack = snapshot;
+  //bms.getAllVoltTemp();
+  //UV  check
+  if (settings.ESSmode == 1)
   {
-    looptime = millis();
-    //bms.getAllVoltTemp();
-    //UV  check
-    if (settings.ESSmode == 1)
+    if (SOCset != 0)
     {
-      if (SOCset != 0)
+      if (pack.lowCellVolt < settings.UnderVSetpoint || pack.highCellVolt < settings.UnderVSetpoint)
       {
-        if (bms.getLowCellVolt() < settings.UnderVSetpoint || bms.getHighCellVolt() < settings.UnderVSetpoint)
-        {
-          SERIALCONSOLE.println("  ");
-          SERIALCONSOLE.print("   !!! Undervoltage Fault !!! ");
-          SERIALCONSOLE.print(bms.getLowCellVolt());
-          SERIALCONSOLE.println("  ");
-          bmsstatus = Error;
-          ErrorReason = ErrorReason & 0x01;
-        }
-        else
-        {
-          ErrorReason = ErrorReason & ~0x01;
-        }
+        consoleText.println("  ");
+        consoleText.print("   !!! Undervoltage Fault !!! ");
+        consoleText.print(pack.lowCellVolt);
+        consoleText.println("  ");
+        bmsstatus = Error;
+        ErrorReason = ErrorReason & 0x01;
+      }
+      else
+      {
+        ErrorReason = ErrorReason & ~0x01;
       }
     }
-    else //In 'vehicle' mode
+  }
+  else //In 'vehicle' mode
+  {
+    if (SOCset != 0)
     {
-      if (SOCset != 0)
+      if (pack.lowCellVolt < settings.UnderVSetpoint || pack.highCellVolt < settings.UnderVSetpoint)
       {
-        if (bms.getLowCellVolt() < settings.UnderVSetpoint || bms.getHighCellVolt() < settings.UnderVSetpoint)
+        if (UnderTime > millis()) //check is last time not undervoltage is longer thatn UnderDur ago
         {
-          if (UnderTime > millis()) //check is last time not undervoltage is longer thatn UnderDur ago
-          {
-            bmsstatus = Error;
-            ErrorReason = ErrorReason | 0x01;
-          }
-        }
-        else
-        {
-          UnderTime = millis() + settings.triptime;
-          ErrorReason = ErrorReason & ~0x01;
-        }
-        if (bms.getHighCellVolt() > settings.OverVSetpoint)
-        {
-          if (OverTime > millis()) //check is last time not undervoltage is longer thatn UnderDur ago
-          {
-            bmsstatus = Error;
-            ErrorReason = ErrorReason | 0x02;
-          }
+          bmsstatus = Error;
+          ErrorReason = ErrorReason | 0x01;
         }
-        else
+      }
+      else
+      {
+        UnderTime = millis() + settings.triptime;
+        ErrorReason = ErrorReason & ~0x01;
+      }
+      if (pack.highCellVolt > settings.OverVSetpoint)
+      {
+        if (OverTime > millis()) //check is last time not undervoltage is longer thatn UnderDur ago
         {
-          OverTime = millis() + settings.triptime;
-          ErrorReason = ErrorReason & ~0x02;
+          bmsstatus = Error;
+          ErrorReason = ErrorReason | 0x02;
         }
       }
+      else
+      {
+        OverTime = millis() + settings.triptime;
+        ErrorReason = ErrorReason & ~0x02;
+      }
     }
+  }
 
-    if (debug != 0)
-    {
-      printbmsstat();
-      bms.printPackDetails(debugdigits, showbal);
-    }
-    if (CSVdebug != 0)
-    {
-      bms.printAllCSV(millis(), currentact, SOC);
-    }
-    if (inputcheck != 0)
-    {
-      inputdebug();
-    }
+  startReport();
+  if (inputcheck != 0)
+  {
+    inputdebug();
+  }
 
-    if (outputcheck != 0)
+  if (outputcheck != 0)
+  {
+    outputdebug();
+  }
+  else
+  {
+    gaugeupdate();
+  }
+
+  updateSOC();
+  currentlimit(pack, bmsstatus, storagemode, chargecurrent, discurrent);
+  if (SOCset == 1)
+  {
+    if (cellspresent == 0 )
     {
-      outputdebug();
+      cellspresent = pack.seriesCells;
     }
     else
     {
-      gaugeupdate();
-    }
-
-    updateSOC();
-    currentlimit();
-    VEcan();
-    if (SOCset == 1)
-    {
-      if (cellspresent == 0 )
+      if (cellspresent != pack.seriesCells || cellspresent != (settings.Scells * settings.Pstrings)) //detect a fault in cells detected
       {
-        cellspresent = bms.seriescells();
+        if (debug != 0)
+        {
+          consoleText.println("  ");
+          consoleText.print("   !!! Series Cells Fault !!!");
+          consoleText.println("  ");
+          bmsstatus = Error;
+          ErrorReason = ErrorReason | 0x04;
+        }
+        // Reset the modules
+        msg.id  = 0x4f8;
+        msg.len = 1;
+        msg.buf[0] = ADAPTER_CMD_RESET;
+        canTx.send(msg, CAN_TX_COMMAND);
       }
       else
       {
-        if (cellspresent != bms.seriescells() || cellspresent != (settings.Scells * settings.Pstrings)) //detect a fault in cells detected
-        {
-          if (debug != 0)
-          {
-            SERIALCONSOLE.println("  ");
-            SERIALCONSOLE.print("   !!! Series Cells Fault !!!");
-            SERIALCONSOLE.println("  ");
-            bmsstatus = Error;
-            ErrorReason = ErrorReason | 0x04;
-          }
-          // Reset the modules
-          msg.id  = 0x4f8;
-          msg.len = 1;
-          msg.buf[0] = 0x01;
-          if (Can0.write(msg) == 0 && sendCnt < sendbufsize)
-          {
-            msgbuf[sendCnt] = msg;
-            sendCnt++;
-          }
-        }
-        else
-        {
-          ErrorReason = ErrorReason & ~0x04;
-        }
+        ErrorReason = ErrorReason & ~0x04;
       }
     }
-    if (SOCset == 1)
-    {
-      alarmupdate();
-    }
-    if (CSVdebug != 1)
+  }
+  if (SOCset == 1)
+  {
+    alarmupdate(pack, alarm, warning);
+  }
+  if (CSVdebug != 1)
+  {
+    dashupdate(); //Info on serial bus 2
+  }
+
+  resetwdog();
+}
+
+// Periodic CAN frames, see canTable
+void cantask()
+{
+  PROFILE_SCOPE(PROF_CANTX);
+  canSchedule.run(millis());
+}
+
+// Write a little of any settings or history change to the EEPROM
+void storetask()
+{
+  settingsStore.service();
+  history.service();
+}
+
+// Add the last second to the lifetime history, saving it if it has moved
+// far enough
+void historytask()
+{
+  const PackSnapshot &pack = snapshot;
+
+  history.addCharge(coulombs.getChargeIn(), coulombs.getChargeOut(), pack.packVoltageMV, settings.CAP * settings.Pstrings);
+  if (pack.numModules > 0)
+  {
+    for (int n = 0; n < pack.numModules; n++)
     {
-      dashupdate(); //Info on serial bus 2
+      int y = bms.getActiveModule(n);
+      BMSModule &module = bms.getModule(y);
+      history.addModule(y, module.getLowestCellRaw(), module.getHighestCellRaw());
     }
+    history.addTemperature(pack.lowTempRaw, pack.highTempRaw);
+  }
+  history.check(millis());
+}
 
-    resetwdog();
+// Take a flight recorder snapshot every period, and one more then
+// freeze it when the BMS goes to Error or a new error reason appears
+void recordertask()
+{
+  if (recorder.isSuspended() && canCapture.drained())
+  {
+    recorder.resume();
+  }
+  bool trip = (bmsstatus == Error && recorderStatus != Error) || (ErrorReason & ~recorderReason) != 0;
+  recorderStatus = bmsstatus;
+  recorderReason = ErrorReason;
+  if (!trip && !recorder.due(millis()))
+  {
+    return;
+  }
+  FlightSnapshot state;
+  state.time = millis();
+  state.current = currentact;
+  state.SOC = constrain(SOC, 0, 100);
+  state.status = bmsstatus;
+  state.errorReason = ErrorReason;
+  state.outputs = digitalRead(OUT1) | digitalRead(OUT2) << 1 | digitalRead(OUT3) << 2 | digitalRead(OUT4) << 3 |
+                  digitalRead(OUT5) << 4 | digitalRead(OUT6) << 5 | digitalRead(OUT7) << 6 | digitalRead(OUT8) << 7;
+  state.reserved = 0;
+  recorder.record(state);
+  if (trip)
+  {
+    recorder.freeze(state.time, ErrorReason);
   }
+}
 
-  if (millis() - looptime1 > settings.chargerspd)
+// Plan each module's balance target. Cells are bled towards the lowest
+// cell, or the balance voltage if that is higher. Targets are only given
+// when settings.moduleBalance is on, otherwise balancecan() broadcasts one
+// for the pack, but the bleeding is counted either way.
+void balancetask()
+{
+  uint16_t floorRaw = snapshot.lowCellRaw;
+  uint16_t balanceRaw = settings.balanceVoltage * 65535.0f / 5.0f;
+  if (floorRaw < balanceRaw)
   {
-    looptime1 = millis();
-    if (settings.ESSmode == 1)
-    {
-      chargercomms();
-    }
-    else
-    {
-      if (bmsstatus == Charge)
-      {
-        chargercomms();
-      }
-    }
+    floorRaw = balanceRaw;
   }
+  planner.update(millis(), balancecells == 1 && settings.moduleBalance == 1, floorRaw, settings.balanceHyst * 65535.0f / 5.0f, settings.CAP);
+}
+
+// Update the daisychain link statistics of every module, chain and the pack
+void linktask()
+{
+  bms.rollLinks(millis());
+}
+
+// Convert the temperature setpoints to raw NTC counts once, so the alarm
+// checks can compare module readings without decoding them
+void updateTempThresholds()
+{
+  OverTRaw = BMSModule::encodeTemperature(settings.OverTSetpoint);
+  OverTWarnRaw = BMSModule::encodeTemperature(settings.OverTSetpoint - settings.WarnToff);
+  UnderTRaw = BMSModule::encodeTemperature(settings.UnderTSetpoint);
+  UnderTWarnRaw = BMSModule::encodeTemperature(settings.UnderTSetpoint + settings.WarnToff);
 }
 
-void alarmupdate()
+// Work out the Victron alarm and warning bits from the pack snapshot
+void alarmupdate(const PackSnapshot &pack, unsigned char *alarms, unsigned char *warnings)
 {
-  alarm[0] = 0x00;
-  if (settings.OverVSetpoint < bms.getHighCellVolt())
+  alarms[0] = 0x00;
+  if (settings.OverVSetpoint < pack.highCellVolt)
   {
-    alarm[0] = 0x04;
+    alarms[0] = 0x04;
   }
-  if (bms.getLowCellVolt() < settings.UnderVSetpoint)
+  if (pack.lowCellVolt < settings.UnderVSetpoint)
   {
-    alarm[0] |= 0x10;
+    alarms[0] |= 0x10;
   }
-  if (bms.getHighTemperature() > settings.OverTSetpoint)
+  if (pack.highTempRaw < OverTRaw)
   {
-    alarm[0] |= 0x40;
+    alarms[0] |= 0x40;
   }
-  alarm[1] = 0;
-  if (bms.getLowTemperature() < settings.UnderTSetpoint)
+  alarms[1] = 0;
+  if (pack.lowTempRaw > UnderTRaw)
   {
-    //  alarm[1] = 0x01;
+    //  alarms[1] = 0x01;
     /*
-      Serial.println();
-      Serial.print("LOW: ");
-      Serial.print(bms.getLowTemperature());
-      Serial.print("|");
-      Serial.print("UT SET : ");
-      Serial.println(settings.UnderTSetpoint);
+      consoleText.println();
+      consoleText.print("LOW: ");
+      consoleText.print(pack.lowTemperature);
+      consoleText.print("|");
+      consoleText.print("UT SET : ");
+      consoleText.println(settings.UnderTSetpoint);
     */
   }
-  alarm[3] = 0;
-  if ((bms.getHighCellVolt() - bms.getLowCellVolt()) > settings.CellGap)
+  alarms[3] = 0;
+  if ((pack.highCellVolt - pack.lowCellVolt) > settings.CellGap)
   {
-    alarm[3] = 0x01;
+    alarms[3] = 0x01;
   }
 
   ///warnings///
-  warning[0] = 0;
+  warnings[0] = 0;
 
-  if (bms.getHighCellVolt() > (settings.OverVSetpoint - settings.WarnOff))
+  if (pack.highCellVolt > (settings.OverVSetpoint - settings.WarnOff))
   {
-    warning[0] = 0x04;
+    warnings[0] = 0x04;
   }
-  if (bms.getLowCellVolt() < (settings.UnderVSetpoint + settings.WarnOff))
+  if (pack.lowCellVolt < (settings.UnderVSetpoint + settings.WarnOff))
   {
-    warning[0] |= 0x10;
+    warnings[0] |= 0x10;
   }
 
-  if (bms.getHighTemperature() > (settings.OverTSetpoint - settings.WarnToff))
+  if (pack.highTempRaw < OverTWarnRaw)
   {
-    warning[0] |= 0x40;
+    warnings[0] |= 0x40;
   }
-  warning[1] = 0;
-  if (bms.getLowTemperature() < (settings.UnderTSetpoint + settings.WarnToff))
+  warnings[1] = 0;
+  if (pack.lowTempRaw > UnderTWarnRaw)
   {
-    warning[1] = 0x01;
+    warnings[1] = 0x01;
   }
 }
 
@@ -1046,12 +1293,12 @@ void gaugeupdate()
     }
     analogWrite(OUT8, map(SOCtest * 0.1, 0, 100, settings.gaugelow, settings.gaugehigh));
 
-    SERIALCONSOLE.println("  ");
-    SERIALCONSOLE.print("SOC : ");
-    SERIALCONSOLE.print(SOCtest * 0.1);
-    SERIALCONSOLE.print("  fuel pwm : ");
-    SERIALCONSOLE.print(map(SOCtest * 0.1, 0, 100, settings.gaugelow, settings.gaugehigh));
-    SERIALCONSOLE.println("  ");
+    consoleText.println("  ");
+    consoleText.print("SOC : ");
+    consoleText.print(SOCtest * 0.1);
+    consoleText.print("  fuel pwm : ");
+    consoleText.print(map(SOCtest * 0.1, 0, 100, settings.gaugelow, settings.gaugehigh));
+    consoleText.println("  ");
   }
   if (gaugedebug == 2)
   {
@@ -1069,432 +1316,337 @@ void gaugeupdate()
   }
 }
 
-void printbmsstat()
+void printbmsstat(Print &out)
 {
-  SERIALCONSOLE.println();
-  SERIALCONSOLE.println();
-  SERIALCONSOLE.println();
-  SERIALCONSOLE.print("BMS Status : ");
+  out.println();
+  out.println();
+  out.println();
+  out.print("BMS Status : ");
   if (settings.ESSmode == 1)
   {
-    SERIALCONSOLE.print("ESS Mode ");
+    out.print("ESS Mode ");
 
-    if (bms.getLowCellVolt() < settings.UnderVSetpoint)
+    if (snapshot.lowCellVolt < settings.UnderVSetpoint)
     {
-      SERIALCONSOLE.print(": UnderVoltage ");
+      out.print(": UnderVoltage ");
     }
-    if (bms.getHighCellVolt() > settings.OverVSetpoint)
+    if (snapshot.highCellVolt > settings.OverVSetpoint)
     {
-      SERIALCONSOLE.print(": OverVoltage ");
+      out.print(": OverVoltage ");
     }
-    if ((bms.getHighCellVolt() - bms.getLowCellVolt()) > settings.CellGap)
+    if ((snapshot.highCellVolt - snapshot.lowCellVolt) > settings.CellGap)
     {
-      SERIALCONSOLE.print(": Cell Imbalance ");
+      out.print(": Cell Imbalance ");
     }
-    if (bms.getHighTemperature() > settings.OverTSetpoint)
+    if (snapshot.highTemperature > settings.OverTSetpoint)
     {
-      SERIALCONSOLE.print(": Over Temp ");
+      out.print(": Over Temp ");
     }
-    if (bms.getLowTemperature() < settings.UnderTSetpoint)
+    if (snapshot.lowTemperature < settings.UnderTSetpoint)
     {
-      SERIALCONSOLE.print(": Under Temp ");
+      out.print(": Under Temp ");
     }
     if (storagemode == 1)
     {
-      if (bms.getLowCellVolt() > settings.StoreVsetpoint)
+      if (snapshot.lowCellVolt > settings.StoreVsetpoint)
       {
-        SERIALCONSOLE.print(": OverVoltage Storage ");
-        SERIALCONSOLE.print(": UNhappy:");
+        out.print(": OverVoltage Storage ");
+        out.print(": UNhappy:");
       }
       else
       {
-        //SERIALCONSOLE.print(": Happy ");
+        //out.print(": Happy ");
       }
     }
     else
     {
-      if (bms.getLowCellVolt() > settings.UnderVSetpoint && bms.getHighCellVolt() < settings.OverVSetpoint)
+      if (snapshot.lowCellVolt > settings.UnderVSetpoint && snapshot.highCellVolt < settings.OverVSetpoint)
       {
         if ( bmsstatus == Error)
         {
-          SERIALCONSOLE.print(": UNhappy:");
+          out.print(": UNhappy:");
         }
         else
         {
-          SERIALCONSOLE.print(": Happy ");
+          out.print(": Happy ");
         }
       }
     }
   }
   else
   {
-    SERIALCONSOLE.print(bmsstatus);
+    out.print(bmsstatus);
     switch (bmsstatus)
     {
       case (Boot):
-        SERIALCONSOLE.print(" Boot ");
+        out.print(" Boot ");
         break;
 
       case (Ready):
-        SERIALCONSOLE.print(" Ready ");
+        out.print(" Ready ");
         break;
 
       case (Precharge):
-        SERIALCONSOLE.print(" Precharge ");
+        out.print(" Precharge ");
         break;
 
       case (Drive):
-        SERIALCONSOLE.print(" Drive ");
+        out.print(" Drive ");
         break;
 
       case (Charge):
-        SERIALCONSOLE.print(" Charge ");
+        out.print(" Charge ");
         break;
 
       case (Error):
-        SERIALCONSOLE.print(" Error ");
+        out.print(" Error ");
         break;
     }
-    if (bms.getLowCellVolt() < settings.UnderVSetpoint)
+    if (snapshot.lowCellVolt < settings.UnderVSetpoint)
     {
-      SERIALCONSOLE.print(": UnderVoltage ");
+      out.print(": UnderVoltage ");
     }
-    if (bms.getHighCellVolt() > settings.OverVSetpoint)
+    if (snapshot.highCellVolt > settings.OverVSetpoint)
     {
-      SERIALCONSOLE.print(": OverVoltage ");
+      out.print(": OverVoltage ");
     }
-    if ((bms.getHighCellVolt() - bms.getLowCellVolt()) > settings.CellGap)
+    if ((snapshot.highCellVolt - snapshot.lowCellVolt) > settings.CellGap)
     {
-      SERIALCONSOLE.print(": Cell Imbalance ");
+      out.print(": Cell Imbalance ");
     }
-    if (bms.getHighTemperature() > settings.OverTSetpoint)
+    if (snapshot.highTemperature > settings.OverTSetpoint)
     {
-      SERIALCONSOLE.print(": Over Temp ");
+      out.print(": Over Temp ");
     }
-    if (bms.getLowTemperature() < settings.UnderTSetpoint)
+    if (snapshot.lowTemperature < settings.UnderTSetpoint)
     {
-      SERIALCONSOLE.print(": Under Temp ");
+      out.print(": Under Temp ");
     }
   }
-  SERIALCONSOLE.print("  ");
+  out.print("  ");
   if (digitalRead(IN3) == HIGH)
   {
-    SERIALCONSOLE.print("| AC Present |");
+    out.print("| AC Present |");
   }
   if (digitalRead(IN1) == HIGH)
   {
-    SERIALCONSOLE.print("| Key ON |");
+    out.print("| Key ON |");
   }
   if (balancecells == 1)
   {
-    SERIALCONSOLE.print("|Balancing Active");
-  }
-  SERIALCONSOLE.print("  ");
-  SERIALCONSOLE.print(cellspresent);
-  SERIALCONSOLE.println();
-  SERIALCONSOLE.print("Out:");
-  SERIALCONSOLE.print(digitalRead(OUT1));
-  SERIALCONSOLE.print(digitalRead(OUT2));
-  SERIALCONSOLE.print(digitalRead(OUT3));
-  SERIALCONSOLE.print(digitalRead(OUT4));
-  SERIALCONSOLE.print(" Cont:");
+    out.print("|Balancing Active");
+  }
+  out.print("  ");
+  out.print(cellspresent);
+  out.println();
+  out.print("Out:");
+  out.print(digitalRead(OUT1));
+  out.print(digitalRead(OUT2));
+  out.print(digitalRead(OUT3));
+  out.print(digitalRead(OUT4));
+  out.print(" Cont:");
   if ((contstat & 1) == 1)
   {
-    SERIALCONSOLE.print("1");
+    out.print("1");
   }
   else
   {
-    SERIALCONSOLE.print("0");
+    out.print("0");
   }
   if ((contstat & 2) == 2)
   {
-    SERIALCONSOLE.print("1");
+    out.print("1");
   }
   else
   {
-    SERIALCONSOLE.print("0");
+    out.print("0");
   }
   if ((contstat & 4) == 4)
   {
-    SERIALCONSOLE.print("1");
+    out.print("1");
   }
   else
   {
-    SERIALCONSOLE.print("0");
+    out.print("0");
   }
   if ((contstat & 8) == 8)
   {
-    SERIALCONSOLE.print("1");
+    out.print("1");
   }
   else
   {
-    SERIALCONSOLE.print("0");
+    out.print("0");
   }
-  SERIALCONSOLE.print(" In:");
-  SERIALCONSOLE.print(digitalRead(IN1));
-  SERIALCONSOLE.print(digitalRead(IN2));
-  SERIALCONSOLE.print(digitalRead(IN3));
-  SERIALCONSOLE.print(digitalRead(IN4));
+  out.print(" In:");
+  out.print(digitalRead(IN1));
+  out.print(digitalRead(IN2));
+  out.print(digitalRead(IN3));
+  out.print(digitalRead(IN4));
+
+  out.print(" Charge Current Limit : ");
+  out.print(chargecurrent * 0.1, 0);
+  out.print(" A DisCharge Current Limit : ");
+  out.print(discurrent * 0.1, 0);
+  out.print(" A");
+}
 
-  SERIALCONSOLE.print(" Charge Current Limit : ");
-  SERIALCONSOLE.print(chargecurrent * 0.1, 0);
-  SERIALCONSOLE.print(" A DisCharge Current Limit : ");
-  SERIALCONSOLE.print(discurrent * 0.1, 0);
-  SERIALCONSOLE.print(" A");
+
+void currentsampleisr()
+{
+  currentSampler.isr();
 }
 
+// Convert one pair of current sensor readings to mA. The low range is used
+// below settings.changecur and the high range above it. Over the top tenth
+// of the low range the two are blended, so the result doesn't step when
+// the range changes.
+int32_t fusecurrent(uint16_t low, uint16_t high)
+{
+  uint32_t maxValue = adc->adc0->getMaxValue();
+  int32_t lowmV = (int32_t)(low * 3300 / maxValue) - settings.offset1;
+  int32_t lowmA = 0;
+  if (abs(lowmV) >= settings.CurDead)
+  {
+    lowmA = lowmV / (settings.convlow * 0.00001);
+  }
+  if (settings.cursens == Analoguesing)
+  {
+    return lowmA;
+  }
+  int32_t highmA = 0;
+  if (high >= 100 && high <= maxValue - 100)
+  {
+    highmA = ((int32_t)(high * 3300 / maxValue) - settings.offset2) / (settings.convhigh * 0.00001);
+  }
+  int32_t blend = settings.changecur / 10;
+  int32_t magnitude = abs(lowmA);
+  if (magnitude >= settings.changecur)
+  {
+    return highmA;
+  }
+  if (blend <= 0 || magnitude <= settings.changecur - blend)
+  {
+    return lowmA;
+  }
+  return lowmA + (int64_t)(highmA - lowmA) * (magnitude - (settings.changecur - blend)) / blend;
+}
 
-void getcurrent()
+// Process the blocks the current sampler has filled since the last call.
+// Every reading is integrated, then the mean of each block is filtered
+// like a reading from a CAN current sensor.
+void analogcurrent()
 {
-  if ( settings.cursens == Analoguedual || settings.cursens == Analoguesing)
+  CurrentBlock block;
+  while (currentSampler.read(block))
   {
-    if ( settings.cursens == Analoguedual)
+    int64_t total = 0;
+    for (int n = 0; n < CURRENT_BLOCK; n++)
     {
-      if (currentact < settings.changecur && currentact > (settings.changecur * -1))
-      {
-        sensor = 1;
-        adc->adc0->startContinuous(ACUR1);
-      }
-      else
-      {
-        sensor = 2;
-        adc->adc0->startContinuous(ACUR2);
-      }
+      int32_t milliamps = fusecurrent(block.low[n], block.high[n]);
+      total += milliamps;
+      coulombs.sample(settings.invertcur == 1 ? -milliamps : milliamps, block.time + n * (1000000 / CURRENT_SAMPLE_RATE));
     }
-    else
+    RawCur = total / CURRENT_BLOCK;
+    if (settings.cursens == Analoguedual && abs(RawCur) >= settings.changecur)
     {
-      sensor = 1;
-      adc->adc0->startContinuous(ACUR1);
+      sensor = 2;
     }
-    if (sensor == 1)
+    else
     {
-      if (debugCur != 0)
-      {
-        SERIALCONSOLE.println();
-        if ( settings.cursens == Analoguedual)
-        {
-          SERIALCONSOLE.print("Low Range: ");
-        }
-        else
-        {
-          SERIALCONSOLE.print("Single In: ");
-        }
-        SERIALCONSOLE.print("Value ADC0: ");
-      }
-      value = (uint16_t)adc->adc0->analogReadContinuous(); // the unsigned is necessary for 16 bits, otherwise values larger than 3.3/2 V are negative!
-      if (debugCur != 0)
-      {
-        SERIALCONSOLE.print(value * 3300 / adc->adc0->getMaxValue()); //- settings.offset1)
-        SERIALCONSOLE.print(" ");
-        SERIALCONSOLE.print(settings.offset1);
-      }
-      RawCur = int16_t((value * 3300 / adc->adc0->getMaxValue()) - settings.offset1) / (settings.convlow * 0.00001);
-
-      if (abs((int16_t(value * 3300 / adc->adc0->getMaxValue()) - settings.offset1)) <  settings.CurDead)
-      {
-        RawCur = 0;
-      }
-      if (debugCur != 0)
-      {
-        SERIALCONSOLE.print("  ");
-        SERIALCONSOLE.print(int16_t(value * 3300 / adc->adc0->getMaxValue()) - settings.offset1);
-        SERIALCONSOLE.print("  ");
-        SERIALCONSOLE.print(RawCur);
-        SERIALCONSOLE.print(" mA");
-        SERIALCONSOLE.print("  ");
-      }
+      sensor = 1;
     }
-    else
+    if (debugCur != 0)
     {
-      if (debugCur != 0)
-      {
-        SERIALCONSOLE.println();
-        SERIALCONSOLE.print("High Range: ");
-        SERIALCONSOLE.print("Value ADC0: ");
-      }
-      value = (uint16_t)adc->adc0->analogReadContinuous(); // the unsigned is necessary for 16 bits, otherwise values larger than 3.3/2 V are negative!
-      if (debugCur != 0)
-      {
-        SERIALCONSOLE.print(value * 3300 / adc->adc0->getMaxValue() );//- settings.offset2)
-        SERIALCONSOLE.print("  ");
-        SERIALCONSOLE.print(settings.offset2);
-      }
-      RawCur = int16_t((value * 3300 / adc->adc0->getMaxValue()) - settings.offset2) / (settings.convhigh * 0.00001);
-      if (value < 100 || value > (adc->adc0->getMaxValue() - 100))
-      {
-        RawCur = 0;
-      }
-      if (debugCur != 0)
-      {
-        SERIALCONSOLE.print("  ");
-        SERIALCONSOLE.print((float(value * 3300 / adc->adc0->getMaxValue()) - settings.offset2));
-        SERIALCONSOLE.print("  ");
-        SERIALCONSOLE.print(RawCur);
-        SERIALCONSOLE.print("mA");
-        SERIALCONSOLE.print("  ");
-      }
+      consoleText.println();
+      consoleText.print("ADC low: ");
+      consoleText.print(block.low[CURRENT_BLOCK - 1]);
+      consoleText.print(" high: ");
+      consoleText.print(block.high[CURRENT_BLOCK - 1]);
+      consoleText.print("  ");
+      consoleText.print(RawCur);
+      consoleText.print(" mA block mean  ");
     }
+    currenttime = block.time + (CURRENT_BLOCK - 1) * (1000000 / CURRENT_SAMPLE_RATE);
+    getcurrent();
   }
+}
 
+// Filter a new current reading in RawCur, taken at currenttime
+void getcurrent()
+{
+  PROFILE_SCOPE(PROF_CURRENT);
   if (settings.invertcur == 1)
   {
     RawCur = RawCur * -1;
   }
 
-  lowpassFilter.input(RawCur);
+  lowpassFilter.input(RawCur, currenttime);
   if (debugCur != 0)
   {
-    SERIALCONSOLE.print(lowpassFilter.output());
-    SERIALCONSOLE.print(" | ");
-    SERIALCONSOLE.print(settings.changecur);
-    SERIALCONSOLE.print(" | ");
+    consoleText.print(lowpassFilter.output());
+    consoleText.print(" | ");
+    consoleText.print(settings.changecur);
+    consoleText.print(" | ");
   }
 
   currentact = lowpassFilter.output();
 
   if (debugCur != 0)
   {
-    SERIALCONSOLE.print(currentact);
-    SERIALCONSOLE.print("mA  ");
+    consoleText.print(currentact);
+    consoleText.print("mA  ");
   }
 
-  if ( settings.cursens == Analoguedual)
+  if (settings.cursens == Canbus)
   {
-    if (sensor == 1)
-    {
-      if (currentact > 500 || currentact < -500 )
-      {
-        ampsecond = ampsecond + ((currentact * (millis() - lasttime) / 1000) / 1000);
-        lasttime = millis();
-      }
-      else
-      {
-        lasttime = millis();
-      }
-    }
-    if (sensor == 2)
-    {
-      if (currentact > settings.changecur || currentact < (settings.changecur * -1) )
-      {
-        ampsecond = ampsecond + ((currentact * (millis() - lasttime) / 1000) / 1000);
-        lasttime = millis();
-      }
-      else
-      {
-        lasttime = millis();
-      }
-    }
-  }
-  else
-  {
-    if (currentact > 500 || currentact < -500 )
-    {
-      ampsecond = ampsecond + ((currentact * (millis() - lasttime) / 1000) / 1000);
-      lasttime = millis();
-    }
-    else
-    {
-      lasttime = millis();
-    }
+    coulombs.sample(currentact, currenttime);
   }
   currentact = settings.ncur * currentact;
   RawCur = 0;
-  AverageCurrent = myRA.reading(currentact);
-  if (millis() - curloop1 > 1000)
+  currentSec.add(currentact, millis());
+  currentMin.add(currentact, millis());
+  currentHour.add(currentact, millis());
+  if (debugAvgCur != 0 && millis() - curloop1 > 1000)
   {
     curloop1 = millis();
-    myRA.reset();
-    AverageCurrentSec = myRASec.reading(AverageCurrent);
-    SecCount ++;
-    if (SecCount >= 59)
-    {
-      SecCount = 0;
-      AverageCurrentMin = myRAMin.reading(AverageCurrentSec);
-    }
-    if (debugAvgCur != 0)
-    {
-      SERIALCONSOLE.println();
-      SERIALCONSOLE.print(millis());
-      SERIALCONSOLE.print(" ");
-      SERIALCONSOLE.print(currentact);
-      SERIALCONSOLE.print(" ");
-      SERIALCONSOLE.print(AverageCurrent);
-      SERIALCONSOLE.print(" ");
-      SERIALCONSOLE.print(AverageCurrentSec);
-      SERIALCONSOLE.print(" ");
-      SERIALCONSOLE.print(AverageCurrentMin);
-    }
+    consoleText.println();
+    consoleText.print(millis());
+    consoleText.print(" ");
+    consoleText.print(currentact);
+    printcurrentwindow(currentSec);
+    printcurrentwindow(currentMin);
+    printcurrentwindow(currentHour);
   }
-  /*
-    if (debugAvgCur != 0)
-    {
-    SERIALCONSOLE.println();
-    SERIALCONSOLE.print(millis());
-    SERIALCONSOLE.print(" ");
-    SERIALCONSOLE.print(currentact);
-    SERIALCONSOLE.print(" ");
-    SERIALCONSOLE.print(AverageCurrent);
-    SERIALCONSOLE.print(" ");
-    SERIALCONSOLE.print(AverageCurrentSec);
-    SERIALCONSOLE.print(" ");
-    SERIALCONSOLE.print(AverageCurrentMin);
-    }
-  */
-  /*
-    AverageCurrentTotal = AverageCurrentTotal - RunningAverageBuffer[NextRunningAverage];
-
-    RunningAverageBuffer[NextRunningAverage] = currentact;
-    if (debugCur != 0)
-    {
-    SERIALCONSOLE.print(" | ");
-    SERIALCONSOLE.print(AverageCurrentTotal);
-    SERIALCONSOLE.print(" | ");
-    SERIALCONSOLE.print(RunningAverageBuffer[NextRunningAverage]);
-    SERIALCONSOLE.print(" | ");
-    }
-    AverageCurrentTotal = AverageCurrentTotal + RunningAverageBuffer[NextRunningAverage];
-    if (debugCur != 0)
-    {
-    SERIALCONSOLE.print(" | ");
-    SERIALCONSOLE.print(AverageCurrentTotal);
-    SERIALCONSOLE.print(" | ");
-    }
-
-    NextRunningAverage = NextRunningAverage + 1;
-
-    if (NextRunningAverage > RunningAverageCount)
-    {
-    NextRunningAverage = 0;
-    }
-
-    AverageCurrent = AverageCurrentTotal / (RunningAverageCount + 1);
-
-    if (debugCur != 0)
-    {
-    SERIALCONSOLE.print(AverageCurrent);
-    SERIALCONSOLE.print(" | ");
-    SERIALCONSOLE.print(AverageCurrentTotal);
-    SERIALCONSOLE.print(" | ");
-    SERIALCONSOLE.print(NextRunningAverage);
-    }
-  */
+}
 
+// Print the average, min and max of a current window for debugAvgCur
+void printcurrentwindow(SlidingWindow &window)
+{
+  consoleText.print(" ");
+  consoleText.print(window.getAverage());
+  consoleText.print(" (");
+  consoleText.print(window.getMin());
+  consoleText.print("/");
+  consoleText.print(window.getMax());
+  consoleText.print(")");
 }
 
 void updateSOC()
 {
+  int32_t capacity = (int32_t)settings.CAP * settings.Pstrings * 1000; //mAh
   if (SOCset == 0)
   {
     if (millis() > 5000)
     {
-      SOC = map(uint16_t(bms.getAvgCellVolt() * 1000), settings.socvolt[0], settings.socvolt[2], settings.socvolt[1], settings.socvolt[3]);
+      int tenths = ocvSOC(snapshot.avgCellMV);
+      SOC = tenths / 10;
 
-      ampsecond = (SOC * settings.CAP * settings.Pstrings * 10) / 0.27777777777778 ;
+      coulombs.setMilliampHours((int64_t)capacity * tenths / 1000);
       SOCset = 1;
       if (debug != 0)
       {
-        SERIALCONSOLE.println("  ");
-        SERIALCONSOLE.println("//////////////////////////////////////// SOC SET ////////////////////////////////////////");
+        consoleText.println("  ");
+        consoleText.println("//////////////////////////////////////// SOC SET ////////////////////////////////////////");
       }
       if (settings.ESSmode == 1)
       {
@@ -1505,14 +1657,37 @@ void updateSOC()
 
   if (settings.voltsoc == 1 || settings.cursens == 0)
   {
-    SOC = map(uint16_t(bms.getAvgCellVolt() * 1000), settings.socvolt[0], settings.socvolt[2], settings.socvolt[1], settings.socvolt[3]);
+    SOC = map(uint16_t(snapshot.avgCellVolt * 1000), settings.socvolt[0], settings.socvolt[2], settings.socvolt[1], settings.socvolt[3]);
 
-    ampsecond = (SOC * settings.CAP * settings.Pstrings * 10) / 0.27777777777778 ;
+    coulombs.setMilliampHours((int64_t)capacity * SOC / 100);
+  }
+  else if (SOCset == 1)
+  {
+    //Correct drift in the coulomb count once the cells have rested
+    if (coulombs.getRestTime() < OCV_REST_TIME)
+    {
+      ocvCorrected = 0;
+    }
+    else if (ocvCorrected == 0)
+    {
+      ocvCorrected = 1;
+      int tenths = ocvSOC(snapshot.avgCellMV);
+      if (debug != 0)
+      {
+        consoleText.println("  ");
+        consoleText.print("SOC corrected at rest from ");
+        consoleText.print(coulombs.getMilliampHours());
+        consoleText.print("mAh to ");
+        consoleText.print((int32_t)((int64_t)capacity * tenths / 1000));
+        consoleText.println("mAh");
+      }
+      coulombs.setMilliampHours((int64_t)capacity * tenths / 1000);
+    }
   }
-  SOC = ((ampsecond * 0.27777777777778) / (settings.CAP * settings.Pstrings * 1000)) * 100;
+  SOC = (int64_t)coulombs.getMilliampHours() * 100 / capacity;
   if (SOC >= 100)
   {
-    ampsecond = (settings.CAP * settings.Pstrings * 1000) / 0.27777777777778 ; //reset to full, dependant on given capacity. Need to improve with auto correction for capcity.
+    coulombs.setMilliampHours(capacity); //reset to full, dependant on given capacity. Need to improve with auto correction for capcity.
     SOC = 100;
   }
 
@@ -1528,29 +1703,29 @@ void updateSOC()
     {
       if (sensor == 1)
       {
-        SERIALCONSOLE.print("Low Range ");
+        consoleText.print("Low Range ");
       }
       else
       {
-        SERIALCONSOLE.print("High Range");
+        consoleText.print("High Range");
       }
     }
     if (settings.cursens == Analoguesing)
     {
-      SERIALCONSOLE.print("Analogue Single ");
+      consoleText.print("Analogue Single ");
     }
     if (settings.cursens == Canbus)
     {
-      SERIALCONSOLE.print("CANbus ");
+      consoleText.print("CANbus ");
     }
-    SERIALCONSOLE.print("  ");
-    SERIALCONSOLE.print(currentact);
-    SERIALCONSOLE.print("mA");
-    SERIALCONSOLE.print("  ");
-    SERIALCONSOLE.print(SOC);
-    SERIALCONSOLE.print("% SOC ");
-    SERIALCONSOLE.print(ampsecond * 0.27777777777778, 2);
-    SERIALCONSOLE.print ("mAh");
+    consoleText.print("  ");
+    consoleText.print(currentact);
+    consoleText.print("mA");
+    consoleText.print("  ");
+    consoleText.print(SOC);
+    consoleText.print("% SOC ");
+    consoleText.print(coulombs.getMilliampHours());
+    consoleText.print("mAh");
   }
 }
 
@@ -1559,12 +1734,12 @@ void SOCcharged(int y)
   if (y == 1)
   {
     SOC = 95;
-    ampsecond = (settings.CAP * settings.Pstrings * 1000) / 0.27777777777778 ; //reset to full, dependant on given capacity. Need to improve with auto correction for capcity.
+    coulombs.setMilliampHours((int32_t)settings.CAP * settings.Pstrings * 1000); //reset to full, dependant on given capacity. Need to improve with auto correction for capcity.
   }
   if (y == 2)
   {
     SOC = 100;
-    ampsecond = (settings.CAP * settings.Pstrings * 1000) / 0.27777777777778 ; //reset to full, dependant on given capacity. Need to improve with auto correction for capcity.
+    coulombs.setMilliampHours((int32_t)settings.CAP * settings.Pstrings * 1000); //reset to full, dependant on given capacity. Need to improve with auto correction for capcity.
   }
 }
 
@@ -1612,6 +1787,7 @@ void Prechargecon()
 
 void contcon()
 {
+  PROFILE_SCOPE(PROF_CONTCON);
   if (contctrl != contstat) //check for contactor request change
   {
     if ((contctrl & 1) == 0)
@@ -1655,8 +1831,8 @@ void contcon()
       {
         if (conttimer2 == 0)
         {
-          Serial.println();
-          Serial.println("pull in OUT6");
+          consoleText.println();
+          consoleText.println("pull in OUT6");
           analogWrite(OUT6, 255);
           conttimer2 = millis() + pulltime ;
         }
@@ -1674,8 +1850,8 @@ void contcon()
       {
         if (conttimer3 == 0)
         {
-          Serial.println();
-          Serial.println("pull in OUT7");
+          consoleText.println();
+          consoleText.println("pull in OUT7");
           analogWrite(OUT7, 255);
           conttimer3 = millis() + pulltime ;
         }
@@ -1688,12 +1864,12 @@ void contcon()
       }
     }
     /*
-      SERIALCONSOLE.print(conttimer);
-      SERIALCONSOLE.print("  ");
-      SERIALCONSOLE.print(contctrl);
-      SERIALCONSOLE.print("  ");
-      SERIALCONSOLE.print(contstat);
-      SERIALCONSOLE.println("  ");
+      consoleText.print(conttimer);
+      consoleText.print("  ");
+      consoleText.print(contctrl);
+      consoleText.print("  ");
+      consoleText.print(contstat);
+      consoleText.println("  ");
     */
 
   }
@@ -1706,6 +1882,7 @@ void contcon()
 
 void calcur()
 {
+  currentSampler.stop();
   adc->adc0->startContinuous(ACUR1);
   sensor = 1;
   x = 0;
@@ -1736,39 +1913,41 @@ void calcur()
   SERIALCONSOLE.print(settings.offset2);
   SERIALCONSOLE.print(" current offset 2 calibrated ");
   SERIALCONSOLE.println("  ");
+  currentSampler.start(currentsampleisr);
 }
 
-void VEcan() //communication with Victron system over CAN
+//communication with Victron system over CAN. Each encoder builds one frame
+//and returns false if it should not be sent this time round.
+
+bool VEcan351(CAN_message_t &msg) //charge and discharge limits
 {
-  if (settings.chargertype != EltekPC)
+  if (settings.chargertype == EltekPC)
   {
-    msg.id  = 0x351;
-    msg.len = 8;
-    if (storagemode == 0)
-    {
-      msg.buf[0] = lowByte(uint16_t((settings.ChargeVsetpoint * settings.Scells ) * 10));
-      msg.buf[1] = highByte(uint16_t((settings.ChargeVsetpoint * settings.Scells ) * 10));
-    }
-    else
-    {
-      msg.buf[0] = lowByte(uint16_t((settings.StoreVsetpoint * settings.Scells ) * 10));
-      msg.buf[1] = highByte(uint16_t((settings.StoreVsetpoint * settings.Scells ) * 10));
-    }
-    msg.buf[2] = lowByte(chargecurrent);
-    msg.buf[3] = highByte(chargecurrent);
-    msg.buf[4] = lowByte(discurrent );
-    msg.buf[5] = highByte(discurrent);
-    msg.buf[6] = lowByte(uint16_t((settings.DischVsetpoint * settings.Scells) * 10));
-    msg.buf[7] = highByte(uint16_t((settings.DischVsetpoint * settings.Scells) * 10));
-
-    if (Can0.write(msg) == 0 && sendCnt < sendbufsize)
-    {
-      msgbuf[sendCnt] = msg;
-      sendCnt++;
-    }
-
+    return false;
   }
+  msg.id  = 0x351;
+  msg.len = 8;
+  if (storagemode == 0)
+  {
+    msg.buf[0] = lowByte(uint16_t((settings.ChargeVsetpoint * settings.Scells ) * 10));
+    msg.buf[1] = highByte(uint16_t((settings.ChargeVsetpoint * settings.Scells ) * 10));
+  }
+  else
+  {
+    msg.buf[0] = lowByte(uint16_t((settings.StoreVsetpoint * settings.Scells ) * 10));
+    msg.buf[1] = highByte(uint16_t((settings.StoreVsetpoint * settings.Scells ) * 10));
+  }
+  msg.buf[2] = lowByte(chargecurrent);
+  msg.buf[3] = highByte(chargecurrent);
+  msg.buf[4] = lowByte(discurrent );
+  msg.buf[5] = highByte(discurrent);
+  msg.buf[6] = lowByte(uint16_t((settings.DischVsetpoint * settings.Scells) * 10));
+  msg.buf[7] = highByte(uint16_t((settings.DischVsetpoint * settings.Scells) * 10));
+  return true;
+}
 
+bool VEcan355(CAN_message_t &msg) //SOC and SOH
+{
   msg.id  = 0x355;
   msg.len = 8;
   msg.buf[0] = lowByte(SOC);
@@ -1779,31 +1958,26 @@ void VEcan() //communication with Victron system over CAN
   msg.buf[5] = highByte(SOC * 10);
   msg.buf[6] = 0;
   msg.buf[7] = 0;
+  return true;
+}
 
-  if (Can0.write(msg) == 0 && sendCnt < sendbufsize)
-  {
-    msgbuf[sendCnt] = msg;
-    sendCnt++;
-  }
-
+bool VEcan356(CAN_message_t &msg) //pack voltage, current and temperature
+{
   msg.id  = 0x356;
   msg.len = 8;
-  msg.buf[0] = lowByte(uint16_t(bms.getPackVoltage() * 100));
-  msg.buf[1] = highByte(uint16_t(bms.getPackVoltage() * 100));
+  msg.buf[0] = lowByte(uint16_t(snapshot.packVoltageMV / 10));
+  msg.buf[1] = highByte(uint16_t(snapshot.packVoltageMV / 10));
   msg.buf[2] = lowByte(long(currentact / 100));
   msg.buf[3] = highByte(long(currentact / 100));
-  msg.buf[4] = lowByte(int16_t(bms.getAvgTemperature() * 10));
-  msg.buf[5] = highByte(int16_t(bms.getAvgTemperature() * 10));
+  msg.buf[4] = lowByte(int16_t(snapshot.avgTemperature * 10));
+  msg.buf[5] = highByte(int16_t(snapshot.avgTemperature * 10));
   msg.buf[6] = 0;
   msg.buf[7] = 0;
+  return true;
+}
 
-  if (Can0.write(msg) == 0 && sendCnt < sendbufsize)
-  {
-    msgbuf[sendCnt] = msg;
-    sendCnt++;
-  }
-
-  //delay(2);
+bool VEcan35A(CAN_message_t &msg) //alarms and warnings
+{
   msg.id  = 0x35A;
   msg.len = 8;
   msg.buf[0] = alarm[0];//High temp  Low Voltage | High Voltage
@@ -1814,133 +1988,182 @@ void VEcan() //communication with Victron system over CAN
   msg.buf[5] = warning[1];// High Discharge Current | Low Temperature
   msg.buf[6] = warning[2];//Internal Failure | High Charge current
   msg.buf[7] = warning[3];// Cell Imbalance
+  return true;
+}
 
-  if (Can0.write(msg) == 0 && sendCnt < sendbufsize)
+bool VEcan35E(CAN_message_t &msg) //BMS name
+{
+  msg.id  = 0x35E;
+  msg.len = 8;
+  for (byte i = 0; i < 8; i++)
   {
-    msgbuf[sendCnt] = msg;
-    sendCnt++;
+    msg.buf[i] = bmsname[i];
   }
+  return true;
+}
 
-  msg.id  = 0x35E;
+bool VEcan370(CAN_message_t &msg) //BMS manufacturer
+{
+  msg.id  = 0x370;
   msg.len = 8;
-  msg.buf[0] = bmsname[0];
-  msg.buf[1] = bmsname[1];
-  msg.buf[2] = bmsname[2];
-  msg.buf[3] = bmsname[3];
-  msg.buf[4] = bmsname[4];
-  msg.buf[5] = bmsname[5];
-  msg.buf[6] = bmsname[6];
-  msg.buf[7] = bmsname[7];
-
-  if (Can0.write(msg) == 0 && sendCnt < sendbufsize)
+  for (byte i = 0; i < 8; i++)
   {
-    msgbuf[sendCnt] = msg;
-    sendCnt++;
+    msg.buf[i] = bmsmanu[i];
   }
+  return true;
+}
 
-  //delay(2);
-  msg.id  = 0x370;
+bool VEcan372(CAN_message_t &msg) //module count
+{
+  msg.id  = 0x372;
+  msg.len = 8;
+  msg.buf[0] = lowByte(snapshot.numModules);
+  msg.buf[1] = highByte(snapshot.numModules);
+  msg.buf[2] = 0x00;
+  msg.buf[3] = 0x00;
+  msg.buf[4] = 0x00;
+  msg.buf[5] = 0x00;
+  msg.buf[6] = 0x00;
+  msg.buf[7] = 0x00;
+  return true;
+}
+
+bool VEcan373(CAN_message_t &msg) //cell voltage and temperature extremes
+{
+  msg.id  = 0x373;
   msg.len = 8;
-  msg.buf[0] = bmsmanu[0];
-  msg.buf[1] = bmsmanu[1];
-  msg.buf[2] = bmsmanu[2];
-  msg.buf[3] = bmsmanu[3];
-  msg.buf[4] = bmsmanu[4];
-  msg.buf[5] = bmsmanu[5];
-  msg.buf[6] = bmsmanu[6];
-  msg.buf[7] = bmsmanu[7];
+  msg.buf[0] = lowByte(snapshot.lowCellMV);
+  msg.buf[1] = highByte(snapshot.lowCellMV);
+  msg.buf[2] = lowByte(snapshot.highCellMV);
+  msg.buf[3] = highByte(snapshot.highCellMV);
+  msg.buf[4] = lowByte(uint16_t(snapshot.lowTemperature + 273.15));
+  msg.buf[5] = highByte(uint16_t(snapshot.lowTemperature + 273.15));
+  msg.buf[6] = lowByte(uint16_t(snapshot.highTemperature + 273.15));
+  msg.buf[7] = highByte(uint16_t(snapshot.highTemperature + 273.15));
+  return true;
+}
 
+bool VEcan379(CAN_message_t &msg) //Installed capacity
+{
+  msg.id  = 0x379;
+  msg.len = 2;
+  msg.buf[0] = lowByte(uint16_t(settings.Pstrings * settings.CAP));
+  msg.buf[1] = highByte(uint16_t(settings.Pstrings * settings.CAP));
+  return true;
+}
 
-  if (Can0.write(msg) == 0 && sendCnt < sendbufsize)
+bool VEcan378(CAN_message_t &msg) //Lifetime energy in and out
+{
+  HistoryImage &lifetime = history.get();
+  uint32_t energyIn = lifetime.energyIn / 100; //100Wh/unit
+  uint32_t energyOut = lifetime.energyOut / 100;
+  msg.id  = 0x378;
+  msg.len = 8;
+  msg.buf[0] = energyIn;
+  msg.buf[1] = energyIn >> 8;
+  msg.buf[2] = energyIn >> 16;
+  msg.buf[3] = energyIn >> 24;
+  msg.buf[4] = energyOut;
+  msg.buf[5] = energyOut >> 8;
+  msg.buf[6] = energyOut >> 16;
+  msg.buf[7] = energyOut >> 24;
+  return true;
+}
+
+bool linkcan(CAN_message_t &msg) //daisychain link health
+{
+  LinkRollup &pack = bms.getPackLink();
+  int weakest = bms.getWeakestModule();
+  msg.id  = 0x37a;
+  msg.len = 8;
+  msg.buf[0] = pack.health; //%
+  msg.buf[1] = weakest < 0 ? 0xff : weakest;
+  msg.buf[2] = lowByte(pack.rate); //frames/s
+  msg.buf[3] = highByte(pack.rate);
+  for (int chain = 0; chain < 4; chain++)
   {
-    msgbuf[sendCnt] = msg;
-    sendCnt++;
+    msg.buf[4 + chain] = chain < bms.getChains() ? bms.getChainLink(chain).health : 0xff;
   }
+  return true;
+}
 
-  if (balancecells == 1)
+bool scancan(CAN_message_t &msg) //daisychain scan period to the adapter
+{
+  uint16_t period = settings.scanFast;
+  if (bmsstatus == Ready || storagemode == 1)
+  {
+    period = settings.scanSlow;
+  }
+  if (period == 0)
   {
-    if (bms.getLowCellVolt() + settings.balanceHyst < bms.getHighCellVolt())
+    return false;
+  }
+  // Send to every chain when the period changes, then to any chain whose
+  // adapter reports a different one
+  int chain = 0xff;
+  if (period == scanPeriod)
+  {
+    for (chain = 0; chain < bms.getChains(); chain++)
     {
-      msg.id  = 0x4f8;
-      msg.len = 3;
-      msg.buf[0] =  0x00;
-      if (bms.getLowCellVolt() < settings.balanceVoltage)
-      {
-        msg.buf[1] = highByte(uint16_t(settings.balanceVoltage * 65535.0f / 5.0f));
-        msg.buf[2] = lowByte(uint16_t(settings.balanceVoltage * 65535.0f / 5.0f));
-      }
-      else
-      {
-        msg.buf[1] = highByte(uint16_t(bms.getLowCellVolt() * 65535.0f / 5.0f));
-        msg.buf[2] = lowByte(uint16_t(bms.getLowCellVolt() * 65535.0f / 5.0f));
-      }
-      if (Can0.write(msg) == 0 && sendCnt < sendbufsize)
+      if (bms.isAdapterHeard(chain) && bms.getAdapterStatus(chain).period != period)
       {
-        msgbuf[sendCnt] = msg;
-        sendCnt++;
+        break;
       }
-
+    }
+    if (chain == bms.getChains())
+    {
+      return false;
     }
   }
+  msg.id  = 0x4f8;
+  msg.len = 4;
+  msg.buf[0] = ADAPTER_CMD_PERIOD;
+  msg.buf[1] = chain;
+  msg.buf[2] = highByte(period);
+  msg.buf[3] = lowByte(period);
+  return true;
+}
 
-  // delay(2);
-  msg.id  = 0x373;
-  msg.len = 8;
-  msg.buf[0] = lowByte(uint16_t(bms.getLowCellVolt() * 1000));
-  msg.buf[1] = highByte(uint16_t(bms.getLowCellVolt() * 1000));
-  msg.buf[2] = lowByte(uint16_t(bms.getHighCellVolt() * 1000));
-  msg.buf[3] = highByte(uint16_t(bms.getHighCellVolt() * 1000));
-  msg.buf[4] = lowByte(uint16_t(bms.getLowTemperature() + 273.15));
-  msg.buf[5] = highByte(uint16_t(bms.getLowTemperature() + 273.15));
-  msg.buf[6] = lowByte(uint16_t(bms.getHighTemperature() + 273.15));
-  msg.buf[7] = highByte(uint16_t(bms.getHighTemperature() + 273.15));
-
-
-  if (Can0.write(msg) == 0 && sendCnt < sendbufsize)
+void scansent(CAN_message_t &msg) //a scan period command has been queued
+{
+  uint16_t period = (msg.buf[2] << 8) | msg.buf[3];
+  if (period != scanPeriod)
   {
-    msgbuf[sendCnt] = msg;
-    sendCnt++;
+    scanPeriod = period;
+    bms.relearnLinks();
   }
+}
 
-  //delay(2);
-  msg.id  = 0x379; //Installed capacity
-  msg.len = 2;
-  msg.buf[0] = lowByte(uint16_t(settings.Pstrings * settings.CAP));
-  msg.buf[1] = highByte(uint16_t(settings.Pstrings * settings.CAP));
-  /*
-    delay(2);
-    msg.id  = 0x378; //Installed capacity
-    msg.len = 2;
-    //energy in 100wh/unit
-    msg.buf[0] =
-    msg.buf[1] =
-    msg.buf[2] =
-    msg.buf[3] =
-    //energy out 100wh/unit
-    msg.buf[4] =
-    msg.buf[5] =
-    msg.buf[6] =
-    msg.buf[7] =
-  */
-
-  //delay(2);
-  msg.id  = 0x372;
-  msg.len = 8;
-  msg.buf[0] = lowByte(bms.getNumModules());
-  msg.buf[1] = highByte(bms.getNumModules());
-  msg.buf[2] = 0x00;
-  msg.buf[3] = 0x00;
-  msg.buf[4] = 0x00;
-  msg.buf[5] = 0x00;
-  msg.buf[6] = 0x00;
-  msg.buf[7] = 0x00;
-
-
-  if (Can0.write(msg) == 0 && sendCnt < sendbufsize)
+bool balancecan(CAN_message_t &msg) //balance target to the daisychain adapter
+{
+  if (settings.moduleBalance == 1 || balancecells != 1 || snapshot.lowCellVolt + settings.balanceHyst >= snapshot.highCellVolt)
+  {
+    return false;
+  }
+  msg.id  = 0x4f8;
+  msg.len = 3;
+  msg.buf[0] = ADAPTER_CMD_BALANCE;
+  if (snapshot.lowCellVolt < settings.balanceVoltage)
   {
-    msgbuf[sendCnt] = msg;
-    sendCnt++;
+    msg.buf[1] = highByte(uint16_t(settings.balanceVoltage * 65535.0f / 5.0f));
+    msg.buf[2] = lowByte(uint16_t(settings.balanceVoltage * 65535.0f / 5.0f));
   }
+  else
+  {
+    msg.buf[1] = highByte(snapshot.lowCellRaw);
+    msg.buf[2] = lowByte(snapshot.lowCellRaw);
+  }
+  return true;
+}
+
+bool modulebalancecan(CAN_message_t &msg) //module balance targets to the daisychain adapter, see balancetask()
+{
+  return planner.nextCommand(msg);
+}
+
+void modulebalancesent(CAN_message_t &msg) //a module balance target has been queued
+{
+  planner.commandSent(msg);
 }
 
 // Settings menu
@@ -1955,7 +2178,25 @@ void menu()
 
       case '1':
         menuload = 1;
+        if (candebug == 0 && (recorder.isFrozen() || recorder.isDumping() || !canCapture.drained()))
+        {
+          //The capture would overwrite the flight recorder's ring
+          SERIALCONSOLE.println();
+          SERIALCONSOLE.println("Flight recorder holds a trip or is busy, dump it with g or restart it with h first");
+          incomingByte = 'd';
+          break;
+        }
         candebug = !candebug;
+        setupCanRoutes(); // open the filters wide while debugging
+        if (candebug == 1)
+        {
+          recorder.suspend();
+          canCapture.start();
+        }
+        else
+        {
+          canCapture.stop();
+        }
         incomingByte = 'd';
         break;
 
@@ -2028,6 +2269,91 @@ void menu()
         incomingByte = 'd';
         break;
 
+      case 'l':
+        canSchedule.printLoad(500000);
+        break;
+
+      case 'p':
+        Profiler::print();
+        Profiler::reset();
+        break;
+
+      case 'k':
+        tasks.printStats();
+        tasks.resetStats();
+        break;
+
+      case 'f':
+        recorder.printStatus(SERIALCONSOLE);
+        break;
+
+      case 'g':
+        recorder.startDump();
+        break;
+
+      case 'h':
+        recorder.rearm();
+        recorder.printStatus(SERIALCONSOLE);
+        break;
+
+      case 'n':
+        bms.printLinkStats(SERIALCONSOLE);
+        bms.resetLinks();
+        break;
+
+      case 'b':
+        planner.printStatus(SERIALCONSOLE);
+        break;
+
+      case 't':
+        menuload = 1;
+        if (telemetry.isActive())
+        {
+          telemetry.stop();
+        }
+        else
+        {
+          telemetry.start(millis());
+        }
+        incomingByte = 'd';
+        break;
+
+      case 'u':
+        menuload = 1;
+        if (Serial.available() > 0)
+        {
+          telemetry.setPeriod(TELEM_PACK, Serial.parseInt());
+        }
+        incomingByte = 'd';
+        break;
+
+      case 'v':
+        menuload = 1;
+        if (Serial.available() > 0)
+        {
+          telemetry.setPeriod(TELEM_CELLS, Serial.parseInt());
+        }
+        incomingByte = 'd';
+        break;
+
+      case 'w':
+        menuload = 1;
+        if (Serial.available() > 0)
+        {
+          telemetry.setPeriod(TELEM_TEMPS, Serial.parseInt());
+        }
+        incomingByte = 'd';
+        break;
+
+      case 'x':
+        menuload = 1;
+        if (Serial.available() > 0)
+        {
+          telemetry.setPeriod(TELEM_BALANCE, Serial.parseInt());
+        }
+        incomingByte = 'd';
+        break;
+
       case 113: //q for quite menu
 
         menuload = 0;
@@ -2140,6 +2466,7 @@ void menu()
         {
           settings.cursens = 0;
         }
+        setupCanRoutes();
         /*
           if (settings.cursens == Analoguedual)
           {
@@ -2165,6 +2492,7 @@ void menu()
         if (settings.curcan > CurCanMax) {
           settings.curcan = 1;
         }
+        setupCanRoutes();
         menuload = 1;
         incomingByte = 'c';
         break;
@@ -2291,6 +2619,7 @@ void menu()
         if (Serial.available() > 0)
         {
           settings.chargerspd = Serial.parseInt();
+          setupCanSchedule();
           menuload = 1;
           incomingByte = 'e';
         }
@@ -2461,74 +2790,129 @@ void menu()
         }
         break;
 
-      case 'h':
+      case 'h':
+        if (Serial.available() > 0)
+        {
+          settings.DisTaper = Serial.parseInt();
+          settings.DisTaper = settings.DisTaper / 1000;
+          menuload = 1;
+          incomingByte = 'b';
+        }
+        break;
+
+
+      case 'b':
+        if (Serial.available() > 0)
+        {
+          settings.socvolt[0] = Serial.parseInt();
+          menuload = 1;
+          incomingByte = 'b';
+        }
+        break;
+
+
+      case 'c':
+        if (Serial.available() > 0)
+        {
+          settings.socvolt[1] = Serial.parseInt();
+          menuload = 1;
+          incomingByte = 'b';
+        }
+        break;
+
+      case 'd':
+        if (Serial.available() > 0)
+        {
+          settings.socvolt[2] = Serial.parseInt();
+          menuload = 1;
+          incomingByte = 'b';
+        }
+        break;
+
+      case 'e':
+        if (Serial.available() > 0)
+        {
+          settings.socvolt[3] = Serial.parseInt();
+          menuload = 1;
+          incomingByte = 'b';
+        }
+        break;
+
+      case '9': //Discharge Voltage Setpoint
         if (Serial.available() > 0)
         {
-          settings.DisTaper = Serial.parseInt();
-          settings.DisTaper = settings.DisTaper / 1000;
+          settings.DischVsetpoint = Serial.parseInt();
+          settings.DischVsetpoint = settings.DischVsetpoint / 1000;
           menuload = 1;
           incomingByte = 'b';
         }
         break;
 
-
-      case 'b':
+      case 'k': //Discharge Voltage hysteresis
         if (Serial.available() > 0)
         {
-          settings.socvolt[0] = Serial.parseInt();
+          settings.DischHys = Serial.parseInt();
+          settings.DischHys  = settings.DischHys  / 1000;
           menuload = 1;
           incomingByte = 'b';
         }
         break;
 
-
-      case 'c':
+      case 'l': //Daisychains installed
         if (Serial.available() > 0)
         {
-          settings.socvolt[1] = Serial.parseInt();
+          settings.chains = constrain(Serial.parseInt(), 1, (MAX_MODULE_ADDR + 1) / 16);
           menuload = 1;
           incomingByte = 'b';
         }
         break;
 
-      case 'd':
+      case 'm': //Modules per daisychain
         if (Serial.available() > 0)
         {
-          settings.socvolt[2] = Serial.parseInt();
+          settings.chainModules = constrain(Serial.parseInt(), 1, 16);
           menuload = 1;
           incomingByte = 'b';
         }
         break;
 
-      case 'e':
+      case 'n': //Cells per module
         if (Serial.available() > 0)
         {
-          settings.socvolt[3] = Serial.parseInt();
+          settings.moduleCells = constrain(Serial.parseInt(), 1, 16);
           menuload = 1;
           incomingByte = 'b';
         }
         break;
 
-      case '9': //Discharge Voltage Setpoint
+      case 'o': //Fast scan period
         if (Serial.available() > 0)
         {
-          settings.DischVsetpoint = Serial.parseInt();
-          settings.DischVsetpoint = settings.DischVsetpoint / 1000;
+          settings.scanFast = Serial.parseInt();
+          if (settings.scanFast != 0)
+          {
+            settings.scanFast = constrain(settings.scanFast, 50, 2000);
+          }
           menuload = 1;
           incomingByte = 'b';
         }
         break;
 
-      case 'k': //Discharge Voltage hysteresis
+      case 'p': //Slow scan period
         if (Serial.available() > 0)
         {
-          settings.DischHys = Serial.parseInt();
-          settings.DischHys  = settings.DischHys  / 1000;
+          settings.scanSlow = constrain(Serial.parseInt(), 50, 2000);
           menuload = 1;
           incomingByte = 'b';
         }
         break;
 
+      case 's': //Per module balance targets
+        settings.moduleBalance = !settings.moduleBalance;
+        menuload = 1;
+        incomingByte = 'b';
+        break;
+
 
       case '0': //c Pstrings
         if (Serial.available() > 0)
@@ -2631,6 +3015,8 @@ void menu()
     switch (incomingByte)
     {
       case 'R'://restart
+        settingsStore.flush();
+        history.flush();
         CPU_REBOOT ;
         break;
       case 'x': //Expansion Settings
@@ -2810,7 +3196,9 @@ void menu()
         break;
 
       case 113: //q to go back to main menu
-        EEPROM.put(0, settings); //save all change to eeprom
+        settingsStore.save(); //changes are written in the background by storetask()
+        bms.setTopology(settings.chains, settings.chainModules, settings.moduleCells);
+        updateTempThresholds();
         menuload = 0;
         debug = 1;
         break;
@@ -2825,7 +3213,7 @@ void menu()
         SERIALCONSOLE.println();
         SERIALCONSOLE.println("Debug Settings Menu");
         SERIALCONSOLE.println("Toggle on/off");
-        SERIALCONSOLE.print("1 - Can Debug :");
+        SERIALCONSOLE.print("1 - Can Capture (binary) :");
         SERIALCONSOLE.println(candebug);
         SERIALCONSOLE.print("2 - Current Debug :");
         SERIALCONSOLE.println(debugCur);
@@ -2845,6 +3233,65 @@ void menu()
         SERIALCONSOLE.println(debugdigits);
         SERIALCONSOLE.print("0 - Show Balancing Status :");
         SERIALCONSOLE.println(showbal);
+        SERIALCONSOLE.println("l - Show CAN Transmit Schedule and Bus Load");
+        SERIALCONSOLE.println("p - Show and Reset Loop Profile");
+        SERIALCONSOLE.println("k - Show and Reset Task Timing");
+        SERIALCONSOLE.println("f - Show Flight Recorder");
+        SERIALCONSOLE.println("g - Dump Flight Recorder (binary)");
+        SERIALCONSOLE.println("h - Restart Flight Recorder after a trip");
+        SERIALCONSOLE.println("n - Show and Reset Daisychain Link Stats");
+        SERIALCONSOLE.println("b - Show Balancing Plan");
+        SERIALCONSOLE.print("t - Binary Telemetry :");
+        SERIALCONSOLE.println(telemetry.isActive());
+        SERIALCONSOLE.print("u - Telemetry Pack Period (ms, 0 off) :");
+        SERIALCONSOLE.println(telemetry.getPeriod(TELEM_PACK));
+        SERIALCONSOLE.print("v - Telemetry Cells Period :");
+        SERIALCONSOLE.println(telemetry.getPeriod(TELEM_CELLS));
+        SERIALCONSOLE.print("w - Telemetry Temperatures Period :");
+        SERIALCONSOLE.println(telemetry.getPeriod(TELEM_TEMPS));
+        SERIALCONSOLE.print("x - Telemetry Balancing Period :");
+        SERIALCONSOLE.println(telemetry.getPeriod(TELEM_BALANCE));
+        SERIALCONSOLE.print("CAN Rx Queue Peak :");
+        SERIALCONSOLE.print(canRx.getHighWater());
+        SERIALCONSOLE.print(" Dropped :");
+        SERIALCONSOLE.println(canRx.getOverflows());
+        SERIALCONSOLE.print("CAN Capture Dropped :");
+        SERIALCONSOLE.println(canCapture.getOverflows());
+        SERIALCONSOLE.print("Current Blocks Overrun :");
+        SERIALCONSOLE.println(currentSampler.getOverruns());
+        SERIALCONSOLE.print("Settings Bank :");
+        SERIALCONSOLE.print(settingsStore.getBank());
+        SERIALCONSOLE.print(" Used :");
+        SERIALCONSOLE.print(settingsStore.getUsed());
+        SERIALCONSOLE.print(" Records :");
+        SERIALCONSOLE.print(settingsStore.getRecords());
+        SERIALCONSOLE.print(" Compactions :");
+        SERIALCONSOLE.println(settingsStore.getCompactions());
+        SERIALCONSOLE.print("History In :");
+        SERIALCONSOLE.print(history.get().energyIn);
+        SERIALCONSOLE.print("Wh ");
+        SERIALCONSOLE.print(history.get().chargeIn);
+        SERIALCONSOLE.print("Ah Out :");
+        SERIALCONSOLE.print(history.get().energyOut);
+        SERIALCONSOLE.print("Wh ");
+        SERIALCONSOLE.print(history.get().chargeOut);
+        SERIALCONSOLE.print("Ah Cycles :");
+        SERIALCONSOLE.println(history.get().cycles);
+        SERIALCONSOLE.print("Console Reports Skipped :");
+        SERIALCONSOLE.println(reportsSkipped);
+        SERIALCONSOLE.print("Telemetry Frames :");
+        SERIALCONSOLE.print(telemetry.getFrames());
+        SERIALCONSOLE.print(" Late :");
+        SERIALCONSOLE.println(telemetry.getOverruns());
+        SERIALCONSOLE.print("CAN Tx Queue Dropped :");
+        SERIALCONSOLE.print(canTx.getDrops());
+        SERIALCONSOLE.print(" Replaced :");
+        SERIALCONSOLE.print(canTx.getCoalesced());
+        SERIALCONSOLE.print(" Latency :");
+        SERIALCONSOLE.print(canTx.getAvgLatency());
+        SERIALCONSOLE.print("us avg ");
+        SERIALCONSOLE.print(canTx.getMaxLatency());
+        SERIALCONSOLE.println("us max");
 
         SERIALCONSOLE.println("q - Go back to menu");
         menuload = 4;
@@ -3021,6 +3468,26 @@ void menu()
         SERIALCONSOLE.print(settings.DischHys * 1000, 0);
         SERIALCONSOLE.print("mV");
         SERIALCONSOLE.println("  ");
+        SERIALCONSOLE.print("l - Daisychains: ");
+        SERIALCONSOLE.print(settings.chains);
+        SERIALCONSOLE.println("  ");
+        SERIALCONSOLE.print("m - Modules per Daisychain: ");
+        SERIALCONSOLE.print(settings.chainModules);
+        SERIALCONSOLE.println("  ");
+        SERIALCONSOLE.print("n - Cells per Module: ");
+        SERIALCONSOLE.print(settings.moduleCells);
+        SERIALCONSOLE.println("  ");
+        SERIALCONSOLE.print("o - Daisychain Scan Period (0 adapter default): ");
+        SERIALCONSOLE.print(settings.scanFast);
+        SERIALCONSOLE.print("ms");
+        SERIALCONSOLE.println("  ");
+        SERIALCONSOLE.print("p - Daisychain Scan Period when Ready or Storing: ");
+        SERIALCONSOLE.print(settings.scanSlow);
+        SERIALCONSOLE.print("ms");
+        SERIALCONSOLE.println("  ");
+        SERIALCONSOLE.print("s - Per Module Balance Targets (adapter must support): ");
+        SERIALCONSOLE.print(settings.moduleBalance);
+        SERIALCONSOLE.println("  ");
         SERIALCONSOLE.println();
         menuload = 3;
         break;
@@ -3053,111 +3520,97 @@ void menu()
   }
 }
 
-void canread()
+// Apply the charger message speed to the transmit table and restart it
+void setupCanSchedule()
 {
-  Can0.read(inMsg);
-  // Read data: len = data length, buf = data byte(s)
-  if ( settings.cursens == Canbus)
+  canTable[CANTABLE_CHARGER1].period = settings.chargerspd;
+  canTable[CANTABLE_CHARGER2].period = settings.chargerspd;
+  canTable[CANTABLE_CHARGER2].phase = settings.chargerspd / 2;
+  canSchedule.begin(millis());
+}
+
+// Register the CAN frames each subsystem consumes and program the
+// hardware filters to match. Called whenever the sensor settings change.
+void setupCanRoutes()
+{
+  canDispatch.clear();
+  canDispatch.add(0x4f0, 0x7fc, false, BMScan); // daisychains 0x4f0-0x4f3
+  if (settings.cursens == Canbus)
   {
-    if (settings.curcan == 1)
+    if (settings.curcan == LemCAB300)
     {
-      switch (inMsg.id)
-      {
-        case 0x3c1:
-          CAB500();
-          break;
-
-        case 0x3c2:
-          CAB300();
-          break;
-
-        default:
-          break;
-      }
+      canDispatch.add(0x3c1, 0x7ff, false, CAB500);
+      canDispatch.add(0x3c2, 0x7ff, false, CAB300);
     }
-    if (settings.curcan == 2)
+    if (settings.curcan == LemCAB500)
     {
-      switch (inMsg.id)
-      {
-        case 0x3c1:
-          CAB500();
-          break;
-
-        case 0x3c2:
-          CAB500();
-          break;
-
-        default:
-          break;
-      }
+      canDispatch.add(0x3c1, 0x7ff, false, CAB500);
+      canDispatch.add(0x3c2, 0x7ff, false, CAB500);
     }
-    if (settings.curcan == 3)
+    if (settings.curcan == IsaScale)
     {
-      switch (inMsg.id)
-      {
-        case 0x521: //
-          CANmilliamps = inMsg.buf[5] + (inMsg.buf[4] << 8) + (inMsg.buf[3] << 16) + (inMsg.buf[2] << 24);
-          if ( settings.cursens == Canbus)
-          {
-            RawCur = CANmilliamps;
-            getcurrent();
-          }
-          break;
-        case 0x522: //
-          voltage1 = inMsg.buf[5] + (inMsg.buf[4] << 8) + (inMsg.buf[3] << 16) + (inMsg.buf[2] << 24);
-          break;
-        case 0x523: //
-          voltage2 = inMsg.buf[5] + (inMsg.buf[4] << 8) + (inMsg.buf[3] << 16) + (inMsg.buf[2] << 24);
-          break;
-        default:
-          break;
-      }
+      canDispatch.add(0x520, 0x7fc, false, ISAcan); // 0x521-0x523
     }
   }
-  if (settings.curcan == 4)
+  if (settings.curcan == VictronLynx)
   {
-    if (pgnFromCANId(inMsg.id) == 0x1F214 && inMsg.buf[0] == 0) // Check PGN and only use the first packet of each sequence
-    {
-      handleVictronLynx();
-    }
+    canDispatch.add(0x11F21400, 0x13FFFF00, true, handleVictronLynx); // PGN 0x1F214, any source
   }
-  if ((inMsg.id & 0xFFFFFFFC) == 0x4f0)
+  canDispatch.setFilters(candebug == 1);
+}
+
+// Process the frames waiting in the receive ring. Only the frames present
+// on entry are taken, so a busy bus can't hold the loop here.
+void canread()
+{
+  PROFILE_SCOPE(PROF_CANREAD);
+  int pending = canRx.available();
+  while (pending-- > 0 && canRx.read(inMsg, inMsgTime))
   {
-    bms.decodecan(inMsg);
+    canframe();
   }
+}
 
-  if (debug == 1)
-  {
-    if (candebug == 1)
-    {
-      Serial.print(millis());
-      if ((inMsg.id & 0x80000000) == 0x80000000)    // Determine if ID is standard (11 bits) or extended (29 bits)
-        sprintf(msgString, "Extended ID: 0x%.8lX  DLC: %1d  Data:", (inMsg.id & 0x1FFFFFFF), inMsg.len);
-      else
-        sprintf(msgString, ",0x%.3lX,false,%1d", inMsg.id, inMsg.len);
+void canframe()
+{
+  // Read data: len = data length, buf = data byte(s)
+  canDispatch.dispatch(inMsg);
+}
 
-      Serial.print(msgString);
+void BMScan(CAN_message_t &msg)
+{
+  bms.decodecan(msg);
+}
 
-      if ((inMsg.id & 0x40000000) == 0x40000000) {  // Determine if message is a remote request frame.
-        sprintf(msgString, " REMOTE REQUEST FRAME");
-        Serial.print(msgString);
-      } else {
-        for (byte i = 0; i < inMsg.len; i++) {
-          sprintf(msgString, ", 0x%.2X", inMsg.buf[i]);
-          Serial.print(msgString);
-        }
+void ISAcan(CAN_message_t &msg)
+{
+  switch (msg.id)
+  {
+    case 0x521: //
+      CANmilliamps = msg.buf[5] + (msg.buf[4] << 8) + (msg.buf[3] << 16) + (msg.buf[2] << 24);
+      if ( settings.cursens == Canbus)
+      {
+        RawCur = CANmilliamps;
+        currenttime = inMsgTime;
+        getcurrent();
       }
-
-      Serial.println();
-    }
+      break;
+    case 0x522: //
+      voltage1 = msg.buf[5] + (msg.buf[4] << 8) + (msg.buf[3] << 16) + (msg.buf[2] << 24);
+      break;
+    case 0x523: //
+      voltage2 = msg.buf[5] + (msg.buf[4] << 8) + (msg.buf[3] << 16) + (msg.buf[2] << 24);
+      break;
+    default:
+      break;
   }
 }
 
-void CAB300()
+void CAB300(CAN_message_t &msg)
 {
   for (int i = 0; i < 4; i++)
   {
-    inbox = (inbox << 8) | inMsg.buf[i];
+    inbox = (inbox << 8) | msg.buf[i];
   }
   CANmilliamps = inbox;
   if (CANmilliamps > 0x80000000)
@@ -3171,29 +3624,19 @@ void CAB300()
   if (settings.cursens == Canbus)
   {
     RawCur = CANmilliamps;
+    currenttime = inMsgTime;
     getcurrent();
   }
-  if (candebug == 1)
-  {
-    Serial.println();
-    Serial.print(CANmilliamps);
-    Serial.print("mA ");
-  }
 }
 
-void CAB500()
+void CAB500(CAN_message_t &msg)
 {
   inbox = 0;
   for (int i = 1; i < 4; i++)
   {
-    inbox = (inbox << 8) | inMsg.buf[i];
+    inbox = (inbox << 8) | msg.buf[i];
   }
   CANmilliamps = inbox;
-  if (candebug == 1)
-  {
-    Serial.println();
-    Serial.print(CANmilliamps, HEX);
-  }
   if (CANmilliamps > 0x800000)
   {
     CANmilliamps -= 0x800000;
@@ -3205,23 +3648,20 @@ void CAB500()
   if ( settings.cursens == Canbus)
   {
     RawCur = CANmilliamps;
+    currenttime = inMsgTime;
     getcurrent();
   }
-  if (candebug == 1)
-  {
-    Serial.println();
-    Serial.print(CANmilliamps);
-    Serial.print("mA ");
-  }
 }
 
 
-void currentlimit()
+// Work out the charge and discharge current limits, in 0.1A, from the
+// pack snapshot, the BMS status and whether storage mode is on
+void currentlimit(const PackSnapshot &pack, int status, int storage, int16_t &charge, int16_t &discharge)
 {
-  if (bmsstatus == Error)
+  if (status == Error)
   {
-    discurrent = 0;
-    chargecurrent = 0;
+    discharge = 0;
+    charge = 0;
   }
   /*
     settings.PulseCh = 600; //Peak Charge current in 0.1A
@@ -3233,76 +3673,76 @@ void currentlimit()
   {
 
     ///Start at no derating///
-    discurrent = settings.discurrentmax;
-    chargecurrent = settings.chargecurrentmax;
+    discharge = settings.discurrentmax;
+    charge = settings.chargecurrentmax;
 
 
     ///////All hard limits to into zeros
-    if (bms.getLowTemperature() < settings.UnderTSetpoint)
+    if (pack.lowTemperature < settings.UnderTSetpoint)
     {
-      //discurrent = 0; Request Daniel
-      chargecurrent = settings.chargecurrentcold;
+      //discharge = 0; Request Daniel
+      charge = settings.chargecurrentcold;
     }
-    if (bms.getHighTemperature() > settings.OverTSetpoint)
+    if (pack.highTemperature > settings.OverTSetpoint)
     {
-      discurrent = 0;
-      chargecurrent = 0;
+      discharge = 0;
+      charge = 0;
     }
-    if (bms.getHighCellVolt() > settings.OverVSetpoint)
+    if (pack.highCellVolt > settings.OverVSetpoint)
     {
-      chargecurrent = 0;
+      charge = 0;
     }
-    if (bms.getHighCellVolt() > settings.OverVSetpoint)
+    if (pack.highCellVolt > settings.OverVSetpoint)
     {
-      chargecurrent = 0;
+      charge = 0;
     }
-    if (bms.getLowCellVolt() < settings.UnderVSetpoint || bms.getLowCellVolt() < settings.DischVsetpoint)
+    if (pack.lowCellVolt < settings.UnderVSetpoint || pack.lowCellVolt < settings.DischVsetpoint)
     {
-      discurrent = 0;
+      discharge = 0;
     }
 
 
     //Modifying discharge current///
 
-    if (discurrent > 0)
+    if (discharge > 0)
     {
       //Temperature based///
 
-      if (bms.getHighTemperature() > settings.DisTSetpoint)
+      if (pack.highTemperature > settings.DisTSetpoint)
       {
-        discurrent = discurrent - map(bms.getHighTemperature(), settings.DisTSetpoint, settings.OverTSetpoint, 0, settings.discurrentmax);
+        discharge = discharge - map(pack.highTemperature, settings.DisTSetpoint, settings.OverTSetpoint, 0, settings.discurrentmax);
       }
       //Voltagee based///
-      if (bms.getLowCellVolt() < (settings.DischVsetpoint + settings.DisTaper))
+      if (pack.lowCellVolt < (settings.DischVsetpoint + settings.DisTaper))
       {
-        discurrent = discurrent - map(bms.getLowCellVolt(), settings.DischVsetpoint, (settings.DischVsetpoint + settings.DisTaper), settings.discurrentmax, 0);
+        discharge = discharge - map(pack.lowCellVolt, settings.DischVsetpoint, (settings.DischVsetpoint + settings.DisTaper), settings.discurrentmax, 0);
       }
 
     }
 
     //Modifying Charge current///
-    if (chargecurrent > settings.chargecurrentcold)
+    if (charge > settings.chargecurrentcold)
     {
       //Temperature based///
-      if (bms.getLowTemperature() < settings.ChargeTSetpoint)
+      if (pack.lowTemperature < settings.ChargeTSetpoint)
       {
 
-        chargecurrent = chargecurrent - map(bms.getLowTemperature(), settings.UnderTSetpoint, settings.ChargeTSetpoint, (settings.chargecurrentmax - settings.chargecurrentcold), 0);
+        charge = charge - map(pack.lowTemperature, settings.UnderTSetpoint, settings.ChargeTSetpoint, (settings.chargecurrentmax - settings.chargecurrentcold), 0);
 
       }
       //Voltagee based///
-      if (storagemode == 1)
+      if (storage == 1)
       {
-        if (bms.getHighCellVolt() > (settings.StoreVsetpoint - settings.ChargeHys))
+        if (pack.highCellVolt > (settings.StoreVsetpoint - settings.ChargeHys))
         {
-          chargecurrent = chargecurrent - map(bms.getHighCellVolt(), (settings.StoreVsetpoint - settings.ChargeHys), settings.StoreVsetpoint, settings.chargecurrentend, settings.chargecurrentmax);
+          charge = charge - map(pack.highCellVolt, (settings.StoreVsetpoint - settings.ChargeHys), settings.StoreVsetpoint, settings.chargecurrentend, settings.chargecurrentmax);
         }
       }
       else
       {
-        if (bms.getHighCellVolt() > (settings.ChargeVsetpoint - settings.ChargeHys))
+        if (pack.highCellVolt > (settings.ChargeVsetpoint - settings.ChargeHys))
         {
-          chargecurrent = chargecurrent - map(bms.getHighCellVolt(), (settings.ChargeVsetpoint - settings.ChargeHys), settings.ChargeVsetpoint, 0, (settings.chargecurrentmax - settings.chargecurrentend));
+          charge = charge - map(pack.highCellVolt, (settings.ChargeVsetpoint - settings.ChargeHys), settings.ChargeVsetpoint, 0, (settings.chargecurrentmax - settings.chargecurrentend));
         }
       }
     }
@@ -3310,54 +3750,54 @@ void currentlimit()
   }
   ///No negative currents///
 
-  if (discurrent < 0)
+  if (discharge < 0)
   {
-    discurrent = 0;
+    discharge = 0;
   }
-  if (chargecurrent < 0)
+  if (charge < 0)
   {
-    chargecurrent = 0;
+    charge = 0;
   }
 }
 
 
 void inputdebug()
 {
-  Serial.println();
-  Serial.print("Input: ");
+  consoleText.println();
+  consoleText.print("Input: ");
   if (digitalRead(IN1))
   {
-    Serial.print("1 ON  ");
+    consoleText.print("1 ON  ");
   }
   else
   {
-    Serial.print("1 OFF ");
+    consoleText.print("1 OFF ");
   }
   if (digitalRead(IN3))
   {
-    Serial.print("2 ON  ");
+    consoleText.print("2 ON  ");
   }
   else
   {
-    Serial.print("2 OFF ");
+    consoleText.print("2 OFF ");
   }
   if (digitalRead(IN3))
   {
-    Serial.print("3 ON  ");
+    consoleText.print("3 ON  ");
   }
   else
   {
-    Serial.print("3 OFF ");
+    consoleText.print("3 OFF ");
   }
   if (digitalRead(IN4))
   {
-    Serial.print("4 ON  ");
+    consoleText.print("4 ON  ");
   }
   else
   {
-    Serial.print("4 OFF ");
+    consoleText.print("4 OFF ");
   }
-  Serial.println();
+  consoleText.println();
 }
 
 void outputdebug()
@@ -3411,7 +3851,7 @@ void pwmcomms()
     Serial.print(" OUT8 ");
   */
 
-  if (bms.getLowCellVolt() < settings.UnderVSetpoint)
+  if (snapshot.lowCellVolt < settings.UnderVSetpoint)
   {
     analogWrite(OUT7, 255); //12V to 10V converter 1.5V
   }
@@ -3427,19 +3867,20 @@ void pwmcomms()
   */
 }
 
+// Update the dashboard values. They are sent from loop() by dash.service().
 void dashupdate()
 {
-  Serial2.write("stat.txt=");
-  Serial2.write(0x22);
+  PROFILE_SCOPE(PROF_DASH);
+  const char *stat = "";
   if (settings.ESSmode == 1)
   {
     switch (bmsstatus)
     {
       case (Boot):
-        Serial2.print(" Active ");
+        stat = " Active ";
         break;
       case (Error):
-        Serial2.print(" Error ");
+        stat = " Error ";
         break;
     }
   }
@@ -3448,93 +3889,54 @@ void dashupdate()
     switch (bmsstatus)
     {
       case (Boot):
-        Serial2.print(" Boot ");
+        stat = " Boot ";
         break;
 
       case (Ready):
-        Serial2.print(" Ready ");
+        stat = " Ready ";
         break;
 
       case (Precharge):
-        Serial2.print(" Precharge ");
+        stat = " Precharge ";
         break;
 
       case (Drive):
-        Serial2.print(" Drive ");
+        stat = " Drive ";
         break;
 
       case (Charge):
-        Serial2.print(" Charge ");
+        stat = " Charge ";
         break;
 
       case (Error):
-        Serial2.print(" Error ");
-        break;
-    }
-  }
-  Serial2.write(0x22);
-  Serial2.write(0xff);  // We always have to send this three lines after each command sent to the nextion display.
-  Serial2.write(0xff);
-  Serial2.write(0xff);
-  Serial2.print("soc.val=");
-  Serial2.print(SOC);
-  Serial2.write(0xff);  // We always have to send this three lines after each command sent to the nextion display.
-  Serial2.write(0xff);
-  Serial2.write(0xff);
-  Serial2.print("soc1.val=");
-  Serial2.print(SOC);
-  Serial2.write(0xff);  // We always have to send this three lines after each command sent to the nextion display.
-  Serial2.write(0xff);
-  Serial2.write(0xff);
-  Serial2.print("current.val=");
-  Serial2.print(currentact / 100, 0);
-  Serial2.write(0xff);  // We always have to send this three lines after each command sent to the nextion display.
-  Serial2.write(0xff);
-  Serial2.write(0xff);
-  Serial2.print("temp.val=");
-  Serial2.print(bms.getAvgTemperature(), 0);
-  Serial2.write(0xff);  // We always have to send this three lines after each command sent to the nextion display.
-  Serial2.write(0xff);
-  Serial2.write(0xff);
-  Serial2.print("templow.val=");
-  Serial2.print(bms.getLowTemperature(), 0);
-  Serial2.write(0xff);  // We always have to send this three lines after each command sent to the nextion display.
-  Serial2.write(0xff);
-  Serial2.write(0xff);
-  Serial2.print("temphigh.val=");
-  Serial2.print(bms.getHighTemperature(), 0);
-  Serial2.write(0xff);  // We always have to send this three lines after each command sent to the nextion display.
-  Serial2.write(0xff);
-  Serial2.write(0xff);
-  Serial2.print("volt.val=");
-  Serial2.print(bms.getPackVoltage() * 10, 0);
-  Serial2.write(0xff);  // We always have to send this three lines after each command sent to the nextion display.
-  Serial2.write(0xff);
-  Serial2.write(0xff);
-  Serial2.print("lowcell.val=");
-  Serial2.print(bms.getLowCellVolt() * 1000, 0);
-  Serial2.write(0xff);  // We always have to send this three lines after each command sent to the nextion display.
-  Serial2.write(0xff);
-  Serial2.write(0xff);
-  Serial2.print("highcell.val=");
-  Serial2.print(bms.getHighCellVolt() * 1000, 0);
-  Serial2.write(0xff);  // We always have to send this three lines after each command sent to the nextion display.
-  Serial2.write(0xff);
-  Serial2.write(0xff);
-  Serial2.print("firm.val=");
-  Serial2.print(firmver);
-  Serial2.write(0xff);  // We always have to send this three lines after each command sent to the nextion display.
-  Serial2.write(0xff);
-  Serial2.write(0xff);
-  Serial2.print("celldelta.val=");
-  Serial2.print((bms.getHighCellVolt() - bms.getLowCellVolt()) * 1000, 0);
-  Serial2.write(0xff);  // We always have to send this three lines after each command sent to the nextion display.
-  Serial2.write(0xff);
-  Serial2.write(0xff);
-}
-
-void chargercomms()
+        stat = " Error ";
+        break;
+    }
+  }
+  uint16_t lowCell = snapshot.lowCellMV;
+  uint16_t highCell = snapshot.highCellMV;
+  dash.setText(DASH_STAT, stat);
+  dash.set(DASH_SOC, SOC);
+  dash.set(DASH_SOC1, SOC);
+  dash.set(DASH_CURRENT, lroundf(currentact / 100));
+  dash.set(DASH_TEMP, lroundf(snapshot.avgTemperature));
+  dash.set(DASH_TEMPLOW, lroundf(snapshot.lowTemperature));
+  dash.set(DASH_TEMPHIGH, lroundf(snapshot.highTemperature));
+  dash.set(DASH_VOLT, (snapshot.packVoltageMV + 50) / 100);
+  dash.set(DASH_LOWCELL, lowCell);
+  dash.set(DASH_HIGHCELL, highCell);
+  dash.set(DASH_FIRM, firmver);
+  dash.set(DASH_CELLDELTA, highCell - lowCell);
+}
+
+// Charger control frames, sent every settings.chargerspd while charging or
+// always in ESS mode. Chargers needing two frames use chargerframe2().
+bool chargerframe1(CAN_message_t &msg)
 {
+  if (settings.ESSmode != 1 && bmsstatus != Charge)
+  {
+    return false;
+  }
   if (settings.chargertype == Elcon)
   {
     msg.id  =  0x1806E5F4; //broadcast to all Elteks
@@ -3549,12 +3951,7 @@ void chargercomms()
     msg.buf[6] = 0x00;
     msg.buf[7] = 0x00;
 
-    if (Can0.write(msg) == 0 && sendCnt < sendbufsize)
-    {
-      msgbuf[sendCnt] = msg;
-      sendCnt++;
-    }
-    msg.ext = 0;
+    return true;
   }
 
   if (settings.chargertype == Eltek)
@@ -3569,11 +3966,7 @@ void chargercomms()
     msg.buf[5] = lowByte(chargecurrent / ncharger);
     msg.buf[6] = highByte(chargecurrent / ncharger);
 
-    if (Can0.write(msg) == 0 && sendCnt < sendbufsize)
-    {
-      msgbuf[sendCnt] = msg;
-      sendCnt++;
-    }
+    return true;
   }
   if (settings.chargertype == BrusaNLG5)
   {
@@ -3607,14 +4000,71 @@ void chargercomms()
     msg.buf[3] = highByte(uint16_t(((settings.ChargeVsetpoint * settings.Scells ) - chargerendbulk) * 10));
     msg.buf[4] = lowByte(uint16_t(((settings.ChargeVsetpoint * settings.Scells ) - chargerendbulk)  * 10));
 
-    if (Can0.write(msg) == 0 && sendCnt < sendbufsize)
+    return true;
+  }
+  if (settings.chargertype == ChevyVolt)
+  {
+    msg.id  = 0x30E;
+    msg.len = 1;
+    msg.buf[0] = 0x02; //only HV charging , 0x03 hv and 12V charging
+
+    return true;
+  }
+
+  if (settings.chargertype == Coda)
+  {
+    msg.id  = 0x050;
+    msg.len = 8;
+    msg.buf[0] = 0x00;
+    msg.buf[1] = 0xDC;
+    if ((settings.ChargeVsetpoint * settings.Scells ) > 200)
+    {
+      msg.buf[2] = highByte(uint16_t((settings.ChargeVsetpoint * settings.Scells ) * 10));
+      msg.buf[3] = lowByte(uint16_t((settings.ChargeVsetpoint * settings.Scells ) * 10));
+    }
+    else
+    {
+      msg.buf[2] = highByte( 400);
+      msg.buf[3] = lowByte( 400);
+    }
+    msg.buf[4] = 0x00;
+    if ((settings.ChargeVsetpoint * settings.Scells)*chargecurrent < 3300)
     {
-      msgbuf[sendCnt] = msg;
-      sendCnt++;
+      msg.buf[5] = highByte(uint16_t(((settings.ChargeVsetpoint * settings.Scells) * chargecurrent) / 240));
+      msg.buf[6] = highByte(uint16_t(((settings.ChargeVsetpoint * settings.Scells) * chargecurrent) / 240));
+    }
+    else //15 A AC limit
+    {
+      msg.buf[5] = 0x00;
+      msg.buf[6] = 0x96;
+    }
+    msg.buf[7] = 0x01; //HV charging
+
+    return true;
+  }
+
+  if (settings.chargertype == EltekPC)
+  {
+    msg.id  = 0x351;
+    msg.len = 7;
+    for (byte i = 0; i < 6; i++) {
+      msg.buf[i] = ChargerSerial[i];
     }
+    msg.buf[6] = 0x01;
 
-    delay(2);
+    return true;
+  }
+  return false;
+}
 
+bool chargerframe2(CAN_message_t &msg)
+{
+  if (settings.ESSmode != 1 && bmsstatus != Charge)
+  {
+    return false;
+  }
+  if (settings.chargertype == BrusaNLG5)
+  {
     msg.id  = chargerid2;
     msg.len = 7;
     msg.buf[0] = 0x80;
@@ -3633,25 +4083,10 @@ void chargercomms()
     msg.buf[5] = highByte(chargecurrent / ncharger);
     msg.buf[6] = lowByte(chargecurrent / ncharger);
 
-    if (Can0.write(msg) == 0 && sendCnt < sendbufsize)
-    {
-      msgbuf[sendCnt] = msg;
-      sendCnt++;
-    }
-
+    return true;
   }
   if (settings.chargertype == ChevyVolt)
   {
-    msg.id  = 0x30E;
-    msg.len = 1;
-    msg.buf[0] = 0x02; //only HV charging , 0x03 hv and 12V charging
-
-    if (Can0.write(msg) == 0 && sendCnt < sendbufsize)
-    {
-      msgbuf[sendCnt] = msg;
-      sendCnt++;
-    }
-
     msg.id  = 0x304;
     msg.len = 4;
     msg.buf[0] = 0x40; //fixed
@@ -3674,47 +4109,7 @@ void chargercomms()
       msg.buf[3] = lowByte( 400);
     }
 
-    if (Can0.write(msg) == 0 && sendCnt < sendbufsize)
-    {
-      msgbuf[sendCnt] = msg;
-      sendCnt++;
-    }
-  }
-
-  if (settings.chargertype == Coda)
-  {
-    msg.id  = 0x050;
-    msg.len = 8;
-    msg.buf[0] = 0x00;
-    msg.buf[1] = 0xDC;
-    if ((settings.ChargeVsetpoint * settings.Scells ) > 200)
-    {
-      msg.buf[2] = highByte(uint16_t((settings.ChargeVsetpoint * settings.Scells ) * 10));
-      msg.buf[3] = lowByte(uint16_t((settings.ChargeVsetpoint * settings.Scells ) * 10));
-    }
-    else
-    {
-      msg.buf[2] = highByte( 400);
-      msg.buf[3] = lowByte( 400);
-    }
-    msg.buf[4] = 0x00;
-    if ((settings.ChargeVsetpoint * settings.Scells)*chargecurrent < 3300)
-    {
-      msg.buf[5] = highByte(uint16_t(((settings.ChargeVsetpoint * settings.Scells) * chargecurrent) / 240));
-      msg.buf[6] = highByte(uint16_t(((settings.ChargeVsetpoint * settings.Scells) * chargecurrent) / 240));
-    }
-    else //15 A AC limit
-    {
-      msg.buf[5] = 0x00;
-      msg.buf[6] = 0x96;
-    }
-    msg.buf[7] = 0x01; //HV charging
-
-    if (Can0.write(msg) == 0 && sendCnt < sendbufsize)
-    {
-      msgbuf[sendCnt] = msg;
-      sendCnt++;
-    }
+    return true;
   }
 
   if (settings.chargertype == EltekPC)
@@ -3731,19 +4126,6 @@ void chargercomms()
     {
       powerout = powerout * 10;
     }
-    msg.id  = 0x351;
-    msg.len = 7;
-    for (byte i = 0; i < 6; i++) {
-      msg.buf[i] = ChargerSerial[i];
-    }
-    msg.buf[6] = 0x01;
-
-    if (Can0.write(msg) == 0 && sendCnt < sendbufsize)
-    {
-      msgbuf[sendCnt] = msg;
-      sendCnt++;
-    }
-
     msg.id  = 0x352;
     msg.len = 6;
     msg.buf[0] = 0xFF;
@@ -3753,11 +4135,9 @@ void chargercomms()
     msg.buf[4] = highByte(uint16_t(settings.ChargeVsetpoint * settings.Scells * 10));
     msg.buf[5] = lowByte(uint16_t(settings.ChargeVsetpoint * settings.Scells * 10));
 
-    if (Can0.write(msg) == 0 && sendCnt < sendbufsize)   {
-      msgbuf[sendCnt] = msg;
-      sendCnt++;
-    }
+    return true;
   }
+  return false;
 }
 
 void SerialCanRecieve()
@@ -3776,54 +4156,130 @@ void SerialCanRecieve()
   }
 }
 
-void Can0callback() //run periodically to check if no can bus message is present in soft buffer
+// Start the 500ms console reports, unless the last ones haven't finished
+void startReport()
 {
-  /*
-    digitalWriteFast(LED_BUILTIN, !digitalReadFast(LED_BUILTIN));
-    Serial.println();
-    Serial.print("In Callback | ");
-    Serial.print(sendCnt);
-  */
-  if (sendCnt > 0)
+  if ((debug == 0 && CSVdebug == 0) || telemetry.isActive())
   {
-    if (Can0.write(msgbuf[0]) != 0)
-    {
-      for (int y = 0; y < 9; y++)
-      {
-        msgbuf[y] = msgbuf[y + 1];
-      }
-      sendCnt --;
-    }
+    return;
+  }
+  if (reportStage != REPORT_IDLE || !consoleOut.idle() || !serial2Out.idle())
+  {
+    reportsSkipped++;
+    return;
+  }
+  reportTime = millis();
+  reportCurrent = currentact;
+  reportSOC = SOC;
+  reportModule = 0;
+  reportCell = 0;
+  consoleText.hold();
+  if (debug != 0)
+  {
+    reportStage = REPORT_STATUS;
+  }
+  else
+  {
+    reportStage = REPORT_CSV;
   }
 }
 
-int pgnFromCANId(int canId)
+// Return true while text on the console would corrupt a binary stream
+bool consolequiet()
+{
+  return telemetry.isActive() || recorder.isDumping();
+}
+
+// Called every loop. Sends the next slice of queued output and formats
+// the next piece of the current report if there is room for it. Text held
+// back while the report was formatted follows it.
+void reportStep()
 {
-  if ((canId & 0x10000000) == 0x10000000)
+  if (!canCapture.busy())
   {
-    return (canId & 0x03FFFF00) >> 8;
+    consoleOut.service();
   }
-  else
+  serial2Out.service();
+  if (reportStage == REPORT_IDLE || recorder.isDumping() || consoleOut.room() < REPORT_PIECE || serial2Out.room() < REPORT_PIECE)
+  {
+    return;
+  }
+  switch (reportStage)
+  {
+    case REPORT_STATUS:
+      printbmsstat(consoleOut);
+      reportStage = REPORT_HEADER;
+      break;
+
+    case REPORT_HEADER:
+      bms.printDetailsHeader(consoleOut);
+      reportStage = REPORT_DETAILS;
+      break;
+
+    case REPORT_DETAILS:
+      reportModule = bms.nextModule(reportModule);
+      if (reportModule < 0)
+      {
+        reportModule = 0;
+        reportStage = (CSVdebug != 0) ? REPORT_CSV : REPORT_IDLE;
+        break;
+      }
+      bms.printModuleDetails(consoleOut, reportModule, reportCell, debugdigits, showbal);
+      reportModule++;
+      reportCell += bms.getModuleCells();
+      break;
+
+    case REPORT_CSV:
+      reportModule = bms.nextModule(reportModule);
+      if (reportModule < 0)
+      {
+        reportStage = REPORT_IDLE;
+        break;
+      }
+      bms.printModuleCSV(consoleOut, reportModule, reportTime, reportCurrent, reportSOC, bms.getModuleCells());
+      bms.printModuleCSV(serial2Out, reportModule, reportTime, reportCurrent, reportSOC, 8);
+      reportModule++;
+      break;
+  }
+  if (reportStage == REPORT_IDLE)
   {
-    return canId; // not sure if this is really right?
+    consoleText.release();
   }
 }
 
-void handleVictronLynx()
+// Fill the telemetry pack summary record
+void telemetryPack(TelemetryPack &pack)
+{
+  pack.status = bmsstatus;
+  pack.modules = snapshot.numModules;
+  pack.errorReason = ErrorReason;
+  pack.packMV = snapshot.packVoltageMV;
+  pack.lowCellMV = snapshot.lowCellMV;
+  pack.highCellMV = snapshot.highCellMV;
+  pack.lowTemp = BMSModule::decodeTemperatureTenths(snapshot.lowTempRaw);
+  pack.highTemp = BMSModule::decodeTemperatureTenths(snapshot.highTempRaw);
+  pack.current = currentact;
+  pack.SOC = constrain(SOC, 0, 100);
+  pack.chargeLimit = chargecurrent;
+  pack.dischargeLimit = discurrent;
+}
+
+void Can0callback() //run periodically in case a transmit complete interrupt was missed
+{
+  canTx.service();
+}
+
+void handleVictronLynx(CAN_message_t &msg)
 {
-  if (inMsg.buf[4] == 0xff && inMsg.buf[3] == 0xff) return;
-  int16_t current = (int)inMsg.buf[4] << 8; // in 0.1A increments
-  current |= inMsg.buf[3];
+  if (msg.buf[0] != 0) return; // only use the first packet of each sequence
+  if (msg.buf[4] == 0xff && msg.buf[3] == 0xff) return;
+  int16_t current = (int)msg.buf[4] << 8; // in 0.1A increments
+  current |= msg.buf[3];
   CANmilliamps = current * 100;
   if (settings.cursens == Canbus)
   {
     RawCur = CANmilliamps;
+    currenttime = inMsgTime;
     getcurrent();
   }
-  if (candebug == 1)
-  {
-    Serial.println();
-    Serial.print(CANmilliamps);
-    Serial.print("mA ");
-  }
 }
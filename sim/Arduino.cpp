@@ -0,0 +1,402 @@
+#include "Sim.h"
+#include <vector>
+#include <algorithm>
+
+#define SIM_PINS 64
+#define SIM_TIMERS 4
+#define SERIAL_PACKET 64     // bytes, USB full speed bulk packet
+#define SERIAL_US_PER_BYTE 8 // the host reading about 125kB/s
+
+uint64_t simNow = 0;
+
+HardwareSerial Serial, Serial1, Serial2, Serial3;
+volatile uint8_t RCM_SRS0 = RCM_SRS0_POR, RCM_SRS1 = 0;
+volatile uint16_t WDOG_STCTRLH, WDOG_TOVALH, WDOG_TOVALL, WDOG_PRESC, WDOG_UNLOCK, WDOG_REFRESH;
+
+static FILE *record = NULL;
+static std::vector<SimEvent> events;
+static size_t nextEvent = 0;
+static IntervalTimer *timers[SIM_TIMERS];
+static uint8_t pinModes[SIM_PINS];
+static uint8_t pinLevels[SIM_PINS];
+static int pinDuty[SIM_PINS];   // -1 when driven as a digital output
+static bool pinKnown[SIM_PINS]; // written at least once
+static int adcValue = -1;
+
+////Virtual clock////
+
+uint32_t millis()
+{
+  return (uint32_t)(simNow / 1000);
+}
+
+uint32_t micros()
+{
+  return (uint32_t)simNow;
+}
+
+void delay(uint32_t ms)
+{
+  simAdvance(simNow + (uint64_t)ms * 1000);
+}
+
+void delayMicroseconds(uint32_t us)
+{
+  simAdvance(simNow + us);
+}
+
+// Interrupts are only ever taken between loop() calls and inside delay(),
+// so there is nothing to mask
+void noInterrupts()
+{
+}
+
+void interrupts()
+{
+}
+
+void yield()
+{
+}
+
+long map(long x, long in_min, long in_max, long out_min, long out_max)
+{
+  return (x - in_min) * (out_max - out_min) / (in_max - in_min) + out_min;
+}
+
+// Add an event to be delivered when the clock reaches it. Events must be
+// queued in time order.
+void simQueue(const SimEvent &event)
+{
+  events.push_back(event);
+}
+
+bool simPending()
+{
+  return nextEvent < events.size();
+}
+
+uint64_t simLastEvent()
+{
+  return events.empty() ? 0 : events.back().at;
+}
+
+static void deliver(SimEvent &event)
+{
+  switch(event.type) {
+    case SIM_FRAME:
+      Can0.receive(event.msg);
+      break;
+    case SIM_PIN:
+      simSetInput(event.pin, event.value);
+      break;
+    case SIM_ADC:
+      simSetAdc(event.value);
+      break;
+    case SIM_CONSOLE:
+      Serial.push(event.text.c_str());
+      break;
+  }
+}
+
+// Run the clock forward, delivering events, timer interrupts and transmit
+// completions in time order
+void simAdvance(uint64_t until)
+{
+  for(;;) {
+    uint64_t next = until + 1;
+    int source = -1;
+    if(nextEvent < events.size() && events[nextEvent].at < next) {
+      next = events[nextEvent].at;
+      source = 0;
+    }
+    if(Can0.nextTxDone() < next) {
+      next = Can0.nextTxDone();
+      source = 1;
+    }
+    IntervalTimer *timer = NULL;
+    for(int n=0; n<SIM_TIMERS; n++) {
+      if(timers[n] && timers[n]->nextDue < next) {
+        next = timers[n]->nextDue;
+        timer = timers[n];
+        source = 2;
+      }
+    }
+    if(source < 0) break;
+    if(next > simNow) simNow = next;
+    if(source == 0) {
+      deliver(events[nextEvent++]);
+    } else if(source == 1) {
+      Can0.finishTx();
+    } else {
+      timer->nextDue += timer->period;
+      timer->function();
+    }
+  }
+  if(until > simNow) simNow = until;
+}
+
+////Recording////
+
+void simRecordTo(FILE *file)
+{
+  record = file;
+}
+
+// Write one line to the recording, stamped with the virtual time in the
+// same form as candump -l
+void simRecord(const char *format, ...)
+{
+  if(!record) return;
+  fprintf(record, "(%010llu.%06llu) ", (unsigned long long)(simNow / 1000000), (unsigned long long)(simNow % 1000000));
+  va_list args;
+  va_start(args, format);
+  vfprintf(record, format, args);
+  va_end(args);
+  fputc('\n', record);
+}
+
+void simRecordFrame(const char *dir, const CAN_message_t &msg)
+{
+  char data[17];
+  for(int n=0; n<msg.len && n<8; n++) sprintf(data + n * 2, "%02X", msg.buf[n]);
+  data[msg.len < 8 ? msg.len * 2 : 16] = 0;
+  if(msg.ext) simRecord("%s %08X#%s", dir, msg.id, data);
+  else simRecord("%s %03X#%s", dir, msg.id, data);
+}
+
+////Pins////
+
+void pinMode(uint8_t pin, uint8_t mode)
+{
+  if(pin < SIM_PINS) pinModes[pin] = mode;
+}
+
+void digitalWrite(uint8_t pin, uint8_t value)
+{
+  if(pin >= SIM_PINS || pinModes[pin] != OUTPUT) return;
+  value = value ? HIGH : LOW;
+  if(!pinKnown[pin] || pinLevels[pin] != value || pinDuty[pin] != -1) simRecord("pin %d %d", pin, value);
+  pinLevels[pin] = value;
+  pinDuty[pin] = -1;
+  pinKnown[pin] = true;
+}
+
+uint8_t digitalRead(uint8_t pin)
+{
+  if(pin >= SIM_PINS) return LOW;
+  return pinLevels[pin];
+}
+
+// PWM outputs are recorded with their duty, 0-255
+void analogWrite(uint8_t pin, int value)
+{
+  if(pin >= SIM_PINS) return;
+  if(!pinKnown[pin] || pinDuty[pin] != value) simRecord("pwm %d %d", pin, value);
+  pinDuty[pin] = value;
+  pinKnown[pin] = true;
+  pinLevels[pin] = value > 0 ? HIGH : LOW;
+}
+
+void analogWriteFrequency(uint8_t pin, float frequency)
+{
+}
+
+int analogRead(uint8_t pin)
+{
+  return simGetAdc() >> 6;
+}
+
+void simSetInput(uint8_t pin, uint8_t value)
+{
+  if(pin < SIM_PINS) pinLevels[pin] = value ? HIGH : LOW;
+}
+
+// Set the raw 16 bit reading returned by the ADC, or -1 for mid scale
+void simSetAdc(int value)
+{
+  adcValue = value;
+}
+
+int simGetAdc()
+{
+  return adcValue < 0 ? 0x8000 : adcValue;
+}
+
+////Interval timers////
+
+IntervalTimer::IntervalTimer() : function(NULL), period(0), nextDue(0)
+{
+}
+
+IntervalTimer::~IntervalTimer()
+{
+  end();
+}
+
+bool IntervalTimer::begin(void (*function)(), uint32_t microseconds)
+{
+  end();
+  for(int n=0; n<SIM_TIMERS; n++) {
+    if(!timers[n]) {
+      this->function = function;
+      period = microseconds ? microseconds : 1;
+      nextDue = simNow + period;
+      timers[n] = this;
+      return true;
+    }
+  }
+  return false;
+}
+
+void IntervalTimer::end()
+{
+  for(int n=0; n<SIM_TIMERS; n++) {
+    if(timers[n] == this) timers[n] = NULL;
+  }
+}
+
+////Serial ports////
+
+HardwareSerial::HardwareSerial() : output(NULL), room(SERIAL_PACKET), lastRoom(0), head(0), tail(0)
+{
+}
+
+size_t HardwareSerial::write(uint8_t b)
+{
+  availableForWrite();
+  if(room > 0) room--;
+  if(output) fputc(b, output);
+  return 1;
+}
+
+// Return the room left in the packet being filled. It fills again at
+// SERIAL_US_PER_BYTE as the host reads. Writes past it aren't lost, as
+// the Teensy would block instead.
+int HardwareSerial::availableForWrite()
+{
+  uint32_t now = micros();
+  uint32_t bytes = (now - lastRoom) / SERIAL_US_PER_BYTE;
+  lastRoom += bytes * SERIAL_US_PER_BYTE;
+  room = room + bytes > SERIAL_PACKET ? SERIAL_PACKET : room + (int)bytes;
+  return room;
+}
+
+int HardwareSerial::available()
+{
+  return (head - tail) & (sizeof(input) - 1);
+}
+
+int HardwareSerial::read()
+{
+  if(head == tail) return -1;
+  int c = (uint8_t)input[tail];
+  tail = (tail + 1) & (sizeof(input) - 1);
+  return c;
+}
+
+int HardwareSerial::peek()
+{
+  if(head == tail) return -1;
+  return (uint8_t)input[tail];
+}
+
+// Stream::parseInt without the timeout: there is never more input to wait
+// for than has already been pushed
+long HardwareSerial::parseInt()
+{
+  int c;
+  while((c = peek()) >= 0 && c != '-' && (c < '0' || c > '9')) read();
+  bool negative = false;
+  if(c == '-') {
+    negative = true;
+    read();
+  }
+  long value = 0;
+  while((c = peek()) >= '0' && c <= '9') {
+    value = value * 10 + c - '0';
+    read();
+  }
+  return negative ? -value : value;
+}
+
+float HardwareSerial::parseFloat()
+{
+  char text[32];
+  int n = 0;
+  int c;
+  while((c = peek()) >= 0 && c != '-' && c != '.' && (c < '0' || c > '9')) read();
+  while((c = peek()) >= 0 && (c == '-' || c == '.' || (c >= '0' && c <= '9')) && n < 31) text[n++] = read();
+  text[n] = 0;
+  return atof(text);
+}
+
+void HardwareSerial::push(const char *text)
+{
+  for(; *text; text++) {
+    uint16_t next = (head + 1) & (sizeof(input) - 1);
+    if(next == tail) return;
+    input[head] = *text;
+    head = next;
+  }
+}
+
+////Print////
+
+size_t Print::write(const char *str)
+{
+  size_t n = 0;
+  while(*str) n += write((uint8_t)*str++);
+  return n;
+}
+
+size_t Print::write(const uint8_t *buffer, size_t size)
+{
+  for(size_t n=0; n<size; n++) write(buffer[n]);
+  return size;
+}
+
+size_t Print::printSigned(long n, int base)
+{
+  if(base == DEC && n < 0) return write((uint8_t)'-') + printNumber(-(unsigned long)n, base);
+  return printNumber((unsigned long)n, base);
+}
+
+size_t Print::printNumber(unsigned long n, int base)
+{
+  char buf[8 * sizeof(long) + 1];
+  char *str = &buf[sizeof(buf) - 1];
+  *str = 0;
+  if(base < 2) base = 10;
+  do {
+    int digit = n % base;
+    n /= base;
+    *--str = digit < 10 ? '0' + digit : 'A' + digit - 10;
+  } while(n);
+  return write(str);
+}
+
+size_t Print::printFloat(double number, int digits)
+{
+  if(isnan(number)) return write("nan");
+  if(isinf(number)) return write("inf");
+  size_t n = 0;
+  if(number < 0.0) {
+    n += write((uint8_t)'-');
+    number = -number;
+  }
+  double rounding = 0.5;
+  for(int i=0; i<digits; i++) rounding /= 10.0;
+  number += rounding;
+  unsigned long whole = (unsigned long)number;
+  double remainder = number - (double)whole;
+  n += printNumber(whole, DEC);
+  if(digits > 0) n += write((uint8_t)'.');
+  while(digits-- > 0) {
+    remainder *= 10.0;
+    int digit = (int)remainder;
+    n += write((uint8_t)('0' + digit));
+    remainder -= digit;
+  }
+  return n;
+}
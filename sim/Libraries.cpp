@@ -0,0 +1,211 @@
+#include "Sim.h"
+#include <EEPROM.h>
+#include <ADC.h>
+
+FlexCAN Can0;
+EEPROMClass EEPROM;
+
+static uint32_t filtered = 0;
+static bool recordRx = false;
+
+////FlexCAN////
+
+FlexCAN::FlexCAN() : baud(500000), onBus(-1), busDone(0)
+{
+  for(int n=0; n<SIZE_LISTENERS; n++) listeners[n] = NULL;
+  for(int n=0; n<NUM_TX_MAILBOXES; n++) txBusy[n] = false;
+  // Open every receive mailbox, half for standard and half for extended
+  for(int n=0; n<NUM_MAILBOXES; n++) {
+    filters[n].id = 0;
+    filters[n].flags.extended = n >= getNumRxBoxes() / 2;
+    filters[n].flags.remote = 0;
+    filters[n].flags.reserved = 0;
+    masks[n] = 0;
+  }
+}
+
+void FlexCAN::begin(uint32_t baud)
+{
+  this->baud = baud;
+}
+
+void FlexCAN::setFilter(const CAN_filter_t &filter, uint8_t n)
+{
+  if(n < getNumRxBoxes()) filters[n] = filter;
+}
+
+bool FlexCAN::getFilter(CAN_filter_t &filter, uint8_t n)
+{
+  if(n >= getNumRxBoxes()) return false;
+  filter = filters[n];
+  return true;
+}
+
+void FlexCAN::setMask(uint32_t mask, uint8_t n)
+{
+  if(n < getNumRxBoxes()) masks[n] = mask;
+}
+
+bool FlexCAN::attachObj(CANListener *listener)
+{
+  for(int n=0; n<SIZE_LISTENERS; n++) {
+    if(!listeners[n]) {
+      listeners[n] = listener;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool FlexCAN::detachObj(CANListener *listener)
+{
+  for(int n=0; n<SIZE_LISTENERS; n++) {
+    if(listeners[n] == listener) {
+      listeners[n] = NULL;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Put a frame in a free transmit mailbox. Returns 0 if they are all busy,
+// as the library does.
+int FlexCAN::write(const CAN_message_t &msg)
+{
+  for(int n=0; n<NUM_TX_MAILBOXES; n++) {
+    if(!txBusy[n]) {
+      txBoxes[n] = msg;
+      txBusy[n] = true;
+      if(onBus < 0) startTx();
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Start the waiting mailbox that would win arbitration
+void FlexCAN::startTx()
+{
+  uint32_t best = 0xffffffff;
+  for(int n=0; n<NUM_TX_MAILBOXES; n++) {
+    if(!txBusy[n]) continue;
+    uint32_t key = txBoxes[n].ext ? txBoxes[n].id & 0x1fffffff : (txBoxes[n].id & 0x7ff) << 18;
+    if(key < best) {
+      best = key;
+      onBus = n;
+    }
+  }
+  if(onBus < 0) return;
+  // Worst case stuffed length plus the interframe space
+  CAN_message_t &msg = txBoxes[onBus];
+  uint32_t bits = (msg.ext ? 54 : 34) + 8 * msg.len;
+  bits += (bits - 1) / 4 + 13;
+  busDone = simNow + (uint64_t)bits * 1000000 / baud;
+}
+
+uint64_t FlexCAN::nextTxDone()
+{
+  return onBus < 0 ? UINT64_MAX : busDone;
+}
+
+// The frame on the bus has gone. Record it and raise the transmit
+// complete interrupt.
+void FlexCAN::finishTx()
+{
+  if(onBus < 0) return;
+  int mailbox = onBus;
+  simRecordFrame("tx", txBoxes[mailbox]);
+  txBusy[mailbox] = false;
+  onBus = -1;
+  startTx();
+  for(int n=0; n<SIZE_LISTENERS; n++) {
+    if(listeners[n] && listeners[n]->generalCallbackActive) listeners[n]->txHandler(getNumRxBoxes() + mailbox, 0);
+  }
+}
+
+// Check a frame against the receive mailbox filters
+bool FlexCAN::accepts(const CAN_message_t &msg)
+{
+  for(int n=0; n<getNumRxBoxes(); n++) {
+    if(filters[n].flags.extended != (msg.ext ? 1 : 0)) continue;
+    if(msg.ext) {
+      if(((msg.id ^ filters[n].id) & masks[n] & 0x1fffffff) == 0) return true;
+    } else {
+      if(((((msg.id ^ filters[n].id) & 0x7ff) << 18) & masks[n]) == 0) return true;
+    }
+  }
+  return false;
+}
+
+// A frame has arrived on the bus. Frames the hardware filters would reject
+// are counted and dropped; the rest go to every listener, as the receive
+// interrupt does.
+void FlexCAN::receive(CAN_message_t &msg)
+{
+  if(!accepts(msg)) {
+    filtered++;
+    return;
+  }
+  if(recordRx) simRecordFrame("rx", msg);
+  for(int n=0; n<SIZE_LISTENERS; n++) {
+    if(listeners[n] && listeners[n]->generalCallbackActive) listeners[n]->frameHandler(msg, -1, 0);
+  }
+}
+
+void simRecordReceived(bool on)
+{
+  recordRx = on;
+}
+
+uint32_t simFilteredFrames()
+{
+  return filtered;
+}
+
+////EEPROM////
+
+EEPROMClass::EEPROMClass() : writes(0)
+{
+  memset(data, 0xff, sizeof(data));
+}
+
+bool EEPROMClass::load(const char *path)
+{
+  FILE *file = fopen(path, "rb");
+  if(!file) return false;
+  size_t n = fread(data, 1, sizeof(data), file);
+  fclose(file);
+  return n > 0;
+}
+
+bool EEPROMClass::save(const char *path)
+{
+  FILE *file = fopen(path, "wb");
+  if(!file) return false;
+  size_t n = fwrite(data, 1, sizeof(data), file);
+  fclose(file);
+  return n == sizeof(data);
+}
+
+////ADC////
+
+int ADC_Module::analogReadContinuous()
+{
+  return simGetAdc() >> (16 - resolution);
+}
+
+int ADC_Module::analogRead(uint8_t pin)
+{
+  return simGetAdc() >> (16 - resolution);
+}
+
+int ADC_Module::readSingle()
+{
+  return simGetAdc() >> (16 - resolution);
+}
+
+// Each timer tick stands for a conversion finishing
+void ADC_Module::startTimer(uint32_t frequency)
+{
+  if(isr) timer.begin(isr, 1000000 / frequency);
+}
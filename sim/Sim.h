@@ -0,0 +1,39 @@
+#pragma once
+// Interface between the replayer and the host versions of the Arduino core
+// and libraries. All time is virtual and in microseconds since boot.
+#include <Arduino.h>
+#include <FlexCAN.h>
+#include <string>
+
+enum SimEventType {
+  SIM_FRAME,   // CAN frame arriving at the controller
+  SIM_PIN,     // digital input changing level
+  SIM_ADC,     // current sensor ADC reading changing
+  SIM_CONSOLE, // text typed on the USB console
+};
+
+typedef struct {
+  uint64_t at;
+  SimEventType type;
+  CAN_message_t msg;
+  uint8_t pin;
+  int value;
+  std::string text;
+} SimEvent;
+
+extern uint64_t simNow;
+
+void simQueue(const SimEvent &event);
+bool simPending();
+uint64_t simLastEvent();
+void simAdvance(uint64_t until);
+
+void simRecordTo(FILE *file);
+void simRecord(const char *format, ...);
+void simRecordFrame(const char *dir, const CAN_message_t &msg);
+void simRecordReceived(bool on);
+
+void simSetInput(uint8_t pin, uint8_t value);
+void simSetAdc(int value);
+int simGetAdc();
+uint32_t simFilteredFrames();
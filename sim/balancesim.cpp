@@ -0,0 +1,273 @@
+// Simulates balancing a resting pack of mismatched cells two ways: with
+// the single pack wide target the sketch used to broadcast every 500ms,
+// and with BalancePlanner's per module targets. The cell readings reach
+// both through BMSModuleManager, as frames from a modelled daisychain
+// adapter, and the planner's commands are fed back to the model.
+//
+// The adapter model bleeds every cell above its module's target through a
+// BALANCE_RESISTOR. To stay within the module's thermal budget it only
+// bleeds a limited number of cells at once, taking turns of BLEED_TURN
+// when more are above the target. The balancing bitmap it reports holds
+// only the cells bleeding at the time, so the planner can count the
+// charge from it. A broadcast target lapses after 1s without a repeat, a
+// module target after a minute.
+//   balancesim [-m modules] [-l bleed limit] [-s SOC spread %] [-c capacity
+//              spread %] [-r seed] [-t hours]
+#include "Sim.h"
+#include <unistd.h>
+#include <vector>
+#include <random>
+#include "BMSModuleManager.h"
+#include "BalancePlanner.h"
+#include "OCVTable.h"
+
+EEPROMSettings settings;
+
+#define CAPACITY 60      // Ah of each cell
+#define START_SOC 88.0   // % of the average cell
+#define BALANCE_MV 3900  // settings.balanceVoltage
+#define HYST_MV 40       // settings.balanceHyst
+#define SCAN_PERIOD 500  // ms between adapter scans
+#define STEP 100         // ms of each simulation step
+#define BLEED_TURN 2000  // ms each group of cells bleeds for when they take turns
+
+typedef struct {
+  double capacity; // Ah
+  double charge;   // Ah
+  bool needed;     // started more than the hysteresis above the lowest cell
+  double bled;     // Ah
+} Cell;
+
+typedef struct {
+  uint16_t target;  // raw, BALANCE_OFF if none
+  uint32_t expires; // ms
+  uint16_t balstat;
+} AdapterModule;
+
+typedef struct {
+  double hours;     // until the spread first fell within the hysteresis, -1 never
+  double bled;      // Ah
+  double wasted;    // Ah bled from cells that didn't need it
+  uint32_t commands;
+  int spread;       // mV at the end
+  double tracked;   // Ah the planner counted from the balancing bitmaps
+  double cellError; // Ah, the most the planner's count for a cell is out
+} Result;
+
+static int modules = 4;
+static int bleedLimit = 4;
+
+// Rested voltage of a cell at a SOC in tenths of a percent, the inverse
+// of ocvSOC()
+static uint16_t cellMV(double soc)
+{
+  if(soc <= ocvTable[0].soc) return ocvTable[0].mV;
+  for(int n=1; n<OCV_POINTS; n++) {
+    if(soc < ocvTable[n].soc) {
+      const OCVPoint &a = ocvTable[n - 1];
+      const OCVPoint &b = ocvTable[n];
+      return a.mV + (soc - a.soc) * (b.mV - a.mV) / (b.soc - a.soc);
+    }
+  }
+  return ocvTable[OCV_POINTS - 1].mV;
+}
+
+static uint16_t raw(uint16_t mV)
+{
+  return mV * 65535UL / 5000;
+}
+
+static uint16_t voltage(const Cell &cell)
+{
+  return cellMV(cell.charge / cell.capacity * 1000);
+}
+
+// Send one scan of every module to the manager
+static void scan(BMSModuleManager &bms, std::vector<Cell> &cells, std::vector<AdapterModule> &adapter)
+{
+  uint16_t ntc = BMSModule::encodeTemperature(25.0f);
+  for(int m=0; m<modules; m++) {
+    CAN_message_t msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.id = 0x4f0;
+    msg.len = 4;
+    msg.buf[0] = m;
+    for(int reg=0; reg<19; reg++) {
+      uint16_t data;
+      if(reg < 16) {
+        msg.buf[1] = reg;
+        data = raw(voltage(cells[m * 16 + reg]));
+      } else if(reg < 18) {
+        msg.buf[1] = reg + 1;
+        data = ntc;
+      } else {
+        msg.buf[1] = 0xff;
+        data = adapter[m].balstat;
+      }
+      msg.buf[2] = highByte(data);
+      msg.buf[3] = lowByte(data);
+      bms.decodecan(msg);
+    }
+  }
+}
+
+// Choose the cells each module bleeds from those above its target, up to
+// the limit, moving on to the next ones every BLEED_TURN
+static void chooseBleed(std::vector<Cell> &cells, std::vector<AdapterModule> &adapter, uint32_t now)
+{
+  for(int m=0; m<modules; m++) {
+    AdapterModule &module = adapter[m];
+    module.balstat = 0;
+    if(module.target == BALANCE_OFF || now >= module.expires) continue;
+    int above[16];
+    int count = 0;
+    for(int n=0; n<16; n++) {
+      if(raw(voltage(cells[m * 16 + n])) > module.target) above[count++] = n;
+    }
+    int first = count > bleedLimit ? now / BLEED_TURN * bleedLimit : 0;
+    for(int n=0; n<count && n<bleedLimit; n++) module.balstat |= 1 << above[(first + n) % count];
+  }
+}
+
+static int spreadMV(std::vector<Cell> &cells)
+{
+  uint16_t low = 0xffff, high = 0;
+  for(size_t n=0; n<cells.size(); n++) {
+    uint16_t mV = voltage(cells[n]);
+    if(mV < low) low = mV;
+    if(mV > high) high = mV;
+  }
+  return high - low;
+}
+
+static Result run(std::vector<Cell> cells, bool planned, double hours)
+{
+  static BMSModuleManager bms;
+  static BalancePlanner planner(bms);
+  bms.setTopology(1, modules, 16);
+  bms.setPstrings(1);
+  planner.clear();
+  std::vector<AdapterModule> adapter(modules);
+  for(int m=0; m<modules; m++) {
+    adapter[m].target = BALANCE_OFF;
+    adapter[m].expires = 0;
+    adapter[m].balstat = 0;
+  }
+
+  Result result = {-1, 0, 0, 0, 0, 0, 0};
+  uint16_t balanceRaw = raw(BALANCE_MV);
+  uint16_t hystRaw = raw(HYST_MV);
+  uint32_t end = hours * 3600000;
+  uint32_t start = simNow / 1000;
+  for(uint32_t t=0; t<end; t+=STEP) {
+    simNow = (uint64_t)(start + t) * 1000;
+    uint32_t now = start + t;
+    if(t % SCAN_PERIOD == 0) {
+      chooseBleed(cells, adapter, now);
+      scan(bms, cells, adapter);
+      bms.expireModules();
+    }
+    uint16_t low = bms.getLowCellRaw(), high = bms.getHighCellRaw();
+    bool enabled = bms.getNumModules() == modules && high > balanceRaw && high > low + hystRaw;
+    uint16_t floorRaw = low < balanceRaw ? balanceRaw : low;
+    // The planner counts the bleeding in both schemes, as the sketch does
+    if(t % 1000 == 0) planner.update(now, planned && enabled, floorRaw, hystRaw, CAPACITY);
+    if(planned) {
+      CAN_message_t msg;
+      while(planner.nextCommand(msg)) {
+        planner.commandSent(msg);
+        int m = msg.buf[1];
+        if(m >= modules) continue;
+        adapter[m].target = (msg.buf[2] << 8) | msg.buf[3];
+        adapter[m].expires = now + 60000;
+      }
+    } else if(t % 500 == 0 && enabled) {
+      // The old balancecan()
+      for(int m=0; m<modules; m++) {
+        adapter[m].target = floorRaw;
+        adapter[m].expires = now + 1000;
+      }
+      result.commands++;
+    }
+
+    for(int m=0; m<modules; m++) {
+      for(int n=0; n<16; n++) {
+        if(!(adapter[m].balstat & (1 << n))) continue;
+        Cell &cell = cells[m * 16 + n];
+        double ah = voltage(cell) / 1000.0 / BALANCE_RESISTOR * STEP / 3600000.0;
+        cell.charge -= ah;
+        cell.bled += ah;
+      }
+    }
+    if(result.hours < 0 && t % 1000 == 0 && spreadMV(cells) <= HYST_MV) result.hours = t / 3600000.0;
+  }
+  for(size_t n=0; n<cells.size(); n++) {
+    result.bled += cells[n].bled;
+    if(!cells[n].needed) result.wasted += cells[n].bled;
+  }
+  result.spread = spreadMV(cells);
+  if(planned) result.commands = planner.getCommands();
+  for(int m=0; m<modules; m++) {
+    result.tracked += planner.getModuleBleedCharge(m) / 3600000.0;
+    for(int n=0; n<16; n++) {
+      double error = fabs(planner.getBleedCharge(m, n) / 3600000.0 - cells[m * 16 + n].bled);
+      if(error > result.cellError) result.cellError = error;
+    }
+  }
+  return result;
+}
+
+static void print(const char *name, Result &result)
+{
+  printf("%-10s", name);
+  if(result.hours < 0) printf("not balanced");
+  else printf("balanced after %.1fh", result.hours);
+  printf(", bled %.3fAh (%.3fAh from cells within the hysteresis), %u commands, spread %dmV at the end",
+         result.bled, result.wasted, result.commands, result.spread);
+  if(result.tracked > 0) {
+    printf(", %.3fAh counted by the planner, each cell to within %.0fmAh", result.tracked, result.cellError * 1000);
+  }
+  printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+  double socSpread = 1.5;
+  double capSpread = 2.0;
+  unsigned seed = 1;
+  double hours = 120;
+  int opt;
+  while((opt = getopt(argc, argv, "m:l:s:c:r:t:")) != -1) {
+    switch(opt) {
+      case 'm': modules = constrain(atoi(optarg), 1, 16); break;
+      case 'l': bleedLimit = constrain(atoi(optarg), 1, 16); break;
+      case 's': socSpread = atof(optarg); break;
+      case 'c': capSpread = atof(optarg); break;
+      case 'r': seed = strtoul(optarg, NULL, 0); break;
+      case 't': hours = atof(optarg); break;
+      default:
+        fprintf(stderr, "usage: balancesim [-m modules] [-l bleed limit] [-s SOC spread %%] [-c capacity spread %%] [-r seed] [-t hours]\n");
+        return 2;
+    }
+  }
+
+  std::mt19937 random(seed);
+  std::normal_distribution<double> soc(START_SOC / 100, socSpread / 100);
+  std::normal_distribution<double> capacity(CAPACITY, CAPACITY * capSpread / 100);
+  std::vector<Cell> cells(modules * 16);
+  uint16_t lowest = 0xffff;
+  for(size_t n=0; n<cells.size(); n++) {
+    cells[n].capacity = capacity(random);
+    cells[n].charge = cells[n].capacity * soc(random);
+    cells[n].bled = 0;
+    if(voltage(cells[n]) < lowest) lowest = voltage(cells[n]);
+  }
+  for(size_t n=0; n<cells.size(); n++) cells[n].needed = voltage(cells[n]) > lowest + HYST_MV;
+
+  printf("%d modules, bleeding up to %d cells each, spread %dmV at the start\n", modules, bleedLimit, spreadMV(cells));
+  Result broadcast = run(cells, false, hours);
+  print("broadcast", broadcast);
+  Result planned = run(cells, true, hours);
+  print("planner", planned);
+  return 0;
+}
@@ -0,0 +1,175 @@
+// Converts the binary CAN capture streamed by the sketch (console debug
+// option 1, see CANCapture.h) into candump -l or Vector ASC text.
+//
+//   stty -F /dev/ttyACM0 raw && cat /dev/ttyACM0 > capture.bin
+//   cancap capture.bin > capture.log
+//
+// Console text mixed in with the chunks is skipped, or copied to stderr
+// with -v. Lost chunks, corrupted chunks and frames the Teensy had to drop
+// are reported on stderr. The candump output can be fed straight to replay.
+#include <CANCapture.h>
+#include <unistd.h>
+#include <time.h>
+
+static bool asc = false;
+static bool verbose = false;
+static const char *interface = "can0";
+
+static uint64_t baseTime = 0;   // us of the first frame
+static uint64_t lastTime = 0;   // unwrapped us of the previous frame
+static bool haveTime = false;
+static bool haveSequence = false;
+static uint16_t lastSequence;
+static uint32_t lastOverflows = 0;
+static uint32_t frames = 0, lostChunks = 0, badChunks = 0, dropped = 0;
+
+static void usage()
+{
+  fprintf(stderr,
+    "usage: cancap [options] [capture]\n"
+    "  -a          write Vector ASC instead of candump -l\n"
+    "  -i <name>   interface name for candump output (default can0)\n"
+    "  -v          copy console text between chunks to stderr\n"
+    "Reads stdin if no capture file is given.\n");
+}
+
+static void printRecord(const CANCaptureRecord &record)
+{
+  // The Teensy's clock is 32 bit microseconds, which wraps every 71 minutes
+  if(!haveTime) {
+    baseTime = lastTime = record.time;
+    haveTime = true;
+  } else {
+    lastTime += (uint32_t)(record.time - (uint32_t)lastTime);
+  }
+  uint64_t t = lastTime - baseTime;
+  bool ext = record.flags & CAN_CAPTURE_EXT;
+  int len = record.len > 8 ? 8 : record.len;
+  frames++;
+
+  if(asc) {
+    char id[16];
+    sprintf(id, ext ? "%Xx" : "%X", record.id);
+    printf("%11.6f 1  %-15s Rx   ", t / 1e6, id);
+    if(record.flags & CAN_CAPTURE_RTR) {
+      printf("r %d\n", len);
+      return;
+    }
+    printf("d %d", len);
+    for(int n=0; n<len; n++) printf(" %02X", record.data[n]);
+    printf("\n");
+  } else {
+    printf("(%010llu.%06llu) %s ", (unsigned long long)(t / 1000000), (unsigned long long)(t % 1000000), interface);
+    printf(ext ? "%08X#" : "%03X#", record.id);
+    if(record.flags & CAN_CAPTURE_RTR) {
+      printf("R\n");
+      return;
+    }
+    for(int n=0; n<len; n++) printf("%02X", record.data[n]);
+    printf("\n");
+  }
+}
+
+// Check and print one chunk. Returns its length in bytes, or 0 if the data
+// at p is not a valid chunk.
+static size_t decodeChunk(const uint8_t *p, size_t avail, bool final, bool &needMore)
+{
+  CANCaptureHeader header;
+  needMore = false;
+  if(avail < sizeof(header)) {
+    needMore = !final;
+    return 0;
+  }
+  memcpy(&header, p, sizeof(header));
+  if(header.magic != CAN_CAPTURE_MAGIC || header.count > CAN_CAPTURE_CHUNK) return 0;
+  size_t len = sizeof(header) + header.count * sizeof(CANCaptureRecord) + 2;
+  if(avail < len) {
+    needMore = !final;
+    return 0;
+  }
+  uint16_t crc = p[len - 2] | (p[len - 1] << 8);
+  if(crc16(p, len - 2) != crc) {
+    badChunks++;
+    return 0;
+  }
+
+  if(haveSequence && header.sequence != (uint16_t)(lastSequence + 1)) {
+    uint16_t lost = header.sequence - lastSequence - 1;
+    lostChunks += lost;
+    fprintf(stderr, "cancap: %u chunks lost before chunk %u\n", lost, header.sequence);
+  }
+  if(header.overflows > lastOverflows) {
+    dropped += header.overflows - lastOverflows;
+    fprintf(stderr, "cancap: %u frames dropped on the Teensy before chunk %u\n", header.overflows - lastOverflows, header.sequence);
+  }
+  lastOverflows = header.overflows;
+  lastSequence = header.sequence;
+  haveSequence = true;
+
+  for(int n=0; n<header.count; n++) {
+    CANCaptureRecord record;
+    memcpy(&record, p + sizeof(header) + n * sizeof(record), sizeof(record));
+    printRecord(record);
+  }
+  return len;
+}
+
+int main(int argc, char **argv)
+{
+  int opt;
+  while((opt = getopt(argc, argv, "ai:v")) != -1) {
+    switch(opt) {
+      case 'a': asc = true; break;
+      case 'i': interface = optarg; break;
+      case 'v': verbose = true; break;
+      default: usage(); return 2;
+    }
+  }
+  if(argc - optind > 1) {
+    usage();
+    return 2;
+  }
+  FILE *in = stdin;
+  if(optind < argc && !(in = fopen(argv[optind], "rb"))) {
+    perror(argv[optind]);
+    return 1;
+  }
+
+  if(asc) {
+    char date[64];
+    time_t now = time(NULL);
+    strftime(date, sizeof(date), "%a %b %d %H:%M:%S.000 %Y", localtime(&now));
+    printf("date %s\nbase hex  timestamps absolute\nno internal events logged\n", date);
+  }
+
+  static uint8_t buf[65536];
+  size_t used = 0;
+  bool eof = false;
+  while(!eof || used > 0) {
+    if(!eof) {
+      size_t n = fread(buf + used, 1, sizeof(buf) - used, in);
+      if(n == 0) eof = true;
+      used += n;
+    }
+    size_t pos = 0;
+    while(pos < used) {
+      bool needMore;
+      size_t len = decodeChunk(buf + pos, used - pos, eof, needMore);
+      if(needMore) break;
+      if(len) {
+        pos += len;
+      } else {
+        if(verbose) fputc(buf[pos], stderr);
+        pos++;
+      }
+    }
+    memmove(buf, buf + pos, used - pos);
+    used -= pos;
+    if(eof && pos == 0) break;
+  }
+  fflush(stdout);
+
+  fprintf(stderr, "cancap: %u frames, %u chunks lost, %u chunks corrupt, %u frames dropped\n",
+          frames, lostChunks, badChunks, dropped);
+  return 0;
+}
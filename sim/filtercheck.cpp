@@ -0,0 +1,85 @@
+// Compares the frequency response of the sketch's fixed point LowPass with
+// the float FilterOnePole it replaced. Each filter is fed a sine wave at a
+// range of frequencies and sample rates, and the gain and phase of its
+// output are measured against the input. Exits with an error if the two
+// differ by more than a tenth of a dB or a degree anywhere.
+//   filtercheck [cutoff Hz]
+#include <Arduino.h>
+#include <Filters.h>
+#include "LowPass.h"
+
+#define AMPLITUDE 100000 // mA, large enough to make rounding negligible
+#define MAX_GAIN_ERROR 0.1f  // dB
+#define MAX_PHASE_ERROR 1.0f // degrees
+
+// FilterOnePole takes its time step from micros()
+static uint32_t now;
+uint32_t micros()
+{
+  return now;
+}
+
+typedef struct {
+  float gain;  // dB
+  float phase; // degrees
+} Response;
+
+// Measure the response to a sine of frequency Hz sampled at rate Hz. The
+// first few time constants are skipped so the filter has settled, then
+// a whole number of cycles is correlated with sine and cosine.
+static void measure(float cutoff, float frequency, int rate, Response &floating, Response &fixed)
+{
+  FilterOnePole reference(LOWPASS, cutoff);
+  LowPass filter(cutoff);
+  now = 0;
+  reference.input(0);
+  filter.input(0, now);
+
+  int period = 1000000 / rate;
+  int settle = rate * 10 / cutoff;
+  int cycles = frequency < 1 ? 2 : (int)frequency * 2;
+  int samples = lroundf(cycles * rate / frequency);
+  double refSin = 0, refCos = 0, fixSin = 0, fixCos = 0;
+  for(int n=-settle; n<samples; n++) {
+    now += period;
+    double angle = 2 * M_PI * frequency * (n * (double)period * 1e-6);
+    int32_t value = lround(AMPLITUDE * sin(angle));
+    float a = reference.input(value);
+    int32_t b = filter.input(value, now);
+    if(n < 0) continue;
+    refSin += a * sin(angle);
+    refCos += a * cos(angle);
+    fixSin += b * sin(angle);
+    fixCos += b * cos(angle);
+  }
+  double scale = 2.0 / samples / AMPLITUDE;
+  floating.gain = 20 * log10(hypot(refSin, refCos) * scale);
+  floating.phase = atan2(refCos, refSin) * 180 / M_PI;
+  fixed.gain = 20 * log10(hypot(fixSin, fixCos) * scale);
+  fixed.phase = atan2(fixCos, fixSin) * 180 / M_PI;
+}
+
+int main(int argc, char **argv)
+{
+  float cutoff = argc > 1 ? atof(argv[1]) : 5.0f;
+  static const int rates[] = {100, 200, 1000, 2000};
+  static const float frequencies[] = {0.1f, 0.5f, 1, 2, 5, 10, 20, 40};
+  bool pass = true;
+
+  printf("cutoff %.1f Hz\n", cutoff);
+  printf("  rate  freq   float dB  fixed dB   float deg  fixed deg\n");
+  for(int r=0; r<(int)(sizeof(rates)/sizeof(rates[0])); r++) {
+    for(int f=0; f<(int)(sizeof(frequencies)/sizeof(frequencies[0])); f++) {
+      if(frequencies[f] * 2 >= rates[r]) continue;
+      Response floating, fixed;
+      measure(cutoff, frequencies[f], rates[r], floating, fixed);
+      bool ok = fabsf(floating.gain - fixed.gain) <= MAX_GAIN_ERROR &&
+                fabsf(floating.phase - fixed.phase) <= MAX_PHASE_ERROR;
+      printf("%6d %5.1f  %9.3f %9.3f  %9.2f %9.2f%s\n", rates[r], frequencies[f],
+             floating.gain, fixed.gain, floating.phase, fixed.phase, ok ? "" : "  FAIL");
+      if(!ok) pass = false;
+    }
+  }
+  printf(pass ? "pass\n" : "FAIL\n");
+  return pass ? 0 : 1;
+}
@@ -0,0 +1,141 @@
+// Decodes a flight recorder dump from the sketch (console debug option g,
+// see FlightRecorder.h) into CSV, one row per module per snapshot with
+// the module's readings as they were at that moment.
+//
+//   stty -F /dev/ttyACM0 raw && cat /dev/ttyACM0 > flight.bin
+//   flightdecode flight.bin > flight.csv
+//
+// Console text around the dump is skipped. Cells are in volts, NTC
+// readings are the raw counts, to the FLIGHT_SHIFT bits kept, and the
+// balancing bitmap is in hex.
+#include <FlightRecorder.h>
+#include <CRC16.h>
+#include <stdlib.h>
+
+static void usage()
+{
+  fprintf(stderr, "usage: flightdecode [dump]\n");
+}
+
+// Reads nibbles low first from a byte buffer
+struct NibbleReader {
+  const uint8_t *p;
+  bool high;
+  uint8_t next()
+  {
+    uint8_t n = high ? (*p++ >> 4) : (*p & 0x0f);
+    high = !high;
+    return n;
+  }
+
+  // Next value, coded as the change from previous, see FlightSnapshot
+  uint16_t value(uint16_t previous)
+  {
+    uint32_t z = next();
+    if(z == FLIGHT_FULL) {
+      uint16_t v = 0;
+      for(int i=0; i<4; i++) v |= next() << (i * 4);
+      return v;
+    }
+    if(z == FLIGHT_BYTE) {
+      z = next();
+      z = FLIGHT_BYTE + (z | (next() << 4));
+    }
+    return previous + (int32_t)((z >> 1) ^ -(z & 1));
+  }
+};
+
+int main(int argc, char **argv)
+{
+  if(argc > 2) {
+    usage();
+    return 2;
+  }
+  FILE *in = stdin;
+  if(argc == 2 && !(in = fopen(argv[1], "rb"))) {
+    perror(argv[1]);
+    return 1;
+  }
+  // Read it all, however much console text surrounds the dump
+  size_t size = 0, capacity = 65536;
+  uint8_t *buf = (uint8_t *)malloc(capacity);
+  size_t n;
+  while((n = fread(buf + size, 1, capacity - size, in)) > 0) {
+    size += n;
+    if(size == capacity) buf = (uint8_t *)realloc(buf, capacity *= 2);
+  }
+
+  // Find the header by its magic, only reading a whole one once found
+  size_t pos = 0;
+  bool found = false;
+  for(; pos + sizeof(FlightDumpHeader) <= size; pos++) {
+    uint32_t magic;
+    memcpy(&magic, buf + pos, sizeof(magic));
+    if(magic == FLIGHT_MAGIC) {
+      found = true;
+      break;
+    }
+  }
+  if(!found) {
+    fprintf(stderr, "no flight recorder dump found\n");
+    return 1;
+  }
+  FlightDumpHeader header;
+  memcpy(&header, buf + pos, sizeof(header));
+  if(header.version != FLIGHT_VERSION) {
+    fprintf(stderr, "dump is version %d, expected %d\n", header.version, FLIGHT_VERSION);
+    return 1;
+  }
+  int baseCount = __builtin_popcountll(header.baseModules);
+  size_t total = sizeof(header) + baseCount * FLIGHT_VALUES * 2 + header.bytes;
+  if(pos + total + 2 > size) {
+    fprintf(stderr, "dump is cut short\n");
+    return 1;
+  }
+  const uint8_t *start = buf + pos;
+  uint16_t crc = start[total] | (start[total + 1] << 8);
+  if(crc16(start, total) != crc) {
+    fprintf(stderr, "CRC error, decoding anyway\n");
+  }
+
+  static uint16_t values[FLIGHT_MODULES][FLIGHT_VALUES];
+  const uint8_t *p = start + sizeof(header);
+  for(int address=0; address<FLIGHT_MODULES; address++) {
+    if(!(header.baseModules & (1ULL << address))) continue;
+    memcpy(values[address], p, FLIGHT_VALUES * 2);
+    p += FLIGHT_VALUES * 2;
+  }
+
+  fprintf(stderr, "%d snapshots, every %d ms at the end, %s", header.snapshots, header.period,
+          header.frozen ? "frozen" : "recording");
+  if(header.frozen) fprintf(stderr, " at %u ms, reason 0x%x", header.tripTime, header.tripReason);
+  fprintf(stderr, "\n");
+
+  printf("time,current,SOC,status,errorReason,outputs,module");
+  for(int n=0; n<16; n++) printf(",cell%d", n);
+  printf(",ntc0,ntc1,balance\n");
+  const uint8_t *end = p + header.bytes;
+  while(p < end) {
+    FlightSnapshot snap;
+    memcpy(&snap, p, sizeof(snap));
+    if(snap.length < sizeof(snap) || p + snap.length > end) {
+      fprintf(stderr, "bad snapshot length %d\n", snap.length);
+      return 1;
+    }
+    NibbleReader reader = {p + sizeof(snap), false};
+    for(int address=0; address<FLIGHT_MODULES; address++) {
+      uint16_t *v = values[address];
+      if(snap.changed & (1ULL << address)) {
+        for(int n=0; n<FLIGHT_VALUES; n++) v[n] = reader.value(v[n]);
+      }
+      // Modules that reported without a change read as before
+      if(!(snap.modules & (1ULL << address))) continue;
+      printf("%.3f,%.3f,%d,%d,0x%x,0x%02x,%d", snap.time / 1000.0, snap.current / 1000.0, snap.SOC,
+             snap.status, snap.errorReason, snap.outputs, address);
+      for(int n=0; n<16; n++) printf(",%.4f", (v[n] << FLIGHT_SHIFT) * 5.0 / 65535.0);
+      printf(",%u,%u,0x%04x\n", v[16] << FLIGHT_SHIFT, v[17] << FLIGHT_SHIFT, v[18]);
+    }
+    p += snap.length;
+  }
+  return 0;
+}
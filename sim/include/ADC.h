@@ -0,0 +1,42 @@
+#pragma once
+// Host replacement for the ADC library. Conversions return the value most
+// recently set by the simulator, by default mid scale. Timer triggered
+// conversions call the interrupt from the virtual clock.
+#include <Arduino.h>
+
+enum class ADC_CONVERSION_SPEED { VERY_LOW_SPEED, LOW_SPEED, MED_SPEED, HIGH_SPEED, VERY_HIGH_SPEED };
+enum class ADC_SAMPLING_SPEED { VERY_LOW_SPEED, LOW_SPEED, MED_SPEED, HIGH_SPEED, VERY_HIGH_SPEED };
+
+class ADC_Module
+{
+  public:
+    ADC_Module() : resolution(10), pin(0), isr(NULL) {}
+    void setAveraging(uint8_t num) {}
+    void setResolution(uint8_t bits) { resolution = bits; }
+    void setConversionSpeed(ADC_CONVERSION_SPEED speed) {}
+    void setSamplingSpeed(ADC_SAMPLING_SPEED speed) {}
+    bool startContinuous(uint8_t pin) { this->pin = pin; return true; }
+    void stopContinuous() {}
+    int analogReadContinuous();
+    int analogRead(uint8_t pin);
+    bool startSingleRead(uint8_t pin) { this->pin = pin; return true; }
+    int readSingle();
+    void enableInterrupts(void (*isr)(), uint8_t priority = 255) { this->isr = isr; }
+    void disableInterrupts() { isr = NULL; }
+    void startTimer(uint32_t frequency);
+    void stopTimer() { timer.end(); }
+    uint32_t getMaxValue() { return (1UL << resolution) - 1; }
+
+  private:
+    uint8_t resolution;
+    uint8_t pin;
+    void (*isr)();
+    IntervalTimer timer;
+};
+
+class ADC
+{
+  public:
+    ADC_Module adc0_obj;
+    ADC_Module *adc0 = &adc0_obj;
+};
@@ -0,0 +1,162 @@
+#pragma once
+// Host replacement for the Teensy 3 core, just enough of it to build the
+// sketch. Time, pins and serial ports are provided by the simulator in
+// Sim.cpp.
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <math.h>
+#include <cmath>
+#include <cstdlib>
+
+using std::abs;
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+
+#define A0 14
+#define A1 15
+#define LED_BUILTIN 13
+
+#define HEX 16
+#define OCT 8
+#define BIN 2
+#define DEC 10
+
+#define lowByte(w) ((uint8_t)((w) & 0xff))
+#define highByte(w) ((uint8_t)((w) >> 8))
+#define bitRead(value, bit) (((value) >> (bit)) & 0x01)
+
+template<class T, class L, class H> T constrain(T x, L low, H high)
+{
+  return x < low ? low : (x > high ? high : x);
+}
+
+long map(long x, long in_min, long in_max, long out_min, long out_max);
+
+uint32_t millis();
+uint32_t micros();
+void delay(uint32_t ms);
+void delayMicroseconds(uint32_t us);
+void noInterrupts();
+void interrupts();
+void yield();
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+uint8_t digitalRead(uint8_t pin);
+void analogWrite(uint8_t pin, int value);
+void analogWriteFrequency(uint8_t pin, float frequency);
+int analogRead(uint8_t pin);
+
+// Arduino Print, formatting numbers the same way the target does
+class Print
+{
+  public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t b) = 0;
+    size_t write(const char *str);
+    size_t write(const uint8_t *buffer, size_t size);
+    size_t write(int b) { return write((uint8_t)b); }
+    virtual int availableForWrite() { return 64; }
+
+    size_t print(const char *str) { return write(str); }
+    size_t print(char c) { return write((uint8_t)c); }
+    size_t print(unsigned char n, int base = DEC) { return printNumber(n, base); }
+    size_t print(int n, int base = DEC) { return printSigned(n, base); }
+    size_t print(unsigned int n, int base = DEC) { return printNumber(n, base); }
+    size_t print(long n, int base = DEC) { return printSigned(n, base); }
+    size_t print(unsigned long n, int base = DEC) { return printNumber(n, base); }
+    size_t print(double n, int digits = 2) { return printFloat(n, digits); }
+
+    size_t println() { return write("\r\n"); }
+    template<class T> size_t println(T value) { size_t n = print(value); return n + println(); }
+    template<class T> size_t println(T value, int format) { size_t n = print(value, format); return n + println(); }
+
+  private:
+    size_t printSigned(long n, int base);
+    size_t printNumber(unsigned long n, int base);
+    size_t printFloat(double n, int digits);
+};
+
+// Serial port. Output goes to the file given to setOutput, if any, and
+// input comes from bytes pushed by the simulator. Like USB serial on the
+// Teensy, output drains at a limited rate and availableForWrite() only
+// offers what is left of a 64 byte packet, so a long write has to be
+// spread over several passes of loop().
+class HardwareSerial : public Print
+{
+  public:
+    HardwareSerial();
+    void begin(long baud) {}
+    void end() {}
+    void flush() {}
+    operator bool() { return true; }
+    size_t write(uint8_t b);
+    using Print::write;
+    int availableForWrite();
+    int available();
+    int read();
+    int peek();
+    long parseInt();
+    float parseFloat();
+
+    void setOutput(FILE *file) { output = file; }
+    void push(const char *text);
+
+  private:
+    FILE *output;
+    int room;           // bytes the port can take now
+    uint32_t lastRoom;  // us when room was last topped up
+    char input[256];
+    uint16_t head;
+    uint16_t tail;
+};
+
+extern HardwareSerial Serial, Serial1, Serial2, Serial3;
+
+// Periodic interrupt, called from the virtual clock
+class IntervalTimer
+{
+  public:
+    IntervalTimer();
+    ~IntervalTimer();
+    bool begin(void (*function)(), uint32_t microseconds);
+    void end();
+
+    void (*function)();
+    uint32_t period;
+    uint64_t nextDue;
+};
+
+// Kinetis registers the sketch touches. Reads give a power-on reset and
+// writes are ignored.
+extern volatile uint8_t RCM_SRS0, RCM_SRS1;
+#define RCM_SRS0_POR 0x80
+#define RCM_SRS0_PIN 0x40
+#define RCM_SRS0_WDOG 0x20
+#define RCM_SRS0_LOL 0x08
+#define RCM_SRS0_LOC 0x04
+#define RCM_SRS0_LVD 0x02
+#define RCM_SRS1_SACKERR 0x20
+#define RCM_SRS1_MDM_AP 0x08
+#define RCM_SRS1_SW 0x04
+#define RCM_SRS1_LOCKUP 0x02
+
+extern volatile uint16_t WDOG_STCTRLH, WDOG_TOVALH, WDOG_TOVALL, WDOG_PRESC, WDOG_UNLOCK, WDOG_REFRESH;
+#define WDOG_UNLOCK_SEQ1 0xC520
+#define WDOG_UNLOCK_SEQ2 0xD928
+#define WDOG_STCTRLH_ALLOWUPDATE 0x0010
+#define WDOG_STCTRLH_WDOGEN 0x0001
+#define WDOG_STCTRLH_WAITEN 0x0080
+#define WDOG_STCTRLH_STOPEN 0x0040
+#define WDOG_STCTRLH_CLKSRC 0x0002
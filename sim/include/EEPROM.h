@@ -0,0 +1,39 @@
+#pragma once
+// Host replacement for the EEPROM library, backed by a RAM image the
+// simulator can load from a file. A blank part reads as 0xff.
+#include <Arduino.h>
+
+#define E2END 0x7FF
+
+class EEPROMClass
+{
+  public:
+    EEPROMClass();
+    uint8_t read(int idx) { return data[idx & E2END]; }
+    void write(int idx, uint8_t val) { data[idx & E2END] = val; writes++; }
+    void update(int idx, uint8_t val) { if(read(idx) != val) write(idx, val); }
+    uint16_t length() { return E2END + 1; }
+
+    template<typename T> T &get(int idx, T &t)
+    {
+      uint8_t *ptr = (uint8_t *)&t;
+      for(size_t n=0; n<sizeof(T); n++) ptr[n] = read(idx + n);
+      return t;
+    }
+    template<typename T> const T &put(int idx, const T &t)
+    {
+      const uint8_t *ptr = (const uint8_t *)&t;
+      for(size_t n=0; n<sizeof(T); n++) update(idx + n, ptr[n]);
+      return t;
+    }
+
+    // Simulator side
+    bool load(const char *path);
+    bool save(const char *path);
+    uint32_t writes; // byte writes since start, to watch wear
+
+  private:
+    uint8_t data[E2END + 1];
+};
+
+extern EEPROMClass EEPROM;
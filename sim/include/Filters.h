@@ -0,0 +1,45 @@
+#pragma once
+// Host copy of the one pole filter from JonHub's Filters library. The time
+// step comes from micros(), so it follows the simulator's clock.
+#include <Arduino.h>
+
+enum FILTER_TYPE { HIGHPASS, LOWPASS, INTEGRATOR, DIFFERENTIATOR };
+
+class FilterOnePole
+{
+  public:
+    FilterOnePole(FILTER_TYPE ft = LOWPASS, float fc = 1.0, float initialValue = 0)
+    {
+      FT = ft;
+      setFrequency(fc);
+      Y = initialValue;
+      Ylast = initialValue;
+      X = initialValue;
+      LastUS = micros();
+    }
+    float input(float inVal)
+    {
+      uint32_t time = micros();
+      float dt = (time - LastUS) * 1e-6f;
+      LastUS = time;
+      X = inVal;
+      float ampFactor = expf(-dt / TauS);
+      Ylast = Y;
+      Y = ampFactor * Y + (1 - ampFactor) * X;
+      return output();
+    }
+    float output()
+    {
+      return FT == HIGHPASS ? X - Y : Y;
+    }
+    void setFrequency(float newFrequency)
+    {
+      TauS = 1.0f / (2.0f * (float)M_PI * newFrequency);
+    }
+
+  private:
+    FILTER_TYPE FT;
+    float TauS;
+    float Y, Ylast, X;
+    uint32_t LastUS;
+};
@@ -0,0 +1,80 @@
+#pragma once
+// Host replacement for the FlexCAN library. Frames written to Can0 take
+// their real time on a simulated bus and are recorded by the simulator
+// when they finish; received frames are handed to the attached listeners
+// as the receive interrupt would.
+#include <Arduino.h>
+
+typedef struct CAN_message_t {
+  uint32_t id;
+  uint16_t timestamp;
+  uint8_t ext;
+  uint8_t rtr;
+  uint8_t len;
+  uint8_t buf[8];
+  uint16_t timeout;
+} CAN_message_t;
+
+typedef struct CAN_filter_t {
+  uint32_t id;
+  struct {
+    uint8_t extended:1;
+    uint8_t remote:1;
+    uint8_t reserved:6;
+  } flags;
+} CAN_filter_t;
+
+#define SIZE_LISTENERS 4
+#define NUM_MAILBOXES 16
+#define NUM_TX_MAILBOXES 2
+
+class CANListener
+{
+  public:
+    CANListener() : generalCallbackActive(false) {}
+    virtual ~CANListener() {}
+    virtual bool frameHandler(CAN_message_t &frame, int mailbox, uint8_t controller) { return false; }
+    virtual void txHandler(int mailbox, uint8_t controller) {}
+    void attachGeneralHandler() { generalCallbackActive = true; }
+    void detachGeneralHandler() { generalCallbackActive = false; }
+    void attachMBHandler(uint8_t mailBox) {}
+
+    bool generalCallbackActive;
+};
+
+class FlexCAN
+{
+  public:
+    FlexCAN();
+    void begin(uint32_t baud = 250000);
+    int write(const CAN_message_t &msg);
+    int available() { return 0; }
+    int read(CAN_message_t &msg) { return 0; }
+    void setFilter(const CAN_filter_t &filter, uint8_t n);
+    bool getFilter(CAN_filter_t &filter, uint8_t n);
+    void setMask(uint32_t mask, uint8_t n);
+    uint8_t getNumRxBoxes() { return NUM_MAILBOXES - NUM_TX_MAILBOXES; }
+    uint8_t getNumMailBoxes() { return NUM_MAILBOXES; }
+    bool attachObj(CANListener *listener);
+    bool detachObj(CANListener *listener);
+
+    // Simulator side
+    bool accepts(const CAN_message_t &msg);
+    void receive(CAN_message_t &msg);
+    uint64_t nextTxDone();
+    void finishTx();
+
+  private:
+    uint32_t baud;
+    CANListener *listeners[SIZE_LISTENERS];
+    CAN_filter_t filters[NUM_MAILBOXES];
+    uint32_t masks[NUM_MAILBOXES];
+    CAN_message_t txBoxes[NUM_TX_MAILBOXES];
+    bool txBusy[NUM_TX_MAILBOXES];
+    int onBus;       // mailbox being transmitted, -1 if the bus is idle
+    uint64_t busDone; // us when the frame on the bus finishes
+
+    void startTx();
+};
+
+extern FlexCAN Can0;
@@ -0,0 +1,3 @@
+#pragma once
+// The sketch includes SPI but doesn't use it
+#include <Arduino.h>
@@ -0,0 +1,12 @@
+#pragma once
+// Host replacement for the serial CAN module library. The module is never
+// connected in the simulator.
+#include <Arduino.h>
+
+class Serial_CAN
+{
+  public:
+    void begin(unsigned long baud) {}
+    unsigned char send(unsigned long id, unsigned char ext, unsigned char rtrBit, unsigned char len, const unsigned char *buf) { return 1; }
+    unsigned char recv(unsigned long *id, unsigned char *buf) { return 0; }
+};
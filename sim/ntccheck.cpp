@@ -0,0 +1,95 @@
+// Compares the sketch's NTC lookup table with the resistance fit and log()
+// that decodeTemperature() evaluated before it. Every raw ADC count from
+// full scale down to the zero of the fit (around 26600, below which the fit
+// no longer describes the sensor) is decoded both ways, and the largest
+// error is reported for each band of temperature. Exits with an error if
+// the table is out by more than MAX_ERROR anywhere in the sensor's
+// operating range, or if encodeTemperature() doesn't find the count a
+// temperature decodes from. Close to the zero of the fit the log runs away
+// and the table falls behind, so the bands above the range are only
+// reported.
+//   ntccheck [-v]
+#include "Sim.h"
+#include <unistd.h>
+#include "BMSModule.h"
+#include "NTCTable.h"
+
+#define MAX_ERROR 0.2   // degrees C
+#define ENCODE_ERROR 1  // tenths of a degree C
+#define RANGE_MIN -40   // degrees C, operating range of the sensor
+#define RANGE_MAX 125
+#define BAND 10         // degrees C of each row of the report
+
+// The old decodeTemperature(), in double so it is the reference
+static double formula(uint16_t data)
+{
+  double r = 0.0000000347363427499292 * data * data - 0.001025770762903 * data + 2.68235340614337;
+  if(r <= 0.0) return NAN;
+  return log(r) * -30.5280964239816 + 95.6841501312447;
+}
+
+int main(int argc, char **argv)
+{
+  bool verbose = false;
+  int opt;
+  while((opt = getopt(argc, argv, "v")) != -1) {
+    switch(opt) {
+      case 'v': verbose = true; break;
+      default:
+        fprintf(stderr, "usage: ntccheck [-v]\n");
+        return 2;
+    }
+  }
+
+  const int bands = (NTC_TEMP_MAX - NTC_TEMP_MIN) / 10 / BAND;
+  double worst[bands];
+  uint16_t worstAt[bands];
+  for(int n=0; n<bands; n++) {
+    worst[n] = -1;
+    worstAt[n] = 0;
+  }
+  bool pass = true;
+  uint32_t counts = 0;
+
+  for(int32_t data=0xffff; data>=0; data--) {
+    double reference = formula(data);
+    if(isnan(reference)) break;
+    // Outside the range the table can hold
+    if(reference * 10 >= NTC_TEMP_MAX || reference * 10 <= NTC_TEMP_MIN) continue;
+    counts++;
+    int16_t tenths = BMSModule::decodeTemperatureTenths(data);
+    double error = fabs(tenths / 10.0 - reference);
+    int band = (reference * 10 - NTC_TEMP_MIN) / 10 / BAND;
+    if(band >= bands) band = bands - 1;
+    if(error > worst[band]) {
+      worst[band] = error;
+      worstAt[band] = data;
+    }
+    if(reference < RANGE_MIN || reference > RANGE_MAX) continue;
+    if(error > MAX_ERROR) {
+      if(verbose) printf("count %d: formula %.3fC table %.1fC  FAIL\n", data, reference, tenths / 10.0);
+      pass = false;
+    }
+
+    // The threshold count for this temperature must decode to it
+    uint16_t encoded = BMSModule::encodeTemperature(tenths / 10.0f);
+    int16_t back = BMSModule::decodeTemperatureTenths(encoded);
+    if(abs(back - tenths) > ENCODE_ERROR) {
+      if(verbose) printf("count %d: %.1fC encodes to %u which decodes to %.1fC  FAIL\n", data, tenths / 10.0, encoded, back / 10.0);
+      pass = false;
+    }
+  }
+
+  printf("%u counts checked, failing past %.1fC error from %dC to %dC\n", counts, MAX_ERROR, RANGE_MIN, RANGE_MAX);
+  printf("      band C   worst error C  at count\n");
+  for(int n=0; n<bands; n++) {
+    if(worst[n] < 0) continue;
+    int low = NTC_TEMP_MIN / 10 + n * BAND;
+    const char *note = "";
+    if(low + BAND <= RANGE_MIN || low >= RANGE_MAX) note = "  outside the range";
+    else if(worst[n] > MAX_ERROR) note = "  FAIL";
+    printf("%5d..%-5d  %13.3f  %8u%s\n", low, low + BAND, worst[n], worstAt[n], note);
+  }
+  printf(pass ? "pass\n" : "FAIL\n");
+  return pass ? 0 : 1;
+}
@@ -0,0 +1,30 @@
+# Turn the sketch into plain C++ the way the Arduino builder does: collect
+# a prototype for every function it defines and insert them just before
+# the first definition. Run with the sketch given twice.
+function signature(line, next_line) {
+  if (line !~ /^[A-Za-z_][A-Za-z0-9_ *&]*[ *&][A-Za-z_][A-Za-z0-9_]*[ \t]*\(.*\)[ \t]*(\/\/.*)?$/) return ""
+  if (next_line !~ /^\{/) return ""
+  sub(/[ \t]*\/\/.*$/, "", line)
+  return line
+}
+
+NR == FNR {
+  lines[FNR] = $0
+  count = FNR
+  next
+}
+
+FNR == 1 {
+  for (i = 1; i < count; i++) {
+    sig = signature(lines[i], lines[i + 1])
+    if (sig == "") continue
+    if (!first) first = i
+    prototypes = prototypes sig ";\n"
+  }
+}
+
+FNR == first {
+  printf "%s#line %d \"%s\"\n", prototypes, FNR, FILENAME
+}
+
+{ print }
@@ -0,0 +1,205 @@
+// Replays a CAN log through the sketch on the host, faster than real time.
+//
+// The log is read in candump -l format, one frame per line:
+//   (1623456789.123456) can0 4F0#0102030405060708
+// Lines in the same form can also drive the inputs:
+//   (1623456789.200000) pin 17 1      digital input level
+//   (1623456789.300000) adc 34750     current sensor ADC reading, 16 bit
+//   (1623456789.400000) console d     text typed on the console
+// Lines starting with # are ignored. The first timestamp in the log is
+// taken as the moment setup() returns.
+//
+// Every frame the sketch transmits and every output pin change is written
+// to the output in the same format, so two runs can be compared with diff.
+#include "Sim.h"
+#include <EEPROM.h>
+#include <unistd.h>
+
+void setup();
+void loop();
+
+static void usage()
+{
+  fprintf(stderr,
+    "usage: replay [options] <log>\n"
+    "  -o <file>   write transmitted frames and pin changes here (default stdout)\n"
+    "  -e <file>   load the EEPROM image from a file\n"
+    "  -E <file>   save the EEPROM image here at the end\n"
+    "  -l <us>     virtual time taken by each pass of loop() (default 1000)\n"
+    "  -t <ms>     keep running this long after the last event (default 1000)\n"
+    "  -r          also record received frames\n"
+    "  -v          copy the serial console to stderr\n"
+    "  -d <file>   write Serial2 (Nextion display and CSV) to a file\n");
+}
+
+// Split "(seconds.micros)" into microseconds
+static bool parseTime(const char *text, uint64_t &us, const char **end)
+{
+  if(*text != '(') return false;
+  char *p;
+  uint64_t seconds = strtoull(text + 1, &p, 10);
+  uint64_t fraction = 0;
+  if(*p == '.') {
+    char *q;
+    fraction = strtoull(p + 1, &q, 10);
+    for(int digits = q - p - 1; digits < 6; digits++) fraction *= 10;
+    for(int digits = q - p - 1; digits > 6; digits--) fraction /= 10;
+    p = q;
+  }
+  if(*p != ')') return false;
+  us = seconds * 1000000 + fraction;
+  *end = p + 1;
+  return true;
+}
+
+// Parse "<id>#<data>". IDs of more than three digits are extended.
+static bool parseFrame(const char *text, CAN_message_t &msg)
+{
+  memset(&msg, 0, sizeof(msg));
+  char *p;
+  msg.id = strtoul(text, &p, 16);
+  if(*p != '#') return false;
+  msg.ext = (p - text) > 3;
+  p++;
+  if(*p == 'R') {
+    msg.rtr = 1;
+    return true;
+  }
+  while(isxdigit((unsigned char)p[0]) && isxdigit((unsigned char)p[1]) && msg.len < 8) {
+    char byte[3] = {p[0], p[1], 0};
+    msg.buf[msg.len++] = strtoul(byte, NULL, 16);
+    p += 2;
+    if(*p == '.') p++;
+  }
+  return true;
+}
+
+// Read the whole log into the event queue
+static bool loadLog(const char *path)
+{
+  FILE *file = fopen(path, "r");
+  if(!file) {
+    perror(path);
+    return false;
+  }
+  char line[512];
+  int lineNo = 0;
+  bool first = true;
+  uint64_t start = 0;
+  uint64_t last = 0;
+  while(fgets(line, sizeof(line), file)) {
+    lineNo++;
+    line[strcspn(line, "\r\n")] = 0;
+    const char *p = line;
+    while(isspace((unsigned char)*p)) p++;
+    if(*p == 0 || *p == '#') continue;
+
+    uint64_t at;
+    if(!parseTime(p, at, &p)) {
+      fprintf(stderr, "%s:%d: no timestamp\n", path, lineNo);
+      continue;
+    }
+    if(first) {
+      start = at;
+      first = false;
+    }
+    if(at < start + last) at = start + last; // keep the queue in order
+    SimEvent event;
+    event.at = simNow + at - start;
+    last = at - start;
+
+    char source[32];
+    int used = 0;
+    if(sscanf(p, " %31s %n", source, &used) < 1) continue;
+    p += used;
+    if(!strcmp(source, "pin")) {
+      int pin, level;
+      if(sscanf(p, "%d %d", &pin, &level) != 2) goto bad;
+      event.type = SIM_PIN;
+      event.pin = pin;
+      event.value = level;
+    } else if(!strcmp(source, "adc")) {
+      if(sscanf(p, "%d", &event.value) != 1) goto bad;
+      event.type = SIM_ADC;
+    } else if(!strcmp(source, "console")) {
+      event.type = SIM_CONSOLE;
+      event.text = std::string(p) + "\n";
+    } else {
+      if(!parseFrame(p, event.msg)) goto bad;
+      if(event.msg.rtr) continue;
+      event.type = SIM_FRAME;
+    }
+    simQueue(event);
+    continue;
+bad:
+    fprintf(stderr, "%s:%d: can't parse \"%s\"\n", path, lineNo, line);
+  }
+  fclose(file);
+  return true;
+}
+
+int main(int argc, char **argv)
+{
+  const char *output = NULL;
+  const char *eepromIn = NULL;
+  const char *eepromOut = NULL;
+  const char *dash = NULL;
+  uint32_t loopTime = 1000;
+  uint32_t tail = 1000;
+  int opt;
+  while((opt = getopt(argc, argv, "o:e:E:l:t:rvd:")) != -1) {
+    switch(opt) {
+      case 'o': output = optarg; break;
+      case 'e': eepromIn = optarg; break;
+      case 'E': eepromOut = optarg; break;
+      case 'l': loopTime = strtoul(optarg, NULL, 0); break;
+      case 't': tail = strtoul(optarg, NULL, 0); break;
+      case 'r': simRecordReceived(true); break;
+      case 'v': Serial.setOutput(stderr); break;
+      case 'd': dash = optarg; break;
+      default: usage(); return 2;
+    }
+  }
+  if(optind != argc - 1 || loopTime == 0) {
+    usage();
+    return 2;
+  }
+
+  FILE *record = stdout;
+  if(output && !(record = fopen(output, "w"))) {
+    perror(output);
+    return 1;
+  }
+  simRecordTo(record);
+  FILE *dashFile = NULL;
+  if(dash) {
+    if(!(dashFile = fopen(dash, "wb"))) {
+      perror(dash);
+      return 1;
+    }
+    Serial2.setOutput(dashFile);
+  }
+  if(eepromIn && !EEPROM.load(eepromIn)) {
+    perror(eepromIn);
+    return 1;
+  }
+
+  setup();
+  if(!loadLog(argv[optind])) return 1;
+
+  uint64_t end = simLastEvent() + (uint64_t)tail * 1000;
+  while(simNow < end) {
+    loop();
+    simAdvance(simNow + loopTime);
+  }
+
+  if(eepromOut && !EEPROM.save(eepromOut)) {
+    perror(eepromOut);
+    return 1;
+  }
+  fprintf(stderr, "%.3fs simulated, %u frames rejected by the filters, %u EEPROM writes\n",
+          simNow / 1e6, simFilteredFrames(), EEPROM.writes);
+  if(record != stdout) fclose(record);
+  if(dashFile) fclose(dashFile);
+  return 0;
+}
@@ -0,0 +1,40 @@
+# Writes a replay log of a resting pack: modules on one daisychain, each
+# reporting its 16 cells, 2 NTCs and balancing every 200ms, spread across
+# the period, for a number of seconds. The keys given are typed on the
+# console one every 50ms from 2s in.
+#   awk -v modules=4 -v seconds=20 -v keys="s d 1 q q" -f synthlog.awk
+BEGIN {
+  if (modules == "") modules = 4
+  if (seconds == "") seconds = 20
+  count = split(keys, key, " ")
+  next_key = 1
+  start = 1700000000
+  spacing = int(200000 / (modules * 19))
+  for (ms = 0; ms < seconds * 1000; ms += 200) {
+    for (m = 0; m < modules; m++) {
+      for (r = 0; r < 19; r++) {
+        us = ms * 1000 + (m * 19 + r) * spacing
+        while (next_key <= count && 2000000 + (next_key - 1) * 50000 <= us) {
+          stamp(2000000 + (next_key - 1) * 50000)
+          printf " console %s\n", key[next_key++]
+        }
+        if (r < 16) {
+          reg = r
+          value = int(3700 * 65535 / 5000) + m * 7 + r
+        } else if (r < 18) {
+          reg = r + 1
+          value = 40000
+        } else {
+          reg = 255
+          value = 0
+        }
+        stamp(us)
+        printf " can0 4F0#%02X%02X%04X\n", m, reg, value
+      }
+    }
+  }
+}
+
+function stamp(us) {
+  printf "(%d.%06d)", start + int(us / 1000000), us % 1000000
+}
@@ -0,0 +1,299 @@
+// Decodes the binary telemetry stream from the sketch (console debug option
+// t, see Telemetry.h) into one CSV file per record type, or into columnar
+// files: a directory per record type holding one little endian binary file
+// per column and a schema.txt naming each column's type and scale.
+//
+//   stty -F /dev/ttyACM0 raw && cat /dev/ttyACM0 > telemetry.bin
+//   teldecode -o run1 telemetry.bin        run1_pack.csv, run1_cells.csv, ...
+//   teldecode -c run1 telemetry.bin        run1/pack/time.u32, ...
+//
+// Frames that fail their CRC, console text caught between frames and gaps
+// in the sequence count are reported on stderr.
+#include <Telemetry.h>
+#include <CRC16.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <stddef.h>
+
+enum FieldKind { U8, U16, I16, U32, I32 };
+static const char *kindNames[] = {"u8", "u16", "i16", "u32", "i32"};
+
+typedef struct {
+  const char *name;
+  FieldKind kind;
+  int offset;   // in the record
+  int count;    // array length, 1 for a plain field
+  double scale; // CSV value = raw * scale
+  int decimals;
+} Field;
+
+#define FIELD(type, member, name, kind, scale, decimals) {name, kind, offsetof(type, member), 1, scale, decimals}
+
+static const Field packFields[] = {
+  FIELD(TelemetryPack, status, "status", U8, 1, 0),
+  FIELD(TelemetryPack, modules, "modules", U8, 1, 0),
+  FIELD(TelemetryPack, errorReason, "errorReason", U16, 1, 0),
+  FIELD(TelemetryPack, packMV, "packV", U32, 0.001, 3),
+  FIELD(TelemetryPack, lowCellMV, "lowCellV", U16, 0.001, 3),
+  FIELD(TelemetryPack, highCellMV, "highCellV", U16, 0.001, 3),
+  FIELD(TelemetryPack, lowTemp, "lowTempC", I16, 0.1, 1),
+  FIELD(TelemetryPack, highTemp, "highTempC", I16, 0.1, 1),
+  FIELD(TelemetryPack, current, "currentA", I32, 0.001, 3),
+  FIELD(TelemetryPack, SOC, "SOC", U8, 1, 0),
+  FIELD(TelemetryPack, chargeLimit, "chargeLimitA", U16, 0.1, 1),
+  FIELD(TelemetryPack, dischargeLimit, "dischargeLimitA", U16, 0.1, 1),
+};
+static const Field cellFields[] = {
+  FIELD(TelemetryCells, module, "module", U8, 1, 0),
+  {"cellV", U16, offsetof(TelemetryCells, cells), 16, 5.0 / 65535, 4},
+};
+static const Field tempFields[] = {
+  FIELD(TelemetryTemps, module, "module", U8, 1, 0),
+  {"tempC", I16, offsetof(TelemetryTemps, temps), 2, 0.1, 1},
+};
+static const Field balanceFields[] = {
+  FIELD(TelemetryBalance, module, "module", U8, 1, 0),
+  FIELD(TelemetryBalance, balance, "balance", U16, 1, 0),
+};
+
+typedef struct {
+  const char *name;
+  const Field *fields;
+  int numFields;
+  size_t size;
+  FILE *csv;
+  FILE **columns; // one per field element, columnar output only
+  int numColumns;
+  uint32_t records;
+} RecordType;
+
+#define TYPE(name, fields, record) {name, fields, sizeof(fields) / sizeof(fields[0]), sizeof(record), NULL, NULL, 0, 0}
+
+static RecordType types[TELEM_TYPES] = {
+  TYPE("pack", packFields, TelemetryPack),
+  TYPE("cells", cellFields, TelemetryCells),
+  TYPE("temps", tempFields, TelemetryTemps),
+  TYPE("balance", balanceFields, TelemetryBalance),
+};
+
+static const char *csvPrefix = NULL;
+static const char *columnDir = NULL;
+static uint32_t frames = 0, badFrames = 0, lostFrames = 0, wrongSchema = 0;
+static bool haveSequence = false;
+static uint16_t lastSequence;
+
+static void usage()
+{
+  fprintf(stderr,
+    "usage: teldecode (-o <prefix> | -c <dir>) [capture]\n"
+    "  -o <prefix>  write <prefix>_<type>.csv for each record type\n"
+    "  -c <dir>     write <dir>/<type>/<column>.<kind> binary columns\n"
+    "Reads stdin if no capture file is given.\n");
+}
+
+static int kindSize(FieldKind kind)
+{
+  return kind == U8 ? 1 : (kind == U16 || kind == I16) ? 2 : 4;
+}
+
+static double readField(const uint8_t *p, FieldKind kind)
+{
+  uint32_t v = p[0];
+  if(kindSize(kind) > 1) v |= p[1] << 8;
+  if(kindSize(kind) > 2) v |= (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+  if(kind == I16) return (int16_t)v;
+  if(kind == I32) return (int32_t)v;
+  return v;
+}
+
+static void columnName(char *name, const Field &field, int n)
+{
+  if(field.count == 1) strcpy(name, field.name);
+  else sprintf(name, "%s%d", field.name, n);
+}
+
+// Open the output files for a record type the first time it is seen
+static bool openType(RecordType &type)
+{
+  char path[512], name[64];
+  if(csvPrefix) {
+    snprintf(path, sizeof(path), "%s_%s.csv", csvPrefix, type.name);
+    if(!(type.csv = fopen(path, "w"))) {
+      perror(path);
+      return false;
+    }
+    fprintf(type.csv, "time,sequence");
+    for(int f=0; f<type.numFields; f++) {
+      for(int n=0; n<type.fields[f].count; n++) {
+        columnName(name, type.fields[f], n);
+        fprintf(type.csv, ",%s", name);
+      }
+    }
+    fprintf(type.csv, "\n");
+    return true;
+  }
+
+  snprintf(path, sizeof(path), "%s/%s", columnDir, type.name);
+  mkdir(columnDir, 0777);
+  mkdir(path, 0777);
+  snprintf(path, sizeof(path), "%s/%s/schema.txt", columnDir, type.name);
+  FILE *schema = fopen(path, "w");
+  if(!schema) {
+    perror(path);
+    return false;
+  }
+  fprintf(schema, "# column kind scale, where value = raw * scale\ntime u32 0.001\nsequence u16 1\n");
+  type.numColumns = 2;
+  for(int f=0; f<type.numFields; f++) type.numColumns += type.fields[f].count;
+  type.columns = new FILE *[type.numColumns];
+  int c = 0;
+  for(int f=-2; f<type.numFields; f++) {
+    int count = f < 0 ? 1 : type.fields[f].count;
+    for(int n=0; n<count; n++) {
+      const char *kind;
+      if(f == -2) {
+        strcpy(name, "time");
+        kind = "u32";
+      } else if(f == -1) {
+        strcpy(name, "sequence");
+        kind = "u16";
+      } else {
+        columnName(name, type.fields[f], n);
+        kind = kindNames[type.fields[f].kind];
+        fprintf(schema, "%s %s %g\n", name, kind, type.fields[f].scale);
+      }
+      snprintf(path, sizeof(path), "%s/%s/%s.%s", columnDir, type.name, name, kind);
+      if(!(type.columns[c++] = fopen(path, "wb"))) {
+        perror(path);
+        return false;
+      }
+    }
+  }
+  fclose(schema);
+  return true;
+}
+
+static void writeRecord(RecordType &type, const TelemetryHeader &header, const uint8_t *record)
+{
+  type.records++;
+  if(type.csv) {
+    fprintf(type.csv, "%.3f,%u", header.time / 1000.0, header.sequence);
+    for(int f=0; f<type.numFields; f++) {
+      const Field &field = type.fields[f];
+      for(int n=0; n<field.count; n++) {
+        double value = readField(record + field.offset + n * kindSize(field.kind), field.kind);
+        fprintf(type.csv, ",%.*f", field.decimals, value * field.scale);
+      }
+    }
+    fprintf(type.csv, "\n");
+    return;
+  }
+  int c = 0;
+  fwrite(&header.time, 4, 1, type.columns[c++]);
+  fwrite(&header.sequence, 2, 1, type.columns[c++]);
+  for(int f=0; f<type.numFields; f++) {
+    const Field &field = type.fields[f];
+    int size = kindSize(field.kind);
+    for(int n=0; n<field.count; n++) fwrite(record + field.offset + n * size, size, 1, type.columns[c++]);
+  }
+}
+
+// Undo the COBS encoding in place. Returns the decoded length or -1.
+static int cobsDecode(uint8_t *buf, int len)
+{
+  int in = 0, out = 0;
+  while(in < len) {
+    int code = buf[in++];
+    if(code == 0 || in + code - 1 > len) return -1;
+    for(int i=1; i<code; i++) buf[out++] = buf[in++];
+    if(code != 0xff && in < len) buf[out++] = 0;
+  }
+  return out;
+}
+
+static void decodeFrame(uint8_t *buf, int len)
+{
+  if(len == 0) return;
+  len = cobsDecode(buf, len);
+  TelemetryHeader header;
+  if(len < (int)sizeof(header) + 2) {
+    badFrames++;
+    return;
+  }
+  uint16_t crc = buf[len - 2] | (buf[len - 1] << 8);
+  if(crc16(buf, len - 2) != crc) {
+    badFrames++;
+    return;
+  }
+  memcpy(&header, buf, sizeof(header));
+  if(header.schema != TELEMETRY_SCHEMA) {
+    if(wrongSchema++ == 0) fprintf(stderr, "teldecode: stream has schema %u, this decoder reads %u\n", header.schema, TELEMETRY_SCHEMA);
+    return;
+  }
+  if(haveSequence && header.sequence != (uint16_t)(lastSequence + 1)) {
+    uint16_t lost = header.sequence - lastSequence - 1;
+    lostFrames += lost;
+    fprintf(stderr, "teldecode: %u frames lost before frame %u\n", lost, header.sequence);
+  }
+  lastSequence = header.sequence;
+  haveSequence = true;
+  frames++;
+
+  if(header.type >= TELEM_TYPES) return;
+  RecordType &type = types[header.type];
+  if(len - 2 - (int)sizeof(header) != (int)type.size) {
+    badFrames++;
+    return;
+  }
+  if(!type.csv && !type.columns && !openType(type)) exit(1);
+  writeRecord(type, header, buf + sizeof(header));
+}
+
+int main(int argc, char **argv)
+{
+  int opt;
+  while((opt = getopt(argc, argv, "o:c:")) != -1) {
+    switch(opt) {
+      case 'o': csvPrefix = optarg; break;
+      case 'c': columnDir = optarg; break;
+      default: usage(); return 2;
+    }
+  }
+  if(!csvPrefix == !columnDir || argc - optind > 1) {
+    usage();
+    return 2;
+  }
+  FILE *in = stdin;
+  if(optind < argc && !(in = fopen(argv[optind], "rb"))) {
+    perror(argv[optind]);
+    return 1;
+  }
+
+  // Frames end with a zero byte. Anything longer than a frame can be is
+  // console text and is thrown away.
+  uint8_t buf[TELEMETRY_FRAME_MAX];
+  int len = 0;
+  bool overlong = false;
+  int c;
+  while((c = fgetc(in)) != EOF) {
+    if(c == 0) {
+      if(overlong) badFrames++;
+      else decodeFrame(buf, len);
+      len = 0;
+      overlong = false;
+    } else if(len < (int)sizeof(buf)) {
+      buf[len++] = c;
+    } else {
+      overlong = true;
+    }
+  }
+
+  for(int t=0; t<TELEM_TYPES; t++) {
+    if(types[t].csv) fclose(types[t].csv);
+    for(int c=0; c<types[t].numColumns; c++) fclose(types[t].columns[c]);
+  }
+  fprintf(stderr, "teldecode: %u frames (%u pack, %u cells, %u temps, %u balance), %u bad, %u lost\n",
+          frames, types[TELEM_PACK].records, types[TELEM_CELLS].records, types[TELEM_TEMPS].records,
+          types[TELEM_BALANCE].records, badFrames, lostFrames);
+  return 0;
+}